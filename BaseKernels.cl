@@ -576,6 +576,87 @@ __kernel void tileSVGDstAtop(__global float4 *out,
     out[get_global_id(0)] = out_pixel;
 }
 
+/* Composite an isolated stroke (aux) onto the unmodified layer (in) for the width x height
+ * block starting at offset, launched as a width x height range. The operation is one of
+ * NativeKernels::IsolateOperation, the math matches the tileSVG kernels at full opacity.
+ */
+__kernel void isolateComposite(__global       float4 *out,
+                               __global const float4 *in,
+                               __global const float4 *aux,
+                                              int     offset,
+                                              int     operation)
+{
+    const int idx = get_global_id(0) + get_global_id(1) * TILE_PIXEL_WIDTH + offset;
+    float4 aux_pixel = aux[idx];
+
+    if (operation == 0) /* Copy */
+    {
+        out[idx] = aux_pixel;
+        return;
+    }
+
+    float4 out_pixel;
+    float4 in_pixel = in[idx];
+
+    if (operation == 1) /* Over */
+    {
+        float alpha = aux_pixel.s3;
+        float dst_alpha = in_pixel.s3;
+
+        float a = alpha + dst_alpha * (1.0f - alpha);
+        float src_term = (a > 0.0f) ? alpha / a : 0.0f;
+        float aux_term = 1.0f - src_term;
+        out_pixel.s012 = aux_pixel.s012 * src_term + in_pixel.s012 * aux_term;
+        out_pixel.s3   = a;
+    }
+    else if (operation == 2) /* Source atop */
+    {
+        float alpha = aux_pixel.s3;
+        out_pixel.s012 = aux_pixel.s012 * alpha + in_pixel.s012 * (1.0f - alpha);
+        out_pixel.s3 = in_pixel.s3;
+    }
+    else /* Destination out */
+    {
+        out_pixel = in_pixel;
+        out_pixel.s3 *= 1.0f - aux_pixel.s3;
+    }
+
+    out[idx] = out_pixel;
+}
+
+/* Grow bounds[index * 4 ...] (min x, min y, max x, max y) to cover every pixel that
+ * differs between a and b. One work item per column so neighbouring items read
+ * neighbouring pixels.
+ */
+__kernel void tileDiffBounds(__global const int4 *a,
+                             __global const int4 *b,
+                             __global       int  *bounds,
+                                            int   index)
+{
+    const int x = get_global_id(0);
+    int minY = TILE_PIXEL_HEIGHT;
+    int maxY = -1;
+
+    for (int y = 0; y < TILE_PIXEL_HEIGHT; ++y)
+    {
+        const int idx = x + y * TILE_PIXEL_WIDTH;
+        if (any(a[idx] != b[idx]))
+        {
+            minY = min(minY, y);
+            maxY = y;
+        }
+    }
+
+    if (maxY < 0)
+        return;
+
+    bounds += index * 4;
+    atomic_min(&bounds[0], x);
+    atomic_min(&bounds[1], minY);
+    atomic_max(&bounds[2], x);
+    atomic_max(&bounds[3], maxY);
+}
+
 __kernel void tileColorMask(__global float4 *out,
                             __global float4 *in,
                             __global float4 *aux,
@@ -9,6 +9,8 @@
 
 float calculate_alpha (float rr, float hardness, float slope1, float slope2);
 float color_query_weight (float xx, float yy, float radius);
+void color_query_reduce(__local float4 *scratch, float4 total_accum, float total_weight,
+                        __global float4 *accum, int accum_offset);
 
 float alpha_from_dab(float x, float y, float4 matrix, float hardness, float slope1, float slope2);
 float alpha_from_subpixel_dab(float x, float y, float4 matrix, float hardness, float slope1, float slope2);
@@ -20,6 +22,9 @@ inline float4 apply_isolate_mode (float4 pixel, float4 color, float alpha);
 
 float apply_texture(float alpha, float x, float y, image2d_t texture, float tex_strength);
 
+float dab_batch_alpha(__global const float4 *dab, float x, float y);
+float4 dab_batch_apply(__global const float4 *dab, float4 pixel, float alpha);
+
 float calculate_alpha (float rr, float hardness, float slope1, float slope2)
 {
   float segment1_offset = 1.0f;
@@ -139,76 +144,104 @@ float color_query_weight (float xx, float yy, float radius)
   return 0.0f;
 }
 
-__kernel void mypaint_color_query_part1(__global float4 *buf,
-                                                 float   x,
-                                                 float   y,
-                                                 int     offset,
-                                                 int     width,
-                                                 int     accum_offset,
-                                        __global float4 *accum,
-                                                 float   radius)
+/* Sum the work group's totals in scratch, which holds two float4s per work item, and
+ * write the group total to accum[accum_offset]. The group size must be a power of two.
+ */
+void color_query_reduce(__local  float4 *scratch,
+                                 float4  total_accum,
+                                 float   total_weight,
+                        __global float4 *accum,
+                                 int     accum_offset)
 {
-  int gidy = get_global_id(0);
+  int lid = get_local_id(0);
 
-  float4 total_accum  = (float4)(0.0f, 0.0f, 0.0f, 0.0f);
-  float  total_weight = 0.0f;
+  scratch[lid * 2] = total_accum;
+  scratch[lid * 2 + 1] = (float4)(total_weight);
+  barrier(CLK_LOCAL_MEM_FENCE);
 
-  for (int ix = 0; ix < width; ++ix)
+  for (int step = get_local_size(0) / 2; step > 0; step /= 2)
     {
-      float xx = (ix - x);
-      float yy = (gidy - y);
-      float pixel_weight = color_query_weight (xx, yy, radius);
-      float4 pixel = buf[ix + gidy * TILE_PIXEL_WIDTH + offset];
-
-      total_accum  += pixel * (float4)(pixel.s333, 1.0f) * pixel_weight;
-      total_weight += pixel_weight;
+      if (lid < step)
+        {
+          scratch[lid * 2] += scratch[(lid + step) * 2];
+          scratch[lid * 2 + 1] += scratch[(lid + step) * 2 + 1];
+        }
+      barrier(CLK_LOCAL_MEM_FENCE);
     }
 
-  accum[(gidy + accum_offset) * 2] = total_accum;
-  accum[(gidy + accum_offset) * 2 + 1] = (float4)(total_weight);
+  if (lid == 0)
+    {
+      accum[accum_offset * 2] = scratch[0];
+      accum[accum_offset * 2 + 1] = scratch[1];
+    }
 }
 
-__kernel void mypaint_color_query_empty_part1(         float   x,
-                                                       float   y,
-                                                       int     width,
-                                                       int     accum_offset,
-                                              __global float4 *accum,
-                                                       float   radius)
+/* Launched as a single work group per tile, each work item strides over the
+ * width x height block starting at offset.
+ */
+__kernel void mypaint_color_query_tile(__global float4 *buf,
+                                                float   x,
+                                                float   y,
+                                                int     offset,
+                                                int     width,
+                                                int     height,
+                                                int     accum_offset,
+                                       __global float4 *accum,
+                                                float   radius,
+                                       __local  float4 *scratch)
 {
-  int gidy = get_global_id(0);
-
   float4 total_accum  = (float4)(0.0f, 0.0f, 0.0f, 0.0f);
   float  total_weight = 0.0f;
 
-  for (int ix = 0; ix < width; ++ix)
+  for (int i = get_local_id(0); i < width * height; i += get_local_size(0))
     {
-      float xx = (ix - x);
-      float yy = (gidy - y);
+      int ix = i % width;
+      int iy = i / width;
+      float pixel_weight = color_query_weight (ix - x, iy - y, radius);
+      float4 pixel = buf[ix + iy * TILE_PIXEL_WIDTH + offset];
 
-      total_weight += color_query_weight(xx, yy, radius);
+      total_accum  += pixel * (float4)(pixel.s333, 1.0f) * pixel_weight;
+      total_weight += pixel_weight;
     }
 
-  accum[(gidy + accum_offset) * 2] = total_accum;
-  accum[(gidy + accum_offset) * 2 + 1] = (float4)(total_weight);
+  color_query_reduce(scratch, total_accum, total_weight, accum, accum_offset);
 }
 
+__kernel void mypaint_color_query_empty_tile(         float   x,
+                                                      float   y,
+                                                      int     width,
+                                                      int     height,
+                                                      int     accum_offset,
+                                             __global float4 *accum,
+                                                      float   radius,
+                                             __local  float4 *scratch)
+{
+  float total_weight = 0.0f;
+
+  for (int i = get_local_id(0); i < width * height; i += get_local_size(0))
+    total_weight += color_query_weight(i % width - x, i / width - y, radius);
 
-__kernel void mypaint_color_query_part2(__global float4 *accum,
-                                                 int     count)
+  color_query_reduce(scratch, (float4)(0.0f, 0.0f, 0.0f, 0.0f), total_weight, accum, accum_offset);
+}
+
+/* Launched as a single work group, sums the count per tile totals into accum[0] */
+__kernel void mypaint_color_query_reduce(__global float4 *accum,
+                                                  int     count,
+                                         __local  float4 *scratch)
 {
   float4 total_accum  = (float4)(0.0f, 0.0f, 0.0f, 0.0f);
   float  total_weight = 0.0f;
-  size_t end_i = count * 2;
-  size_t i = 0;
 
-  while (i < end_i)
+  for (int i = get_local_id(0); i < count; i += get_local_size(0))
     {
-      total_accum  += accum[i++];
-      total_weight += accum[i++].s0;
+      total_accum  += accum[i * 2];
+      total_weight += accum[i * 2 + 1].s0;
     }
 
-  accum[0] = total_accum;
-  accum[1] = (float4)(total_weight);
+  /* Every item must have read its totals before item 0 writes the result over them */
+  barrier(CLK_GLOBAL_MEM_FENCE);
+
+  color_query_reduce(scratch, total_accum, total_weight, accum, 0);
 }
 
 inline float4 apply_normal_mode(float4 pixel, float4 color, float alpha, float color_alpha)
@@ -253,3 +286,111 @@ inline float4 apply_isolate_mode(float4 pixel, float4 color, float alpha)
 
   return pixel;
 }
+
+/* Batched dabs, see MyPaintStrokeContextPrivate::flushDabs()
+ *
+ * Each dab is 4 float4s:
+ *   (hardness, slope1, slope2, color_alpha)
+ *   matrix
+ *   color
+ *   (tex_offset_x, tex_offset_y, shape, mode)
+ * Where shape is 0 for a normal dab or 1 for a subpixel dab and mode is
+ * 0 for normal, 1 for locked alpha or 2 for isolate.
+ *
+ * Each span is the region of one dab inside a tile, identical to the arguments of the
+ * single dab kernels: (offset, width, height, dab index) and the dab's (x, y) relative
+ * to offset. A work item applies every span covering its pixel in order.
+ */
+float dab_batch_alpha(__global const float4 *dab, float x, float y)
+{
+  float4 params = dab[0];
+
+  if (dab[3].s2 != 0.0f)
+    return alpha_from_subpixel_dab(x, y, dab[1], params.s0, params.s1, params.s2);
+  return alpha_from_dab(x, y, dab[1], params.s0, params.s1, params.s2);
+}
+
+float4 dab_batch_apply(__global const float4 *dab, float4 pixel, float alpha)
+{
+  float mode = dab[3].s3;
+
+  if (mode == 1.0f)
+    return apply_locked_normal_mode(pixel, dab[2], alpha);
+  else if (mode == 2.0f)
+    return apply_isolate_mode(pixel, dab[2], alpha);
+  return apply_normal_mode(pixel, dab[2], alpha, dab[0].s3);
+}
+
+__kernel void mypaint_dab_batch(__global       float4 *buf,
+                                               int2    origin,
+                                __global const int4   *spans,
+                                __global const float2 *coords,
+                                               int     first,
+                                               int     count,
+                                __global const float4 *dabs)
+{
+  int px = get_global_id(0) + origin.x;
+  int py = get_global_id(1) + origin.y;
+  const int idx = px + py * TILE_PIXEL_WIDTH;
+  float4 pixel = buf[idx];
+
+  for (int i = first; i < first + count; ++i)
+    {
+      int4 span = spans[i];
+      int gidx = px - span.s0 % TILE_PIXEL_WIDTH;
+      int gidy = py - span.s0 / TILE_PIXEL_WIDTH;
+
+      if (gidx < 0 || gidy < 0 || gidx >= span.s1 || gidy >= span.s2)
+        continue;
+
+      __global const float4 *dab = dabs + span.s3 * 4;
+      float2 xy = coords[i];
+      float alpha = dab_batch_alpha(dab, gidx - xy.x, gidy - xy.y);
+
+      if (alpha > 0.0f)
+        pixel = dab_batch_apply(dab, pixel, alpha);
+    }
+
+  buf[idx] = pixel;
+}
+
+__kernel void mypaint_dab_batch_textured(__global       float4   *buf,
+                                                        int2      origin,
+                                         __global const int4     *spans,
+                                         __global const float2   *coords,
+                                                        int       first,
+                                                        int       count,
+                                         __global const float4   *dabs,
+                                                        float     tex_strength,
+                                         read_only      image2d_t texture)
+{
+  int px = get_global_id(0) + origin.x;
+  int py = get_global_id(1) + origin.y;
+  const int idx = px + py * TILE_PIXEL_WIDTH;
+  float4 pixel = buf[idx];
+
+  for (int i = first; i < first + count; ++i)
+    {
+      int4 span = spans[i];
+      int gidx = px - span.s0 % TILE_PIXEL_WIDTH;
+      int gidy = py - span.s0 / TILE_PIXEL_WIDTH;
+
+      if (gidx < 0 || gidy < 0 || gidx >= span.s1 || gidy >= span.s2)
+        continue;
+
+      __global const float4 *dab = dabs + span.s3 * 4;
+      float2 xy = coords[i];
+      float alpha = dab_batch_alpha(dab, gidx - xy.x, gidy - xy.y);
+
+      if (alpha > 0.0f)
+        {
+          float4 tex_offset = dab[3];
+          alpha = apply_texture(alpha, gidx + tex_offset.s0 - xy.x, gidy + tex_offset.s1 - xy.y, texture, tex_strength);
+        }
+
+      if (alpha > 0.0f)
+        pixel = dab_batch_apply(dab, pixel, alpha);
+    }
+
+  buf[idx] = pixel;
+}
@@ -64,6 +64,9 @@ SOURCES += main.cpp\
     canvasindex.cpp \
     canvaswidget-opencl.cpp \
     opencldeviceinfo.cpp \
+    openclprofiler.cpp \
+    workgrouptuner.cpp \
+    nativekernels.cpp \
     glhelper.cpp \
     mypaintstrokecontext.cpp \
     canvascontext.cpp \
@@ -74,6 +77,8 @@ SOURCES += main.cpp\
     canvasstack.cpp \
     tileset.cpp \
     ora.cpp \
+    pngstream.cpp \
+    tsdfile.cpp \
     hsvcolordial.cpp \
     canvasundoevent.cpp \
     basetool.cpp \
@@ -93,6 +98,8 @@ SOURCES += main.cpp\
     deviceselectdialog.cpp \
     maskbuffer.cpp \
     batchprocessor.cpp \
+    strokereplay.cpp \
+    benchmarksuite.cpp \
     gradienttool.cpp \
     nativeeventfilter.cpp \
     toollistview.cpp \
@@ -116,6 +123,9 @@ HEADERS  += mainwindow.h \
     canvasindex.h \
     canvaswidget-opencl.h \
     opencldeviceinfo.h \
+    openclprofiler.h \
+    workgrouptuner.h \
+    nativekernels.h \
     glhelper.h \
     mypaintstrokecontext.h \
     canvascontext.h \
@@ -126,6 +136,8 @@ HEADERS  += mainwindow.h \
     canvasstack.h \
     tileset.h \
     ora.h \
+    pngstream.h \
+    tsdfile.h \
     hsvcolordial.h \
     canvasundoevent.h \
     basetool.h \
@@ -147,6 +159,8 @@ HEADERS  += mainwindow.h \
     deviceselectdialog.h \
     maskbuffer.h \
     batchprocessor.h \
+    strokereplay.h \
+    benchmarksuite.h \
     gradienttool.h \
     nativeeventfilter.h \
     toollistview.h \
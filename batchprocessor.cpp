@@ -4,6 +4,7 @@
 #include "canvasstrokepoint.h"
 #include "imagefiles.h"
 #include "ora.h"
+#include "tsdfile.h"
 #include "toolfactory.h"
 #include <QApplication>
 #include <QFile>
@@ -13,6 +14,7 @@
 #include <QJsonObject>
 #include <QJsonValue>
 #include <QDebug>
+#include <iostream>
 
 struct BatchProcessorContext {
     CanvasStack layers;
@@ -264,6 +266,10 @@ void BatchCommandExport::apply(BatchProcessorContext *ctx)
     {
         saveStackAs(&ctx->layers, QRect(), path);
     }
+    else if (isTSDPath(path))
+    {
+        saveStackAsTSD(&ctx->layers, QRect(), path);
+    }
     else
     {
         QImage output = stackToImage(&ctx->layers);
@@ -305,13 +311,16 @@ void BatchCommandOpen::apply(BatchProcessorContext *ctx)
     {
         loadStackFromORA(&ctx->layers, nullptr, path);
     }
+    else if (isTSDPath(path))
+    {
+        loadStackFromTSD(&ctx->layers, nullptr, path);
+    }
     else
     {
-        QImage image(path);
-        if (!image.isNull())
+        std::unique_ptr<CanvasLayer> imageLayer = layerFromFile(path);
+        if (imageLayer)
         {
             ctx->layers.clearLayers();
-            std::unique_ptr<CanvasLayer> imageLayer = layerFromImage(image);
             imageLayer->name = path;
             ctx->layers.layers.append(imageLayer.release());
         }
@@ -400,5 +409,33 @@ void BatchProcessor::execute(QString path)
             commandIter->apply(&ctx);
     }
 
+    if (SharedOpenCL *opencl = SharedOpenCL::getSharedOpenCLMaybe())
+    {
+        if (opencl->profiler)
+        {
+            clFinish(opencl->cmdQueue);
+            if (!opencl->profiler->waitForPending())
+                qWarning() << "Timed out waiting for profiling events";
+
+            QJsonObject profileObject;
+            profileObject["kernels"] = opencl->profiler->toJson();
+            QByteArray profileJson = QJsonDocument(profileObject).toJson();
+
+            if (profileOutputPath.isEmpty() || profileOutputPath == QStringLiteral("-"))
+            {
+                std::cout << profileJson.constData() << std::flush;
+            }
+            else
+            {
+                QFile profileFile(profileOutputPath);
+                if (!profileFile.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+                    profileFile.write(profileJson) != profileJson.size())
+                {
+                    qWarning() << "Failed to write profile" << profileOutputPath << profileFile.errorString();
+                }
+            }
+        }
+    }
+
     QApplication::quit();
 }
@@ -9,6 +9,9 @@ class BatchProcessor : public QObject
 public:
     explicit BatchProcessor(QObject *parent = 0);
 
+    /* Write the OpenCL profile as JSON after executing, "-" for stdout */
+    QString profileOutputPath;
+
 signals:
 
 public slots:
@@ -0,0 +1,647 @@
+#include "benchmarksuite.h"
+#include "canvaswidget-opencl.h"
+#include "canvasstack.h"
+#include "canvaslayer.h"
+#include "canvastile.h"
+#include "canvasundoevent.h"
+#include "imagefiles.h"
+#include "mypaintstrokecontext.h"
+#include "nativekernels.h"
+#include "opencldeviceinfo.h"
+#include "ora.h"
+#include "tsdfile.h"
+#include "toolfactory.h"
+#include <QApplication>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QImageWriter>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMatrix>
+#include <QTemporaryDir>
+#include <QDebug>
+#include <algorithm>
+#include <qmath.h>
+#include <functional>
+#include <iostream>
+
+namespace {
+    const int minRuns = 5;
+    const int maxRuns = 50;
+    const double minTotalMs = 500.0;
+
+    /* Each layer is filled over a tileSpan x tileSpan block of tiles */
+    const int tileSpan = 8;
+
+    /* How far the OpenCL kernels may stray from the native backend, two 8 bit levels */
+    const float nativeTolerance = 2.0f / 255.0f;
+
+    void finishQueue()
+    {
+        SharedOpenCL *opencl = SharedOpenCL::getSharedOpenCL();
+        if (!opencl->native)
+            clFinish(opencl->cmdQueue);
+    }
+
+    void fillLayer(CanvasLayer *layer, float r, float g, float b, float a, int span = tileSpan)
+    {
+        for (int y = 0; y < span; ++y)
+            for (int x = 0; x < span; ++x)
+                layer->getTile(x, y)->fill(r * a, g * a, b * a, a);
+    }
+
+    struct Result
+    {
+        QString name;
+        std::vector<double> runs;
+        int tiles = 0;
+        QJsonObject extra;
+
+        QJsonObject toJson() const;
+    };
+
+    QJsonObject Result::toJson() const
+    {
+        std::vector<double> sorted = runs;
+        std::sort(sorted.begin(), sorted.end());
+
+        double sum = 0.0;
+        for (double run: sorted)
+            sum += run;
+        double mean = sorted.empty() ? 0.0 : sum / sorted.size();
+
+        double variance = 0.0;
+        for (double run: sorted)
+            variance += (run - mean) * (run - mean);
+        if (sorted.size() > 1)
+            variance /= sorted.size() - 1;
+
+        QJsonObject result = extra;
+        result["name"] = name;
+        result["runs"] = double(sorted.size());
+        result["tiles"] = tiles;
+        result["mean_ms"] = mean;
+        result["median_ms"] = sorted.empty() ? 0.0 : sorted[sorted.size() / 2];
+        result["min_ms"] = sorted.empty() ? 0.0 : sorted.front();
+        result["max_ms"] = sorted.empty() ? 0.0 : sorted.back();
+        result["variance_ms2"] = variance;
+        result["stddev_ms"] = std::sqrt(variance);
+
+        return result;
+    }
+
+    /* Time run, which returns the number of tiles it touched, after calling
+     * prepare outside of the timed section. The queue is finished before the
+     * timer stops so device work is counted.
+     */
+    Result measure(QString const &name, std::function<int()> run, std::function<void()> prepare = nullptr)
+    {
+        Result result;
+        result.name = name;
+
+        double totalMs = 0.0;
+        for (int i = 0; i <= maxRuns; ++i)
+        {
+            if (i > minRuns && totalMs >= minTotalMs)
+                break;
+
+            if (prepare)
+                prepare();
+            finishQueue();
+
+            QElapsedTimer timer;
+            timer.start();
+            result.tiles = run();
+            finishQueue();
+            double runMs = timer.nsecsElapsed() / 1.0e6;
+
+            // Discard the first run
+            if (i == 0)
+                continue;
+
+            result.runs.push_back(runMs);
+            totalMs += runMs;
+        }
+
+        qDebug() << "Benchmark" << name << totalMs / result.runs.size() << "ms";
+
+        return result;
+    }
+
+    std::unique_ptr<CanvasStack> filledStack(int layerCount)
+    {
+        std::unique_ptr<CanvasStack> stack(new CanvasStack());
+
+        for (int i = 0; i < layerCount; ++i)
+        {
+            CanvasLayer *layer = new CanvasLayer(QString().sprintf("Layer %02d", i + 1));
+            float hue = float(i) / layerCount;
+            QColor color = QColor::fromHsvF(hue, 0.8, 0.8);
+            fillLayer(layer, color.redF(), color.greenF(), color.blueF(), 0.5f);
+            layer->mode = (i % 2) ? BlendMode::Multiply : BlendMode::Over;
+            stack->layers.append(layer);
+        }
+
+        return stack;
+    }
+
+    void strokeBenchmarks(std::vector<Result> &results)
+    {
+        const float radius = 100.0f;
+        const float center = 150.0f;
+        const int points = 200;
+
+        for (auto const &toolEntry: ToolFactory::listTools())
+        {
+            QString const &toolPath = toolEntry.first;
+
+            // Only tools that paint along the stroke
+            if (toolPath != QStringLiteral("round") && !toolPath.endsWith(".myb") && !toolPath.endsWith(".mbi"))
+                continue;
+
+            std::unique_ptr<BaseTool> tool = ToolFactory::loadTool(toolPath);
+            if (!tool)
+                continue;
+            tool->setColor(QColor::fromRgbF(0.2, 0.4, 0.8));
+
+            std::unique_ptr<CanvasLayer> layer;
+            std::unique_ptr<CanvasLayer> layerCopy;
+            quint64 dabs = 0;
+
+            auto prepare = [&]() {
+                layer.reset(new CanvasLayer());
+                layerCopy = layer->deepCopy();
+            };
+
+            auto run = [&]() -> int {
+                quint64 startDabs = MyPaintStrokeContext::totalDabCount();
+                StrokeContextArgs args = {layer.get(), layerCopy.get()};
+                std::unique_ptr<StrokeContext> stroke = tool->newStroke(args);
+
+                float angle = 0.0f;
+                stroke->startStroke(QPointF(cosf(angle) * radius + center, sinf(angle) * radius + center), 1.0f);
+                for (int i = 0; i < points; ++i)
+                {
+                    angle += M_PI * 2.0f / 100.0f;
+                    stroke->strokeTo(QPointF(cosf(angle) * radius + center, sinf(angle) * radius + center),
+                                     1.0f, 1000.0f / 60.0f);
+                }
+                stroke.reset();
+
+                dabs = MyPaintStrokeContext::totalDabCount() - startDabs;
+                return layer->tiles->size();
+            };
+
+            Result result = measure(QStringLiteral("stroke/") + toolEntry.second, run, prepare);
+            result.extra["tool"] = toolPath;
+            result.extra["points"] = points + 1;
+            if (dabs)
+                result.extra["dabs"] = double(dabs);
+            results.push_back(result);
+        }
+    }
+
+    void compositeBenchmarks(std::vector<Result> &results)
+    {
+        for (int layerCount: {1, 4, 16})
+        {
+            std::unique_ptr<CanvasStack> stack = filledStack(layerCount);
+
+            auto run = [&]() -> int {
+                TileSet tileSet = stack->getTileSet();
+                for (QPoint const &iter: tileSet)
+                    stack->getTileMaybe(iter.x(), iter.y());
+                return tileSet.size();
+            };
+
+            Result result = measure(QString().sprintf("composite/%d", layerCount), run);
+            result.extra["layers"] = layerCount;
+            results.push_back(result);
+        }
+    }
+
+    void undoBenchmarks(std::vector<Result> &results)
+    {
+        CanvasStack stack;
+        CanvasLayer *layer = new CanvasLayer();
+        stack.layers.append(layer);
+        fillLayer(layer, 0.2f, 0.4f, 0.8f, 1.0f);
+
+        /* The same tiles painted over, as a stroke would leave them */
+        CanvasUndoTiles undoEvent;
+        undoEvent.currentLayer = 0;
+        undoEvent.targetTileMap = layer->tiles;
+        for (auto const &iter: *layer->tiles)
+        {
+            undoEvent.tiles[iter.first] = iter.second->copy();
+            iter.second->fill(0.8f, 0.4f, 0.2f, 1.0f);
+        }
+
+        int activeLayer = 0;
+        QRect activeFrame, inactiveFrame;
+
+        auto run = [&]() -> int {
+            TileSet changed = undoEvent.apply(&stack, &activeLayer, nullptr, &activeFrame, &inactiveFrame);
+            undoEvent.apply(&stack, &activeLayer, nullptr, &activeFrame, &inactiveFrame);
+            return changed.size();
+        };
+
+        results.push_back(measure(QStringLiteral("undo/tiles"), run));
+
+        /* A 32x32 pixel change to every tile, stored as deltas */
+        CanvasUndoTiles deltaEvent;
+        deltaEvent.currentLayer = 0;
+        deltaEvent.targetTileMap = layer->tiles;
+
+        TileMap previous;
+        for (auto const &iter: *layer->tiles)
+        {
+            previous[iter.first] = iter.second->copy();
+            float *data = iter.second->mapHost();
+            for (int y = 48; y < 80; ++y)
+                std::fill_n(data + (y * TILE_PIXEL_WIDTH + 48) * 4, 32 * 4, 0.5f);
+        }
+        deltaEvent.storeTiles(std::move(previous));
+
+        Result deltaResult = measure(QStringLiteral("undo/delta"), [&]() -> int {
+            TileSet changed = deltaEvent.apply(&stack, &activeLayer, nullptr, &activeFrame, &inactiveFrame);
+            deltaEvent.apply(&stack, &activeLayer, nullptr, &activeFrame, &inactiveFrame);
+            return changed.size();
+        });
+        // Applying finishes the comparison storeTiles left pending
+        deltaResult.extra["stored_bytes"] = double(deltaEvent.cost().compressedBytes);
+        results.push_back(deltaResult);
+    }
+
+    void oraBenchmarks(std::vector<Result> &results)
+    {
+        QTemporaryDir tempDir;
+        if (!tempDir.isValid())
+        {
+            qWarning() << "Failed to create a temporary directory, skipping ORA benchmarks";
+            return;
+        }
+
+        const int layerCount = 4;
+        QString path = tempDir.path() + QStringLiteral("/benchmark.ora");
+        std::unique_ptr<CanvasStack> stack = filledStack(layerCount);
+        int tiles = stack->getTileSet().size() * layerCount;
+
+        // Forget the previous save so every layer is encoded
+        Result saveResult = measure(QStringLiteral("ora/save"), [&]() -> int {
+            saveStackAs(stack.get(), QRect(), path);
+            return tiles;
+        }, [&]() {
+            stack->oraRecord = OraFileRecord();
+        });
+        saveResult.extra["layers"] = layerCount;
+        saveResult.extra["bytes"] = double(QFile(path).size());
+        results.push_back(saveResult);
+
+        // Only the first layer changes, the others are copied from the previous save
+        CanvasLayer *editedLayer = stack->layers.first();
+        Result editResult = measure(QStringLiteral("ora/save-edit"), [&]() -> int {
+            saveStackAs(stack.get(), QRect(), path);
+            return editedLayer->tiles->size();
+        }, [&]() {
+            editedLayer->markModified();
+        });
+        editResult.extra["layers"] = layerCount;
+        results.push_back(editResult);
+
+        Result loadResult = measure(QStringLiteral("ora/load"), [&]() -> int {
+            CanvasStack loaded;
+            loadStackFromORA(&loaded, nullptr, path);
+            int loadedTiles = 0;
+            for (CanvasLayer const *layer: loaded.layers)
+                loadedTiles += layer->tiles->size();
+            return loadedTiles;
+        });
+        loadResult.extra["layers"] = layerCount;
+        results.push_back(loadResult);
+    }
+
+    void tsdBenchmarks(std::vector<Result> &results)
+    {
+        QTemporaryDir tempDir;
+        if (!tempDir.isValid())
+        {
+            qWarning() << "Failed to create a temporary directory, skipping TSD benchmarks";
+            return;
+        }
+
+        const int layerCount = 4;
+        QString path = tempDir.path() + QStringLiteral("/benchmark.tsd");
+        std::unique_ptr<CanvasStack> stack = filledStack(layerCount);
+        int tiles = stack->getTileSet().size() * layerCount;
+
+        // Forget the previous save so every tile is written
+        Result saveResult = measure(QStringLiteral("tsd/save"), [&]() -> int {
+            saveStackAsTSD(stack.get(), QRect(), path);
+            return tiles;
+        }, [&]() {
+            stack->tsdRecord = TsdFileRecord();
+        });
+        saveResult.extra["layers"] = layerCount;
+        saveResult.extra["bytes"] = double(QFile(path).size());
+        results.push_back(saveResult);
+
+        // One tile of the first layer changes, only it is appended
+        CanvasLayer *editedLayer = stack->layers.first();
+        float value = 0.0f;
+        Result editResult = measure(QStringLiteral("tsd/save-edit"), [&]() -> int {
+            saveStackAsTSD(stack.get(), QRect(), path);
+            return 1;
+        }, [&]() {
+            value += 1.0f / 256.0f;
+            float *data = editedLayer->openTileAt(0, 0);
+            data[0] = value;
+        });
+        editResult.extra["layers"] = layerCount;
+        editResult.extra["bytes"] = double(QFile(path).size());
+        results.push_back(editResult);
+
+        Result loadResult = measure(QStringLiteral("tsd/load"), [&]() -> int {
+            CanvasStack loaded;
+            loadStackFromTSD(&loaded, nullptr, path);
+            int loadedTiles = 0;
+            for (CanvasLayer const *layer: loaded.layers)
+                loadedTiles += layer->tiles->size();
+            return loadedTiles;
+        });
+        loadResult.extra["layers"] = layerCount;
+        results.push_back(loadResult);
+    }
+
+    void pngBenchmarks(std::vector<Result> &results)
+    {
+        QTemporaryDir tempDir;
+        if (!tempDir.isValid())
+        {
+            qWarning() << "Failed to create a temporary directory, skipping PNG benchmarks";
+            return;
+        }
+
+        QString path = tempDir.path() + QStringLiteral("/benchmark.png");
+        std::unique_ptr<CanvasStack> stack = filledStack(4);
+
+        Result result = measure(QStringLiteral("png/export"), [&]() -> int {
+            QImage output = stackToImage(stack.get());
+            QImageWriter writer(path);
+            writer.setQuality(9);
+            if (!writer.write(output))
+                qWarning() << "PNG export failed" << writer.errorString();
+            return stack->getTileSet().size();
+        });
+        result.extra["bytes"] = double(QFile(path).size());
+        results.push_back(result);
+    }
+
+    void transformBenchmarks(std::vector<Result> &results)
+    {
+        CanvasLayer layer;
+        fillLayer(&layer, 0.2f, 0.4f, 0.8f, 1.0f);
+
+        results.push_back(measure(QStringLiteral("transform/translate"), [&]() -> int {
+            return layer.translated(37, 23)->tiles->size();
+        }));
+
+        QMatrix rotation;
+        rotation.translate(tileSpan * TILE_PIXEL_WIDTH / 2, tileSpan * TILE_PIXEL_HEIGHT / 2);
+        rotation.rotate(30.0);
+        rotation.translate(-tileSpan * TILE_PIXEL_WIDTH / 2, -tileSpan * TILE_PIXEL_HEIGHT / 2);
+
+        results.push_back(measure(QStringLiteral("transform/rotate"), [&]() -> int {
+            return layer.applyMatrix(rotation)->tiles->size();
+        }));
+    }
+
+    void pruneBenchmarks(std::vector<Result> &results)
+    {
+        std::unique_ptr<CanvasLayer> layer;
+        int tiles = 0;
+
+        /* Half of the tiles are empty */
+        auto prepare = [&]() {
+            layer.reset(new CanvasLayer());
+            fillLayer(layer.get(), 0.0f, 0.0f, 0.0f, 0.0f, tileSpan * 2);
+            fillLayer(layer.get(), 0.2f, 0.4f, 0.8f, 1.0f);
+            for (int y = 0; y < tileSpan; ++y)
+                layer->getTile(tileSpan + y, y)->fill(0.2f, 0.4f, 0.8f, 1.0f);
+            tiles = layer->tiles->size();
+        };
+
+        results.push_back(measure(QStringLiteral("prune"), [&]() -> int {
+            layer->prune();
+            return tiles;
+        }, prepare));
+    }
+
+    void blendBenchmarks(std::vector<Result> &results)
+    {
+        static const std::pair<BlendMode::Mode, const char *> modes[] = {
+            {BlendMode::Over, "over"},
+            {BlendMode::Multiply, "multiply"},
+            {BlendMode::ColorDodge, "color-dodge"},
+            {BlendMode::ColorBurn, "color-burn"},
+            {BlendMode::Screen, "screen"},
+            {BlendMode::Hue, "hue"},
+            {BlendMode::Saturation, "saturation"},
+            {BlendMode::Color, "color"},
+            {BlendMode::Luminosity, "luminosity"},
+            {BlendMode::DestinationIn, "dst-in"},
+            {BlendMode::DestinationOut, "dst-out"},
+            {BlendMode::SourceAtop, "src-atop"},
+            {BlendMode::DestinationAtop, "dst-atop"},
+        };
+
+        const int tileCount = tileSpan * tileSpan;
+        // Each blend reads both tiles and writes the target
+        const double bytesPerTile = 3.0 * TILE_COMP_TOTAL * sizeof(float);
+
+        std::vector<std::unique_ptr<CanvasTile>> auxTiles;
+        std::vector<std::unique_ptr<CanvasTile>> targetTiles;
+        for (int i = 0; i < tileCount; ++i)
+        {
+            auxTiles.emplace_back(new CanvasTile());
+            targetTiles.emplace_back(new CanvasTile());
+        }
+
+        const bool checkNative = !SharedOpenCL::getSharedOpenCL()->native;
+
+        for (auto const &mode: modes)
+        {
+            auto fillTiles = [&](bool hostResident) {
+                for (int i = 0; i < tileCount; ++i)
+                {
+                    float shade = float(i) / tileCount;
+                    auxTiles[i]->fill(shade * 0.6f, 0.3f, (1.0f - shade) * 0.6f, 0.6f);
+                    targetTiles[i]->fill(0.2f, shade * 0.8f, 0.4f, 0.8f);
+                    if (hostResident)
+                        auxTiles[i]->swapHost();
+                }
+            };
+
+            /* The kernel's output is compared with the native backend's blend of the same tiles */
+            float nativeError = 0.0f;
+            if (checkNative)
+            {
+                fillTiles(false);
+
+                std::vector<float> expected(TILE_COMP_TOTAL);
+                for (int i = 0; i < tileCount; ++i)
+                {
+                    const float *target = targetTiles[i]->mapHost();
+                    std::copy(target, target + TILE_COMP_TOTAL, expected.begin());
+                    NativeKernels::blend(expected.data(), auxTiles[i]->mapHost(), mode.first, 0.8f);
+
+                    auxTiles[i]->blendOnto(targetTiles[i].get(), mode.first, 0.8f);
+                    const float *actual = targetTiles[i]->mapHost();
+                    for (int j = 0; j < TILE_COMP_TOTAL; ++j)
+                        nativeError = std::max(nativeError, std::abs(actual[j] - expected[j]));
+                }
+
+                if (nativeError > nativeTolerance)
+                    qWarning() << "Blend mode" << mode.second << "differs from the native backend by" << nativeError;
+            }
+
+            /* Host resident tiles are read back before each run so blendOnto has to
+             * upload them again, as it does for layers that were swapped out.
+             */
+            for (bool hostResident: {false, true})
+            {
+                auto prepare = [&]() {
+                    fillTiles(hostResident);
+                };
+
+                auto run = [&]() -> int {
+                    for (int i = 0; i < tileCount; ++i)
+                        auxTiles[i]->blendOnto(targetTiles[i].get(), mode.first, 0.8f);
+                    return tileCount;
+                };
+
+                QString name = QStringLiteral("blend/%1/%2").arg(mode.second, hostResident ? "host" : "device");
+                Result result = measure(name, run, prepare);
+
+                double meanSeconds = 0.0;
+                for (double runMs: result.runs)
+                    meanSeconds += runMs / 1000.0;
+                meanSeconds /= std::max<size_t>(result.runs.size(), 1);
+
+                result.extra["mode"] = mode.second;
+                result.extra["resident"] = hostResident ? "host" : "device";
+                result.extra["tiles_per_s"] = meanSeconds > 0.0 ? tileCount / meanSeconds : 0.0;
+                result.extra["gb_per_s"] = meanSeconds > 0.0 ? tileCount * bytesPerTile / meanSeconds / 1.0e9 : 0.0;
+                if (checkNative)
+                {
+                    result.extra["native_max_error"] = nativeError;
+                    result.extra["native_match"] = nativeError <= nativeTolerance;
+                }
+                results.push_back(result);
+            }
+        }
+    }
+
+    typedef void (*SuiteFunction)(std::vector<Result> &);
+
+    std::vector<std::pair<QString, SuiteFunction>> const &suites()
+    {
+        static const std::vector<std::pair<QString, SuiteFunction>> list = {
+            {QStringLiteral("strokes"), strokeBenchmarks},
+            {QStringLiteral("composite"), compositeBenchmarks},
+            {QStringLiteral("undo"), undoBenchmarks},
+            {QStringLiteral("ora"), oraBenchmarks},
+            {QStringLiteral("tsd"), tsdBenchmarks},
+            {QStringLiteral("png"), pngBenchmarks},
+            {QStringLiteral("transform"), transformBenchmarks},
+            {QStringLiteral("prune"), pruneBenchmarks},
+            {QStringLiteral("blend"), blendBenchmarks},
+        };
+
+        return list;
+    }
+}
+
+BenchmarkSuite::BenchmarkSuite(QObject *parent) :
+    QObject(parent)
+{
+}
+
+QStringList BenchmarkSuite::suiteNames()
+{
+    QStringList result = {QStringLiteral("all")};
+    for (auto const &iter: suites())
+        result.append(iter.first);
+    return result;
+}
+
+void BenchmarkSuite::execute(QString suite)
+{
+    if (!suiteNames().contains(suite))
+    {
+        qWarning() << "Unknown benchmark suite" << suite << "expected one of" << suiteNames().join(", ");
+        QApplication::exit(1);
+        return;
+    }
+
+    SharedOpenCL *opencl = SharedOpenCL::getSharedOpenCL();
+    std::vector<Result> results;
+
+    for (auto const &iter: suites())
+        if (suite == QStringLiteral("all") || suite == iter.first)
+            iter.second(results);
+
+    QJsonArray resultsArray;
+    int nativeMismatches = 0;
+    for (Result const &result: results)
+    {
+        resultsArray.append(result.toJson());
+        if (result.extra.contains("native_match") && !result.extra["native_match"].toBool())
+            nativeMismatches++;
+    }
+
+    QJsonObject outputObject;
+    outputObject["suite"] = suite;
+    outputObject["timestamp"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+    if (opencl->native)
+    {
+        outputObject["device"] = QStringLiteral("native");
+    }
+    else
+    {
+        OpenCLDeviceInfo deviceInfo(opencl->device);
+        outputObject["device"] = deviceInfo.getDeviceName();
+        outputObject["platform"] = deviceInfo.getPlatformName();
+        outputObject["driver"] = deviceInfo.getDeviceInfoString(CL_DRIVER_VERSION);
+    }
+    QJsonArray tileSize;
+    tileSize.append(TILE_PIXEL_WIDTH);
+    tileSize.append(TILE_PIXEL_HEIGHT);
+    outputObject["tile_size"] = tileSize;
+    outputObject["results"] = resultsArray;
+    if (!opencl->native)
+        outputObject["native_mismatches"] = nativeMismatches;
+    QByteArray outputJson = QJsonDocument(outputObject).toJson();
+
+    if (outputPath.isEmpty() || outputPath == QStringLiteral("-"))
+    {
+        std::cout << outputJson.constData() << std::flush;
+    }
+    else
+    {
+        QFile outputFile(outputPath);
+        if (!outputFile.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+            outputFile.write(outputJson) != outputJson.size())
+        {
+            qWarning() << "Failed to write benchmark results" << outputPath << outputFile.errorString();
+        }
+    }
+
+    // Results that don't match the native backend fail the run, so scripts can check for them
+    if (nativeMismatches)
+        QApplication::exit(1);
+    else
+        QApplication::quit();
+}
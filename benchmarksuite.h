@@ -0,0 +1,26 @@
+#ifndef BENCHMARKSUITE_H
+#define BENCHMARKSUITE_H
+
+#include <QObject>
+#include <QStringList>
+
+/* Runs a named set of benchmarks without a canvas window and writes the
+ * timings as JSON. Each benchmark is repeated until its timings settle,
+ * the first run is discarded as warm up.
+ */
+class BenchmarkSuite : public QObject
+{
+    Q_OBJECT
+public:
+    explicit BenchmarkSuite(QObject *parent = 0);
+
+    static QStringList suiteNames();
+
+    /* Write the results as JSON, "-" or empty for stdout */
+    QString outputPath;
+
+public slots:
+    void execute(QString suite);
+};
+
+#endif // BENCHMARKSUITE_H
@@ -1,10 +1,21 @@
 #include "canvascontext.h"
+#include "nativekernels.h"
+#include <algorithm>
 #include <QDebug>
+#include <QSettings>
 
 CanvasContext::CanvasContext()
     : currentLayer(0),
-      inTransientOpacity(false)
+      inTransientOpacity(false),
+      strokeEventsProcessed(0),
+      strokeEventsCoalesced(0),
+      strokeEventsDropped(0)
 {
+    QSettings appSettings;
+    undoMemoryLimit = appSettings.value("Undo/MemoryLimitMB", 2048).toULongLong() * 1024 * 1024;
+    undoStepLimit = appSettings.value("Undo/StepLimit", 0).toInt();
+    undoDeviceLimit = appSettings.value("Undo/DeviceLimitMB", 512).toULongLong() * 1024 * 1024;
+
     resetQuickmask();
 }
 
@@ -29,6 +40,14 @@ void CanvasContext::renderDirty(TileMap *into)
                 if (!renderedTile)
                     renderedTile = layers.backgroundTileCL->copy();
 
+                if (SharedOpenCL::getSharedOpenCL()->native)
+                {
+                    const float color[4] = {1.0f, 0.0f, 0.0f, 0.6f};
+                    NativeKernels::colorMask(renderedTile->mapHost(), qmTile->mapHost(), color);
+                    (*into)[iter] = std::move(renderedTile);
+                    continue;
+                }
+
                 static const size_t global_work_size[1] = {TILE_PIXEL_WIDTH * TILE_PIXEL_HEIGHT};
                 cl_kernel kernel = SharedOpenCL::getSharedOpenCL()->colorMask;
                 cl_mem inMem = renderedTile->unmapHost();
@@ -36,14 +55,18 @@ void CanvasContext::renderDirty(TileMap *into)
 
                 cl_float4 color = {1.0f, 0.0f, 0.0f, 0.6f};
 
+                CLDependencies deps;
+                deps.add(renderedTile->eventSlot()).add(qmTile->eventSlot());
+
                 clSetKernelArg<cl_mem>(kernel, 0, inMem);
                 clSetKernelArg<cl_mem>(kernel, 1, inMem);
                 clSetKernelArg<cl_mem>(kernel, 2, auxMem);
                 clSetKernelArg<cl_float4>(kernel, 3, color);
                 clEnqueueNDRangeKernel(SharedOpenCL::getSharedOpenCL()->cmdQueue,
                                        kernel,
-                                       1, nullptr, global_work_size, nullptr,
-                                       0, nullptr, nullptr);
+                                       1, nullptr, global_work_size,
+                                       SharedOpenCL::getSharedOpenCL()->localWorkSize(kernel, 1, global_work_size).get(),
+                                       deps.count(), deps.waitList(), deps.event(kernel));
             }
         }
 
@@ -72,17 +95,100 @@ void CanvasContext::updateQuickmaskCopy()
 void CanvasContext::addUndoEvent(CanvasUndoEvent *undoEvent)
 {
     clearRedoHistory();
+    pollUndoSpills();
     inTransientOpacity = false;
     undoHistory.push_front(std::unique_ptr<CanvasUndoEvent>(undoEvent));
+    updateUndoCost(undoEvent);
+
+    auto dropOldest = [this]() {
+        forgetUndoEvent(undoHistory.back().get());
+        undoHistory.pop_back();
+    };
+
+    if (undoStepLimit > 0)
+        while (undoHistory.size() > size_t(undoStepLimit))
+            dropOldest();
+
+    // The newest event is always kept so the last action can be undone
+    if (undoMemoryLimit > 0)
+        while (undoCost.total() > undoMemoryLimit && undoHistory.size() > 1)
+            dropOldest();
+
+    /* Undoing is fastest from device memory, so the newest events keep their tiles
+     * there until the device limit is reached. The spills are finished once the
+     * history next changes and their reads have completed. Tiles already on their
+     * way out aren't counted again, and nothing is spilled where device memory is
+     * host memory.
+     */
+    if (CanvasTile::canSwapHost() && undoCost.deviceBytes - undoCost.pendingBytes > undoDeviceLimit)
+    {
+        quint64 kept = 0;
+        quint64 remaining = undoCost.deviceBytes - undoCost.pendingBytes;
+
+        for (auto const &event: undoHistory)
+        {
+            if (remaining == 0)
+                break;
+
+            quint64 deviceBytes = event->countedCost.deviceBytes - event->countedCost.pendingBytes;
+            remaining -= deviceBytes;
+
+            if (deviceBytes == 0 || kept == 0 || kept + deviceBytes <= undoDeviceLimit)
+            {
+                kept += deviceBytes;
+                continue;
+            }
+
+            event->spill();
+            updateUndoCost(event.get());
+        }
+    }
 }
 
 void CanvasContext::clearUndoHistory()
 {
     inTransientOpacity = false;
+    for (auto const &event: undoHistory)
+        forgetUndoEvent(event.get());
     undoHistory.clear();
 }
 
 void CanvasContext::clearRedoHistory()
 {
+    for (auto const &event: redoHistory)
+        forgetUndoEvent(event.get());
     redoHistory.clear();
 }
+
+void CanvasContext::updateUndoCost(CanvasUndoEvent *event)
+{
+    undoCost -= event->countedCost;
+    event->countedCost = event->cost();
+    undoCost += event->countedCost;
+
+    if (event->countedCost.pendingBytes > 0 &&
+        std::find(spillingUndoEvents.begin(), spillingUndoEvents.end(), event) == spillingUndoEvents.end())
+    {
+        spillingUndoEvents.push_back(event);
+    }
+}
+
+void CanvasContext::forgetUndoEvent(CanvasUndoEvent *event)
+{
+    undoCost -= event->countedCost;
+    spillingUndoEvents.erase(std::remove(spillingUndoEvents.begin(), spillingUndoEvents.end(), event),
+                             spillingUndoEvents.end());
+}
+
+void CanvasContext::pollUndoSpills()
+{
+    std::vector<CanvasUndoEvent *> spilling;
+    spilling.swap(spillingUndoEvents);
+
+    // Events with tiles still being read back are put back on the list by updateUndoCost()
+    for (CanvasUndoEvent *event: spilling)
+    {
+        event->finishSpill();
+        updateUndoCost(event);
+    }
+}
@@ -29,10 +29,29 @@ public:
     std::list<std::unique_ptr<CanvasUndoEvent>> undoHistory;
     std::list<std::unique_ptr<CanvasUndoEvent>> redoHistory;
 
+    /* Limits on undoHistory from the Undo/MemoryLimitMB and Undo/StepLimit
+     * settings, the oldest events are dropped past either. Zero is no limit.
+     */
+    quint64 undoMemoryLimit;
+    int undoStepLimit;
+    /* Device memory undoHistory may hold from the Undo/DeviceLimitMB setting, past
+     * it the oldest events are spilled to the host. The newest event always stays.
+     */
+    quint64 undoDeviceLimit;
+    /* The memory held by undoHistory and redoHistory, the sum of each event's countedCost */
+    CanvasUndoCost undoCost;
+    /* Events with tiles still being moved to the host, see pollUndoSpills() */
+    std::vector<CanvasUndoEvent *> spillingUndoEvents;
+
     bool inTransientOpacity;
     TileSet dirtyTiles;
     TileSet strokeModifiedTiles;
 
+    /* strokeTo events run, skipped because a newer one was queued, and received without a stroke */
+    quint64 strokeEventsProcessed;
+    quint64 strokeEventsCoalesced;
+    quint64 strokeEventsDropped;
+
     void renderDirty(TileMap *into);
 
     void resetQuickmask();
@@ -41,6 +60,12 @@ public:
     void addUndoEvent(CanvasUndoEvent *undoEvent);
     void clearUndoHistory();
     void clearRedoHistory();
+    /* Recount the event's cost in undoCost after it changed, e.g. by being applied */
+    void updateUndoCost(CanvasUndoEvent *event);
+    /* Remove the event's cost from undoCost before it's deleted */
+    void forgetUndoEvent(CanvasUndoEvent *event);
+    /* Finish the spills whose reads have completed, releasing their device memory */
+    void pollUndoSpills();
 };
 
 #endif // CANVASCONTEXT_H
@@ -1,11 +1,17 @@
 #include "canvaslayer.h"
 #include "canvasstack.h"
 #include "canvastile.h"
+#include "nativekernels.h"
 #include <QDebug>
 #include <QMatrix>
 #include <QPolygonF>
+#include <atomic>
 #include <utility>
 
+namespace {
+std::atomic<quint64> lastContentVersion(0);
+}
+
 CanvasLayer::CanvasLayer(QString name)
     : name(name),
       visible(true),
@@ -13,7 +19,8 @@ CanvasLayer::CanvasLayer(QString name)
       mode(BlendMode::Over),
       opacity(1.0f),
       type(LayerType::Layer),
-      tiles(std::make_shared<TileMap>())
+      tiles(std::make_shared<TileMap>()),
+      contentVersion(++lastContentVersion)
 {
 }
 
@@ -24,7 +31,8 @@ CanvasLayer::CanvasLayer(CanvasLayer const& from)
       mode(from.mode),
       opacity(from.opacity),
       type(from.type),
-      tiles(from.tiles)
+      tiles(from.tiles),
+      contentVersion(from.contentVersion)
 {
     for (CanvasLayer const *child: from.children)
         children.push_back(new CanvasLayer(*child));
@@ -36,6 +44,11 @@ CanvasLayer::~CanvasLayer()
         delete children.takeLast();
 }
 
+void CanvasLayer::markModified()
+{
+    contentVersion = ++lastContentVersion;
+}
+
 std::unique_ptr<CanvasLayer> CanvasLayer::shellCopy() const
 {
     std::unique_ptr<CanvasLayer> result(new CanvasLayer());
@@ -52,6 +65,14 @@ std::unique_ptr<CanvasLayer> CanvasLayer::shellCopy() const
 std::unique_ptr<CanvasLayer> CanvasLayer::deepCopy() const
 {
     std::unique_ptr<CanvasLayer> result = shellCopy();
+    result->contentVersion = contentVersion;
+
+    if (lazySource)
+    {
+        for (QPoint const &point: getTileSet())
+            (*result->tiles)[point] = getTileMaybe(point.x(), point.y())->copy();
+        return result;
+    }
 
     for (TileMap::iterator iter = tiles->begin(); iter != tiles->end(); ++iter)
     {
@@ -64,6 +85,42 @@ std::unique_ptr<CanvasLayer> CanvasLayer::deepCopy() const
     return result;
 }
 
+std::unique_ptr<CanvasLayer> CanvasLayer::lazyCopy()
+{
+    std::unique_ptr<CanvasLayer> result = shellCopy();
+    result->lazySource = tiles;
+    captureInto = result->tiles;
+
+    return result;
+}
+
+TileSet CanvasLayer::restoreCaptured()
+{
+    TileSet result;
+
+    for (auto &iter: *tiles)
+    {
+        if (iter.second)
+            (*lazySource)[iter.first] = std::move(iter.second);
+        else
+            lazySource->erase(iter.first);
+        result.insert(iter.first);
+    }
+    tiles->clear();
+
+    return result;
+}
+
+void CanvasLayer::captureTile(QPoint const &point)
+{
+    std::shared_ptr<TileMap> into = captureInto.lock();
+    if (!into || into->count(point))
+        return;
+
+    CanvasTile *tile = getTileMaybe(point.x(), point.y());
+    (*into)[point] = tile ? tile->copy() : nullptr;
+}
+
 void CanvasLayer::prune()
 {
     /* Search the layer for empty tiles and delete them */
@@ -96,17 +153,32 @@ void CanvasLayer::swapOut()
         child->swapOut();
 }
 
-static void subrectCopy(cl_mem src, int srcX, int srcY, cl_mem dst, int dstX, int dstY)
+static void subrectCopy(CanvasTile *srcTile, int srcX, int srcY, CanvasTile *dstTile, int dstX, int dstY)
 {
-    static const size_t PIXEL_SIZE = sizeof(float) * 4;
     size_t width = std::min(TILE_PIXEL_WIDTH - srcX, TILE_PIXEL_WIDTH - dstX);
     size_t height = std::min(TILE_PIXEL_HEIGHT - srcY, TILE_PIXEL_HEIGHT - dstY);
+
+    if (SharedOpenCL::getSharedOpenCL()->native)
+    {
+        NativeKernels::subrectCopy(srcTile->mapHost(), srcX, srcY,
+                                   dstTile->mapHost(), dstX, dstY,
+                                   width, height);
+        return;
+    }
+
+    cl_mem src = srcTile->unmapHost();
+    cl_mem dst = dstTile->unmapHost();
+
+    static const size_t PIXEL_SIZE = sizeof(float) * 4;
     size_t stride = TILE_PIXEL_WIDTH * PIXEL_SIZE;
 
     size_t copySrcXYZ[3] = CL_DIM3(srcX * PIXEL_SIZE, srcY, 0);
     size_t copyDstXYZ[3] = CL_DIM3(dstX * PIXEL_SIZE, dstY, 0);
     size_t copyRegion[3] = CL_DIM3(width * PIXEL_SIZE, height, 1);
 
+    CLDependencies deps;
+    deps.add(srcTile->eventSlot()).add(dstTile->eventSlot());
+
     clEnqueueCopyBufferRect(SharedOpenCL::getSharedOpenCL()->cmdQueue,
                             src, dst,
                             copySrcXYZ, copyDstXYZ, copyRegion,
@@ -114,7 +186,7 @@ static void subrectCopy(cl_mem src, int srcX, int srcY, cl_mem dst, int dstX, in
                             0,
                             stride,
                             0,
-                            0, nullptr, nullptr);
+                            deps.count(), deps.waitList(), deps.event("copyBufferRect"));
 }
 
 std::unique_ptr<CanvasLayer> CanvasLayer::translated(int x, int y) const
@@ -138,29 +210,29 @@ std::unique_ptr<CanvasLayer> CanvasLayer::translated(int x, int y) const
         int subShiftX = dstOriginX - dstOrigin.x() * TILE_PIXEL_WIDTH;
         int subShiftY = dstOriginY - dstOrigin.y() * TILE_PIXEL_HEIGHT;
 
-        cl_mem originTileMem = iter->second->unmapHost();
-        subrectCopy(originTileMem, 0, 0,
-                    result->clOpenTileAt(dstOrigin.x(), dstOrigin.y()),
+        CanvasTile *originTile = iter->second.get();
+        subrectCopy(originTile, 0, 0,
+                    result->getTile(dstOrigin.x(), dstOrigin.y()),
                     subShiftX, subShiftY);
 
         if (subShiftX)
         {
-            subrectCopy(originTileMem, TILE_PIXEL_WIDTH - subShiftX, 0,
-                        result->clOpenTileAt(dstOrigin.x() + 1, dstOrigin.y()),
+            subrectCopy(originTile, TILE_PIXEL_WIDTH - subShiftX, 0,
+                        result->getTile(dstOrigin.x() + 1, dstOrigin.y()),
                         0, subShiftY);
         }
         if (subShiftY)
         {
-            subrectCopy(originTileMem, 0, TILE_PIXEL_HEIGHT - subShiftY,
-                        result->clOpenTileAt(dstOrigin.x(), dstOrigin.y() + 1),
+            subrectCopy(originTile, 0, TILE_PIXEL_HEIGHT - subShiftY,
+                        result->getTile(dstOrigin.x(), dstOrigin.y() + 1),
                         subShiftX, 0);
         }
         if (subShiftX && subShiftY)
         {
-            subrectCopy(originTileMem,
+            subrectCopy(originTile,
                         TILE_PIXEL_WIDTH - subShiftX,
                         TILE_PIXEL_HEIGHT - subShiftY,
-                        result->clOpenTileAt(dstOrigin.x() + 1, dstOrigin.y() + 1),
+                        result->getTile(dstOrigin.x() + 1, dstOrigin.y() + 1),
                         0, 0);
         }
     }
@@ -181,14 +253,24 @@ std::unique_ptr<CanvasLayer> CanvasLayer::applyMatrix(const QMatrix &matrix) con
         QMatrix inversion = matrix.inverted();
 
         auto opencl = SharedOpenCL::getSharedOpenCL();
-        cl_kernel kernel = opencl->matrixApply;
+        cl_kernel kernel = opencl->native ? nullptr : opencl->matrixApply;
         const size_t workSize[2] = CL_DIM2(TILE_PIXEL_WIDTH, TILE_PIXEL_HEIGHT);
+        const float nativeMatrix[4] = {float(inversion.m11()), float(inversion.m21()),
+                                       float(inversion.m12()), float(inversion.m22())};
         cl_float4 rotationMatrixArg;
         rotationMatrixArg.s[0] = inversion.m11();
         rotationMatrixArg.s[1] = inversion.m21();
         rotationMatrixArg.s[2] = inversion.m12();
         rotationMatrixArg.s[3] = inversion.m22();
-        clSetKernelArg<cl_float4>(kernel, 2, rotationMatrixArg);
+        if (kernel)
+            clSetKernelArg<cl_float4>(kernel, 2, rotationMatrixArg);
+
+        struct NativeJob {
+            CanvasTile *dstTile;
+            float x_comp;
+            float y_comp;
+        };
+        std::vector<NativeJob> nativeJobs;
 
         for (auto const &srcIter: *tiles)
         {
@@ -202,7 +284,9 @@ std::unique_ptr<CanvasLayer> CanvasLayer::applyMatrix(const QMatrix &matrix) con
             int x_post = -srcIter.first.x() * TILE_PIXEL_WIDTH;
             int y_post = -srcIter.first.y() * TILE_PIXEL_HEIGHT;
 
-            clSetKernelArg<cl_mem>(kernel, 0, srcIter.second->unmapHost());
+            CanvasTile *srcTile = srcIter.second.get();
+            if (kernel)
+                clSetKernelArg<cl_mem>(kernel, 0, srcTile->unmapHost());
 
             for (int tileY = outputBBox.top(); tileY <= outputBBox.bottom(); ++tileY)
             {
@@ -222,14 +306,39 @@ std::unique_ptr<CanvasLayer> CanvasLayer::applyMatrix(const QMatrix &matrix) con
                     float x_comp = x_pre * inversion.m11() + y_pre * inversion.m21() + x_post + float(inversion.dx());
                     float y_comp = x_pre * inversion.m12() + y_pre * inversion.m22() + y_post + float(inversion.dy());
 
+                    CanvasTile *dstTile = result->getTile(tileX, tileY);
+
+                    if (!kernel)
+                    {
+                        nativeJobs.push_back({dstTile, x_comp, y_comp});
+                        continue;
+                    }
+
+                    cl_mem dstMem = dstTile->unmapHost();
+
+                    CLDependencies deps;
+                    deps.add(srcTile->eventSlot()).add(dstTile->eventSlot());
+
                     clSetKernelArg<cl_float2>(kernel, 3, {x_comp, y_comp});
-                    clSetKernelArg<cl_mem>(kernel, 1, result->clOpenTileAt(tileX, tileY));
+                    clSetKernelArg<cl_mem>(kernel, 1, dstMem);
                     clEnqueueNDRangeKernel(opencl->cmdQueue,
                                            kernel, 2,
-                                           nullptr, workSize, nullptr,
-                                           0, nullptr, nullptr);
+                                           nullptr, workSize,
+                                           opencl->localWorkSize(kernel, 2, workSize).get(),
+                                           deps.count(), deps.waitList(), deps.event(kernel));
                 }
             }
+
+            // Each destination appears once per source tile, so they can be filled in parallel
+            if (!nativeJobs.empty())
+            {
+                const float *srcData = srcTile->mapHost();
+                NativeKernels::parallelFor(nativeJobs.size(), [&](int i) {
+                    NativeKernels::matrixApply(srcData, nativeJobs[i].dstTile->mapHost(), nativeMatrix,
+                                               nativeJobs[i].x_comp, nativeJobs[i].y_comp);
+                });
+                nativeJobs.clear();
+            }
         }
     }
 
@@ -295,6 +404,20 @@ TileSet CanvasLayer::takeTiles(CanvasLayer *source)
 {
     TileSet result;
 
+    markModified();
+    source->markModified();
+
+    // The replaced tiles are moved to the lazy copy rather than duplicated
+    if (std::shared_ptr<TileMap> into = captureInto.lock())
+    {
+        for (auto &iter: *tiles)
+            if (!into->count(iter.first))
+                (*into)[iter.first] = std::move(iter.second);
+        for (auto const &iter: *(source->tiles))
+            if (!into->count(iter.first))
+                (*into)[iter.first] = nullptr;
+    }
+
     tiles->clear();
     std::swap(*tiles, *(source->tiles));
 
@@ -309,6 +432,17 @@ TileSet CanvasLayer::getTileSet() const
     TileMap::iterator iter;
     TileSet result;
 
+    if (lazySource)
+    {
+        for (auto const &iter: *tiles)
+            if (iter.second)
+                result.insert(iter.first);
+        for (auto const &iter: *lazySource)
+            if (!tiles->count(iter.first))
+                result.insert(iter.first);
+        return result;
+    }
+
     for (iter = tiles->begin(); iter != tiles->end(); ++iter)
     {
         result.insert(iter->first);
@@ -328,6 +462,9 @@ TileSet CanvasLayer::getTileSet() const
 
 std::unique_ptr<CanvasTile> CanvasLayer::takeTileMaybe(int x, int y)
 {
+    captureTile(QPoint(x, y));
+    markModified();
+
     TileMap::iterator found = tiles->find(QPoint(x, y));
 
     if (found != tiles->end())
@@ -336,8 +473,15 @@ std::unique_ptr<CanvasTile> CanvasLayer::takeTileMaybe(int x, int y)
         tiles->erase(found);
         return result;
     }
-    else
-        return nullptr;
+    else if (lazySource)
+    {
+        // Not captured, so the source's tile is unmodified
+        found = lazySource->find(QPoint(x, y));
+        if (found != lazySource->end())
+            return found->second->copy();
+    }
+
+    return nullptr;
 }
 
 CanvasTile *CanvasLayer::getTileMaybe(int x, int y) const
@@ -346,12 +490,38 @@ CanvasTile *CanvasLayer::getTileMaybe(int x, int y) const
 
     if (found != tiles->end())
         return found->second.get();
-    else
-        return nullptr;
+
+    if (lazySource)
+    {
+        found = lazySource->find(QPoint(x, y));
+        if (found != lazySource->end())
+            return found->second.get();
+    }
+
+    return nullptr;
+}
+
+void CanvasLayer::setTile(int x, int y, std::unique_ptr<CanvasTile> tile)
+{
+    QPoint point(x, y);
+    std::unique_ptr<CanvasTile> &current = (*tiles)[point];
+    markModified();
+
+    // The replaced tile can move to the lazy copy instead of being duplicated
+    std::shared_ptr<TileMap> into = captureInto.lock();
+    if (into && !into->count(point))
+        (*into)[point] = std::move(current);
+
+    current = std::move(tile);
+    if (!current)
+        tiles->erase(point);
 }
 
 CanvasTile *CanvasLayer::getTile(int x, int y)
 {
+    captureTile(QPoint(x, y));
+    markModified();
+
     std::unique_ptr<CanvasTile> &tile = (*tiles)[QPoint(x, y)];
 
     if (!tile)
@@ -29,6 +29,18 @@ public:
     std::shared_ptr<TileMap> tiles;
     QList<CanvasLayer *> children;
 
+    /* Only set on a lazyCopy(), the tiles of the layer it was copied from. Any tile
+     * that hasn't been captured into tiles yet is read from here, a captured tile
+     * is null if the layer had no tile there.
+     */
+    std::shared_ptr<TileMap> lazySource;
+
+    /* Changes whenever the layer's tiles might have been modified, two layers with
+     * the same version have the same pixels. Versions are never reused.
+     */
+    quint64 contentVersion;
+    void markModified();
+
     TileSet getTileSet() const;
 
     float *openTileAt(int x, int y);
@@ -37,8 +49,19 @@ public:
     CanvasTile *getTile(int x, int y);
     CanvasTile *getTileMaybe(int x, int y) const;
     std::unique_ptr<CanvasTile> takeTileMaybe(int x, int y);
+    /* Replace the tile at x, y, a null tile removes it */
+    void setTile(int x, int y, std::unique_ptr<CanvasTile> tile);
 
     std::unique_ptr<CanvasLayer> deepCopy() const;
+    /* A copy of this layer's tiles that costs nothing to make, each tile is captured
+     * into it just before this layer first modifies it. Only the most recent
+     * lazyCopy() of a layer is kept up to date, and it has no children.
+     */
+    std::unique_ptr<CanvasLayer> lazyCopy();
+    /* For a lazyCopy(), put the captured tiles back into the source layer and
+     * forget them. Returns the tiles that were restored.
+     */
+    TileSet restoreCaptured();
     std::unique_ptr<CanvasLayer> translated(int x, int y) const;
     std::unique_ptr<CanvasLayer> applyMatrix(QMatrix const &matrix) const;
     std::unique_ptr<CanvasLayer> mergeDown(CanvasLayer const *target) const;
@@ -49,6 +72,10 @@ public:
 
 private:
     std::unique_ptr<CanvasLayer> shellCopy() const;
+    void captureTile(QPoint const &point);
+
+    /* The tiles of this layer's lazyCopy(), if it still exists */
+    std::weak_ptr<TileMap> captureInto;
 };
 
 #endif // CANVASLAYER_H
@@ -347,7 +347,13 @@ void CanvasRender::renderTile(int x, int y, CanvasTile *tile)
         cl_int err = CL_SUCCESS;
         cl_command_queue cmdQueue = SharedOpenCL::getSharedOpenCL()->cmdQueue;
 
-        err = clEnqueueAcquireGLObjects(cmdQueue, 1, &ref.clBuf, 0, nullptr, nullptr);
+        cl_event glEvent = nullptr;
+
+        {
+            CLDependencies deps;
+            deps.add(&glEvent);
+            err = clEnqueueAcquireGLObjects(cmdQueue, 1, &ref.clBuf, deps.count(), deps.waitList(), deps.event("acquireGLObjects"));
+        }
 
         cl_mem input = tile->unmapHost();
 
@@ -358,12 +364,23 @@ void CanvasRender::renderTile(int x, int y, CanvasTile *tile)
 
         size_t workSize = TILE_PIXEL_WIDTH * TILE_PIXEL_HEIGHT;
 
-        err = clEnqueueNDRangeKernel(cmdQueue,
-                                     kernel, 1,
-                                     nullptr, &workSize, nullptr,
-                                     0, nullptr, nullptr);
+        {
+            CLDependencies deps;
+            deps.add(&glEvent).add(tile->eventSlot());
+            err = clEnqueueNDRangeKernel(cmdQueue,
+                                         kernel, 1,
+                                         nullptr, &workSize,
+                                         SharedOpenCL::getSharedOpenCL()->localWorkSize(kernel, 1, &workSize).get(),
+                                         deps.count(), deps.waitList(), deps.event(kernel));
+        }
+
+        {
+            CLDependencies deps;
+            deps.add(&glEvent);
+            err = clEnqueueReleaseGLObjects(cmdQueue, 1, &ref.clBuf, deps.count(), deps.waitList(), deps.event("releaseGLObjects"));
+        }
 
-        err = clEnqueueReleaseGLObjects(cmdQueue, 1, &ref.clBuf, 0, nullptr, nullptr);
+        clearEventSlot(&glEvent);
         (void)err; /* Ignore the fact that err is unused */
     }
     else
@@ -2,13 +2,69 @@
 #define CANVASSTACK_H
 
 #include <QList>
+#include <QDateTime>
+#include <QPoint>
+#include <QSize>
+#include <QString>
+#include <map>
 #include <memory>
+#include <vector>
 #include "canvaswidget-opencl.h"
 #include "tileset.h"
 
 class CanvasTile;
 class CanvasLayer;
 
+/* The ORA file a stack was last loaded from or saved to, so saveStackAs() can copy
+ * the PNGs of anything that hasn't changed since instead of encoding them again.
+ */
+struct OraFileRecord
+{
+    struct Entry
+    {
+        QString path;
+        QPoint origin; /* Canvas position of the PNG's top left corner */
+    };
+
+    QString filePath;
+    QDateTime lastModified;
+    qint64 size = 0;
+
+    /* Keyed by CanvasLayer::contentVersion */
+    std::map<quint64, Entry> layers;
+
+    /* The background PNGs were made from these pixels and this many tiles */
+    std::vector<float> backgroundPixels;
+    QSize backgroundSize;
+};
+
+/* The TileShadow document a stack was last loaded from or saved to, so saveStackAsTSD()
+ * can append only the tiles the file doesn't already have.
+ */
+struct TsdFileRecord
+{
+    struct Chunk
+    {
+        quint64 offset;
+        quint32 size;
+    };
+
+    struct TileRef
+    {
+        QPoint point;
+        QByteArray digest;
+    };
+
+    QString filePath;
+    QDateTime lastModified;
+    qint64 size = 0;
+
+    /* The chunks of the file's current index, by the SHA-256 digest of their tile */
+    std::map<QByteArray, Chunk> chunks;
+    /* Keyed by CanvasLayer::contentVersion */
+    std::map<quint64, std::vector<TileRef>> layers;
+};
+
 class CanvasStack
 {
 public:
@@ -29,6 +85,9 @@ public:
     std::unique_ptr<CanvasTile> backgroundTileCL;
 
     void setBackground(std::unique_ptr<CanvasTile> newBackground);
+
+    OraFileRecord oraRecord;
+    TsdFileRecord tsdRecord;
 };
 
 //FIXME: Probably shouldn't be public API
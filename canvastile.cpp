@@ -1,10 +1,91 @@
 #include "canvaswidget-opencl.h"
 #include "canvastile.h"
+#include "nativekernels.h"
+#include <string.h>
+#include <algorithm>
+#include <vector>
 #include <QAtomicInt>
+#include <QMutex>
+#include <QMutexLocker>
 
 static QAtomicInt privAllocatedTileCount;
 static QAtomicInt privDeviceTileCount;
 
+/* A pinned buffer that stays mapped for its whole life, so reading a tile into it
+ * doesn't have to wait for the driver to stage the copy through its own memory.
+ */
+struct StagingBuffer
+{
+    cl_mem buffer;
+    float *data;
+};
+
+static const size_t maxFreeStagingBuffers = 64;
+/* Reads swapHostAsync may have in flight, each pins a tile's worth of host memory */
+static const int maxStagingBuffers = 256;
+static QAtomicInt privStagingCount;
+
+static QMutex *stagingPoolMutex()
+{
+    static QMutex mutex;
+    return &mutex;
+}
+
+static std::vector<StagingBuffer *> *stagingPool()
+{
+    static std::vector<StagingBuffer *> pool;
+    return &pool;
+}
+
+static StagingBuffer *takeStagingBuffer()
+{
+    privStagingCount.ref();
+
+    {
+        QMutexLocker lock(stagingPoolMutex());
+        std::vector<StagingBuffer *> *pool = stagingPool();
+        if (!pool->empty())
+        {
+            StagingBuffer *result = pool->back();
+            pool->pop_back();
+            return result;
+        }
+    }
+
+    cl_int err = CL_SUCCESS;
+    StagingBuffer *result = new StagingBuffer;
+    result->buffer = clCreateBuffer(SharedOpenCL::getSharedOpenCL()->ctx, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                                    TILE_COMP_TOTAL * sizeof(float), nullptr, &err);
+    check_cl_error(err);
+    result->data = (float *)clEnqueueMapBuffer(SharedOpenCL::getSharedOpenCL()->cmdQueue, result->buffer,
+                                               CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
+                                               0, TILE_COMP_TOTAL * sizeof(float),
+                                               0, nullptr, nullptr, &err);
+    check_cl_error(err);
+
+    return result;
+}
+
+static void returnStagingBuffer(StagingBuffer *staging)
+{
+    privStagingCount.deref();
+
+    {
+        QMutexLocker lock(stagingPoolMutex());
+        std::vector<StagingBuffer *> *pool = stagingPool();
+        if (pool->size() < maxFreeStagingBuffers)
+        {
+            pool->push_back(staging);
+            return;
+        }
+    }
+
+    clEnqueueUnmapMemObject(SharedOpenCL::getSharedOpenCL()->cmdQueue, staging->buffer, staging->data,
+                            0, nullptr, nullptr);
+    clReleaseMemObject(staging->buffer);
+    delete staging;
+}
+
 int CanvasTile::allocatedTileCount()
 {
     return privAllocatedTileCount.load();
@@ -17,18 +98,31 @@ int CanvasTile::deviceTileCount()
 
 CanvasTile::CanvasTile()
 {
+    lastEvent = nullptr;
+    staging = nullptr;
+    stagingEvent = nullptr;
+    privAllocatedTileCount.ref();
+
+    if (SharedOpenCL::getSharedOpenCL()->native)
+    {
+        tileData = new float[TILE_COMP_TOTAL];
+        tileMem = 0;
+        return;
+    }
+
     cl_int err = CL_SUCCESS;
     tileData = nullptr;
     tileMem = clCreateBuffer(SharedOpenCL::getSharedOpenCL()->ctx, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
                              TILE_COMP_TOTAL * sizeof(float), tileData, &err);
     check_cl_error(err);
 
-    privAllocatedTileCount.ref();
     privDeviceTileCount.ref();
 }
 
 CanvasTile::~CanvasTile()
 {
+    finishStaging(false);
+
     if (tileMem)
     {
         unmapHost();
@@ -37,22 +131,28 @@ CanvasTile::~CanvasTile()
     }
     else if (tileData)
     {
-        delete tileData;
+        delete[] tileData;
     }
 
+    clearEventSlot(&lastEvent);
     privAllocatedTileCount.deref();
 }
 
 float *CanvasTile::mapHost()
 {
+    finishStaging(true);
+
     if (!tileData)
     {
         cl_int err = CL_SUCCESS;
+        CLDependencies deps;
+        deps.add(&lastEvent);
         tileData = (float *)clEnqueueMapBuffer(SharedOpenCL::getSharedOpenCL()->cmdQueue, tileMem,
                                                CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
                                                0, TILE_COMP_TOTAL * sizeof(float),
-                                               0, nullptr, nullptr, &err);
+                                               deps.count(), deps.waitList(), deps.event("mapBuffer"), &err);
         check_cl_error(err);
+        clearEventSlot(&lastEvent);
     }
 
     return tileData;
@@ -60,9 +160,18 @@ float *CanvasTile::mapHost()
 
 cl_mem CanvasTile::unmapHost()
 {
+    // Native tiles never leave host memory
+    if (SharedOpenCL::getSharedOpenCL()->native)
+        return 0;
+
+    finishStaging(false);
+
     if (tileData && tileMem)
     {
-        clEnqueueUnmapMemObject(SharedOpenCL::getSharedOpenCL()->cmdQueue, tileMem, tileData, 0, nullptr, nullptr);
+        CLDependencies deps;
+        deps.add(&lastEvent);
+        clEnqueueUnmapMemObject(SharedOpenCL::getSharedOpenCL()->cmdQueue, tileMem, tileData,
+                                deps.count(), deps.waitList(), deps.event("unmapMemObject"));
         tileData = nullptr;
     }
     else if (tileData)
@@ -71,7 +180,7 @@ cl_mem CanvasTile::unmapHost()
         tileMem = clCreateBuffer (SharedOpenCL::getSharedOpenCL()->ctx, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR | CL_MEM_COPY_HOST_PTR ,
                                   TILE_COMP_TOTAL * sizeof(float), tileData, &err);
         check_cl_error(err);
-        delete tileData;
+        delete[] tileData;
         tileData = nullptr;
         privDeviceTileCount.ref();
     }
@@ -79,32 +188,110 @@ cl_mem CanvasTile::unmapHost()
     return tileMem;
 }
 
+bool CanvasTile::canSwapHost()
+{
+    return !SharedOpenCL::getSharedOpenCL()->native &&
+           SharedOpenCL::getSharedOpenCL()->deviceType != CL_DEVICE_TYPE_CPU;
+}
+
 void CanvasTile::swapHost()
 {
-    if (SharedOpenCL::getSharedOpenCL()->deviceType == CL_DEVICE_TYPE_CPU)
+    if (!canSwapHost())
         return;
 
+    finishStaging(true);
+
     if (tileMem && tileData)
-    {
-        clEnqueueUnmapMemObject(SharedOpenCL::getSharedOpenCL()->cmdQueue, tileMem, tileData, 0, nullptr, nullptr);
-        tileData = nullptr;
-    }
+        unmapHost();
 
     if (!tileData)
     {
+        CLDependencies deps;
+        deps.add(&lastEvent);
         tileData = new float[TILE_COMP_TOTAL];
         clEnqueueReadBuffer(SharedOpenCL::getSharedOpenCL()->cmdQueue,
                             tileMem, CL_TRUE,
                             0, TILE_COMP_TOTAL * sizeof(float), tileData,
-                            0, nullptr, nullptr);
+                            deps.count(), deps.waitList(), deps.event("readBuffer"));
+        clearEventSlot(&lastEvent);
+        clReleaseMemObject(tileMem);
+        tileMem = 0;
+        privDeviceTileCount.deref();
+    }
+}
+
+void CanvasTile::swapHostAsync()
+{
+    if (!canSwapHost())
+        return;
+
+    if (staging || !tileMem)
+        return;
+
+    if (privStagingCount.load() >= maxStagingBuffers)
+    {
+        swapHost();
+        return;
+    }
+
+    if (tileData)
+        unmapHost();
+
+    staging = takeStagingBuffer();
+
+    CLDependencies deps;
+    deps.add(&lastEvent);
+    cl_int err = clEnqueueReadBuffer(SharedOpenCL::getSharedOpenCL()->cmdQueue,
+                                     tileMem, CL_FALSE,
+                                     0, TILE_COMP_TOTAL * sizeof(float), staging->data,
+                                     deps.count(), deps.waitList(), deps.event("readBuffer", &stagingEvent));
+    check_cl_error(err);
+}
+
+void CanvasTile::pollSwapHost()
+{
+    if (!staging)
+        return;
+
+    cl_int status = CL_COMPLETE;
+    clGetEventInfo(stagingEvent, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, nullptr);
+    if (status > CL_COMPLETE)
+        return;
+
+    finishStaging(true);
+}
+
+void CanvasTile::finishStaging(bool keepHost)
+{
+    if (!staging)
+        return;
+
+    clWaitForEvents(1, &stagingEvent);
+    clearEventSlot(&stagingEvent);
+
+    if (keepHost)
+    {
+        clearEventSlot(&lastEvent);
+        tileData = new float[TILE_COMP_TOTAL];
+        memcpy(tileData, staging->data, TILE_COMP_TOTAL * sizeof(float));
         clReleaseMemObject(tileMem);
         tileMem = 0;
         privDeviceTileCount.deref();
     }
+
+    returnStagingBuffer(staging);
+    staging = nullptr;
 }
 
 void CanvasTile::fill(float r, float g, float b, float a)
 {
+    if (SharedOpenCL::getSharedOpenCL()->native)
+    {
+        const float color[4] = {r, g, b, a};
+        NativeKernels::fill(tileData, color);
+        return;
+    }
+
     unmapHost();
 
     cl_kernel kernel = SharedOpenCL::getSharedOpenCL()->fillKernel;
@@ -112,16 +299,26 @@ void CanvasTile::fill(float r, float g, float b, float a)
 
     cl_float4 color = {r, g, b, a};
 
+    CLDependencies deps;
+    deps.add(&lastEvent);
+
     clSetKernelArg<cl_mem>(kernel, 0, tileMem);
     clSetKernelArg<cl_float4>(kernel, 1, color);
     clEnqueueNDRangeKernel(SharedOpenCL::getSharedOpenCL()->cmdQueue,
                            kernel, 1,
-                           nullptr, global_work_size, nullptr,
-                           0, nullptr, nullptr);
+                           nullptr, global_work_size,
+                           SharedOpenCL::getSharedOpenCL()->localWorkSize(kernel, 1, global_work_size).get(),
+                           deps.count(), deps.waitList(), deps.event(kernel));
 }
 
 void CanvasTile::blendOnto(CanvasTile *target, BlendMode::Mode mode, float opacity)
 {
+    if (SharedOpenCL::getSharedOpenCL()->native)
+    {
+        NativeKernels::blend(target->tileData, tileData, mode, opacity);
+        return;
+    }
+
     const size_t global_work_size[1] = {TILE_PIXEL_WIDTH * TILE_PIXEL_HEIGHT};
     cl_mem inMem  = target->unmapHost();
     cl_mem auxMem = unmapHost();
@@ -170,27 +367,107 @@ void CanvasTile::blendOnto(CanvasTile *target, BlendMode::Mode mode, float opaci
         break;
     }
 
+    CLDependencies deps;
+    deps.add(target->eventSlot()).add(&lastEvent);
+
     clSetKernelArg<cl_mem>(kernel, 0, inMem);
     clSetKernelArg<cl_mem>(kernel, 1, inMem);
     clSetKernelArg<cl_mem>(kernel, 2, auxMem);
     clSetKernelArg<cl_float>(kernel, 3, opacity);
     clEnqueueNDRangeKernel(SharedOpenCL::getSharedOpenCL()->cmdQueue,
                            kernel,
-                           1, nullptr, global_work_size, nullptr,
-                           0, nullptr, nullptr);
+                           1, nullptr, global_work_size,
+                           SharedOpenCL::getSharedOpenCL()->localWorkSize(kernel, 1, global_work_size).get(),
+                           deps.count(), deps.waitList(), deps.event(kernel));
+}
+
+void CanvasTile::readRect(QRect const &rect, float *out, cl_event *event)
+{
+    const size_t rowFloats = rect.width() * 4;
+
+    if (tileData)
+    {
+        for (int y = 0; y < rect.height(); ++y)
+        {
+            const float *row = tileData + ((rect.y() + y) * TILE_PIXEL_WIDTH + rect.x()) * 4;
+            std::copy_n(row, rowFloats, out + y * rowFloats);
+        }
+        if (event)
+            *event = nullptr;
+        return;
+    }
+
+    const size_t bufferOrigin[3] = {rect.x() * 4 * sizeof(float), size_t(rect.y()), 0};
+    const size_t hostOrigin[3] = {0, 0, 0};
+    const size_t region[3] = {rowFloats * sizeof(float), size_t(rect.height()), 1};
+
+    CLDependencies deps;
+    deps.add(&lastEvent);
+    cl_int err = clEnqueueReadBufferRect(SharedOpenCL::getSharedOpenCL()->cmdQueue, tileMem,
+                                         event ? CL_FALSE : CL_TRUE,
+                                         bufferOrigin, hostOrigin, region,
+                                         TILE_PIXEL_WIDTH * 4 * sizeof(float), 0,
+                                         rowFloats * sizeof(float), 0, out,
+                                         deps.count(), deps.waitList(),
+                                         event ? deps.event("readBufferRect", event) : deps.event("readBufferRect"));
+    check_cl_error(err);
+}
+
+void CanvasTile::writeRect(QRect const &rect, const float *in, cl_event *event)
+{
+    const size_t rowFloats = rect.width() * 4;
+
+    if (tileData)
+    {
+        for (int y = 0; y < rect.height(); ++y)
+        {
+            float *row = tileData + ((rect.y() + y) * TILE_PIXEL_WIDTH + rect.x()) * 4;
+            std::copy_n(in + y * rowFloats, rowFloats, row);
+        }
+        if (event)
+            *event = nullptr;
+        return;
+    }
+
+    // Writing over the device copy makes a pending read back stale
+    finishStaging(false);
+
+    const size_t bufferOrigin[3] = {rect.x() * 4 * sizeof(float), size_t(rect.y()), 0};
+    const size_t hostOrigin[3] = {0, 0, 0};
+    const size_t region[3] = {rowFloats * sizeof(float), size_t(rect.height()), 1};
+
+    CLDependencies deps;
+    deps.add(&lastEvent);
+    cl_int err = clEnqueueWriteBufferRect(SharedOpenCL::getSharedOpenCL()->cmdQueue, tileMem,
+                                          event ? CL_FALSE : CL_TRUE,
+                                          bufferOrigin, hostOrigin, region,
+                                          TILE_PIXEL_WIDTH * 4 * sizeof(float), 0,
+                                          rowFloats * sizeof(float), 0, in,
+                                          deps.count(), deps.waitList(),
+                                          event ? deps.event("writeBufferRect", event) : deps.event("writeBufferRect"));
+    check_cl_error(err);
 }
 
 std::unique_ptr<CanvasTile> CanvasTile::copy()
 {
     CanvasTile *result = new CanvasTile();
 
+    if (SharedOpenCL::getSharedOpenCL()->native)
+    {
+        memcpy(result->tileData, tileData, TILE_COMP_TOTAL * sizeof(float));
+        return std::unique_ptr<CanvasTile>(result);
+    }
+
     unmapHost();
     result->unmapHost();
 
+    CLDependencies deps;
+    deps.add(&lastEvent).add(&result->lastEvent);
+
     clEnqueueCopyBuffer(SharedOpenCL::getSharedOpenCL()->cmdQueue,
                         tileMem, result->tileMem, 0, 0,
                         TILE_COMP_TOTAL * sizeof(float),
-                        0, nullptr, nullptr);
+                        deps.count(), deps.waitList(), deps.event("copyBuffer"));
 
     return std::unique_ptr<CanvasTile>(result);
 }
@@ -2,6 +2,7 @@
 #define CANVASTILE_H
 
 #include <memory>
+#include <QRect>
 #include "blendmodes.h"
 
 #ifdef __APPLE__
@@ -22,6 +23,8 @@ static inline int tile_indice(int coordinate, int stride)
     return (coordinate - n) / stride + n;
 }
 
+struct StagingBuffer;
+
 class CanvasTile
 {
 public:
@@ -33,17 +36,51 @@ public:
     float *mapHost();
     cl_mem unmapHost();
     void swapHost();
+    /* False if swapHost() is a no-op because device memory is host memory */
+    static bool canSwapHost();
+    /* Start moving the tile to host memory without waiting for the read back,
+     * the move completes the next time the tile is used or pollSwapHost() finds
+     * the read finished. Past a limit on the reads in flight this moves the
+     * tile synchronously.
+     */
+    void swapHostAsync();
+    /* Complete a swapHostAsync() whose read back has finished, releasing the device memory */
+    void pollSwapHost();
 
     void fill(float r, float g, float b, float a);
     void blendOnto(CanvasTile *target, BlendMode::Mode mode, float opacity);
     std::unique_ptr<CanvasTile> copy();
 
+    /* Copy the pixels of rect to out, which holds rect.width() * rect.height() RGBA pixels.
+     * If event isn't null the read doesn't block, *event is set to an event the caller
+     * must wait on before using out and then release. It may be null if the read
+     * already finished.
+     */
+    void readRect(QRect const &rect, float *out, cl_event *event = nullptr);
+    /* Replace the pixels of rect with in, laid out and waited on as for readRect */
+    void writeRect(QRect const &rect, const float *in, cl_event *event = nullptr);
+
+    /* True if the tile's data is held in device memory, including while it's being moved to the host */
+    bool isOnDevice() const { return tileMem != 0; }
+    bool isSwappingHost() const { return staging != nullptr; }
+
+    /* The last command that used this tile's device memory, see CLDependencies */
+    cl_event *eventSlot() { return &lastEvent; }
+
     static int allocatedTileCount();
     static int deviceTileCount();
 
 private:
   cl_mem  tileMem;
   float  *tileData;
+  cl_event lastEvent;
+
+  /* The pinned buffer swapHostAsync is reading into, and the read's event */
+  StagingBuffer *staging;
+  cl_event stagingEvent;
+
+  /* Wait for swapHostAsync's read, and move to the host if keepHost is true */
+  void finishStaging(bool keepHost);
 };
 
 #endif // CANVASTILE_H
@@ -1,7 +1,80 @@
 #include "canvasundoevent.h"
 #include "canvastile.h"
+#include "nativekernels.h"
 #include <algorithm>
 
+namespace {
+    /* The tiles of whichever layer uses tileMap are being changed behind its back */
+    void markTileMapModified(QList<CanvasLayer *> const &layers, TileMap const *tileMap)
+    {
+        for (CanvasLayer *layer: layers)
+        {
+            if (layer->tiles.get() == tileMap)
+                layer->markModified();
+            markTileMapModified(layer->children, tileMap);
+        }
+    }
+
+    void addTileCost(CanvasUndoCost &cost, CanvasTile const *tile)
+    {
+        if (!tile)
+            return;
+
+        if (tile->isOnDevice())
+        {
+            cost.deviceBytes += TILE_COMP_TOTAL * sizeof(float);
+            if (tile->isSwappingHost())
+                cost.pendingBytes += TILE_COMP_TOTAL * sizeof(float);
+        }
+        else
+            cost.hostBytes += TILE_COMP_TOTAL * sizeof(float);
+    }
+
+    /* Layers whose tiles are still in use by the canvas (or another event) are skipped */
+    void addLayerCost(CanvasUndoCost &cost, CanvasLayer const *layer)
+    {
+        if (layer->tiles.use_count() == 1)
+            for (auto const &iter: *layer->tiles)
+                addTileCost(cost, iter.second.get());
+
+        for (CanvasLayer const *child: layer->children)
+            addLayerCost(cost, child);
+    }
+
+    void spillLayer(CanvasLayer *layer, bool finish)
+    {
+        if (layer->tiles.use_count() == 1)
+            for (auto &iter: *layer->tiles)
+            {
+                if (finish)
+                    iter.second->pollSwapHost();
+                else
+                    iter.second->swapHostAsync();
+            }
+
+        for (CanvasLayer *child: layer->children)
+            spillLayer(child, finish);
+    }
+}
+
+CanvasUndoCost &CanvasUndoCost::operator+=(CanvasUndoCost const &other)
+{
+    deviceBytes += other.deviceBytes;
+    hostBytes += other.hostBytes;
+    compressedBytes += other.compressedBytes;
+    pendingBytes += other.pendingBytes;
+    return *this;
+}
+
+CanvasUndoCost &CanvasUndoCost::operator-=(CanvasUndoCost const &other)
+{
+    deviceBytes -= other.deviceBytes;
+    hostBytes -= other.hostBytes;
+    compressedBytes -= other.compressedBytes;
+    pendingBytes -= other.pendingBytes;
+    return *this;
+}
+
 CanvasUndoEvent::CanvasUndoEvent()
 {
 }
@@ -16,16 +89,224 @@ bool CanvasUndoEvent::modifiesBackground()
     return false;
 }
 
+CanvasUndoCost CanvasUndoEvent::cost() const
+{
+    return CanvasUndoCost();
+}
+
+void CanvasUndoEvent::spill()
+{
+}
+
+void CanvasUndoEvent::finishSpill()
+{
+}
+
 CanvasUndoTiles::CanvasUndoTiles()
+    : compareEvent(nullptr)
 {
 
 }
 
 CanvasUndoTiles::~CanvasUndoTiles()
 {
+    // The device may still be writing into compareBounds or the delta buffers
+    if (compareEvent)
+    {
+        clWaitForEvents(1, &compareEvent);
+        clearEventSlot(&compareEvent);
+    }
+    finishTransfers();
+
     tiles.clear();
 }
 
+CanvasUndoCost CanvasUndoTiles::cost() const
+{
+    CanvasUndoCost result;
+
+    for (auto const &iter: tiles)
+        addTileCost(result, iter.second.get());
+    // Until the comparison completes these are counted in full, they then become deltas or are spilled
+    for (auto const &iter: comparedTiles)
+    {
+        addTileCost(result, iter.second.get());
+        result.pendingBytes += TILE_COMP_TOTAL * sizeof(float);
+    }
+    for (auto const &iter: deltas)
+        result.compressedBytes += iter.second.pixels.size() * sizeof(float);
+
+    return result;
+}
+
+void CanvasUndoTiles::spill()
+{
+    /* Most compared tiles end up as deltas, so they stay on the device until the
+     * comparison is done rather than being waited on here.
+     */
+    pollCompare();
+
+    for (auto const &iter: tiles)
+        if (iter.second)
+            iter.second->swapHostAsync();
+}
+
+void CanvasUndoTiles::finishSpill()
+{
+    pollCompare();
+
+    for (auto const &iter: tiles)
+        if (iter.second)
+            iter.second->pollSwapHost();
+}
+
+void CanvasUndoTiles::storeTiles(TileMap &&previous)
+{
+    SharedOpenCL *opencl = SharedOpenCL::getSharedOpenCL();
+
+    finishCompare();
+
+    for (auto &iter: previous)
+    {
+        if (iter.second && targetTileMap->count(iter.first))
+        {
+            comparedTiles[iter.first] = std::move(iter.second);
+            continue;
+        }
+
+        if (iter.second)
+            iter.second->swapHostAsync();
+        tiles[iter.first] = std::move(iter.second);
+    }
+
+    if (comparedTiles.empty())
+        return;
+
+    /* Find the changed rectangle of every tile with one read back */
+    compareBounds.clear();
+    for (size_t i = 0; i < comparedTiles.size(); ++i)
+        compareBounds.insert(compareBounds.end(), {TILE_PIXEL_WIDTH, TILE_PIXEL_HEIGHT, -1, -1});
+
+    if (opencl->native)
+    {
+        size_t i = 0;
+        for (auto &iter: comparedTiles)
+            NativeKernels::tileDiffBounds(iter.second->mapHost(),
+                                          (*targetTileMap)[iter.first]->mapHost(), &compareBounds[i++ * 4]);
+        finishCompare();
+        return;
+    }
+
+    cl_int err = CL_SUCCESS;
+    cl_kernel kernel = opencl->tileDiffBounds;
+    cl_mem boundsMem = clCreateBuffer(opencl->ctx, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                      sizeof(cl_int) * compareBounds.size(), compareBounds.data(), &err);
+    check_cl_error(err);
+
+    const size_t global_work_size[1] = {TILE_PIXEL_WIDTH};
+    err = clSetKernelArg<cl_mem>(kernel, 2, boundsMem);
+
+    CLDependencies readDeps;
+    cl_int i = 0;
+    for (auto &iter: comparedTiles)
+    {
+        CanvasTile *previousTile = iter.second.get();
+        CanvasTile *currentTile = (*targetTileMap)[iter.first].get();
+
+        {
+            CLDependencies deps;
+            deps.add(previousTile->eventSlot()).add(currentTile->eventSlot());
+
+            err = clSetKernelArg<cl_mem>(kernel, 0, previousTile->unmapHost());
+            err = clSetKernelArg<cl_mem>(kernel, 1, currentTile->unmapHost());
+            err = clSetKernelArg<cl_int>(kernel, 3, i++);
+            err = clEnqueueNDRangeKernel(opencl->cmdQueue, kernel, 1,
+                                         nullptr, global_work_size,
+                                         opencl->localWorkSize(kernel, 1, global_work_size).get(),
+                                         deps.count(), deps.waitList(), deps.event(kernel));
+            check_cl_error(err);
+        }
+
+        readDeps.add(previousTile->eventSlot());
+    }
+
+    err = clEnqueueReadBuffer(opencl->cmdQueue, boundsMem, CL_FALSE,
+                              0, sizeof(cl_int) * compareBounds.size(), compareBounds.data(),
+                              readDeps.count(), readDeps.waitList(), readDeps.event("readBuffer", &compareEvent));
+    check_cl_error(err);
+    // Released once the read is done with it
+    clReleaseMemObject(boundsMem);
+}
+
+void CanvasUndoTiles::finishCompare()
+{
+    if (comparedTiles.empty())
+        return;
+
+    if (compareEvent)
+    {
+        clWaitForEvents(1, &compareEvent);
+        clearEventSlot(&compareEvent);
+    }
+
+    size_t i = 0;
+    for (auto &iter: comparedTiles)
+    {
+        QPoint const &point = iter.first;
+        std::unique_ptr<CanvasTile> &previousTile = iter.second;
+        const cl_int *tileBounds = &compareBounds[i++ * 4];
+
+        // Unchanged, there is nothing to undo
+        if (tileBounds[2] < 0)
+            continue;
+
+        QRect rect(QPoint(tileBounds[0], tileBounds[1]), QPoint(tileBounds[2], tileBounds[3]));
+
+        if (rect == QRect(0, 0, TILE_PIXEL_WIDTH, TILE_PIXEL_HEIGHT))
+        {
+            previousTile->swapHostAsync();
+            tiles[point] = std::move(previousTile);
+            continue;
+        }
+
+        /* The read holds its own reference to the tile's memory, so the tile
+         * can be released before it finishes.
+         */
+        TileDelta &delta = deltas[point];
+        delta.rect = rect;
+        delta.pixels.resize(rect.width() * rect.height() * 4);
+        cl_event event = nullptr;
+        previousTile->readRect(rect, delta.pixels.data(), &event);
+        if (event)
+            pendingEvents.push_back(event);
+    }
+
+    comparedTiles.clear();
+    compareBounds.clear();
+}
+
+void CanvasUndoTiles::pollCompare()
+{
+    cl_int status = CL_COMPLETE;
+    if (compareEvent)
+        clGetEventInfo(compareEvent, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, nullptr);
+    if (status == CL_COMPLETE)
+        finishCompare();
+}
+
+void CanvasUndoTiles::finishTransfers()
+{
+    if (!pendingEvents.empty())
+    {
+        clWaitForEvents(pendingEvents.size(), pendingEvents.data());
+        for (cl_event &event: pendingEvents)
+            clearEventSlot(&event);
+    }
+
+    pendingEvents.clear();
+    pendingBuffers.clear();
+}
+
 TileSet CanvasUndoTiles::apply(CanvasStack *stack,
                                int         *activeLayer,
                                CanvasLayer *quickmask,
@@ -34,12 +315,17 @@ TileSet CanvasUndoTiles::apply(CanvasStack *stack,
 {
     TileSet modifiedTiles;
 
+    finishCompare();
+    finishTransfers();
+
+    markTileMapModified(stack->layers, targetTileMap.get());
+
     for (TileMap::iterator iter = tiles.begin(); iter != tiles.end(); ++iter)
     {
         std::unique_ptr<CanvasTile> &target = (*targetTileMap)[iter->first];
 
         if (target)
-            target->swapHost();
+            target->swapHostAsync();
 
         std::swap(target, iter->second);
 
@@ -49,6 +335,36 @@ TileSet CanvasUndoTiles::apply(CanvasStack *stack,
         modifiedTiles.insert(iter->first);
     }
 
+    /* Read the target's pixels out before the stored ones are written over them,
+     * the buffers stay alive until the next finishTransfers().
+     */
+    for (auto &iter: deltas)
+    {
+        // A tile that has since been removed was transparent, the delta still has to land
+        std::unique_ptr<CanvasTile> &target = (*targetTileMap)[iter.first];
+        if (!target)
+        {
+            target.reset(new CanvasTile());
+            target->fill(0.0f, 0.0f, 0.0f, 0.0f);
+        }
+
+        TileDelta &delta = iter.second;
+        std::vector<float> current(delta.pixels.size());
+        cl_event readEvent = nullptr;
+        cl_event writeEvent = nullptr;
+
+        target->readRect(delta.rect, current.data(), &readEvent);
+        target->writeRect(delta.rect, delta.pixels.data(), &writeEvent);
+
+        for (cl_event event: {readEvent, writeEvent})
+            if (event)
+                pendingEvents.push_back(event);
+
+        pendingBuffers.push_back(std::move(delta.pixels));
+        delta.pixels = std::move(current);
+        modifiedTiles.insert(iter.first);
+    }
+
     std::swap(*activeLayer, currentLayer);
     return modifiedTiles;
 }
@@ -67,6 +383,28 @@ CanvasUndoLayers::~CanvasUndoLayers()
     layers.clear();
 }
 
+CanvasUndoCost CanvasUndoLayers::cost() const
+{
+    CanvasUndoCost result;
+
+    for (CanvasLayer const *layer: layers)
+        addLayerCost(result, layer);
+
+    return result;
+}
+
+void CanvasUndoLayers::spill()
+{
+    for (CanvasLayer *layer: layers)
+        spillLayer(layer, false);
+}
+
+void CanvasUndoLayers::finishSpill()
+{
+    for (CanvasLayer *layer: layers)
+        spillLayer(layer, true);
+}
+
 TileSet CanvasUndoLayers::apply(CanvasStack *stack,
                                 int         *activeLayer,
                                 CanvasLayer *quickmask,
@@ -107,6 +445,25 @@ bool CanvasUndoBackground::modifiesBackground()
     return true;
 }
 
+CanvasUndoCost CanvasUndoBackground::cost() const
+{
+    CanvasUndoCost result;
+    addTileCost(result, tile.get());
+    return result;
+}
+
+void CanvasUndoBackground::spill()
+{
+    if (tile)
+        tile->swapHostAsync();
+}
+
+void CanvasUndoBackground::finishSpill()
+{
+    if (tile)
+        tile->pollSwapHost();
+}
+
 CanvasUndoQuickMask::CanvasUndoQuickMask(bool visible)
     : visible(visible)
 {
@@ -4,6 +4,20 @@
 #include "canvasstack.h"
 #include "canvaslayer.h"
 #include "canvastile.h"
+#include <vector>
+
+/* Memory held by an undo event, tiles still shared with the canvas aren't counted */
+struct CanvasUndoCost
+{
+    quint64 deviceBytes = 0;
+    quint64 hostBytes = 0;
+    quint64 compressedBytes = 0; /* Partial tiles, see CanvasUndoTiles::deltas */
+    quint64 pendingBytes = 0; /* Part of deviceBytes already being moved to the host or compared */
+
+    quint64 total() const { return deviceBytes + hostBytes + compressedBytes; }
+    CanvasUndoCost &operator+=(CanvasUndoCost const &other);
+    CanvasUndoCost &operator-=(CanvasUndoCost const &other);
+};
 
 class CanvasUndoEvent
 {
@@ -11,11 +25,23 @@ public:
     CanvasUndoEvent();
     virtual ~CanvasUndoEvent();
     virtual bool modifiesBackground();
+    virtual CanvasUndoCost cost() const;
+    /* Start moving any tiles held in device memory to the host without waiting,
+     * the device memory is released by finishSpill().
+     */
+    virtual void spill();
+    /* Release the device memory of tiles whose move to the host has finished,
+     * without waiting on the others.
+     */
+    virtual void finishSpill();
     virtual TileSet apply(CanvasStack *stack,
                           int         *activeLayer,
                           CanvasLayer *quickmask,
                           QRect       *activeFrame,
                           QRect       *inactiveFrame) = 0;
+
+    /* The cost last added to CanvasContext::undoCost for this event */
+    CanvasUndoCost countedCost;
 };
 
 class CanvasUndoTiles : public CanvasUndoEvent
@@ -28,10 +54,45 @@ public:
                   CanvasLayer *quickmask,
                   QRect       *activeFrame,
                   QRect       *inactiveFrame);
+    CanvasUndoCost cost() const;
+    void spill();
+    void finishSpill();
+
+    /* Keep the previous contents of each tile in previous. Where the tile still exists
+     * in targetTileMap only the rectangle of pixels that differ from it is kept.
+     * This doesn't wait for the device, the comparison and read backs finish when
+     * the event is next used.
+     */
+    void storeTiles(TileMap &&previous);
 
     int currentLayer;
     std::shared_ptr<TileMap> targetTileMap;
+    /* Whole tiles, swapped with the target tile on apply */
     TileMap tiles;
+
+    struct TileDelta
+    {
+        QRect rect;
+        std::vector<float> pixels;
+    };
+
+    /* Partial tiles, swapped with the same rectangle of the target tile on apply */
+    std::map<QPoint, TileDelta, _tilePointCompare> deltas;
+
+private:
+    /* Previous tiles waiting on the changed bounds read back, in bounds order */
+    TileMap comparedTiles;
+    std::vector<cl_int> compareBounds;
+    cl_event compareEvent;
+
+    /* Reads and writes of deltas still in flight, and buffers they use that aren't in deltas */
+    std::vector<cl_event> pendingEvents;
+    std::vector<std::vector<float>> pendingBuffers;
+
+    void finishCompare();
+    /* finishCompare() if the comparison has completed */
+    void pollCompare();
+    void finishTransfers();
 };
 
 class CanvasUndoLayers : public CanvasUndoEvent
@@ -44,6 +105,9 @@ public:
                   CanvasLayer *quickmask,
                   QRect       *activeFrame,
                   QRect       *inactiveFrame);
+    CanvasUndoCost cost() const;
+    void spill();
+    void finishSpill();
 
     int currentLayer;
     QList<CanvasLayer *> layers;
@@ -59,6 +123,9 @@ public:
                   QRect       *activeFrame,
                   QRect       *inactiveFrame);
     bool modifiesBackground();
+    CanvasUndoCost cost() const;
+    void spill();
+    void finishSpill();
 
     std::unique_ptr<CanvasTile> tile;
 };
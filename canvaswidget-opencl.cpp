@@ -2,6 +2,7 @@
 #include "canvastile.h"
 #include "opencldeviceinfo.h"
 #include <string.h>
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include <QFile>
@@ -9,6 +10,12 @@
 #include <QStringList>
 #include <QSettings>
 #include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QStandardPaths>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QThreadPool>
 
 #if defined(Q_OS_WIN32)
 #include <windows.h>
@@ -22,6 +29,8 @@
 using namespace std;
 
 static SharedOpenCL* singleton = nullptr;
+static bool profilingRequested = false;
+static bool nativeRequested = false;
 
 void _check_cl_error(const char *file, int line, cl_int err) {
     if (err != CL_SUCCESS)
@@ -107,6 +116,85 @@ void _check_cl_error(const char *file, int line, cl_int err) {
     }
 }
 
+CLDependencies::CLDependencies()
+    : enabled(SharedOpenCL::getSharedOpenCL()->outOfOrder),
+      profiler(SharedOpenCL::getSharedOpenCL()->profiler.get()),
+      profileKernel(nullptr),
+      profileCommand(nullptr),
+      keepEvent(nullptr),
+      resultEvent(nullptr)
+{
+}
+
+CLDependencies::~CLDependencies()
+{
+    if (!resultEvent)
+        return;
+
+    if (profiler)
+    {
+        if (profileKernel)
+            profiler->record(resultEvent, profileKernel);
+        else
+            profiler->record(resultEvent, profileCommand);
+    }
+
+    for (cl_event *slot: slots)
+    {
+        clearEventSlot(slot);
+        clRetainEvent(resultEvent);
+        *slot = resultEvent;
+    }
+
+    if (keepEvent)
+    {
+        clRetainEvent(resultEvent);
+        *keepEvent = resultEvent;
+    }
+
+    clReleaseEvent(resultEvent);
+}
+
+CLDependencies &CLDependencies::add(cl_event *slot)
+{
+    if (!enabled || !slot)
+        return *this;
+
+    slots.push_back(slot);
+    if (*slot && std::find(waitEvents.begin(), waitEvents.end(), *slot) == waitEvents.end())
+        waitEvents.push_back(*slot);
+
+    return *this;
+}
+
+cl_event *CLDependencies::event(cl_kernel kernel)
+{
+    profileKernel = kernel;
+    return (enabled || profiler) ? &resultEvent : nullptr;
+}
+
+cl_event *CLDependencies::event(const char *command)
+{
+    profileCommand = command;
+    return (enabled || profiler) ? &resultEvent : nullptr;
+}
+
+cl_event *CLDependencies::event(const char *command, cl_event *keep)
+{
+    profileCommand = command;
+    keepEvent = keep;
+    return &resultEvent;
+}
+
+void clearEventSlot(cl_event *slot)
+{
+    if (*slot)
+    {
+        clReleaseEvent(*slot);
+        *slot = nullptr;
+    }
+}
+
 SharedOpenCL *SharedOpenCL::getSharedOpenCL()
 {
     if (!singleton)
@@ -119,6 +207,16 @@ SharedOpenCL *SharedOpenCL::getSharedOpenCLMaybe()
     return singleton;
 }
 
+void SharedOpenCL::requestProfiling()
+{
+    profilingRequested = true;
+}
+
+void SharedOpenCL::requestNative()
+{
+    nativeRequested = true;
+}
+
 static QByteArray checkedFileRead(const QString &path)
 {
     QFile file(path);
@@ -139,7 +237,7 @@ static QByteArray checkedFileRead(const QString &path)
     return source;
 }
 
-static QByteArray kernelFromTemplate(const QString &path)
+static QList<QByteArray> kernelsFromTemplate(const QString &path)
 {
     QByteArray source = checkedFileRead(path);
     if (source.isNull())
@@ -233,10 +331,106 @@ static QByteArray kernelFromTemplate(const QString &path)
     for (auto &inKernel: inputKernels)
         inKernel.replace("FUNCTION_SUFFIX", "");
 
-    QByteArray result = inputKernels.join();
-//    qDebug() << qPrintable(result);
+    return inputKernels;
+}
 
-    return result;
+/* Find the name of the first kernel function in source */
+static QByteArray kernelNameFromSource(const QByteArray &source)
+{
+    const QByteArray KERNEL_DECL = QByteArray("__kernel void ");
+
+    int idx = source.indexOf(KERNEL_DECL);
+    if (idx == -1)
+        return {};
+    idx += KERNEL_DECL.size();
+
+    int endIdx = idx;
+    while (endIdx < source.size() && (isalnum(source.at(endIdx)) || source.at(endIdx) == '_'))
+        endIdx++;
+
+    return source.mid(idx, endIdx - idx);
+}
+
+/* Program binaries are cached by a hash of everything that could change the
+ * build result: the device, its driver, the build options and the source.
+ */
+static QString programCachePath(SharedOpenCL *cl, const QByteArray &source, const QByteArray &options)
+{
+    OpenCLDeviceInfo deviceInfo(cl->device);
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(deviceInfo.getPlatformName().toUtf8());
+    hash.addData(deviceInfo.getPlatformInfoString(CL_PLATFORM_VERSION).toUtf8());
+    hash.addData(deviceInfo.getDeviceName().toUtf8());
+    hash.addData(deviceInfo.getDeviceInfoString(CL_DEVICE_VERSION).toUtf8());
+    hash.addData(deviceInfo.getDeviceInfoString(CL_DRIVER_VERSION).toUtf8());
+    hash.addData(options);
+    hash.addData(source);
+
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) +
+           QStringLiteral("/kernels/") +
+           QString::fromLatin1(hash.result().toHex()) +
+           QStringLiteral(".bin");
+}
+
+static cl_program loadCachedProgram(SharedOpenCL *cl, const QString &cachePath, const QByteArray &options)
+{
+    QFile file(cachePath);
+
+    if (!file.open(QIODevice::ReadOnly))
+        return 0;
+
+    QByteArray binary = file.readAll();
+    if (binary.isEmpty())
+        return 0;
+
+    cl_int err = CL_SUCCESS;
+    cl_int binaryStatus = CL_SUCCESS;
+    const unsigned char *binary_str = (const unsigned char *)binary.constData();
+    size_t binary_len = binary.size();
+
+    cl_program prog = clCreateProgramWithBinary(cl->ctx, 1, &cl->device, &binary_len, &binary_str, &binaryStatus, &err);
+
+    if (err == CL_SUCCESS && binaryStatus == CL_SUCCESS)
+        err = clBuildProgram(prog, 0, nullptr, options.constData(), nullptr, nullptr);
+    else if (err == CL_SUCCESS)
+        err = binaryStatus;
+
+    if (err != CL_SUCCESS)
+    {
+        qWarning() << "Discarding invalid program cache entry" << cachePath << "(" << err << ")";
+        if (prog)
+            clReleaseProgram(prog);
+        QFile::remove(cachePath);
+        return 0;
+    }
+
+    return prog;
+}
+
+static void saveCachedProgram(SharedOpenCL *cl, const QString &cachePath, cl_program prog)
+{
+    cl_uint numDevices = 0;
+    if (CL_SUCCESS != clGetProgramInfo(prog, CL_PROGRAM_NUM_DEVICES, sizeof(numDevices), &numDevices, nullptr) || numDevices != 1)
+        return;
+
+    size_t binary_len = 0;
+    if (CL_SUCCESS != clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES, sizeof(binary_len), &binary_len, nullptr) || !binary_len)
+        return;
+
+    QByteArray binary(binary_len, '\0');
+    unsigned char *binary_str = (unsigned char *)binary.data();
+    if (CL_SUCCESS != clGetProgramInfo(prog, CL_PROGRAM_BINARIES, sizeof(binary_str), &binary_str, nullptr))
+        return;
+
+    QDir().mkpath(QFileInfo(cachePath).absolutePath());
+
+    QSaveFile file(cachePath);
+    if (!file.open(QIODevice::WriteOnly))
+        return;
+    file.write(binary);
+    if (!file.commit())
+        qWarning() << "Failed to write program cache" << cachePath;
 }
 
 static cl_program compileBytes(SharedOpenCL *cl, const QByteArray &source, const QString &options = "")
@@ -244,6 +438,10 @@ static cl_program compileBytes(SharedOpenCL *cl, const QByteArray &source, const
     QByteArray options_bytes = options.toUtf8();
     cl_int err = CL_SUCCESS;
 
+    QString cachePath = programCachePath(cl, source, options_bytes);
+    if (cl_program cached = loadCachedProgram(cl, cachePath, options_bytes))
+        return cached;
+
     const char *source_str = source.data();
     size_t source_len = source.size();
 
@@ -281,6 +479,9 @@ static cl_program compileBytes(SharedOpenCL *cl, const QByteArray &source, const
             qWarning() << "No log data";
     }
 
+    if (err == CL_SUCCESS)
+        saveCachedProgram(cl, cachePath, prog);
+
     return prog;
 }
 
@@ -298,9 +499,25 @@ static cl_program compileFile(SharedOpenCL *cl, const QString &path, const QStri
     return compileBytes(cl, source, options);
 }
 
-static cl_program compileTemplate(SharedOpenCL *cl, QString path, const QString &options = "")
+/* Compile the template instance named kernelName, expanded templates are cached in
+ * expandedKernels so the template only needs to be parsed once.
+ */
+static cl_program compileTemplate(SharedOpenCL *cl, QString path, QMap<QByteArray, QByteArray> &expandedKernels,
+                                  const QByteArray &kernelName, const QString &options = "")
 {
-    QByteArray templateSource = kernelFromTemplate(path);
+    if (expandedKernels.isEmpty())
+    {
+        for (QByteArray const &kernelSource: kernelsFromTemplate(path))
+            expandedKernels[kernelNameFromSource(kernelSource)] = kernelSource;
+    }
+
+    QByteArray templateSource = expandedKernels.value(kernelName);
+    if (templateSource.isNull())
+    {
+        qWarning() << "No template instance for" << kernelName << "in" << path;
+        return {};
+    }
+
     QByteArray headerSource = checkedFileRead(path.replace(QStringLiteral("-template.cl"), QStringLiteral(".cl")));
     if (headerSource.isNull())
     {
@@ -308,7 +525,7 @@ static cl_program compileTemplate(SharedOpenCL *cl, QString path, const QString
         return {};
     }
 
-    cout << "Compiling " << qPrintable(path) << " (template)" << endl;
+    cout << "Compiling " << qPrintable(path) << " (" << kernelName.constData() << ")" << endl;
 
     return compileBytes(cl, headerSource + templateSource, options);
 }
@@ -429,6 +646,74 @@ static cl_kernel buildOrWarn(cl_program prog, const char *name)
     return kernel;
 }
 
+namespace {
+class KernelPrewarmThread : public QThread
+{
+public:
+    KernelPrewarmThread(std::vector<LazyKernel *> kernels) : kernels(kernels) {}
+
+    void run() override
+    {
+        for (LazyKernel *kernel: kernels)
+        {
+            cl_kernel built = *kernel;
+            (void)built;
+        }
+    }
+
+    std::vector<LazyKernel *> kernels;
+};
+}
+
+void LazyProgram::setCompiler(Compiler newCompiler, bool newPerKernel)
+{
+    QMutexLocker lock(&mutex);
+
+    compiler = newCompiler;
+    perKernel = newPerKernel;
+}
+
+cl_program LazyProgram::get(const QByteArray &kernelName)
+{
+    QMutexLocker lock(&mutex);
+
+    QByteArray key = perKernel ? kernelName : QByteArray();
+    auto found = programs.find(key);
+    if (found != programs.end())
+        return found.value();
+
+    // A failed compile is also cached as a null program so it isn't retried for every kernel
+    cl_program result = compiler ? compiler(kernelName) : 0;
+    programs[key] = result;
+
+    return result;
+}
+
+cl_kernel LazyKernel::build()
+{
+    QMutexLocker lock(&mutex);
+
+    cl_kernel result = kernel.load();
+    if (result || failed)
+        return result;
+
+    cl_program prog = program->get(name);
+    if (prog)
+        result = buildOrWarn(prog, name);
+
+    // Remember the failure so later uses don't retry (and warn) on every call
+    if (!result)
+    {
+        failed = true;
+        qWarning() << "Kernel" << name << "is unavailable";
+        return 0;
+    }
+
+    kernel.store(result);
+
+    return result;
+}
+
 SharedOpenCL::SharedOpenCL()
 {
     cl_int err = CL_SUCCESS;
@@ -441,6 +726,10 @@ SharedOpenCL::SharedOpenCL()
     ctx = nullptr;
     cmdQueue = nullptr;
     gl_sharing = false;
+    outOfOrder = false;
+    batchDabs = false;
+    pipelineDabs = false;
+    native = false;
 
     cl_command_queue_properties command_queue_flags = 0;
 
@@ -450,9 +739,19 @@ SharedOpenCL::SharedOpenCL()
     if (appSettings.contains("OpenCL/Device"))
     {
         bool ok = false;
-        selectedDeviceType = appSettings.value("OpenCL/Device").toString().toInt(&ok);
+        int deviceSetting = appSettings.value("OpenCL/Device").toString().toInt(&ok);
         if (!ok)
             selectedDeviceType = CL_DEVICE_TYPE_CPU;
+        else if (deviceSetting == NativeDevice)
+            nativeRequested = true;
+        else
+            selectedDeviceType = deviceSetting;
+    }
+
+    if (nativeRequested)
+    {
+        initNative();
+        return;
     }
 
     if (selectedDeviceType == 0)
@@ -488,8 +787,9 @@ SharedOpenCL::SharedOpenCL()
 
         if (deviceInfoIter == deviceInfoList.end())
         {
-            qWarning() << "No OpenCL devices found";
-            exit(1);
+            qWarning() << "No OpenCL devices found, using the native backend";
+            initNative();
+            return;
         }
 
         deviceInfo = *deviceInfoIter;
@@ -504,84 +804,182 @@ SharedOpenCL::SharedOpenCL()
     cout << "CL Device: " << qPrintable(deviceInfo.getDeviceName().simplified()) << endl;
     cout << "CL Sharing: " << (gl_sharing ? "yes" : "no") << endl;
 
+    /* The out-of-order queue is opt in, not all drivers handle it well */
+    outOfOrder = false;
+    if (appSettings.value("OpenCL/OutOfOrderQueue", false).toBool())
+    {
+        cl_command_queue_properties supported = deviceInfo.getDeviceInfo<cl_command_queue_properties>(CL_DEVICE_QUEUE_PROPERTIES);
+        if (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+        {
+            command_queue_flags |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+            outOfOrder = true;
+        }
+        else
+        {
+            qWarning() << "Device does not support out-of-order queues";
+        }
+    }
+
+    cout << "CL Out-of-order Queue: " << (outOfOrder ? "yes" : "no") << endl;
+
+    if (profilingRequested || appSettings.value("OpenCL/Profiling", false).toBool())
+    {
+        command_queue_flags |= CL_QUEUE_PROFILING_ENABLE;
+        profiler.reset(new OpenCLProfiler());
+    }
+
+    cout << "CL Profiling: " << (profiler ? "yes" : "no") << endl;
+
+    batchDabs = appSettings.value("OpenCL/BatchDabs", true).toBool();
+    cout << "CL Batched Dabs: " << (batchDabs ? "yes" : "no") << endl;
+    pipelineDabs = batchDabs && appSettings.value("OpenCL/PipelineDabs", true).toBool();
+    cout << "CL Pipelined Dabs: " << (pipelineDabs ? "yes" : "no") << endl;
+
     cmdQueue = clCreateCommandQueue (ctx, device, command_queue_flags, &err);
 
-    /* Compile base kernels */
+    setTunedSizes(WorkGroupTuner::load(device));
+    cout << "CL Tuned Kernels: " << tunedSizes.size() << endl;
+
+    /* Kernels are compiled on first use */
     QString kernelDefs = QStringLiteral("-cl-denorms-are-zero -cl-no-signed-zeros");
             kernelDefs += QString(" -DTILE_PIXEL_WIDTH=%1").arg((size_t)TILE_PIXEL_WIDTH);
             kernelDefs += QString(" -DTILE_PIXEL_HEIGHT=%1").arg((size_t)TILE_PIXEL_HEIGHT);
 
-    cl_program baseKernelProg = compileFile(this, ":/BaseKernels.cl", kernelDefs);
-    if (baseKernelProg)
-    {
-        circleKernel = buildOrWarn(baseKernelProg, "circle");
-        fillKernel = buildOrWarn(baseKernelProg, "fill");
-        floatToU8 = buildOrWarn(baseKernelProg, "floatToU8");
-        gradientApply = buildOrWarn(baseKernelProg, "gradientApply");
-        colorMask = buildOrWarn(baseKernelProg, "tileColorMask");
-        matrixApply = buildOrWarn(baseKernelProg, "matrixApply");
-        blendKernel_over = buildOrWarn(baseKernelProg, "tileSVGOver");
-        blendKernel_multiply = buildOrWarn(baseKernelProg, "tileSVGMultipy");
-        blendKernel_colorDodge = buildOrWarn(baseKernelProg, "tileSVGMColorDodge");
-        blendKernel_colorBurn = buildOrWarn(baseKernelProg, "tileSVGColorBurn");
-        blendKernel_screen = buildOrWarn(baseKernelProg, "tileSVGScreen");
-        blendKernel_hue = buildOrWarn(baseKernelProg, "tileSVGHue");
-        blendKernel_saturation = buildOrWarn(baseKernelProg, "tileSVGSaturation");
-        blendKernel_color = buildOrWarn(baseKernelProg, "tileSVGColor");
-        blendKernel_luminosity = buildOrWarn(baseKernelProg, "tileSVGLuminosity");
-        blendKernel_dstOut = buildOrWarn(baseKernelProg, "tileSVGDstOut");
-        blendKernel_dstIn = buildOrWarn(baseKernelProg, "tileSVGDstIn");
-        blendKernel_srcAtop = buildOrWarn(baseKernelProg, "tileSVGSrcAtop");
-        blendKernel_dstAtop = buildOrWarn(baseKernelProg, "tileSVGDstAtop");
-
-        clReleaseProgram (baseKernelProg);
-    }
+    baseKernelsProgram.setCompiler([this, kernelDefs](QByteArray const &) {
+        return compileFile(this, ":/BaseKernels.cl", kernelDefs);
+    });
+
+    myPaintKernelsProgram.setCompiler([this, kernelDefs](QByteArray const &) {
+        return compileFile(this, ":/MyPaintKernels.cl", kernelDefs);
+    });
+
+    auto expandedKernels = std::make_shared<QMap<QByteArray, QByteArray>>();
+    myPaintTemplateProgram.setCompiler([this, kernelDefs, expandedKernels](QByteArray const &kernelName) {
+        return compileTemplate(this, ":/MyPaintKernels-template.cl", *expandedKernels, kernelName, kernelDefs);
+    }, true);
+
+    paintKernelsProgram.setCompiler([this, kernelDefs](QByteArray const &) {
+        return compileFile(this, ":/PaintKernels.cl", kernelDefs);
+    });
+
+    patternKernelsProgram.setCompiler([this, kernelDefs](QByteArray const &) {
+        return compileFile(this, ":/PatternKernels.cl", kernelDefs);
+    });
+
+    /* Build the kernels needed by the default brush in the background */
+    prewarmThread.reset(new KernelPrewarmThread({
+        &fillKernel,
+        &blendKernel_over,
+        &floatToU8,
+        &colorMask,
+        &mypaintDabKernel,
+        &mypaintMicroDabKernel,
+        &mypaintDabBatchKernel,
+        &mypaintGetColorKernelTile,
+        &mypaintGetColorKernelEmptyTile,
+        &mypaintGetColorKernelReduce,
+    }));
+    prewarmThread->start(QThread::LowPriority);
+}
 
-    cl_program myPaintKernelsProg = compileTemplate(this, ":/MyPaintKernels-template.cl", kernelDefs);
-    if (myPaintKernelsProg)
-    {
-        mypaintDabKernel = buildOrWarn(myPaintKernelsProg, "mypaint_dab");
-        mypaintDabLockedKernel = buildOrWarn(myPaintKernelsProg, "mypaint_dab_locked");
-        mypaintDabIsolateKernel = buildOrWarn(myPaintKernelsProg, "mypaint_dab_isolate");
-        mypaintMicroDabKernel = buildOrWarn(myPaintKernelsProg, "mypaint_micro");
-        mypaintMicroDabLockedKernel = buildOrWarn(myPaintKernelsProg, "mypaint_micro_locked");
-        mypaintMicroDabIsolateKernel = buildOrWarn(myPaintKernelsProg, "mypaint_micro_isolate");
-        mypaintMaskDabKernel = buildOrWarn(myPaintKernelsProg, "mypaint_mask");
-        mypaintMaskDabLockedKernel = buildOrWarn(myPaintKernelsProg, "mypaint_mask_locked");
-        mypaintMaskDabIsolateKernel = buildOrWarn(myPaintKernelsProg, "mypaint_mask_isolate");
-        mypaintDabTexturedKernel = buildOrWarn(myPaintKernelsProg, "mypaint_dab_textured");
-        mypaintDabLockedTexturedKernel = buildOrWarn(myPaintKernelsProg, "mypaint_dab_locked_textured");
-        mypaintDabIsolateTexturedKernel = buildOrWarn(myPaintKernelsProg, "mypaint_dab_isolate_textured");
-        mypaintMicroDabTexturedKernel = buildOrWarn(myPaintKernelsProg, "mypaint_micro_textured");
-        mypaintMicroDabLockedTexturedKernel = buildOrWarn(myPaintKernelsProg, "mypaint_micro_locked_textured");
-        mypaintMicroDabIsolateTexturedKernel = buildOrWarn(myPaintKernelsProg, "mypaint_micro_isolate_textured");
-        mypaintMaskDabTexturedKernel = buildOrWarn(myPaintKernelsProg, "mypaint_mask_textured");
-        mypaintMaskDabLockedTexturedKernel = buildOrWarn(myPaintKernelsProg, "mypaint_mask_locked_textured");
-        mypaintMaskDabIsolateTexturedKernel = buildOrWarn(myPaintKernelsProg, "mypaint_mask_isolate_textured");
-        mypaintGetColorKernelPart1 = buildOrWarn(myPaintKernelsProg, "mypaint_color_query_part1");
-        mypaintGetColorKernelEmptyPart1 = buildOrWarn(myPaintKernelsProg, "mypaint_color_query_empty_part1");
-        mypaintGetColorKernelPart2 = buildOrWarn(myPaintKernelsProg, "mypaint_color_query_part2");
-
-        clReleaseProgram (myPaintKernelsProg);
-    }
+WorkSize SharedOpenCL::localWorkSize(cl_kernel kernel, cl_uint dims, const size_t *globalWorkSize, const size_t *fallback)
+{
+    WorkSize result(dims, fallback);
 
-    cl_program paintKernelsProg = compileFile(this, ":/PaintKernels.cl", kernelDefs);
-    if (paintKernelsProg)
-    {
-        paintKernel_fillFloats = buildOrWarn(paintKernelsProg, "fillFloats");
-        paintKernel_maskCircle = buildOrWarn(paintKernelsProg, "maskCircle");
-        paintKernel_applyMaskTile = buildOrWarn(paintKernelsProg, "applyMaskTile");
+    QMutexLocker lock(&tunedMutex);
+
+    if (tunedSizes.empty() || dims > 2)
+        return result;
 
-        clReleaseProgram(paintKernelsProg);
+    QByteArray &name = kernelNames[kernel];
+    if (name.isEmpty())
+    {
+        size_t nameSize = 0;
+        clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, nullptr, &nameSize);
+        name = QByteArray(nameSize, '\0');
+        clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, nameSize, name.data(), nullptr);
+        // Drop the trailing null
+        name.truncate(qstrlen(name.constData()));
     }
 
-    cl_program patternKernelsProg = compileFile(this, ":/PatternKernels.cl", kernelDefs);
-    if (patternKernelsProg)
+    auto found = tunedSizes.find(name);
+    if (found == tunedSizes.end())
+        return result;
+
+    WorkGroupTuner::LocalSize const &tuned = found->second;
+    if (tuned.isDefault())
+        return result;
+
+    for (cl_uint i = 0; i < dims; ++i)
+        if (globalWorkSize[i] % tuned.size[i] != 0)
+            return result;
+
+    return WorkSize(dims, tuned.size);
+}
+
+void SharedOpenCL::setTunedSizes(WorkGroupTuner::Results const &sizes)
+{
+    QMutexLocker lock(&tunedMutex);
+    tunedSizes = sizes;
+}
+
+static const size_t maxFreeScratchBuffers = 16;
+
+cl_mem SharedOpenCL::acquireScratchBuffer(size_t size)
+{
+    QMutexLocker lock(&scratchMutex);
+
+    // Hand out the smallest free buffer that fits
+    auto best = scratchBuffers.lower_bound(size);
+    if (best != scratchBuffers.end())
     {
-        patternFill_fillCircle = buildOrWarn(patternKernelsProg, "patternFillCircle");
+        cl_mem result = best->second;
+        scratchSizes[result] = best->first;
+        scratchBuffers.erase(best);
+        return result;
+    }
 
-        clReleaseProgram(patternKernelsProg);
+    // Round up so that slowly growing requests don't each allocate a new buffer
+    size_t allocSize = 4096;
+    while (allocSize < size)
+        allocSize *= 2;
+
+    cl_int err = CL_SUCCESS;
+    cl_mem result = clCreateBuffer(ctx, CL_MEM_READ_WRITE, allocSize, nullptr, &err);
+    check_cl_error(err);
+
+    if (result)
+        scratchSizes[result] = allocSize;
+
+    return result;
+}
+
+void SharedOpenCL::releaseScratchBuffer(cl_mem buffer)
+{
+    if (!buffer)
+        return;
+
+    QMutexLocker lock(&scratchMutex);
+
+    auto found = scratchSizes.find(buffer);
+    if (found == scratchSizes.end())
+        return;
+
+    scratchBuffers.insert(std::make_pair(found->second, buffer));
+    scratchSizes.erase(found);
+
+    // Drop the smallest buffers first, a larger one can still serve their requests
+    while (scratchBuffers.size() > maxFreeScratchBuffers)
+    {
+        clReleaseMemObject(scratchBuffers.begin()->second);
+        scratchBuffers.erase(scratchBuffers.begin());
     }
+}
 
+void SharedOpenCL::initNative()
+{
+    native = true;
+    deviceType = CL_DEVICE_TYPE_CPU;
 
+    cout << "Backend: native (" << QThreadPool::globalInstance()->maxThreadCount() << " threads)" << endl;
 }
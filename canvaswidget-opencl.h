@@ -7,6 +7,20 @@
 #include <CL/cl.h>
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+#include <QByteArray>
+#include <QMap>
+#include <QMutex>
+#include <QThread>
+
+#include "openclprofiler.h"
+#include "workgrouptuner.h"
+
 void _check_cl_error(const char *file, int line, cl_int err);
 #define check_cl_error(err) _check_cl_error(__FILE__,__LINE__,err)
 
@@ -19,11 +33,86 @@ template <typename T> static inline cl_int clSetKernelArg(cl_kernel kernel, cl_u
     return clSetKernelArg(kernel, idx, sizeof(T), &value);
 }
 
+class SharedOpenCL;
+
+/* The local_work_size argument of clEnqueueNDRangeKernel, get() is null when
+ * the driver should choose.
+ */
+struct WorkSize
+{
+    WorkSize() : valid(false) {}
+    WorkSize(cl_uint dims, const size_t *from) : valid(from != nullptr)
+    {
+        if (from)
+            std::copy_n(from, std::min<cl_uint>(dims, 3), size);
+    }
+
+    const size_t *get() const { return valid ? size : nullptr; }
+
+    size_t size[3];
+    bool valid;
+};
+
+/* A program that is compiled the first time one of its kernels is requested.
+ * If perKernel is set the compiler is invoked separately for each kernel name,
+ * otherwise it's called once and all kernels share the resulting program.
+ */
+class LazyProgram
+{
+public:
+    typedef std::function<cl_program(QByteArray const &kernelName)> Compiler;
+
+    void setCompiler(Compiler newCompiler, bool newPerKernel = false);
+    cl_program get(QByteArray const &kernelName);
+
+private:
+    QMutex mutex;
+    Compiler compiler;
+    bool perKernel = false;
+    QMap<QByteArray, cl_program> programs;
+};
+
+class LazyKernel
+{
+public:
+    LazyKernel(LazyProgram *program, const char *name) : program(program), name(name) {}
+    LazyKernel(const LazyKernel&) = delete;
+    LazyKernel &operator=(const LazyKernel&) = delete;
+
+    operator cl_kernel()
+    {
+        cl_kernel result = kernel.load();
+        return result ? result : build();
+    }
+
+    bool isBuilt() const { return kernel.load() != nullptr; }
+
+private:
+    cl_kernel build();
+
+    QMutex mutex;
+    LazyProgram *program;
+    const char *name;
+    std::atomic<cl_kernel> kernel{nullptr};
+    bool failed = false;
+};
+
 class SharedOpenCL
 {
 public:
     static SharedOpenCL *getSharedOpenCL();
     static SharedOpenCL *getSharedOpenCLMaybe();
+    /* Enable profiling regardless of the settings, must be called before the
+     * shared context is created.
+     */
+    static void requestProfiling();
+    /* Use the native backend regardless of the settings, must be called
+     * before the shared context is created.
+     */
+    static void requestNative();
+
+    /* The "OpenCL/Device" setting value that selects the native backend */
+    enum { NativeDevice = -1 };
 
     cl_platform_id platform;
     cl_device_id   device;
@@ -32,60 +121,148 @@ public:
     cl_context ctx;
     cl_command_queue cmdQueue;
 
-    cl_kernel circleKernel;
-    cl_kernel fillKernel;
-    cl_kernel floatToU8;
-    cl_kernel gradientApply;
-    cl_kernel colorMask;
-    cl_kernel matrixApply;
-
-    cl_kernel blendKernel_over;
-    cl_kernel blendKernel_multiply;
-    cl_kernel blendKernel_colorDodge;
-    cl_kernel blendKernel_colorBurn;
-    cl_kernel blendKernel_screen;
-    cl_kernel blendKernel_hue;
-    cl_kernel blendKernel_saturation;
-    cl_kernel blendKernel_color;
-    cl_kernel blendKernel_luminosity;
-    cl_kernel blendKernel_dstOut;
-    cl_kernel blendKernel_dstIn;
-    cl_kernel blendKernel_srcAtop;
-    cl_kernel blendKernel_dstAtop;
-
-    cl_kernel mypaintDabKernel;
-    cl_kernel mypaintDabLockedKernel;
-    cl_kernel mypaintDabIsolateKernel;
-    cl_kernel mypaintMicroDabKernel;
-    cl_kernel mypaintMicroDabLockedKernel;
-    cl_kernel mypaintMicroDabIsolateKernel;
-    cl_kernel mypaintMaskDabKernel;
-    cl_kernel mypaintMaskDabLockedKernel;
-    cl_kernel mypaintMaskDabIsolateKernel;
-    cl_kernel mypaintDabTexturedKernel;
-    cl_kernel mypaintDabLockedTexturedKernel;
-    cl_kernel mypaintDabIsolateTexturedKernel;
-    cl_kernel mypaintMicroDabTexturedKernel;
-    cl_kernel mypaintMicroDabLockedTexturedKernel;
-    cl_kernel mypaintMicroDabIsolateTexturedKernel;
-    cl_kernel mypaintMaskDabTexturedKernel;
-    cl_kernel mypaintMaskDabLockedTexturedKernel;
-    cl_kernel mypaintMaskDabIsolateTexturedKernel;
-    cl_kernel mypaintGetColorKernelPart1;
-    cl_kernel mypaintGetColorKernelEmptyPart1;
-    cl_kernel mypaintGetColorKernelPart2;
-
-    cl_kernel paintKernel_fillFloats;
-    cl_kernel paintKernel_maskCircle;
-    cl_kernel paintKernel_applyMaskTile;
-
-    cl_kernel patternFill_fillCircle;
+    LazyProgram baseKernelsProgram;
+    LazyProgram myPaintKernelsProgram;
+    LazyProgram myPaintTemplateProgram;
+    LazyProgram paintKernelsProgram;
+    LazyProgram patternKernelsProgram;
+
+    LazyKernel circleKernel{&baseKernelsProgram, "circle"};
+    LazyKernel fillKernel{&baseKernelsProgram, "fill"};
+    LazyKernel floatToU8{&baseKernelsProgram, "floatToU8"};
+    LazyKernel gradientApply{&baseKernelsProgram, "gradientApply"};
+    LazyKernel colorMask{&baseKernelsProgram, "tileColorMask"};
+    LazyKernel matrixApply{&baseKernelsProgram, "matrixApply"};
+    LazyKernel isolateComposite{&baseKernelsProgram, "isolateComposite"};
+    LazyKernel tileDiffBounds{&baseKernelsProgram, "tileDiffBounds"};
+
+    LazyKernel blendKernel_over{&baseKernelsProgram, "tileSVGOver"};
+    LazyKernel blendKernel_multiply{&baseKernelsProgram, "tileSVGMultipy"};
+    LazyKernel blendKernel_colorDodge{&baseKernelsProgram, "tileSVGMColorDodge"};
+    LazyKernel blendKernel_colorBurn{&baseKernelsProgram, "tileSVGColorBurn"};
+    LazyKernel blendKernel_screen{&baseKernelsProgram, "tileSVGScreen"};
+    LazyKernel blendKernel_hue{&baseKernelsProgram, "tileSVGHue"};
+    LazyKernel blendKernel_saturation{&baseKernelsProgram, "tileSVGSaturation"};
+    LazyKernel blendKernel_color{&baseKernelsProgram, "tileSVGColor"};
+    LazyKernel blendKernel_luminosity{&baseKernelsProgram, "tileSVGLuminosity"};
+    LazyKernel blendKernel_dstOut{&baseKernelsProgram, "tileSVGDstOut"};
+    LazyKernel blendKernel_dstIn{&baseKernelsProgram, "tileSVGDstIn"};
+    LazyKernel blendKernel_srcAtop{&baseKernelsProgram, "tileSVGSrcAtop"};
+    LazyKernel blendKernel_dstAtop{&baseKernelsProgram, "tileSVGDstAtop"};
+
+    LazyKernel mypaintDabKernel{&myPaintTemplateProgram, "mypaint_dab"};
+    LazyKernel mypaintDabLockedKernel{&myPaintTemplateProgram, "mypaint_dab_locked"};
+    LazyKernel mypaintDabIsolateKernel{&myPaintTemplateProgram, "mypaint_dab_isolate"};
+    LazyKernel mypaintMicroDabKernel{&myPaintTemplateProgram, "mypaint_micro"};
+    LazyKernel mypaintMicroDabLockedKernel{&myPaintTemplateProgram, "mypaint_micro_locked"};
+    LazyKernel mypaintMicroDabIsolateKernel{&myPaintTemplateProgram, "mypaint_micro_isolate"};
+    LazyKernel mypaintMaskDabKernel{&myPaintTemplateProgram, "mypaint_mask"};
+    LazyKernel mypaintMaskDabLockedKernel{&myPaintTemplateProgram, "mypaint_mask_locked"};
+    LazyKernel mypaintMaskDabIsolateKernel{&myPaintTemplateProgram, "mypaint_mask_isolate"};
+    LazyKernel mypaintDabTexturedKernel{&myPaintTemplateProgram, "mypaint_dab_textured"};
+    LazyKernel mypaintDabLockedTexturedKernel{&myPaintTemplateProgram, "mypaint_dab_locked_textured"};
+    LazyKernel mypaintDabIsolateTexturedKernel{&myPaintTemplateProgram, "mypaint_dab_isolate_textured"};
+    LazyKernel mypaintMicroDabTexturedKernel{&myPaintTemplateProgram, "mypaint_micro_textured"};
+    LazyKernel mypaintMicroDabLockedTexturedKernel{&myPaintTemplateProgram, "mypaint_micro_locked_textured"};
+    LazyKernel mypaintMicroDabIsolateTexturedKernel{&myPaintTemplateProgram, "mypaint_micro_isolate_textured"};
+    LazyKernel mypaintMaskDabTexturedKernel{&myPaintTemplateProgram, "mypaint_mask_textured"};
+    LazyKernel mypaintMaskDabLockedTexturedKernel{&myPaintTemplateProgram, "mypaint_mask_locked_textured"};
+    LazyKernel mypaintMaskDabIsolateTexturedKernel{&myPaintTemplateProgram, "mypaint_mask_isolate_textured"};
+    LazyKernel mypaintDabBatchKernel{&myPaintKernelsProgram, "mypaint_dab_batch"};
+    LazyKernel mypaintDabBatchTexturedKernel{&myPaintKernelsProgram, "mypaint_dab_batch_textured"};
+    LazyKernel mypaintGetColorKernelTile{&myPaintKernelsProgram, "mypaint_color_query_tile"};
+    LazyKernel mypaintGetColorKernelEmptyTile{&myPaintKernelsProgram, "mypaint_color_query_empty_tile"};
+    LazyKernel mypaintGetColorKernelReduce{&myPaintKernelsProgram, "mypaint_color_query_reduce"};
+
+    LazyKernel paintKernel_fillFloats{&paintKernelsProgram, "fillFloats"};
+    LazyKernel paintKernel_maskCircle{&paintKernelsProgram, "maskCircle"};
+    LazyKernel paintKernel_applyMaskTile{&paintKernelsProgram, "applyMaskTile"};
+
+    LazyKernel patternFill_fillCircle{&patternKernelsProgram, "patternFillCircle"};
 
     bool gl_sharing;
+    bool outOfOrder;
+    /* Queue the dabs of a stroke segment and draw them with one launch per tile */
+    bool batchDabs;
+    /* Enqueue batched dabs from a worker thread while brushlib generates the next ones */
+    bool pipelineDabs;
+    /* No OpenCL context exists, tiles live in host memory and the work is done by NativeKernels */
+    bool native;
+    /* Null unless the queue was created with CL_QUEUE_PROFILING_ENABLE */
+    std::unique_ptr<OpenCLProfiler> profiler;
+
+    /* The local work size to launch kernel with. This is the size found by
+     * WorkGroupTuner if there is one that evenly divides globalWorkSize,
+     * otherwise fallback.
+     */
+    WorkSize localWorkSize(cl_kernel kernel, cl_uint dims, const size_t *globalWorkSize, const size_t *fallback = nullptr);
+    void setTunedSizes(WorkGroupTuner::Results const &sizes);
+
+    /* A buffer of at least size bytes from a pool of scratch buffers. It must be handed
+     * back with releaseScratchBuffer() once the commands using it have completed.
+     */
+    cl_mem acquireScratchBuffer(size_t size);
+    void releaseScratchBuffer(cl_mem buffer);
+
 private:
     SharedOpenCL();
+    void initNative();
+
+    QMutex tunedMutex;
+    WorkGroupTuner::Results tunedSizes;
+    std::map<cl_kernel, QByteArray> kernelNames;
+
+    QMutex scratchMutex;
+    std::multimap<size_t, cl_mem> scratchBuffers; // Free buffers by size
+    std::map<cl_mem, size_t> scratchSizes; // Handed out buffers
+
+    std::unique_ptr<QThread> prewarmThread;
+};
+
+/* Dependency tracking for a single command on an out-of-order queue.
+ *
+ * Each resource the command touches has an event slot holding the last command
+ * that used it. The command waits on those events and, when the CLDependencies
+ * goes out of scope, becomes the new last event of every slot. With an in-order
+ * queue the wait list is always empty and no events are created unless
+ * profiling is enabled.
+ */
+class CLDependencies
+{
+public:
+    CLDependencies();
+    ~CLDependencies();
+    CLDependencies(const CLDependencies&) = delete;
+    CLDependencies &operator=(const CLDependencies&) = delete;
+
+    CLDependencies &add(cl_event *slot);
+
+    cl_uint count() const { return waitEvents.size(); }
+    const cl_event *waitList() const { return waitEvents.empty() ? nullptr : waitEvents.data(); }
+    /* The result event for the command, the name is used to attribute
+     * the command when profiling is enabled.
+     */
+    cl_event *event(cl_kernel kernel);
+    cl_event *event(const char *command);
+    /* As event(command), but the event is always created and once the command is
+     * recorded a reference to it is stored in *keep for the caller to release.
+     */
+    cl_event *event(const char *command, cl_event *keep);
+
+private:
+    bool enabled;
+    OpenCLProfiler *profiler;
+    cl_kernel profileKernel;
+    const char *profileCommand;
+    cl_event *keepEvent;
+    std::vector<cl_event *> slots;
+    std::vector<cl_event> waitEvents;
+    cl_event resultEvent;
 };
 
+/* Release the event in slot, if any */
+void clearEventSlot(cl_event *slot);
+
 namespace cl {
     static inline cl_mem createImage2D(SharedOpenCL          *opencl,
                                        cl_mem_flags           flags,
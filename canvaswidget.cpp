@@ -7,6 +7,7 @@
 #include "canvasindex.h"
 #include "basetool.h"
 #include "ora.h"
+#include "tsdfile.h"
 #include "imagefiles.h"
 #include "toolfactory.h"
 #include <list>
@@ -14,6 +15,7 @@
 #include <QApplication>
 #include <QWindow>
 #include <QProgressDialog>
+#include <QFileInfo>
 #include <QRegExp>
 #include <QMouseEvent>
 #include <QTimer>
@@ -150,6 +152,7 @@ public:
     QRect canvasFrame;
     RectHandle::Handle canvasFrameHandle = RectHandle::None;
     std::shared_ptr<QAtomicInt> motionCoalesceToken;
+    CanvasWidget::UndoUsage lastUndoUsage;
 
     struct {
         QPoint origin;
@@ -579,6 +582,28 @@ namespace {
             undoLayer = ctx->currentLayerCopy.get();
         }
     }
+
+    /* Transforms read every tile of the unmodified layer, so instead of the lazy copy
+     * strokes use it's a full copy, or a rendering of a group, made when first needed.
+     */
+    CanvasLayer *getTransformSource(CanvasContext *ctx)
+    {
+        if (!ctx->currentLayerCopy || ctx->currentLayerCopy->lazySource)
+            ctx->currentLayerCopy = layerFromAbsoluteIndex(&ctx->layers, ctx->currentLayer)->flattened();
+
+        return ctx->currentLayerCopy.get();
+    }
+
+    void revertToUndoLayer(CanvasLayer *targetLayer, CanvasLayer *undoLayer)
+    {
+        if (undoLayer->lazySource)
+        {
+            undoLayer->restoreCaptured();
+            targetLayer->markModified();
+        }
+        else
+            targetLayer->takeTiles(undoLayer->deepCopy().get());
+    }
 }
 
 void CanvasWidget::startStroke(QPointF pos, float pressure)
@@ -647,8 +672,12 @@ void CanvasWidget::strokeTo(QPointF pos, float pressure, float dt)
         if (ctx->stroke)
         {
             if (coalesceToken && coalesceToken->deref() == true)
+            {
+                ctx->strokeEventsCoalesced++;
                 return;
+            }
 
+            ctx->strokeEventsProcessed++;
             TileSet changedTiles = ctx->stroke->strokeTo(pos, pressure, dt);
 
             if(!changedTiles.empty())
@@ -657,6 +686,10 @@ void CanvasWidget::strokeTo(QPointF pos, float pressure, float dt)
                 ctx->strokeModifiedTiles.insert(changedTiles.begin(), changedTiles.end());
             }
         }
+        else
+        {
+            ctx->strokeEventsDropped++;
+        }
     };
 
     d->eventThread.enqueueCommand(msg);
@@ -670,18 +703,24 @@ static void transferUndoEventTiles(CanvasUndoTiles *undoEvent,
                                    CanvasLayer const *modifiedLayer)
 {
     /* Move modified tiles from the backup layer to the event, and from the new layer to the backup */
+    TileMap oldTiles;
+
     for (QPoint const &iter : modifiedTiles)
     {
-        std::unique_ptr<CanvasTile> oldTile = originalLayer->takeTileMaybe(iter.x(), iter.y());
+        oldTiles[iter] = originalLayer->takeTileMaybe(iter.x(), iter.y());
 
-        if (oldTile)
-            oldTile->swapHost();
-
-        undoEvent->tiles[iter] = std::move(oldTile);
+        if (originalLayer->lazySource)
+            continue;
 
         if (CanvasTile *newTile = modifiedLayer->getTileMaybe(iter.x(), iter.y()))
             (*originalLayer->tiles)[iter] = newTile->copy();
     }
+
+    // With its captured tiles gone a lazy copy matches the layer again
+    if (originalLayer->lazySource)
+        originalLayer->tiles->clear();
+
+    undoEvent->storeTiles(std::move(oldTiles));
 }
 
 void CanvasWidget::endStroke()
@@ -768,6 +807,7 @@ void CanvasWidget::lineTo(QPointF start, QPointF end)
             ctx->dirtyTiles.insert(iter);
         }
 
+        targetLayer->markModified();
         ctx->strokeModifiedTiles.clear();
 
         StrokeContextArgs args = {targetLayer, undoLayer};
@@ -958,6 +998,17 @@ void CanvasWidget::addLayerAbove(int layerIndex, QImage image, QString name)
     insertLayerAbove(layerIndex, std::move(imported));
 }
 
+bool CanvasWidget::addLayerAbove(int layerIndex, QString const &path)
+{
+    std::unique_ptr<CanvasLayer> imported = layerFromFile(path);
+    if (!imported)
+        return false;
+
+    imported->name = QFileInfo(path).fileName();
+    insertLayerAbove(layerIndex, std::move(imported));
+    return true;
+}
+
 void CanvasWidget::addGroupAbove(int layerIndex)
 {
     CanvasLayer *layer = new CanvasLayer(QStringLiteral("Group"));
@@ -1332,12 +1383,7 @@ void CanvasWidget::updateLayerTranslate(int x,  int y)
         if (!ctx->quickmask->visible)
         {
             targetLayer = layerFromAbsoluteIndex(&ctx->layers, ctx->currentLayer);
-            if (!ctx->currentLayerCopy)
-            {
-                // If the current layer is a group generate a cached rendering of it
-                ctx->currentLayerCopy = targetLayer->flattened();
-            }
-            sourceLayer = ctx->currentLayerCopy.get();
+            sourceLayer = getTransformSource(ctx);
         }
         else
         {
@@ -1378,7 +1424,8 @@ void CanvasWidget::translateCurrentLayer(int x,  int y)
     else
     {
         currentLayer = layerFromAbsoluteIndex(&ctx->layers, ctx->currentLayer);
-        sourceLayer = ctx->currentLayerCopy.get();
+        // Groups are transformed directly and don't need a source
+        sourceLayer = currentLayer->type == LayerType::Layer ? getTransformSource(ctx) : nullptr;
     }
 
     if (currentLayer->type == LayerType::Layer)
@@ -1452,12 +1499,7 @@ void CanvasWidget::updateLayerTransform(QMatrix matrix)
         if (!ctx->quickmask->visible)
         {
             targetLayer = layerFromAbsoluteIndex(&ctx->layers, ctx->currentLayer);
-            if (!ctx->currentLayerCopy)
-            {
-                // If the current layer is a group generate a cached rendering of it
-                ctx->currentLayerCopy = targetLayer->flattened();
-            }
-            sourceLayer = ctx->currentLayerCopy.get();
+            sourceLayer = getTransformSource(ctx);
         }
         else
         {
@@ -1498,7 +1540,8 @@ void CanvasWidget::transformCurrentLayer(QMatrix const &matrix)
     else
     {
         currentLayer = layerFromAbsoluteIndex(&ctx->layers, ctx->currentLayer);
-        sourceLayer = ctx->currentLayerCopy.get();
+        // Groups are transformed directly and don't need a source
+        sourceLayer = currentLayer->type == LayerType::Layer ? getTransformSource(ctx) : nullptr;
     }
 
     if (currentLayer->type == LayerType::Layer)
@@ -1569,7 +1612,7 @@ void CanvasWidget::resetCurrentLayer(CanvasContext *ctx, int index)
     d->updateEditable(ctx);
 
     if(currentLayerObj->type == LayerType::Layer)
-        ctx->currentLayerCopy = currentLayerObj->deepCopy();
+        ctx->currentLayerCopy = currentLayerObj->lazyCopy();
     else
         ctx->currentLayerCopy.reset(nullptr);
 }
@@ -2101,6 +2144,7 @@ void CanvasWidget::undo()
                                             &d->canvasFrame,
                                             &d->inactiveFrame);
     d->quickmaskActive = ctx->quickmask->visible;
+    ctx->updateUndoCost(undoEvent.get());
     ctx->redoHistory.push_front(std::move(undoEvent));
 
     if (changedBackground)
@@ -2145,6 +2189,7 @@ void CanvasWidget::redo()
                                             &d->canvasFrame,
                                             &d->inactiveFrame);
     d->quickmaskActive = ctx->quickmask->visible;
+    ctx->updateUndoCost(undoEvent.get());
     ctx->undoHistory.push_front(std::move(undoEvent));
 
     if (changedBackground)
@@ -2207,6 +2252,56 @@ void CanvasWidget::setSynchronous(bool synced)
     return d->eventThread.setSynchronous(synced);
 }
 
+CanvasWidget::UndoUsage CanvasWidget::getUndoUsage()
+{
+    Q_D(CanvasWidget);
+
+    // Don't wait for the event thread, the last known usage is close enough
+    if (CanvasContext *ctx = getContextMaybe())
+    {
+        d->lastUndoUsage.steps = ctx->undoHistory.size();
+        d->lastUndoUsage.deviceBytes = ctx->undoCost.deviceBytes;
+        d->lastUndoUsage.totalBytes = ctx->undoCost.total();
+    }
+
+    return d->lastUndoUsage;
+}
+
+CanvasWidget::StrokeEventStats CanvasWidget::getStrokeEventStats()
+{
+    CanvasContext *ctx = getContext();
+
+    StrokeEventStats result;
+    result.processed = ctx->strokeEventsProcessed;
+    result.coalesced = ctx->strokeEventsCoalesced;
+    result.dropped = ctx->strokeEventsDropped;
+
+    return result;
+}
+
+void CanvasWidget::resetStrokeEventStats()
+{
+    CanvasContext *ctx = getContext();
+
+    ctx->strokeEventsProcessed = 0;
+    ctx->strokeEventsCoalesced = 0;
+    ctx->strokeEventsDropped = 0;
+}
+
+void CanvasWidget::notifyWhenProcessed(std::function<void()> callback)
+{
+    Q_D(CanvasWidget);
+
+    d->eventThread.enqueueCommand([callback](CanvasContext *) {
+        callback();
+    });
+}
+
+bool CanvasWidget::isReady()
+{
+    return context != nullptr;
+}
+
 std::vector<CanvasStrokePoint> CanvasWidget::getLastStrokeData()
 {
     Q_D(CanvasWidget);
@@ -2243,9 +2338,21 @@ void CanvasWidget::pickColorAt(QPoint pos, bool merged)
         offset *= sizeof(float) * 4;
 
         float data[4];
-        clEnqueueReadBuffer(SharedOpenCL::getSharedOpenCL()->cmdQueue, tile->unmapHost(), CL_TRUE,
+
+        if (SharedOpenCL::getSharedOpenCL()->native)
+        {
+            memcpy(data, tile->mapHost() + offset / sizeof(float), sizeof(float) * 4);
+            if (data[3] > 0.0f)
+                setToolColor(QColor::fromRgbF(data[0], data[1], data[2]));
+            return;
+        }
+
+        cl_mem tileMem = tile->unmapHost();
+        CLDependencies deps;
+        deps.add(tile->eventSlot());
+        clEnqueueReadBuffer(SharedOpenCL::getSharedOpenCL()->cmdQueue, tileMem, CL_TRUE,
                             offset, sizeof(float) * 4, data,
-                            0, nullptr, nullptr);
+                            deps.count(), deps.waitList(), deps.event("readBuffer"));
 
         if (data[3] > 0.0f)
             setToolColor(QColor::fromRgbF(data[0], data[1], data[2]));
@@ -2775,7 +2882,7 @@ void CanvasWidget::cancelCanvasAction()
         CanvasLayer *targetLayer, *undoLayer;
         getPaintingTargets(ctx, targetLayer, undoLayer);
 
-        targetLayer->takeTiles(undoLayer->deepCopy().get());
+        revertToUndoLayer(targetLayer, undoLayer);
 
         tileSetInsert(ctx->dirtyTiles, ctx->strokeModifiedTiles);
         ctx->strokeModifiedTiles.clear();
@@ -2798,7 +2905,7 @@ void CanvasWidget::cancelCanvasAction()
 
         if (targetLayer->type == LayerType::Layer)
         {
-            targetLayer->takeTiles(undoLayer->deepCopy().get());
+            revertToUndoLayer(targetLayer, undoLayer);
             tileSetInsert(ctx->dirtyTiles, undoLayer->getTileSet());
         }
         else if (targetLayer->type == LayerType::Group)
@@ -3243,7 +3350,7 @@ namespace {
     }
 }
 
-void CanvasWidget::openORA(QString path)
+void CanvasWidget::openDocument(QString path)
 {
     Q_D(CanvasWidget);
 
@@ -3257,7 +3364,10 @@ void CanvasWidget::openORA(QString path)
     ctx->clearUndoHistory();
     ctx->clearRedoHistory();
     render->clearTiles();
-    loadStackFromORA(&ctx->layers, &newFrame, path);
+    if (isTSDPath(path))
+        loadStackFromTSD(&ctx->layers, &newFrame, path);
+    else
+        loadStackFromORA(&ctx->layers, &newFrame, path);
     ctx->resetQuickmask();
     lastNewLayerNumber = findHighestLayerNumber(ctx->layers.layers, layerNameReg);
     resetCurrentLayer(ctx, 0); // Sync up the undo layer
@@ -3272,10 +3382,18 @@ void CanvasWidget::openORA(QString path)
     emit updateLayers();
 }
 
-void CanvasWidget::openImage(QImage image)
+bool CanvasWidget::openImage(QString const &path)
 {
     Q_D(CanvasWidget);
 
+    QSize imageSize;
+    std::unique_ptr<CanvasLayer> imported = layerFromFile(path, &imageSize);
+    if (!imported)
+    {
+        qWarning() << "Failed to load" << path;
+        return false;
+    }
+
     if (action != CanvasAction::None)
         cancelCanvasAction();
 
@@ -3289,17 +3407,9 @@ void CanvasWidget::openImage(QImage image)
     ctx->resetQuickmask();
     CanvasLayer *imageLayer = new CanvasLayer(QString().sprintf("Layer %02d", ++lastNewLayerNumber));
     ctx->layers.layers.append(imageLayer);
-    if (image.isNull())
-    {
-        qWarning() << "CanvasWidget::openImage called with a null image";
-    }
-    else
-    {
-        std::unique_ptr<CanvasLayer> imported = layerFromImage(image);
-        imageLayer->takeTiles(imported.get());
-    }
+    imageLayer->takeTiles(imported.get());
     resetCurrentLayer(ctx, 0); // Sync up the undo layer
-    d->inactiveFrame = QRect(QPoint(0, 0), image.size());
+    d->inactiveFrame = QRect(QPoint(0, 0), imageSize);
     d->canvasFrame = {};
     setViewTransform({d->viewTransform.scale, 0.0f, false, false});
     canvasOrigin = QPoint(0, 0);
@@ -3307,9 +3417,10 @@ void CanvasWidget::openImage(QImage image)
     update();
     modified = false;
     emit updateLayers();
+    return true;
 }
 
-void CanvasWidget::saveAsORA(QString path)
+void CanvasWidget::saveDocument(QString path)
 {
     Q_D(CanvasWidget);
 
@@ -3331,7 +3442,10 @@ void CanvasWidget::saveAsORA(QString path)
         dialog.setValue(qBound<int>(1, percent, 99));
     };
 
-    saveStackAs(&ctx->layers, d->canvasFrame, path, callback);
+    if (isTSDPath(path))
+        saveStackAsTSD(&ctx->layers, d->canvasFrame, path, callback);
+    else
+        saveStackAs(&ctx->layers, d->canvasFrame, path, callback);
 
     dialog.close();
 
@@ -1,6 +1,7 @@
 #ifndef CANVASWIDGET_H
 #define CANVASWIDGET_H
 
+#include <functional>
 #include <memory>
 #include <QGLWidget>
 #include <QInputEvent>
@@ -113,10 +114,37 @@ public:
 
     std::vector<CanvasStrokePoint> getLastStrokeData();
 
+    struct UndoUsage
+    {
+        int steps = 0;
+        quint64 deviceBytes = 0;
+        quint64 totalBytes = 0;
+    };
+
+    /* The size of the undo history, may be out of date while the event thread is busy */
+    UndoUsage getUndoUsage();
+
+    struct StrokeEventStats
+    {
+        quint64 processed = 0;
+        quint64 coalesced = 0;
+        quint64 dropped = 0;
+    };
+
+    /* Counts of strokeTo events handled by the event thread since the last reset */
+    StrokeEventStats getStrokeEventStats();
+    void resetStrokeEventStats();
+    /* Call callback from the event thread once every command queued before it has run */
+    void notifyWhenProcessed(std::function<void()> callback);
+    /* False until the GL context exists and the event thread has started */
+    bool isReady();
+
     int getActiveLayer();
     void setActiveLayer(int layerIndex);
     void addLayerAbove(int layerIndex);
     void addLayerAbove(int layerIndex, QImage image, QString name);
+    /* Import the image file at path as a new layer, returns false if it couldn't be read */
+    bool addLayerAbove(int layerIndex, QString const &path);
     void addGroupAbove(int layerIndex);
     void removeLayer(int layerIndex);
     void duplicateLayer(int layerIndex);
@@ -155,9 +183,11 @@ public:
     void scaleMode();
 
     void newDrawing();
-    void openORA(QString path);
-    void openImage(QImage image);
-    void saveAsORA(QString path);
+    /* Open an ORA or TileShadow document */
+    void openDocument(QString path);
+    bool openImage(QString const &path);
+    /* Save as ORA or a TileShadow document depending on the extension */
+    void saveDocument(QString path);
     QImage asImage();
 
     BoxcarTimer mouseEventRate;
@@ -79,4 +79,17 @@ DeviceSelectDialog::DeviceSelectDialog(QWidget *parent) :
         });
         layout->addWidget(button);
     }
+
+    layout->addWidget(new QLabel("Without OpenCL:"));
+
+    {
+        QPushButton *button = new QPushButton("Native CPU");
+        button->setStyleSheet("text-align: left");
+        button->setAutoDefault(false);
+        connect(button, &QPushButton::clicked, [this]() {
+           QSettings().setValue("OpenCL/Device", QVariant::fromValue<int>(SharedOpenCL::NativeDevice));
+           this->accept();
+        });
+        layout->addWidget(button);
+    }
 }
@@ -1,5 +1,7 @@
 #include "gradienttool.h"
+#include "nativekernels.h"
 #include <cmath>
+#include <vector>
 
 class GradientToolPrivate
 {
@@ -80,31 +82,63 @@ TileSet GradientStrokeContext::strokeTo(QPointF point, float pressure, float dt)
 {
     end = point.toPoint();
     auto opencl = SharedOpenCL::getSharedOpenCL();
-    cl_kernel kernel = opencl->gradientApply;
-    const size_t workSize[2] = CL_DIM2(TILE_PIXEL_HEIGHT, TILE_PIXEL_WIDTH);
 
     float dx = end.x() - start.x();
     float dy = end.y() - start.y();
     float denom = dx * dx + dy * dy;
+
+    if (opencl->native)
+    {
+        const float nativeColor[4] = {(float)color.redF(), (float)color.greenF(), (float)color.blueF(), 1.0f};
+        std::vector<std::pair<QPoint, CanvasTile *>> srcTiles;
+        std::vector<CanvasTile *> dstTiles;
+
+        // The destination is opened first so a lazy source captures the tile before it changes
+        for (QPoint const &tileIdx: srcLayer->getTileSet())
+        {
+            dstTiles.push_back(layer->getTile(tileIdx.x(), tileIdx.y()));
+            srcTiles.push_back({tileIdx, srcLayer->getTileMaybe(tileIdx.x(), tileIdx.y())});
+        }
+
+        NativeKernels::parallelFor(srcTiles.size(), [&](int i) {
+            QPoint const &tileIdx = srcTiles[i].first;
+            NativeKernels::gradientApply(srcTiles[i].second->mapHost(), dstTiles[i]->mapHost(),
+                                         tileIdx.x() * TILE_PIXEL_WIDTH - start.x(),
+                                         tileIdx.y() * TILE_PIXEL_HEIGHT - start.y(),
+                                         dx / denom, dy / denom, nativeColor);
+        });
+
+        return layer->getTileSet();
+    }
+
+    cl_kernel kernel = opencl->gradientApply;
+    const size_t workSize[2] = CL_DIM2(TILE_PIXEL_HEIGHT, TILE_PIXEL_WIDTH);
+
     clSetKernelArg<cl_float2>(kernel, 3, {dx / denom, dy / denom});
     clSetKernelArg<cl_float4>(kernel, 4, {(float)color.redF(), (float)color.greenF(), (float)color.blueF(), 1.0f});
 
-    for (auto &iter: *(srcLayer->tiles))
+    for (QPoint const &tileIdx: srcLayer->getTileSet())
     {
-        QPoint const &tileIdx = iter.first;
-        CanvasTile *srcTile = iter.second.get();
         CanvasTile *dstTile = layer->getTile(tileIdx.x(), tileIdx.y());
+        CanvasTile *srcTile = srcLayer->getTileMaybe(tileIdx.x(), tileIdx.y());
 
         cl_int originX = tileIdx.x() * TILE_PIXEL_WIDTH;
         cl_int originY = tileIdx.y() * TILE_PIXEL_HEIGHT;
 
-        clSetKernelArg<cl_mem>(kernel, 0, srcTile->unmapHost());
-        clSetKernelArg<cl_mem>(kernel, 1, dstTile->unmapHost());
+        cl_mem srcMem = srcTile->unmapHost();
+        cl_mem dstMem = dstTile->unmapHost();
+
+        CLDependencies deps;
+        deps.add(srcTile->eventSlot()).add(dstTile->eventSlot());
+
+        clSetKernelArg<cl_mem>(kernel, 0, srcMem);
+        clSetKernelArg<cl_mem>(kernel, 1, dstMem);
         clSetKernelArg<cl_int2>(kernel, 2, {originX - start.x(), originY - start.y()});
         clEnqueueNDRangeKernel(opencl->cmdQueue,
                                kernel, 2,
-                               nullptr, workSize, nullptr,
-                               0, nullptr, nullptr);
+                               nullptr, workSize,
+                               opencl->localWorkSize(kernel, 2, workSize).get(),
+                               deps.count(), deps.waitList(), deps.event(kernel));
     }
 
     return layer->getTileSet();
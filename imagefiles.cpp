@@ -1,8 +1,12 @@
 #include "imagefiles.h"
 #include "canvastile.h"
 #include "canvaslayer.h"
+#include "pngstream.h"
 #include <QImage>
+#include <QFile>
 #include <QDebug>
+#include <algorithm>
+#include <cstring>
 
 QImage stackToImage(CanvasStack *stack, QRect frame)
 {
@@ -184,3 +188,87 @@ std::unique_ptr<CanvasLayer> layerFromImage(QImage image)
 
     return result;
 }
+
+std::unique_ptr<CanvasLayer> layerFromPNG(QIODevice *device, QSize *size)
+{
+    PNGStreamReader reader(device);
+    if (!reader.isValid())
+        return nullptr;
+
+    const int width = reader.width();
+    const int height = reader.height();
+    const int tileCount = (width + TILE_PIXEL_WIDTH - 1) / TILE_PIXEL_WIDTH;
+    const size_t rowStride = size_t(width) * 4;
+
+    // One row of tiles, the rows past the bottom of the image stay zero. The reader
+    // refuses widths too large for this, leaving those images to QImage.
+    std::unique_ptr<float[]> rows(new float[rowStride * TILE_PIXEL_HEIGHT]());
+    std::unique_ptr<CanvasLayer> result(new CanvasLayer(""));
+
+    for (int y = 0; y < height; y += TILE_PIXEL_HEIGHT)
+    {
+        int rowCount = std::min(TILE_PIXEL_HEIGHT, height - y);
+        if (!reader.readRows(rows.get(), rowCount))
+            return nullptr;
+        if (rowCount < TILE_PIXEL_HEIGHT)
+            memset(rows.get() + rowStride * rowCount, 0, sizeof(float) * rowStride * (TILE_PIXEL_HEIGHT - rowCount));
+
+        for (int ix = 0; ix < tileCount; ++ix)
+        {
+            const int x = ix * TILE_PIXEL_WIDTH;
+            const int columns = std::min(TILE_PIXEL_WIDTH, width - x);
+            const float *src = rows.get() + x * 4;
+
+            bool realPixels = false;
+            for (int row = 0; row < rowCount && !realPixels; ++row)
+            {
+                const float *inPtr = src + rowStride * row;
+                for (int i = 0; i < columns * 4; ++i)
+                    if (inPtr[i] != 0.0f)
+                    {
+                        realPixels = true;
+                        break;
+                    }
+            }
+
+            // Transparent tiles are never allocated
+            if (!realPixels)
+                continue;
+
+            float *outPtr = result->openTileAt(ix, y / TILE_PIXEL_HEIGHT);
+            for (int row = 0; row < TILE_PIXEL_HEIGHT; ++row)
+            {
+                float *outRow = outPtr + row * TILE_PIXEL_WIDTH * 4;
+                memcpy(outRow, src + rowStride * row, sizeof(float) * columns * 4);
+                if (columns < TILE_PIXEL_WIDTH)
+                    memset(outRow + columns * 4, 0, sizeof(float) * (TILE_PIXEL_WIDTH - columns) * 4);
+            }
+        }
+    }
+
+    if (size)
+        *size = QSize(width, height);
+
+    return result;
+}
+
+std::unique_ptr<CanvasLayer> layerFromFile(QString const &path, QSize *size)
+{
+    QFile file(path);
+    if (file.open(QIODevice::ReadOnly))
+    {
+        std::unique_ptr<CanvasLayer> result = layerFromPNG(&file, size);
+        if (result)
+            return result;
+    }
+
+    // Not a PNG, or one the stream reader doesn't handle
+    QImage image(path);
+    if (image.isNull())
+        return nullptr;
+
+    if (size)
+        *size = image.size();
+
+    return layerFromImage(image);
+}
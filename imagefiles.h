@@ -3,9 +3,14 @@
 
 #include "canvasstack.h"
 #include <QImage>
+#include <QIODevice>
 
 QImage stackToImage(CanvasStack *stack, QRect frame = {});
 QImage layerToImage(CanvasLayer *layer);
 std::unique_ptr<CanvasLayer> layerFromImage(QImage image);
+/* Decode a PNG straight into tiles, returns null if the file can't be streamed */
+std::unique_ptr<CanvasLayer> layerFromPNG(QIODevice *device, QSize *size = nullptr);
+/* Load any image QImage can read, PNGs are streamed with layerFromPNG. Returns null on failure. */
+std::unique_ptr<CanvasLayer> layerFromFile(QString const &path, QSize *size = nullptr);
 
 #endif // IMAGEFILES_H
@@ -8,6 +8,9 @@
 #include "nativeeventfilter.h"
 #include "deviceselectdialog.h"
 #include "batchprocessor.h"
+#include "strokereplay.h"
+#include "benchmarksuite.h"
+#include "canvaswidget-opencl.h"
 #ifdef Q_OS_MAC
 #include "machelpers.h"
 #endif
@@ -39,31 +42,92 @@ int main(int argc, char *argv[])
     QCommandLineParser parser;
     QCommandLineOption batchFile("batch", "Command file to execute", "batchfile");
     parser.addOption(batchFile);
+    QCommandLineOption nativeBackend("native", "Run without OpenCL using the native CPU backend");
+    parser.addOption(nativeBackend);
+    QCommandLineOption autotune("autotune", "Find the fastest OpenCL work group sizes for the selected device before starting");
+    parser.addOption(autotune);
+    QCommandLineOption profileFile("profile", "Enable OpenCL profiling and write the batch profile to a JSON file (\"-\" for stdout)", "jsonfile");
+    parser.addOption(profileFile);
+    QCommandLineOption benchmarkSuite("benchmark", "Run a benchmark suite (" + BenchmarkSuite::suiteNames().join(", ") + ") and write the results as JSON to stdout", "suite");
+    parser.addOption(benchmarkSuite);
+    QCommandLineOption benchmarkOutput("benchmark-output", "Write the --benchmark results to a JSON file instead of stdout", "jsonfile");
+    parser.addOption(benchmarkOutput);
+    QCommandLineOption replayFile("replay", "Replay recorded strokes on a new canvas, write a JSON report to stdout and exit", "strokefile");
+    parser.addOption(replayFile);
+    QCommandLineOption replayMode("replay-mode", "Pacing for --replay: realtime, fast (default) or sync", "mode", "fast");
+    parser.addOption(replayMode);
+    QCommandLineOption replayTool("replay-tool", "Tool to use for --replay instead of the default", "tool");
+    parser.addOption(replayTool);
+    QCommandLineOption replayImage("replay-image", "Save the final --replay image as a PNG", "pngfile");
+    parser.addOption(replayImage);
+    QCommandLineOption replayReference("replay-reference", "Compare the final --replay image with a PNG, e.g. one saved with --native, and fail if they differ", "pngfile");
+    parser.addOption(replayReference);
+    QCommandLineOption replayTolerance("replay-tolerance", "Largest per channel difference --replay-reference allows, in 8 bit levels (default 2)", "levels", "2");
+    parser.addOption(replayTolerance);
 
     parser.process(a);
     QString batchFilePath = parser.value(batchFile);
 
+    if (parser.isSet(profileFile))
+        SharedOpenCL::requestProfiling();
+
+    if (parser.isSet(nativeBackend))
+        SharedOpenCL::requestNative();
+
     std::unique_ptr<MainWindow> w;
-    if (!batchFilePath.isEmpty())
+    if (parser.isSet(benchmarkSuite))
+    {
+        if (parser.isSet(autotune))
+            WorkGroupTuner::tune(SharedOpenCL::getSharedOpenCL());
+
+        BenchmarkSuite *benchmark = new BenchmarkSuite();
+        benchmark->outputPath = parser.value(benchmarkOutput);
+        QMetaObject::invokeMethod(benchmark, "execute", Qt::QueuedConnection, Q_ARG(QString, parser.value(benchmarkSuite)));
+    }
+    else if (!batchFilePath.isEmpty())
     {
+        if (parser.isSet(autotune))
+            WorkGroupTuner::tune(SharedOpenCL::getSharedOpenCL());
+
         BatchProcessor *batch = new BatchProcessor();
+        batch->profileOutputPath = parser.value(profileFile);
         QMetaObject::invokeMethod(batch, "execute", Qt::QueuedConnection, Q_ARG(QString, batchFilePath));
     }
     else
     {
         bool deviceValid = false;
         appSettings.value("OpenCL/Device").toString().toInt(&deviceValid);
-        if ((!deviceValid) ||
-            (a.queryKeyboardModifiers() & Qt::ShiftModifier))
+        if (!parser.isSet(nativeBackend) &&
+            ((!deviceValid) ||
+             (a.queryKeyboardModifiers() & Qt::ShiftModifier)))
         {
             DeviceSelectDialog().exec();
         }
 
+        if (parser.isSet(autotune))
+            WorkGroupTuner::tune(SharedOpenCL::getSharedOpenCL());
+
         w.reset(new MainWindow());
         w->show();
 
-        if (!parser.positionalArguments().empty())
+        if (parser.isSet(replayFile))
+        {
+            StrokeReplay *replay = new StrokeReplay(w->getCanvas(), w.get());
+            if (!StrokeReplay::modeFromString(parser.value(replayMode), &replay->mode))
+            {
+                qWarning() << "Invalid replay mode" << parser.value(replayMode);
+                return 1;
+            }
+            replay->toolPath = parser.value(replayTool);
+            replay->imageOutputPath = parser.value(replayImage);
+            replay->referencePath = parser.value(replayReference);
+            replay->referenceTolerance = parser.value(replayTolerance).toInt();
+            QMetaObject::invokeMethod(replay, "execute", Qt::QueuedConnection, Q_ARG(QString, parser.value(replayFile)));
+        }
+        else if (!parser.positionalArguments().empty())
+        {
             w->openFileRequest(parser.positionalArguments().at(0));
+        }
     }
 
 #ifdef USE_NATIVE_EVENT_FILTER
@@ -18,6 +18,8 @@
 #include <QClipboard>
 #include <QMimeData>
 #include "canvastile.h"
+#include "canvaslayer.h"
+#include "mypaintstrokecontext.h"
 #include "hsvcolordial.h"
 #include "toolfactory.h"
 #include "toolsettingswidget.h"
@@ -26,6 +28,7 @@
 #include "deviceselectdialog.h"
 #include "userpathsdialog.h"
 #include "filedialog.h"
+#include "tsdfile.h"
 
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
@@ -156,6 +159,8 @@ void MainWindow::connectActions()
 
     // System
     connect(ui->actionCircle_Benchmark, &QAction::triggered, this, &MainWindow::runCircleBenchmark);
+    connect(ui->actionColor_Query_Benchmark, &QAction::triggered, this, &MainWindow::runColorQueryBenchmark);
+    connect(ui->actionTune_Work_Group_Sizes, &QAction::triggered, this, &MainWindow::runWorkGroupTuner);
     connect(ui->actionCopy_Stroke_Data, &QAction::triggered, this, &MainWindow::actionCopyStrokeData);
     connect(ui->actionSelect_OpenCL_Device, &QAction::triggered, this, &MainWindow::showDeviceSelect);
     connect(ui->actionShow_OpenCL_Information, &QAction::triggered, this, &MainWindow::showOpenCLInfo);
@@ -271,6 +276,10 @@ void MainWindow::updateStatus()
 
     message += " Tiles: " + QString::number(deviceAllocated) + "MB + " + QString::number(allocated) + "MB";
 
+    CanvasWidget::UndoUsage undoUsage = canvas->getUndoUsage();
+    message += " Undo: " + QString::number(undoUsage.steps) + " steps " +
+               QString::number(undoUsage.totalBytes / (1024 * 1024)) + "MB";
+
     statusBarLabel->setText(message);
 }
 
@@ -348,7 +357,7 @@ namespace {
         if (!urls.isEmpty() && urls.at(0).isLocalFile())
         {
             QString path = urls.at(0).toLocalFile();
-            if (path.endsWith(".ora"))
+            if (path.endsWith(".ora") || isTSDPath(path))
                 return true;
             for (auto const &readerFormat: QImageReader::supportedImageFormats())
                 if (path.endsWith(QStringLiteral(".") + readerFormat))
@@ -447,6 +456,7 @@ void MainWindow::actionOpenFile()
         return;
 
     QStringList importWildcards;
+    importWildcards.append("*.tsd");
     importWildcards.append("*.ora");
 
     for (auto const &readerFormat: QImageReader::supportedImageFormats())
@@ -464,18 +474,16 @@ void MainWindow::openFile(QString const &filename)
     if (filename.isEmpty())
         return;
 
-    if (filename.endsWith(".ora"))
+    if (filename.endsWith(".ora") || isTSDPath(filename))
     {
-        canvas->openORA(filename);
+        canvas->openDocument(filename);
         setWindowFilePath(filename);
         updateTitle();
     }
     else
     {
-        QImage image(filename);
-        if (!image.isNull())
+        if (canvas->openImage(filename))
         {
-            canvas->openImage(image);
             setWindowFilePath("");
             updateTitle();
         }
@@ -494,13 +502,7 @@ void MainWindow::actionOpenAsLayer()
     QString filename = FileDialog::getOpenFileName(this, "Open", QDir::homePath(), formats);
 
     if (!filename.isEmpty())
-    {
-        QImage image(filename);
-        if (!image.isNull())
-        {
-            canvas->addLayerAbove(canvas->getActiveLayer(), image, QFileInfo(filename).fileName());
-        }
-    }
+        canvas->addLayerAbove(canvas->getActiveLayer(), filename);
 }
 
 void MainWindow::actionSave()
@@ -516,14 +518,14 @@ bool MainWindow::doSave(QString filename)
         if (!windowFilePath().isEmpty())
             saveDirectory = QFileInfo(windowFilePath()).dir().path();
         filename = FileDialog::getSaveFileName(this, "Save As...",
-                                               saveDirectory + QDir::toNativeSeparators("/untitled.ora"),
-                                               "OpenRaster (*.ora)");
+                                               saveDirectory + QDir::toNativeSeparators("/untitled.tsd"),
+                                               "TileShadow Document (*.tsd);;OpenRaster (*.ora)");
 
         if (filename.isEmpty())
             return false;
     }
 
-    canvas->saveAsORA(filename);
+    canvas->saveDocument(filename);
     setWindowFilePath(filename);
     updateTitle();
 
@@ -827,13 +829,101 @@ double drawBenchmarkCircle(CanvasWidget *canvas, float radius, float centerX, fl
         canvas->strokeTo(QPointF(cosf(currentAngle) * radius + centerX, sinf(currentAngle) * radius + centerY), 1.0f, 1000.0f / 60.0f);
     }
     canvas->endStroke();
-    clFinish(SharedOpenCL::getSharedOpenCL()->cmdQueue);
+    if (!SharedOpenCL::getSharedOpenCL()->native)
+        clFinish(SharedOpenCL::getSharedOpenCL()->cmdQueue);
     double runTime = timer.elapsed();
     canvas->setSynchronous(savedSync);
 
     return runTime;
 }
 
+/* Smudge color queries per second at radius, against a layer painted everywhere
+ * the sample can reach so that no tile is skipped as empty.
+ */
+double benchmarkColorQueries(float radius)
+{
+    CanvasLayer layer;
+    const int tileRadius = tile_indice(int(radius) + 2, TILE_PIXEL_WIDTH) + 1;
+    for (int iy = -tileRadius; iy <= tileRadius; ++iy)
+        for (int ix = -tileRadius; ix <= tileRadius; ++ix)
+            layer.getTile(ix, iy)->fill(0.25f, 0.5f, 0.75f, 1.0f);
+
+    MyPaintStrokeContext stroke(&layer, &layer);
+    float color[4];
+
+    // Build the kernels before timing
+    stroke.sampleColor(QPointF(0.0f, 0.0f), radius, color);
+
+    QElapsedTimer timer;
+    int queries = 0;
+
+    timer.start();
+    while (timer.elapsed() < 250)
+    {
+        for (int i = 0; i < 16; ++i, ++queries)
+            stroke.sampleColor(QPointF(queries % 7, queries % 5), radius, color);
+    }
+
+    return queries * 1000.0 / timer.elapsed();
+}
+
+void MainWindow::runColorQueryBenchmark()
+{
+    QString outputText;
+
+    setEnabled(false);
+    QApplication::setOverrideCursor(Qt::WaitCursor);
+    bool savedSync = canvas->getSynchronous();
+    canvas->setSynchronous(true);
+
+    for (float radius: {1.0f, 4.0f, 16.0f, 64.0f, 256.0f})
+    {
+        double rate = benchmarkColorQueries(radius);
+
+        qDebug() << "Color query radius" << radius << rate << "queries/s";
+        outputText += QString().sprintf("Radius %g\t%.0f queries/s\n", radius, rate);
+        QCoreApplication::processEvents();
+    }
+
+    canvas->setSynchronous(savedSync);
+    QApplication::restoreOverrideCursor();
+    setEnabled(true);
+
+    QMessageBox resultBox(this);
+    resultBox.setWindowTitle("Color Query Benchmark");
+    resultBox.setText(outputText);
+    resultBox.exec();
+}
+
+void MainWindow::runWorkGroupTuner()
+{
+    SharedOpenCL *opencl = SharedOpenCL::getSharedOpenCL();
+
+    if (opencl->native)
+    {
+        QMessageBox::information(this, "Tune Work Group Sizes",
+                                 "The native backend does not use OpenCL work groups.");
+        return;
+    }
+
+    QString outputText;
+
+    setEnabled(false);
+    QApplication::setOverrideCursor(Qt::WaitCursor);
+    WorkGroupTuner::tune(opencl, [&outputText](QString const &line) {
+        outputText += line + "\n";
+        QCoreApplication::processEvents();
+    });
+    QApplication::restoreOverrideCursor();
+    setEnabled(true);
+
+    QMessageBox resultBox(this);
+    resultBox.setWindowTitle("Tune Work Group Sizes");
+    resultBox.setText("The work group sizes for this device have been saved.");
+    resultBox.setDetailedText(outputText);
+    resultBox.exec();
+}
+
 void MainWindow::runCircleBenchmark()
 {
     if (benchmarkWindow.isNull())
@@ -854,6 +944,7 @@ void MainWindow::runCircleBenchmark()
 
     double totalTime = 0.0;
     double totalPoints = 0.0;
+    quint64 totalDabs = 0;
     int numRuns = 0;
     int localRuns = 0;
     double lastAverage = 0.0;
@@ -876,7 +967,9 @@ void MainWindow::runCircleBenchmark()
 
     while (true)
     {
+        quint64 startDabs = MyPaintStrokeContext::totalDabCount();
         double runTime = drawBenchmarkCircle(canvas, radius, centerX, centerY, runPoints);
+        totalDabs += MyPaintStrokeContext::totalDabCount() - startDabs;
         totalTime += runTime;
         totalPoints += runPoints;
         numRuns += 1;
@@ -910,6 +1003,9 @@ void MainWindow::runCircleBenchmark()
     qDebug() << "Benchmark" << lastAverage << "ms";
     outputText += "======\n";
     outputText += QString().sprintf("Average\t%.4fms", lastAverage);
+    // Only MyPaint brushes count dabs
+    if (totalDabs > 0 && totalTime > 0.0)
+        outputText += QString().sprintf("\nDabs\t%.0f/s", totalDabs * 1000.0 / totalTime);
 
     benchmarkWindow->setOutputText(outputText);
     canvas->setUpdatesEnabled(true);
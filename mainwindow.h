@@ -22,6 +22,8 @@ public:
     explicit MainWindow(QWidget *parent = 0);
     ~MainWindow();
 
+    CanvasWidget *getCanvas() { return canvas; }
+
     bool eventFilter(QObject *obj, QEvent *event);
 
     void closeEvent(QCloseEvent *event);
@@ -54,6 +56,8 @@ public slots:
     void showDeviceSelect();
     void showResourcePaths();
     void runCircleBenchmark();
+    void runColorQueryBenchmark();
+    void runWorkGroupTuner();
     void actionCopyStrokeData();
     void actionQuit();
     void actionNewFile();
@@ -1,21 +1,90 @@
 #include "maskbuffer.h"
 #include "lodepng.h"
 #include <qmath.h>
+#include <QCryptographicHash>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MASK_BUFFER_SSE
+#include <emmintrin.h>
+#endif
 
 MaskBuffer::MaskBuffer(QImage const &image)
 {
     bounds = image.size();
     data.reset(new uint8_t[bounds.width() * bounds.height()]);
 
+    // Format_ARGB32 scanlines hold the same values image.pixel() would return
+    QImage argbImage = image.convertToFormat(QImage::Format_ARGB32);
+
     int xEnd = image.width();
     int yEnd = image.height();
     uint8_t *dataPtr = data.get();
 
     for (int iy = 0; iy < yEnd; ++iy)
+    {
+        const QRgb *line = reinterpret_cast<const QRgb *>(argbImage.constScanLine(iy));
         for (int ix = 0; ix < xEnd; ++ix)
+            *dataPtr++ = qGray(line[ix]);
+    }
+
+    updateHash();
+}
+
+void MaskBuffer::updateHash()
+{
+    if (isNull())
+    {
+        hash = QByteArray();
+        return;
+    }
+
+    QCryptographicHash digest(QCryptographicHash::Md5);
+    qint32 size[2] = {bounds.width(), bounds.height()};
+    digest.addData(reinterpret_cast<const char *>(size), sizeof(size));
+    digest.addData(reinterpret_cast<const char *>(data.get()), bounds.width() * bounds.height());
+    hash = digest.result();
+}
+
+/* Downscale by exactly 2x2, each result pixel is the rounded mean of its 4 source
+ * pixels. This is the same value the general downscale computes for even sizes.
+ */
+static void downscaleEven(uint8_t const *src, int srcWidth, uint8_t *dst, int dstWidth, int dstHeight)
+{
+    for (int y = 0; y < dstHeight; ++y)
+    {
+        uint8_t const *row0 = src + srcWidth * (y * 2);
+        uint8_t const *row1 = row0 + srcWidth;
+        uint8_t *out = dst + dstWidth * y;
+        int x = 0;
+
+#ifdef MASK_BUFFER_SSE
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ones = _mm_set1_epi16(1);
+        const __m128i two = _mm_set1_epi32(2);
+
+        for (; x + 8 <= dstWidth; x += 8)
+        {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + x * 2));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + x * 2));
+
+            // Sum the rows as 16 bit values, then sum horizontal pairs as 32 bit values
+            __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+            __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+            __m128i sumLo = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(lo, ones), two), 2);
+            __m128i sumHi = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(hi, ones), two), 2);
+
+            __m128i packed = _mm_packs_epi32(sumLo, sumHi);
+            packed = _mm_packus_epi16(packed, packed);
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(out + x), packed);
+        }
+#endif
+
+        for (; x < dstWidth; ++x)
         {
-            *dataPtr++ = qGray(image.pixel(ix, iy));
+            int sum = row0[x * 2] + row0[x * 2 + 1] + row1[x * 2] + row1[x * 2 + 1];
+            out[x] = (sum + 2) >> 2;
         }
+    }
 }
 
 MaskBuffer MaskBuffer::invert() const
@@ -27,6 +96,7 @@ MaskBuffer MaskBuffer::invert() const
     size_t len = width() * height();
     for (size_t i = 0; i < len; ++i)
         result.data.get()[i] = 0xFF - data.get()[i];
+    result.updateHash();
 
     return result;
 }
@@ -38,6 +108,13 @@ MaskBuffer MaskBuffer::downscale() const
                      (bounds.height() % 2 + bounds.height()) / 2};
     result.data.reset(new uint8_t[result.width() * result.height()]);
 
+    if (bounds.width() % 2 == 0 && bounds.height() % 2 == 0)
+    {
+        downscaleEven(data.get(), width(), result.data.get(), result.width(), result.height());
+        result.updateHash();
+        return result;
+    }
+
     float bin_width = float(bounds.width()) / result.width();
     float bin_height = float(bounds.height()) / result.height();
 
@@ -88,6 +165,7 @@ MaskBuffer MaskBuffer::downscale() const
         }
       y_bin_start += bin_height;
     }
+    result.updateHash();
 
     return result;
 }
@@ -19,14 +19,20 @@ public:
 
     bool isNull() const { return data.get() == nullptr; }
 
+    /* A digest of the size and contents, equal buffers have equal hashes */
+    QByteArray contentHash() const { return hash; }
+
     MaskBuffer invert() const;
     MaskBuffer downscale() const;
     QByteArray toPNG() const;
     QImage     toImage() const;
 
 protected:
+    void updateHash();
+
     QSize bounds;
     std::shared_ptr<uint8_t> data;
+    QByteArray hash;
 };
 
 Q_DECLARE_METATYPE (MaskBuffer)
@@ -1,10 +1,19 @@
 #include "mypaintstrokecontext.h"
 #include "canvastile.h"
+#include "nativekernels.h"
+#include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <vector>
 #include <qmath.h>
 #include <QMatrix>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
 #include <QFile>
 #include <QDebug>
 #include <QColor>
@@ -38,8 +47,9 @@ class CLMaskImage
 public:
     CLMaskImage() : image(0), size(0, 0) {}
     CLMaskImage(cl_mem image, QSize size) : image(image), size(size) {}
-    CLMaskImage(CLMaskImage &from) = delete;
-    CLMaskImage& operator=(CLMaskImage &from) = delete;
+    CLMaskImage(MaskBuffer const &buffer) : image(0), size(buffer.width(), buffer.height()), buffer(buffer) {}
+    CLMaskImage(CLMaskImage const &from);
+    CLMaskImage& operator=(CLMaskImage const &from);
     CLMaskImage(CLMaskImage &&from);
     CLMaskImage& operator=(CLMaskImage &&from);
 
@@ -47,14 +57,30 @@ public:
 
     int width() const { return size.width(); }
     int height() const { return size.height(); }
-    bool isNull() const { return (image == 0); }
+    bool isNull() const { return (image == 0) && buffer.isNull(); }
 
     cl_mem image;
     QSize  size;
+    MaskBuffer buffer; /* Used instead of image by the native backend */
 };
 
+CLMaskImage::CLMaskImage(CLMaskImage const &from)
+    : image(from.image), size(from.size), buffer(from.buffer)
+{
+    if (image)
+        clRetainMemObject(image);
+}
+
+CLMaskImage& CLMaskImage::operator=(CLMaskImage const &from)
+{
+    CLMaskImage copy(from);
+    std::swap(*this, copy);
+
+    return *this;
+}
+
 CLMaskImage::CLMaskImage(CLMaskImage &&from)
-    : image(from.image), size(from.size)
+    : image(from.image), size(from.size), buffer(std::move(from.buffer))
 {
     from.image = 0;
 }
@@ -63,6 +89,7 @@ CLMaskImage& CLMaskImage::operator=(CLMaskImage &&from)
 {
     std::swap(image, from.image);
     std::swap(size, from.size);
+    std::swap(buffer, from.buffer);
 
     return *this;
 }
@@ -73,6 +100,238 @@ CLMaskImage::~CLMaskImage()
         clReleaseMemObject(image);
 }
 
+/* Device images for mask mip chains and textures, shared by every stroke. Entries are
+ * keyed by MaskBuffer::contentHash() so starting a stroke with a brush that was used
+ * before costs no mip generation or uploads. Once more than maxBytes of image data is
+ * cached the least recently used entries are dropped, strokes using them keep their
+ * own references.
+ */
+class MaskImageCache
+{
+public:
+    static MaskImageCache *get();
+
+    std::vector<CLMaskImage> mips(MaskBuffer const &mask);
+    CLMaskImage single(MaskBuffer const &mask);
+
+private:
+    struct Entry
+    {
+        std::vector<CLMaskImage> images;
+        size_t bytes = 0;
+        quint64 lastUse = 0;
+    };
+
+    std::vector<CLMaskImage> find(QByteArray const &key, std::function<MipSet<MaskBuffer>()> const &generate);
+
+    static const size_t maxBytes = 64 * 1024 * 1024;
+
+    QMutex mutex;
+    std::map<QByteArray, Entry> entries;
+    size_t totalBytes = 0;
+    quint64 useCount = 0;
+};
+
+MaskImageCache *MaskImageCache::get()
+{
+    // Never destroyed, the images must not be released after the OpenCL context
+    static MaskImageCache *cache = new MaskImageCache();
+    return cache;
+}
+
+static CLMaskImage uploadMask(MaskBuffer const &mask)
+{
+    SharedOpenCL *opencl = SharedOpenCL::getSharedOpenCL();
+
+    if (opencl->native)
+        return CLMaskImage(mask);
+
+    cl_int err = CL_SUCCESS;
+    cl_image_format fmt = {CL_INTENSITY, CL_UNORM_INT8};
+
+    cl_mem maskImage = cl::createImage2D(opencl, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &fmt,
+                                         mask.width(), mask.height(), 0,
+                                         (void *)mask.constData(), &err);
+    check_cl_error(err);
+
+    if (err != CL_SUCCESS)
+        return CLMaskImage();
+    return CLMaskImage(maskImage, QSize(mask.width(), mask.height()));
+}
+
+std::vector<CLMaskImage> MaskImageCache::mips(MaskBuffer const &mask)
+{
+    if (mask.isNull())
+        return {};
+    return find(mask.contentHash() + "mips", [&mask]() { return mipsFromMask(mask); });
+}
+
+CLMaskImage MaskImageCache::single(MaskBuffer const &mask)
+{
+    if (mask.isNull())
+        return CLMaskImage();
+
+    std::vector<CLMaskImage> images = find(mask.contentHash() + "single", [&mask]() { return singleFromMask(mask); });
+
+    if (images.empty())
+        return CLMaskImage();
+    return images.front();
+}
+
+std::vector<CLMaskImage> MaskImageCache::find(QByteArray const &key, std::function<MipSet<MaskBuffer>()> const &generate)
+{
+    QMutexLocker lock(&mutex);
+
+    auto found = entries.find(key);
+    if (found != entries.end())
+    {
+        found->second.lastUse = ++useCount;
+        return found->second.images;
+    }
+
+    Entry entry;
+    MipSet<MaskBuffer> maskMips = generate();
+    for (auto const &mask: maskMips)
+    {
+        CLMaskImage image = uploadMask(mask);
+        if (image.isNull())
+            break;
+        entry.bytes += mask.width() * mask.height();
+        entry.images.push_back(std::move(image));
+    }
+
+    // Failed uploads aren't cached so they will be retried
+    if (entry.images.empty())
+        return {};
+
+    std::vector<CLMaskImage> result = entry.images;
+    entry.lastUse = ++useCount;
+    totalBytes += entry.bytes;
+    entries[key] = std::move(entry);
+
+    while (totalBytes > maxBytes && entries.size() > 1)
+    {
+        auto oldest = entries.end();
+        for (auto iter = entries.begin(); iter != entries.end(); ++iter)
+            if (iter->first != key && (oldest == entries.end() || iter->second.lastUse < oldest->second.lastUse))
+                oldest = iter;
+
+        totalBytes -= oldest->second.bytes;
+        entries.erase(oldest);
+    }
+
+    return result;
+}
+
+/* Batched dabs, each dab is 4 float4s in the layout read by mypaint_dab_batch. The
+ * spans for each tile are kept in the order the dabs were drawn.
+ */
+struct DabSpan
+{
+    cl_int offset;
+    cl_int width;
+    cl_int height;
+    cl_int dab;
+    float  tileX;
+    float  tileY;
+};
+
+struct DabBatchTile
+{
+    CanvasTile *tile;
+    std::vector<DabSpan> spans;
+};
+
+/* Dabs drawn by every MyPaintStrokeContext, see MyPaintStrokeContext::totalDabCount */
+static std::atomic<quint64> dabCount(0);
+/* The number of dabs drawDabFunction queues before submitting them from DabSubmitThread */
+static const size_t dabPipelineBatchSize = 128;
+
+struct DabBatch
+{
+    std::vector<cl_float4>    dabs;
+    std::vector<DabBatchTile> tiles;
+    CLMaskImage               texture;
+    float                     textureOpacity = 0.0f;
+};
+
+static void submitDabBatch(DabBatch const &batch);
+
+/* Enqueues dab batches in the order they were submitted from a worker thread, so brushlib
+ * can evaluate the next dabs of a stroke while the previous ones are being enqueued.
+ * Only the worker sets the mypaint_dab_batch kernel arguments while it is busy.
+ */
+class DabSubmitThread : public QThread
+{
+public:
+    ~DabSubmitThread();
+
+    void submit(DabBatch &&batch);
+    /* Return once every submitted batch has been enqueued */
+    void waitForIdle();
+
+protected:
+    void run() override;
+
+private:
+    QMutex mutex;
+    QWaitCondition changed;
+    std::deque<DabBatch> pending;
+    bool busy = false;
+    bool stopping = false;
+};
+
+DabSubmitThread::~DabSubmitThread()
+{
+    {
+        QMutexLocker lock(&mutex);
+        stopping = true;
+        changed.wakeAll();
+    }
+    wait();
+}
+
+void DabSubmitThread::submit(DabBatch &&batch)
+{
+    QMutexLocker lock(&mutex);
+    pending.push_back(std::move(batch));
+    if (!isRunning())
+        start();
+    changed.wakeAll();
+}
+
+void DabSubmitThread::waitForIdle()
+{
+    QMutexLocker lock(&mutex);
+    while (busy || !pending.empty())
+        changed.wait(&mutex);
+}
+
+void DabSubmitThread::run()
+{
+    QMutexLocker lock(&mutex);
+
+    while (true)
+    {
+        while (pending.empty() && !stopping)
+            changed.wait(&mutex);
+        // Anything still pending is enqueued before stopping
+        if (pending.empty())
+            break;
+
+        DabBatch batch = std::move(pending.front());
+        pending.pop_front();
+        busy = true;
+
+        lock.unlock();
+        submitDabBatch(batch);
+        lock.relock();
+
+        busy = false;
+        changed.wakeAll();
+    }
+}
+
 class MyPaintStrokeContextPrivate
 {
 public:
@@ -87,7 +346,24 @@ public:
     std::unique_ptr<CanvasLayer> isolateLayer;
     bool                     isolateLockAlpha = false;
     bool                     isolateErase = false;
-
+    /* The part of each isolate tile drawn since it was last composited into the
+     * layer, and the layer tiles that have been composited during this stroke.
+     */
+    std::map<QPoint, QRect, _tilePointCompare> isolateDirty;
+    TileSet                  isolateComposited;
+
+    /* Dabs queued by drawDabFunction when SharedOpenCL::batchDabs is set */
+    std::vector<cl_float4>   batchDabs;
+    std::map<QPoint, DabBatchTile, _tilePointCompare> batchTiles;
+    /* Created on first use when SharedOpenCL::pipelineDabs is set */
+    std::unique_ptr<DabSubmitThread> submitThread;
+
+    cl_int queueDab(NativeKernels::DabParams const &params);
+    DabBatch takeDabs(QRect const &tileRect);
+    /* Hand the queued dabs to submitThread without waiting for them to be enqueued */
+    void submitDabs();
+    /* Draw the queued dabs, or only those on tiles inside tileRect */
+    void flushDabs(QRect const &tileRect = QRect());
     void renderIsolate(CanvasLayer *layer, QPoint p);
 };
 
@@ -151,35 +427,11 @@ void MyPaintStrokeContext::setMasks(const QList<MaskBuffer> &masks)
 {
     priv->masks.clear();
     priv->activeMask = 0;
-    auto opencl = SharedOpenCL::getSharedOpenCL();
 
     for (auto const &baseMask: masks)
     {
         MipSet<CLMaskImage> clMips;
-        MipSet<MaskBuffer> maskMips = mipsFromMask(baseMask);
-
-//        qDebug() << "mips:" << maskMips.mips.size();
-
-        for (auto const mask: maskMips)
-        {
-            cl_int err = CL_SUCCESS;
-            cl_image_format fmt = {CL_INTENSITY, CL_UNORM_INT8};
-
-            cl_mem maskImage = cl::createImage2D(opencl, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &fmt,
-                                                 mask.width(), mask.height(), 0,
-                                                 (void *)mask.constData(), &err);
-            check_cl_error(err);
-
-            if (err == CL_SUCCESS)
-            {
-//                qDebug() << "  loaded:" << mask.width() << mask.height();
-                clMips.mips.emplace_back(maskImage, QSize(mask.width(), mask.height()));
-            }
-            else
-            {
-                break;
-            }
-        }
+        clMips.mips = MaskImageCache::get()->mips(baseMask);
 
         if (!clMips.mips.empty())
             priv->masks.push_back(std::move(clMips));
@@ -191,25 +443,9 @@ void MyPaintStrokeContext::setTexture(const MaskBuffer &texture, float textureOp
     priv->textureOpacity = textureOpacity;
 
     if (texture.isNull())
-    {
         priv->texture = CLMaskImage();
-    }
     else
-    {
-        cl_int err = CL_SUCCESS;
-        cl_image_format fmt = {CL_INTENSITY, CL_UNORM_INT8};
-
-        cl_mem maskImage = cl::createImage2D(SharedOpenCL::getSharedOpenCL(),
-                                             CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &fmt,
-                                             texture.width(), texture.height(), 0,
-                                             (void *)texture.constData(), &err);
-        check_cl_error(err);
-
-        if (err == CL_SUCCESS)
-            priv->texture = CLMaskImage(maskImage, QSize(texture.width(), texture.height()));
-        else
-            priv->texture = CLMaskImage();
-    }
+        priv->texture = MaskImageCache::get()->single(texture);
 }
 
 void MyPaintStrokeContext::setIsolate(bool isolate)
@@ -234,10 +470,22 @@ MyPaintStrokeContext::MyPaintStrokeContext(CanvasLayer *layer, const CanvasLayer
 
 MyPaintStrokeContext::~MyPaintStrokeContext()
 {
+    priv->flushDabs();
     mypaint_brush_unref(priv->brush);
     priv->brush = nullptr;
 }
 
+quint64 MyPaintStrokeContext::totalDabCount()
+{
+    return dabCount;
+}
+
+void MyPaintStrokeContext::sampleColor(QPointF point, float radius, float color[4])
+{
+    getColorFunction(&priv->surface, point.x(), point.y(), radius,
+                     &color[0], &color[1], &color[2], &color[3]);
+}
+
 TileSet MyPaintStrokeContext::startStroke(QPointF point, float pressure)
 {
     mypaint_brush_reset (priv->brush);
@@ -255,6 +503,8 @@ TileSet MyPaintStrokeContext::startStroke(QPointF point, float pressure)
     }
 
     priv->modTiles.clear();
+    priv->isolateDirty.clear();
+    priv->isolateComposited.clear();
     mypaint_brush_stroke_to(priv->brush, &priv->surface,
                             point.x(), point.y(),
                             0.0f /* pressure */, 0.0f /* xtilt */, 0.0f /* ytilt */,
@@ -264,6 +514,7 @@ TileSet MyPaintStrokeContext::startStroke(QPointF point, float pressure)
                             point.x(), point.y(),
                             pressure /* pressure */, 0.0f /* xtilt */, 0.0f /* ytilt */,
                             1.0f / 60.0f /* deltaTime in seconds */);
+    priv->flushDabs();
 
     if (priv->isolateLayer)
         for (auto const &p: priv->modTiles)
@@ -280,6 +531,7 @@ TileSet MyPaintStrokeContext::strokeTo(QPointF point, float pressure, float dt)
                             point.x(), point.y(),
                             pressure /* pressure */, 0.0f /* xtilt */, 0.0f /* ytilt */,
                             dt / 1000.0f /* deltaTime in seconds */);
+    priv->flushDabs();
 
     if (priv->isolateLayer)
         for (auto const &p: priv->modTiles)
@@ -288,39 +540,433 @@ TileSet MyPaintStrokeContext::strokeTo(QPointF point, float pressure, float dt)
     return priv->modTiles;
 }
 
+cl_int MyPaintStrokeContextPrivate::queueDab(NativeKernels::DabParams const &params)
+{
+    cl_int index = batchDabs.size() / 4;
+
+    cl_float mode = 0.0f;
+    if (params.mode == NativeKernels::DabParams::Locked)
+        mode = 1.0f;
+    else if (params.mode == NativeKernels::DabParams::Isolate)
+        mode = 2.0f;
+    cl_float shape = (params.shape == NativeKernels::DabParams::Micro) ? 1.0f : 0.0f;
+
+    batchDabs.push_back(cl_float4{params.hardness, params.slope1, params.slope2, params.colorAlpha});
+    batchDabs.push_back(cl_float4{params.matrix[0], params.matrix[1], params.matrix[2], params.matrix[3]});
+    batchDabs.push_back(cl_float4{params.color[0], params.color[1], params.color[2], params.color[3]});
+    batchDabs.push_back(cl_float4{params.texOffsetX, params.texOffsetY, shape, mode});
+
+    return index;
+}
+
+DabBatch MyPaintStrokeContextPrivate::takeDabs(QRect const &tileRect)
+{
+    DabBatch batch;
+
+    for (auto iter = batchTiles.begin(); iter != batchTiles.end();)
+    {
+        if (tileRect.isNull() || tileRect.contains(iter->first))
+        {
+            batch.tiles.push_back(std::move(iter->second));
+            iter = batchTiles.erase(iter);
+        }
+        else
+        {
+            ++iter;
+        }
+    }
+
+    /* Tiles that weren't taken still index into batchDabs, so it can only be
+     * cleared once every tile is drawn.
+     */
+    if (batchTiles.empty())
+        batch.dabs.swap(batchDabs);
+    else if (!batch.tiles.empty())
+        batch.dabs = batchDabs;
+
+    batch.texture = texture;
+    batch.textureOpacity = textureOpacity;
+
+    return batch;
+}
+
+void MyPaintStrokeContextPrivate::submitDabs()
+{
+    DabBatch batch = takeDabs(QRect());
+    if (batch.tiles.empty())
+        return;
+
+    if (!submitThread)
+        submitThread.reset(new DabSubmitThread());
+    submitThread->submit(std::move(batch));
+}
+
+void MyPaintStrokeContextPrivate::flushDabs(QRect const &tileRect)
+{
+    // Batches handed to the worker must be enqueued before anything after them
+    if (submitThread)
+        submitThread->waitForIdle();
+
+    DabBatch batch = takeDabs(tileRect);
+    if (!batch.tiles.empty())
+        submitDabBatch(batch);
+}
+
+/* The arguments of a batch's kernels. The host copies have to outlive the non-blocking
+ * writes, and the scratch buffers go back to the pool once the kernels are done.
+ */
+struct DabBatchUpload
+{
+    std::vector<cl_float4> dabs;
+    std::vector<cl_int4>   spans;
+    std::vector<cl_float2> coords;
+    cl_mem dabsMem;
+    cl_mem spansMem;
+    cl_mem coordsMem;
+};
+
+static void releaseDabBatchUpload(DabBatchUpload *upload)
+{
+    SharedOpenCL *opencl = SharedOpenCL::getSharedOpenCL();
+    opencl->releaseScratchBuffer(upload->dabsMem);
+    opencl->releaseScratchBuffer(upload->spansMem);
+    opencl->releaseScratchBuffer(upload->coordsMem);
+    delete upload;
+}
+
+static void CL_CALLBACK dabBatchComplete(cl_event event, cl_int status, void *userData)
+{
+    (void)status;
+    releaseDabBatchUpload(reinterpret_cast<DabBatchUpload *>(userData));
+    clReleaseEvent(event);
+}
+
+static void submitDabBatch(DabBatch const &batch)
+{
+    SharedOpenCL *opencl = SharedOpenCL::getSharedOpenCL();
+    cl_kernel kernel = batch.texture.isNull() ? opencl->mypaintDabBatchKernel : opencl->mypaintDabBatchTexturedKernel;
+    cl_int err = CL_SUCCESS;
+    (void)err; /* Ignore the fact that err is unused, it's helpful for debugging */
+
+    DabBatchUpload *upload = new DabBatchUpload;
+    upload->dabs = batch.dabs;
+    for (DabBatchTile const &batchTile: batch.tiles)
+        for (DabSpan const &span: batchTile.spans)
+        {
+            upload->spans.push_back(cl_int4{span.offset, span.width, span.height, span.dab});
+            upload->coords.push_back(cl_float2{span.tileX, span.tileY});
+        }
+
+    const size_t dabsSize = sizeof(cl_float4) * upload->dabs.size();
+    const size_t spansSize = sizeof(cl_int4) * upload->spans.size();
+    const size_t coordsSize = sizeof(cl_float2) * upload->coords.size();
+    upload->dabsMem = opencl->acquireScratchBuffer(dabsSize);
+    upload->spansMem = opencl->acquireScratchBuffer(spansSize);
+    upload->coordsMem = opencl->acquireScratchBuffer(coordsSize);
+
+    /* The writes are chained so every kernel only has to wait on the last one */
+    cl_event uploadEvent = nullptr;
+    auto write = [&](cl_mem mem, size_t size, const void *data) {
+        CLDependencies deps;
+        deps.add(&uploadEvent);
+        err = clEnqueueWriteBuffer(opencl->cmdQueue, mem, CL_FALSE, 0, size, data,
+                                   deps.count(), deps.waitList(), deps.event("writeBuffer"));
+        check_cl_error(err);
+    };
+    write(upload->dabsMem, dabsSize, upload->dabs.data());
+    write(upload->spansMem, spansSize, upload->spans.data());
+    write(upload->coordsMem, coordsSize, upload->coords.data());
+
+    err = clSetKernelArg<cl_mem>(kernel, 2, upload->spansMem);
+    err = clSetKernelArg<cl_mem>(kernel, 3, upload->coordsMem);
+    err = clSetKernelArg<cl_mem>(kernel, 6, upload->dabsMem);
+    if (!batch.texture.isNull())
+    {
+        err = clSetKernelArg<cl_float>(kernel, 7, batch.textureOpacity);
+        err = clSetKernelArg<cl_mem>(kernel, 8, batch.texture.image);
+    }
+
+    cl_int first = 0;
+    for (DabBatchTile const &batchTile: batch.tiles)
+    {
+        CanvasTile *tile = batchTile.tile;
+        std::vector<DabSpan> const &tileSpans = batchTile.spans;
+        cl_int count = tileSpans.size();
+
+        // Only launch over the part of the tile touched by a dab
+        int minX = TILE_PIXEL_WIDTH, minY = TILE_PIXEL_HEIGHT;
+        int maxX = 0, maxY = 0;
+        for (DabSpan const &span: tileSpans)
+        {
+            int spanX = span.offset % TILE_PIXEL_WIDTH;
+            int spanY = span.offset / TILE_PIXEL_WIDTH;
+            minX = std::min(minX, spanX);
+            minY = std::min(minY, spanY);
+            maxX = std::max(maxX, spanX + span.width);
+            maxY = std::max(maxY, spanY + span.height);
+        }
+
+        size_t global_work_size[2] = CL_DIM2(maxX - minX, maxY - minY);
+
+        cl_mem data = tile->unmapHost();
+
+        // A copy of the slot, so the kernels of other tiles don't end up waiting on this one
+        cl_event uploaded = uploadEvent;
+        if (uploaded)
+            clRetainEvent(uploaded);
+
+        {
+            CLDependencies deps;
+            deps.add(tile->eventSlot()).add(&uploaded);
+
+            err = clSetKernelArg<cl_mem>(kernel, 0, data);
+            err = clSetKernelArg<cl_int2>(kernel, 1, {minX, minY});
+            err = clSetKernelArg<cl_int>(kernel, 4, first);
+            err = clSetKernelArg<cl_int>(kernel, 5, count);
+            err = clEnqueueNDRangeKernel(opencl->cmdQueue, kernel, 2,
+                                         nullptr, global_work_size,
+                                         opencl->localWorkSize(kernel, 2, global_work_size).get(),
+                                         deps.count(), deps.waitList(), deps.event(kernel));
+            check_cl_error(err);
+        }
+
+        clearEventSlot(&uploaded);
+        first += count;
+    }
+
+    clearEventSlot(&uploadEvent);
+
+    /* The marker completes once everything enqueued so far has, including this
+     * batch's kernels, after which the buffers can be reused.
+     */
+    cl_event doneEvent = nullptr;
+    err = clEnqueueMarker(opencl->cmdQueue, &doneEvent);
+    check_cl_error(err);
+    if (!doneEvent || CL_SUCCESS != clSetEventCallback(doneEvent, CL_COMPLETE, dabBatchComplete, upload))
+    {
+        clFinish(opencl->cmdQueue);
+        releaseDabBatchUpload(upload);
+        clearEventSlot(&doneEvent);
+    }
+
+    // Start the device on this batch while the next one is being generated
+    clFlush(opencl->cmdQueue);
+}
+
+static void compositeIsolate(CanvasTile *dstTile, CanvasTile *srcTile, CanvasTile *isolateTile,
+                             QRect const &rect, NativeKernels::IsolateOperation operation)
+{
+    const int offset = rect.x() + rect.y() * TILE_PIXEL_WIDTH;
+
+    if (SharedOpenCL::getSharedOpenCL()->native)
+    {
+        NativeKernels::isolateComposite(dstTile->mapHost(), srcTile ? srcTile->mapHost() : nullptr,
+                                        isolateTile->mapHost(), offset, rect.width(), rect.height(), operation);
+        return;
+    }
+
+    SharedOpenCL *opencl = SharedOpenCL::getSharedOpenCL();
+    cl_kernel kernel = opencl->isolateComposite;
+    const size_t global_work_size[2] = CL_DIM2(rect.width(), rect.height());
+
+    CLDependencies deps;
+    deps.add(dstTile->eventSlot()).add(isolateTile->eventSlot());
+    if (srcTile)
+        deps.add(srcTile->eventSlot());
+
+    cl_mem auxMem = isolateTile->unmapHost();
+    // Copy doesn't read in, but it must still be a valid buffer
+    cl_mem inMem = srcTile ? srcTile->unmapHost() : auxMem;
+
+    clSetKernelArg<cl_mem>(kernel, 0, dstTile->unmapHost());
+    clSetKernelArg<cl_mem>(kernel, 1, inMem);
+    clSetKernelArg<cl_mem>(kernel, 2, auxMem);
+    clSetKernelArg<cl_int>(kernel, 3, offset);
+    clSetKernelArg<cl_int>(kernel, 4, operation);
+    cl_int err = clEnqueueNDRangeKernel(opencl->cmdQueue, kernel, 2,
+                                        nullptr, global_work_size,
+                                        opencl->localWorkSize(kernel, 2, global_work_size).get(),
+                                        deps.count(), deps.waitList(), deps.event(kernel));
+    check_cl_error(err);
+}
+
 void MyPaintStrokeContextPrivate::renderIsolate(CanvasLayer *layer, QPoint p)
 {
     if (isolateErase && isolateLockAlpha)
         return;
 
+    /* Once a layer tile has been composited it only needs to be updated where
+     * new dabs have landed since.
+     */
+    auto dirty = isolateDirty.find(p);
+    bool composited = isolateComposited.count(p);
+    if (composited && dirty == isolateDirty.end())
+        return;
+
+    QRect rect(0, 0, TILE_PIXEL_WIDTH, TILE_PIXEL_HEIGHT);
+    if (dirty != isolateDirty.end())
+    {
+        if (composited)
+            rect = dirty->second;
+        isolateDirty.erase(dirty);
+    }
+
     CanvasTile *isolateTile = isolateLayer->getTileMaybe(p.x(), p.y());
     CanvasTile *srcTile = srcLayer->getTileMaybe(p.x(), p.y());
 
+    NativeKernels::IsolateOperation operation;
+    if (isolateErase)
+        operation = NativeKernels::IsolateDestinationOut;
+    else if (isolateLockAlpha)
+        operation = NativeKernels::IsolateSourceAtop;
+    else
+        operation = NativeKernels::IsolateOver;
+
     if (isolateTile)
     {
-        if (srcTile)
+        if (!srcTile)
         {
-            std::unique_ptr<CanvasTile> dstTile = srcTile->copy();
+            if (isolateLockAlpha || isolateErase)
+                return;
+            operation = NativeKernels::IsolateCopy;
+        }
 
-            if (isolateErase)
-                isolateTile->blendOnto(dstTile.get(), BlendMode::DestinationOut, 1.0f);
-            else if (isolateLockAlpha)
-                isolateTile->blendOnto(dstTile.get(), BlendMode::SourceAtop, 1.0f);
-            else
-                isolateTile->blendOnto(dstTile.get(), BlendMode::Over, 1.0f);
-            (*layer->tiles)[p] = std::move(dstTile);
+        if (composited)
+        {
+            compositeIsolate(layer->getTile(p.x(), p.y()), srcTile, isolateTile, rect, operation);
         }
-        else if (!(isolateLockAlpha || isolateErase))
+        else
         {
-            (*layer->tiles)[p] = isolateTile->copy();
+            // Copy and composite in one pass
+            std::unique_ptr<CanvasTile> dstTile(new CanvasTile());
+            compositeIsolate(dstTile.get(), srcTile, isolateTile, rect, operation);
+            layer->setTile(p.x(), p.y(), std::move(dstTile));
+            isolateComposited.insert(p);
         }
     }
     else if (srcTile && !(isolateLockAlpha || isolateErase))
     {
-        (*layer->tiles)[p] = srcTile->copy();
+        layer->setTile(p.x(), p.y(), srcTile->copy());
+        isolateComposited.insert(p);
+    }
+}
+
+static void colorFromAccumulator(float totalValues[5],
+                                 float * color_r, float * color_g, float * color_b, float * color_a)
+{
+    if (totalValues[4] > 0.0f && totalValues[3] > 0.0f)
+    {
+        totalValues[0] /= totalValues[4];
+        totalValues[1] /= totalValues[4];
+        totalValues[2] /= totalValues[4];
+        totalValues[3] /= totalValues[4];
+
+        *color_r = qBound(0.0f, totalValues[0] / totalValues[3], 1.0f);
+        *color_g = qBound(0.0f, totalValues[1] / totalValues[3], 1.0f);
+        *color_b = qBound(0.0f, totalValues[2] / totalValues[3], 1.0f);
+        *color_a = qBound(0.0f, totalValues[3], 1.0f);
+    }
+    else
+    {
+        *color_r = 0.0f;
+        *color_g = 0.0f;
+        *color_b = 0.0f;
+        *color_a = 0.0f;
     }
 }
 
+/* The largest power of two work group, up to 256 items, that kernel can be launched with */
+static size_t colorQueryGroupSize(cl_kernel kernel)
+{
+    static QMutex cacheMutex;
+    static std::map<cl_kernel, size_t> cache;
+
+    QMutexLocker lock(&cacheMutex);
+
+    auto found = cache.find(kernel);
+    if (found != cache.end())
+        return found->second;
+
+    size_t maxSize = 1;
+    clGetKernelWorkGroupInfo(kernel, SharedOpenCL::getSharedOpenCL()->device, CL_KERNEL_WORK_GROUP_SIZE,
+                             sizeof(maxSize), &maxSize, nullptr);
+    maxSize = std::min<size_t>(maxSize, 256);
+
+    size_t groupSize = 1;
+    while (groupSize * 2 <= maxSize)
+        groupSize *= 2;
+
+    cache[kernel] = groupSize;
+
+    return groupSize;
+}
+
+static void getColorNative(MyPaintStrokeContextPrivate *priv, CanvasLayer *layer,
+                           float x, float y, float radius,
+                           int firstPixelX, int firstPixelY, int lastPixelX, int lastPixelY,
+                           float * color_r, float * color_g, float * color_b, float * color_a)
+{
+    struct Part {
+        const float *data;
+        float tileX;
+        float tileY;
+        int offset;
+        int width;
+        int height;
+        float accum[5];
+    };
+    std::vector<Part> parts;
+
+    int ix_start = tile_indice(firstPixelX, TILE_PIXEL_WIDTH);
+    int iy_start = tile_indice(firstPixelY, TILE_PIXEL_HEIGHT);
+
+    int ix_end   = tile_indice(lastPixelX, TILE_PIXEL_WIDTH);
+    int iy_end   = tile_indice(lastPixelY, TILE_PIXEL_HEIGHT);
+
+    for (int iy = iy_start; iy <= iy_end; ++iy)
+    {
+        const int tileOriginY = iy * TILE_PIXEL_HEIGHT;
+        const int offsetY = std::max(firstPixelY - tileOriginY, 0);
+        const int extraY = std::max(tileOriginY + TILE_PIXEL_HEIGHT - lastPixelY - 1, 0);
+
+        for (int ix = ix_start; ix <= ix_end; ++ix)
+        {
+            const int tileOriginX = ix * TILE_PIXEL_WIDTH;
+            const int offsetX = std::max(firstPixelX - tileOriginX, 0);
+            const int extraX = std::max(tileOriginX + TILE_PIXEL_WIDTH - lastPixelX - 1, 0);
+
+            if (priv->isolateLayer)
+                priv->renderIsolate(layer, {ix, iy});
+            CanvasTile *srcTile = layer->getTileMaybe(ix, iy);
+
+            Part part;
+            part.data = srcTile ? srcTile->mapHost() : nullptr;
+            part.tileX = (x + 0.5f) - tileOriginX - offsetX;
+            part.tileY = (y + 0.5f) - tileOriginY - offsetY;
+            part.offset = offsetX + offsetY * TILE_PIXEL_WIDTH;
+            part.width = TILE_PIXEL_WIDTH - offsetX - extraX;
+            part.height = TILE_PIXEL_HEIGHT - offsetY - extraY;
+            std::fill_n(part.accum, 5, 0.0f);
+            parts.push_back(part);
+        }
+    }
+
+    NativeKernels::parallelFor(parts.size(), [&](int i) {
+        Part &part = parts[i];
+        NativeKernels::mypaintColorQuery(part.data, part.tileX, part.tileY,
+                                         part.offset, part.width, part.height,
+                                         radius, part.accum);
+    });
+
+    // Sum in a fixed order so the result doesn't depend on thread scheduling
+    float totalValues[5] = {0, 0, 0, 0, 0};
+    for (Part const &part: parts)
+        for (int i = 0; i < 5; ++i)
+            totalValues[i] += part.accum[i];
+
+    colorFromAccumulator(totalValues, color_r, color_g, color_b, color_a);
+}
+
 static void getColorFunction (MyPaintSurface *base_surface,
                               float x, float y,
                               float radius,
@@ -340,33 +986,71 @@ static void getColorFunction (MyPaintSurface *base_surface,
     int lastPixelX = ceilf(x + fringe_radius);
     int lastPixelY = ceilf(y + fringe_radius);
 
+    if (SharedOpenCL::getSharedOpenCL()->native)
+    {
+        getColorNative(priv, layer, x, y, radius,
+                       firstPixelX, firstPixelY, lastPixelX, lastPixelY,
+                       color_r, color_g, color_b, color_a);
+        return;
+    }
+
     int ix_start = tile_indice(firstPixelX, TILE_PIXEL_WIDTH);
     int iy_start = tile_indice(firstPixelY, TILE_PIXEL_HEIGHT);
 
     int ix_end   = tile_indice(lastPixelX, TILE_PIXEL_WIDTH);
     int iy_end   = tile_indice(lastPixelY, TILE_PIXEL_HEIGHT);
 
-    cl_kernel kernel1 = SharedOpenCL::getSharedOpenCL()->mypaintGetColorKernelPart1;
-    cl_kernel empty_kernel1 = SharedOpenCL::getSharedOpenCL()->mypaintGetColorKernelEmptyPart1;
-    cl_kernel kernel2 = SharedOpenCL::getSharedOpenCL()->mypaintGetColorKernelPart2;
+    /* Smudge reads back what was just painted, but only the tiles under the
+     * sample need to be drawn. Dabs queued elsewhere stay in the batch.
+     */
+    priv->flushDabs(QRect(QPoint(ix_start, iy_start), QPoint(ix_end, iy_end)));
 
-    cl_mem colorAccumulatorMem;
+    bool emptySample = true;
+    for (int iy = iy_start; iy <= iy_end; ++iy)
+        for (int ix = ix_start; ix <= ix_end; ++ix)
+        {
+            if (priv->isolateLayer)
+                priv->renderIsolate(layer, {ix, iy});
+            if (layer->getTileMaybe(ix, iy))
+                emptySample = false;
+        }
+
+    /* Every pixel under an empty sample is transparent, which always gives a zero color.
+     * Answer on the host instead of waiting for the device.
+     */
+    if (emptySample)
+    {
+        float totalValues[5] = {0, 0, 0, 0, 0};
+        colorFromAccumulator(totalValues, color_r, color_g, color_b, color_a);
+        return;
+    }
+
+    SharedOpenCL *opencl = SharedOpenCL::getSharedOpenCL();
+    cl_kernel tileKernel = opencl->mypaintGetColorKernelTile;
+    cl_kernel emptyTileKernel = opencl->mypaintGetColorKernelEmptyTile;
 
     int tile_count = (iy_end - iy_start + 1) * (ix_end - ix_start + 1);
 
-    colorAccumulatorMem = clCreateBuffer (SharedOpenCL::getSharedOpenCL()->ctx, CL_MEM_READ_WRITE,
-                                          2 * TILE_PIXEL_HEIGHT * sizeof(cl_float4) * tile_count, nullptr, nullptr);
+    /* Each tile is reduced by one work group into its own accumulator slot. With a
+     * single tile that slot is the result, otherwise the slots are reduced again.
+     */
+    cl_mem colorAccumulatorMem = opencl->acquireScratchBuffer(2 * sizeof(cl_float4) * tile_count);
 
     cl_int err = CL_SUCCESS;
+    cl_event accumulatorEvent = nullptr;
+
+    size_t tileGroupSize = colorQueryGroupSize(tileKernel);
+    size_t emptyTileGroupSize = colorQueryGroupSize(emptyTileKernel);
 
-    /* Part 1 */
-    err = clSetKernelArg<cl_mem>(kernel1, 6, colorAccumulatorMem);
-    err = clSetKernelArg<cl_float>(kernel1, 7, radius);
+    err = clSetKernelArg<cl_mem>(tileKernel, 7, colorAccumulatorMem);
+    err = clSetKernelArg<cl_float>(tileKernel, 8, radius);
+    err = clSetKernelArg(tileKernel, 9, 2 * sizeof(cl_float4) * tileGroupSize, nullptr);
 
-    err = clSetKernelArg<cl_mem>(empty_kernel1, 4, colorAccumulatorMem);
-    err = clSetKernelArg<cl_float>(empty_kernel1, 5, radius);
+    err = clSetKernelArg<cl_mem>(emptyTileKernel, 5, colorAccumulatorMem);
+    err = clSetKernelArg<cl_float>(emptyTileKernel, 6, radius);
+    err = clSetKernelArg(emptyTileKernel, 7, 2 * sizeof(cl_float4) * emptyTileGroupSize, nullptr);
 
-    cl_int row_count = 0;
+    cl_int accum_offset = 0;
 
     for (int iy = iy_start; iy <= iy_end; ++iy)
     {
@@ -387,83 +1071,82 @@ static void getColorFunction (MyPaintSurface *base_surface,
             cl_int height = TILE_PIXEL_HEIGHT - offsetY - extraY;
             cl_int offset = offsetX + offsetY * TILE_PIXEL_WIDTH;
 
-            size_t global_work_size[1] = CL_DIM1(height);
-            size_t local_work_size[1] = CL_DIM1(1);
-
-            if (priv->isolateLayer)
-                priv->renderIsolate(layer, {ix, iy});
             CanvasTile *srcTile = layer->getTileMaybe(ix, iy);
 
+            CLDependencies deps;
+            deps.add(&accumulatorEvent);
+
             if (srcTile)
             {
                 cl_mem data = srcTile->unmapHost();
-
-                err = clSetKernelArg<cl_mem>(kernel1, 0, data);
-                err = clSetKernelArg<cl_float>(kernel1, 1, tileX);
-                err = clSetKernelArg<cl_float>(kernel1, 2, tileY);
-                err = clSetKernelArg<cl_int>(kernel1, 3, offset);
-                err = clSetKernelArg<cl_int>(kernel1, 4, width);
-                err = clSetKernelArg<cl_int>(kernel1, 5, row_count);
-                err = clEnqueueNDRangeKernel(SharedOpenCL::getSharedOpenCL()->cmdQueue,
-                                             kernel1, 1,
-                                             nullptr, global_work_size, local_work_size,
-                                             0, nullptr, nullptr);
+                deps.add(srcTile->eventSlot());
+
+                size_t work_size[1] = CL_DIM1(tileGroupSize);
+                err = clSetKernelArg<cl_mem>(tileKernel, 0, data);
+                err = clSetKernelArg<cl_float>(tileKernel, 1, tileX);
+                err = clSetKernelArg<cl_float>(tileKernel, 2, tileY);
+                err = clSetKernelArg<cl_int>(tileKernel, 3, offset);
+                err = clSetKernelArg<cl_int>(tileKernel, 4, width);
+                err = clSetKernelArg<cl_int>(tileKernel, 5, height);
+                err = clSetKernelArg<cl_int>(tileKernel, 6, accum_offset);
+                err = clEnqueueNDRangeKernel(opencl->cmdQueue,
+                                             tileKernel, 1,
+                                             nullptr, work_size, work_size,
+                                             deps.count(), deps.waitList(), deps.event(tileKernel));
                 check_cl_error(err);
             }
             else
             {
-                err = clSetKernelArg<cl_float>(empty_kernel1, 0, tileX);
-                err = clSetKernelArg<cl_float>(empty_kernel1, 1, tileY);
-                err = clSetKernelArg<cl_int>(empty_kernel1, 2, width);
-                err = clSetKernelArg<cl_int>(empty_kernel1, 3, row_count);
-                err = clEnqueueNDRangeKernel(SharedOpenCL::getSharedOpenCL()->cmdQueue,
-                                             empty_kernel1, 1,
-                                             nullptr, global_work_size, local_work_size,
-                                             0, nullptr, nullptr);
+                size_t work_size[1] = CL_DIM1(emptyTileGroupSize);
+                err = clSetKernelArg<cl_float>(emptyTileKernel, 0, tileX);
+                err = clSetKernelArg<cl_float>(emptyTileKernel, 1, tileY);
+                err = clSetKernelArg<cl_int>(emptyTileKernel, 2, width);
+                err = clSetKernelArg<cl_int>(emptyTileKernel, 3, height);
+                err = clSetKernelArg<cl_int>(emptyTileKernel, 4, accum_offset);
+                err = clEnqueueNDRangeKernel(opencl->cmdQueue,
+                                             emptyTileKernel, 1,
+                                             nullptr, work_size, work_size,
+                                             deps.count(), deps.waitList(), deps.event(emptyTileKernel));
                 check_cl_error(err);
-
             }
 
-            row_count += height;
+            accum_offset += 1;
         }
     }
 
-    size_t global_work_size[1] = {1};
-    err = clSetKernelArg<cl_mem>(kernel2, 0, colorAccumulatorMem);
-    err = clSetKernelArg<cl_int>(kernel2, 1, row_count);
-    err = clEnqueueNDRangeKernel(SharedOpenCL::getSharedOpenCL()->cmdQueue,
-                                 kernel2, 1,
-                                 nullptr, global_work_size, nullptr,
-                                 0, nullptr, nullptr);
-    check_cl_error(err);
-
+    if (tile_count > 1)
+    {
+        cl_kernel reduceKernel = opencl->mypaintGetColorKernelReduce;
+        size_t reduceGroupSize = colorQueryGroupSize(reduceKernel);
+
+        CLDependencies deps;
+        deps.add(&accumulatorEvent);
+
+        size_t work_size[1] = CL_DIM1(reduceGroupSize);
+        err = clSetKernelArg<cl_mem>(reduceKernel, 0, colorAccumulatorMem);
+        err = clSetKernelArg<cl_int>(reduceKernel, 1, tile_count);
+        err = clSetKernelArg(reduceKernel, 2, 2 * sizeof(cl_float4) * reduceGroupSize, nullptr);
+        err = clEnqueueNDRangeKernel(opencl->cmdQueue,
+                                     reduceKernel, 1,
+                                     nullptr, work_size, work_size,
+                                     deps.count(), deps.waitList(), deps.event(reduceKernel));
+        check_cl_error(err);
+    }
 
     float totalValues[5] = {0, 0, 0, 0, 0};
-    clEnqueueReadBuffer(SharedOpenCL::getSharedOpenCL()->cmdQueue, colorAccumulatorMem, CL_TRUE,
-                        0, sizeof(float) * 5, totalValues,
-                        0, nullptr, nullptr);
-
-    if (totalValues[4] > 0.0f && totalValues[3] > 0.0f)
     {
-        totalValues[0] /= totalValues[4];
-        totalValues[1] /= totalValues[4];
-        totalValues[2] /= totalValues[4];
-        totalValues[3] /= totalValues[4];
+        CLDependencies deps;
+        deps.add(&accumulatorEvent);
 
-        *color_r = qBound(0.0f, totalValues[0] / totalValues[3], 1.0f);
-        *color_g = qBound(0.0f, totalValues[1] / totalValues[3], 1.0f);
-        *color_b = qBound(0.0f, totalValues[2] / totalValues[3], 1.0f);
-        *color_a = qBound(0.0f, totalValues[3], 1.0f);
-    }
-    else
-    {
-        *color_r = 0.0f;
-        *color_g = 0.0f;
-        *color_b = 0.0f;
-        *color_a = 0.0f;
+        clEnqueueReadBuffer(opencl->cmdQueue, colorAccumulatorMem, CL_TRUE,
+                            0, sizeof(float) * 5, totalValues,
+                            deps.count(), deps.waitList(), deps.event("readBuffer"));
     }
+    clearEventSlot(&accumulatorEvent);
 
-    clReleaseMemObject(colorAccumulatorMem);
+    colorFromAccumulator(totalValues, color_r, color_g, color_b, color_a);
+
+    opencl->releaseScratchBuffer(colorAccumulatorMem);
 }
 
 static int drawDabFunction (MyPaintSurface *base_surface,
@@ -497,7 +1180,11 @@ static int drawDabFunction (MyPaintSurface *base_surface,
     MyPaintStrokeContextPrivate *priv = surface->strokeContext->priv.get();
     CanvasLayer *layer = priv->isolateLayer ? priv->isolateLayer.get() : surface->strokeContext->layer;
     QRectF boundRect;
-    cl_kernel kernel;
+    cl_kernel kernel = nullptr;
+    const bool native = SharedOpenCL::getSharedOpenCL()->native;
+    /* Mask dabs each use their own mip image so they are always drawn immediately */
+    const bool batch = !native && priv->masks.empty() && SharedOpenCL::getSharedOpenCL()->batchDabs;
+    NativeKernels::DabParams dabParams;
     cl_int err = CL_SUCCESS;
     (void)err; /* Ignore the fact that err is unused, it's helpful for debugging */
     int argIndex = 4;
@@ -514,6 +1201,11 @@ static int drawDabFunction (MyPaintSurface *base_surface,
         color_a = 1.0f;
     }
 
+    if (lock_alpha > 0.0f)
+        dabParams.mode = NativeKernels::DabParams::Locked;
+    else if (priv->isolateLayer)
+        dabParams.mode = NativeKernels::DabParams::Isolate;
+
     if (priv->masks.empty())
     {
         if (hardness <= 0.0f)
@@ -527,7 +1219,14 @@ static int drawDabFunction (MyPaintSurface *base_surface,
         boundRect.setRect(-1.0f, -1.0f, 2.0f, 2.0f);
         boundRect = transform.inverted().mapRect(boundRect).adjusted(-2.0, -2.0, 4.0, 4.0);
 
-        if (radius < 1.0f)
+        if (native || batch)
+        {
+            if (radius < 1.0f)
+                dabParams.shape = NativeKernels::DabParams::Micro;
+            else
+                dabParams.shape = NativeKernels::DabParams::Dab;
+        }
+        else if (radius < 1.0f)
         {
             if (lock_alpha > 0.0f)
             {
@@ -585,10 +1284,20 @@ static int drawDabFunction (MyPaintSurface *base_surface,
         float slope1 = -(1.0f / hardness - 1.0f);
         float slope2 = -(hardness / (1.0f - hardness));
 
-        err = clSetKernelArg<cl_float>(kernel, argIndex++, hardness);
-        err = clSetKernelArg<cl_float4>(kernel, argIndex++, transformMatrix);
-        err = clSetKernelArg<cl_float>(kernel, argIndex++, slope1);
-        err = clSetKernelArg<cl_float>(kernel, argIndex++, slope2);
+        if (native || batch)
+        {
+            dabParams.hardness = hardness;
+            std::copy_n(transformMatrix.s, 4, dabParams.matrix);
+            dabParams.slope1 = slope1;
+            dabParams.slope2 = slope2;
+        }
+        else
+        {
+            err = clSetKernelArg<cl_float>(kernel, argIndex++, hardness);
+            err = clSetKernelArg<cl_float4>(kernel, argIndex++, transformMatrix);
+            err = clSetKernelArg<cl_float>(kernel, argIndex++, slope1);
+            err = clSetKernelArg<cl_float>(kernel, argIndex++, slope2);
+        }
     }
     else
     {
@@ -611,7 +1320,12 @@ static int drawDabFunction (MyPaintSurface *base_surface,
         boundRect.setRect(-0.5f, -0.5f, 1.0f, 1.0f);
         boundRect = transform.inverted().mapRect(boundRect).adjusted(-1.0, -1.0, 1.0, 1.0);
 
-        if (lock_alpha > 0.0f)
+        if (native)
+        {
+            dabParams.shape = NativeKernels::DabParams::Mask;
+            dabParams.stamp = &maskImage.buffer;
+        }
+        else if (lock_alpha > 0.0f)
         {
             if (priv->texture.isNull())
                 kernel = SharedOpenCL::getSharedOpenCL()->mypaintMaskDabLockedKernel;
@@ -639,11 +1353,34 @@ static int drawDabFunction (MyPaintSurface *base_surface,
         transformMatrix.s[2] = transform.m12();
         transformMatrix.s[3] = transform.m22();
 
-        err = clSetKernelArg<cl_mem>(kernel, argIndex++, maskImage.image);
-        err = clSetKernelArg<cl_float4>(kernel, argIndex++, transformMatrix);
+        if (native)
+        {
+            std::copy_n(transformMatrix.s, 4, dabParams.matrix);
+        }
+        else
+        {
+            err = clSetKernelArg<cl_mem>(kernel, argIndex++, maskImage.image);
+            err = clSetKernelArg<cl_float4>(kernel, argIndex++, transformMatrix);
+        }
     }
 
-    if (!priv->texture.isNull())
+    if (native || batch)
+    {
+        if (!priv->texture.isNull())
+        {
+            dabParams.texture = &priv->texture.buffer;
+            dabParams.texOffsetX = x + 1.0f;
+            dabParams.texOffsetY = y + 1.0f;
+            dabParams.texStrength = priv->textureOpacity;
+        }
+
+        dabParams.colorAlpha = color_a;
+        dabParams.color[0] = color_r;
+        dabParams.color[1] = color_g;
+        dabParams.color[2] = color_b;
+        dabParams.color[3] = opaque;
+    }
+    else if (!priv->texture.isNull())
     {
         // Add 1.0f to (x, y) to reverse the offset applied to (tileX, tileY)
         err = clSetKernelArg<cl_float>(kernel, argIndex++, x + 1.0f);
@@ -652,8 +1389,11 @@ static int drawDabFunction (MyPaintSurface *base_surface,
         err = clSetKernelArg<cl_mem>(kernel, argIndex++, priv->texture.image);
     }
 
-    err = clSetKernelArg<cl_float>(kernel, argIndex++, color_a);
-    err = clSetKernelArg<cl_float4>(kernel, argIndex++, cl_float4{color_r, color_g, color_b, opaque});
+    if (!native && !batch)
+    {
+        err = clSetKernelArg<cl_float>(kernel, argIndex++, color_a);
+        err = clSetKernelArg<cl_float4>(kernel, argIndex++, cl_float4{color_r, color_g, color_b, opaque});
+    }
 
     bool skipEmptyTiles = false;
     if (lock_alpha > 0.0f || color_a <= 0.0f)
@@ -672,6 +1412,18 @@ static int drawDabFunction (MyPaintSurface *base_surface,
 
     cl_command_queue cmdQueue = SharedOpenCL::getSharedOpenCL()->cmdQueue;
 
+    struct NativeJob {
+        float *data;
+        int offset;
+        int width;
+        int height;
+        float tileX;
+        float tileY;
+    };
+    std::vector<NativeJob> nativeJobs;
+
+    cl_int batchIndex = batch ? priv->queueDab(dabParams) : 0;
+
     for (int iy = iy_start; iy <= iy_end; ++iy)
     {
         const int tileOriginY = iy * TILE_PIXEL_HEIGHT;
@@ -680,13 +1432,10 @@ static int drawDabFunction (MyPaintSurface *base_surface,
 
         for (int ix = ix_start; ix <= ix_end; ++ix)
         {
-            cl_mem data;
-            if (!skipEmptyTiles)
-                data = layer->getTile(ix, iy)->unmapHost();
-            else if (CanvasTile *tile = layer->getTileMaybe(ix, iy))
-                data = tile->unmapHost();
-            else
+            if (skipEmptyTiles && !layer->getTileMaybe(ix, iy))
                 continue;
+            // getTile() rather than writing through getTileMaybe() so a lazy copy captures it
+            CanvasTile *tile = layer->getTile(ix, iy);
 
             const int tileOriginX = ix * TILE_PIXEL_WIDTH;
             const int offsetX = std::max(firstPixelX - tileOriginX, 0);
@@ -704,15 +1453,56 @@ static int drawDabFunction (MyPaintSurface *base_surface,
 
             priv->modTiles.insert(QPoint(ix, iy));
 
+            if (priv->isolateLayer)
+            {
+                QRect &dirty = priv->isolateDirty[QPoint(ix, iy)];
+                dirty = dirty.united(QRect(offsetX, offsetY, width, height));
+            }
+
+            if (native)
+            {
+                nativeJobs.push_back({tile->mapHost(), offset, width, height, tileX, tileY});
+                continue;
+            }
+
+            if (batch)
+            {
+                auto &batchTile = priv->batchTiles[QPoint(ix, iy)];
+                batchTile.tile = tile;
+                batchTile.spans.push_back({offset, width, height, batchIndex, tileX, tileY});
+                continue;
+            }
+
+            cl_mem data = tile->unmapHost();
+
+            CLDependencies deps;
+            deps.add(tile->eventSlot());
+
             err = clSetKernelArg<cl_mem>(kernel, 0, data);
             err = clSetKernelArg<cl_int>(kernel, 1, offset);
             err = clSetKernelArg<cl_float>(kernel, 2, tileX);
             err = clSetKernelArg<cl_float>(kernel, 3, tileY);
             err = clEnqueueNDRangeKernel(cmdQueue, kernel, 2,
-                                         nullptr, global_work_size, local_work_size,
-                                         0, nullptr, nullptr);
+                                         nullptr, global_work_size,
+                                         SharedOpenCL::getSharedOpenCL()->localWorkSize(kernel, 2, global_work_size, local_work_size).get(),
+                                         deps.count(), deps.waitList(), deps.event(kernel));
         }
     }
 
+    NativeKernels::parallelFor(nativeJobs.size(), [&](int i) {
+        NativeJob const &job = nativeJobs[i];
+        NativeKernels::mypaintDab(job.data, job.offset, job.width, job.height,
+                                  job.tileX, job.tileY, dabParams);
+    });
+
+    /* Once enough dabs are queued hand them off, they get enqueued while brushlib
+     * evaluates the rest of the segment. A smudge sample flushes its tiles first.
+     */
+    if (batch && priv->batchDabs.size() >= dabPipelineBatchSize * 4 &&
+        SharedOpenCL::getSharedOpenCL()->pipelineDabs)
+        priv->submitDabs();
+
+    dabCount++;
+
     return 1;
 }
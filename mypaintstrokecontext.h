@@ -25,6 +25,12 @@ public:
     void setTexture(const MaskBuffer &texture, float textureOpacity);
     void setIsolate(bool isolate);
 
+    /* The color brushlib would get when smudging at point, as r, g, b, a */
+    void sampleColor(QPointF point, float radius, float color[4]);
+
+    /* The number of dabs drawn by all stroke contexts since startup */
+    static quint64 totalDabCount();
+
     std::unique_ptr<MyPaintStrokeContextPrivate> priv;
 };
 
@@ -0,0 +1,940 @@
+#include "nativekernels.h"
+#include "canvastile.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NATIVE_KERNELS_SSE
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+/* Just enough of OpenCL's float4 to port the kernels, one pixel per vector */
+struct float4
+{
+#ifdef NATIVE_KERNELS_SSE
+    __m128 v;
+
+    float4() : v(_mm_setzero_ps()) {}
+    explicit float4(__m128 v) : v(v) {}
+    explicit float4(float s) : v(_mm_set1_ps(s)) {}
+    float4(float r, float g, float b, float a) : v(_mm_setr_ps(r, g, b, a)) {}
+
+    static float4 load(const float *p) { return float4(_mm_loadu_ps(p)); }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+
+    float alpha() const { return _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3))); }
+    float4 withAlpha(float a) const
+    {
+        const __m128 colorMask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+        return float4(_mm_or_ps(_mm_and_ps(colorMask, v), _mm_andnot_ps(colorMask, _mm_set1_ps(a))));
+    }
+
+    float4 operator+(float4 o) const { return float4(_mm_add_ps(v, o.v)); }
+    float4 operator-(float4 o) const { return float4(_mm_sub_ps(v, o.v)); }
+    float4 operator*(float4 o) const { return float4(_mm_mul_ps(v, o.v)); }
+    float4 operator*(float s) const { return float4(_mm_mul_ps(v, _mm_set1_ps(s))); }
+    float4 operator/(float s) const { return float4(_mm_div_ps(v, _mm_set1_ps(s))); }
+#else
+    float c[4];
+
+    float4() : c{0.0f, 0.0f, 0.0f, 0.0f} {}
+    explicit float4(float s) : c{s, s, s, s} {}
+    float4(float r, float g, float b, float a) : c{r, g, b, a} {}
+
+    static float4 load(const float *p) { return float4(p[0], p[1], p[2], p[3]); }
+    void store(float *p) const { memcpy(p, c, sizeof(c)); }
+
+    float alpha() const { return c[3]; }
+    float4 withAlpha(float a) const { return float4(c[0], c[1], c[2], a); }
+
+    float4 operator+(float4 o) const { return float4(c[0] + o.c[0], c[1] + o.c[1], c[2] + o.c[2], c[3] + o.c[3]); }
+    float4 operator-(float4 o) const { return float4(c[0] - o.c[0], c[1] - o.c[1], c[2] - o.c[2], c[3] - o.c[3]); }
+    float4 operator*(float4 o) const { return float4(c[0] * o.c[0], c[1] * o.c[1], c[2] * o.c[2], c[3] * o.c[3]); }
+    float4 operator*(float s) const { return float4(c[0] * s, c[1] * s, c[2] * s, c[3] * s); }
+    float4 operator/(float s) const { return float4(c[0] / s, c[1] / s, c[2] / s, c[3] / s); }
+#endif
+    float4 &operator+=(float4 o) { return *this = *this + o; }
+};
+
+static const int TILE_PIXEL_COUNT = TILE_PIXEL_WIDTH * TILE_PIXEL_HEIGHT;
+
+class ParallelForTask : public QRunnable
+{
+public:
+    ParallelForTask(std::function<void(int)> const &fn, std::atomic<int> *next, int count, QSemaphore *done)
+        : fn(fn), next(next), count(count), done(done) {}
+
+    void run() override
+    {
+        int i;
+        while ((i = next->fetch_add(1)) < count)
+            fn(i);
+        done->release();
+    }
+
+private:
+    std::function<void(int)> const &fn;
+    std::atomic<int> *next;
+    int count;
+    QSemaphore *done;
+};
+
+/* Porter-Duff over, the common tail of most of the blend modes */
+inline float4 overPixel(float4 in, float4 aux, float alpha)
+{
+    float dst_alpha = in.alpha();
+    float a = alpha + dst_alpha * (1.0f - alpha);
+    float src_term = (a > 0.0f) ? alpha / a : 0.0f;
+    float aux_term = 1.0f - src_term;
+    return (aux * src_term + in * aux_term).withAlpha(a);
+}
+
+inline float4 premultiply(float4 pixel)
+{
+    float a = pixel.alpha();
+    return (pixel * a).withAlpha(a);
+}
+
+inline float4 unpremultiply(float4 pixel)
+{
+    float a = pixel.alpha();
+    if (a > 0.0f)
+        return (pixel / a).withAlpha(a);
+    return pixel;
+}
+
+/* Color compositing operations from:
+ * http://www.w3.org/TR/2015/CR-compositing-1-20150113/#blendingnonseparable */
+
+inline float hsl_lum(const float color[3])
+{
+    return 0.3f * color[0] + 0.59f * color[1] + 0.11f * color[2];
+}
+
+inline float hsl_sat(const float color[3])
+{
+    return std::max(std::max(color[0], color[1]), color[2]) - std::min(std::min(color[0], color[1]), color[2]);
+}
+
+void hsl_clip_color(float color[3])
+{
+    float lum = hsl_lum(color);
+    float n = std::min(std::min(color[0], color[1]), color[2]);
+    float x = std::max(std::max(color[0], color[1]), color[2]);
+    for (int c = 0; c < 3; ++c)
+    {
+        if (n < 0.0f)
+            color[c] = lum + (((color[c] - lum) * lum) / (lum - n));
+        if (x > 1.0f)
+            color[c] = lum + (((color[c] - lum) * (1.0f - lum)) / (x - lum));
+        // Sanity clamp, the above code sometimes produces bad values when lum is zero
+        color[c] = std::min(std::max(color[c], 0.0f), 1.0f);
+    }
+}
+
+void hsl_set_lum(float color[3], float lum)
+{
+    float d = lum - hsl_lum(color);
+    for (int c = 0; c < 3; ++c)
+        color[c] += d;
+    hsl_clip_color(color);
+}
+
+void hsl_set_sat(float colors[3], float s)
+{
+    int Cmin = 0;
+    int Cmid = 1;
+    int Cmax = 2;
+
+    // mini-bubble sort to find Cmin, Cmid, Cmax
+    if (colors[Cmin] > colors[Cmid])
+        std::swap(Cmin, Cmid);
+    if (colors[Cmid] > colors[Cmax])
+        std::swap(Cmid, Cmax);
+    if (colors[Cmin] > colors[Cmid])
+        std::swap(Cmin, Cmid);
+
+    if (colors[Cmax] > colors[Cmin])
+    {
+        colors[Cmid] = ((colors[Cmid] - colors[Cmin]) * s) / (colors[Cmax] - colors[Cmin]);
+        colors[Cmax] = s;
+        colors[Cmin] = 0;
+    }
+    else
+    {
+        colors[0] = colors[1] = colors[2] = 0.0f;
+    }
+}
+
+template <BlendMode::Mode mode>
+void blendNonSeparable(float *inout, const float *aux, float opacity)
+{
+    for (int i = 0; i < TILE_PIXEL_COUNT * 4; i += 4)
+    {
+        float alpha = aux[i + 3] * opacity;
+        if (!(alpha > 0.0f))
+            continue;
+
+        float in_color[3] = {inout[i + 0], inout[i + 1], inout[i + 2]};
+        float color[3] = {aux[i + 0], aux[i + 1], aux[i + 2]};
+
+        if (mode == BlendMode::Hue)
+        {
+            hsl_set_sat(color, hsl_sat(in_color));
+            hsl_set_lum(color, hsl_lum(in_color));
+        }
+        else if (mode == BlendMode::Saturation)
+        {
+            float sat = hsl_sat(color);
+            memcpy(color, in_color, sizeof(color));
+            hsl_set_sat(color, sat);
+            hsl_set_lum(color, hsl_lum(in_color));
+        }
+        else if (mode == BlendMode::Color)
+        {
+            hsl_set_lum(color, hsl_lum(in_color));
+        }
+        else /* Luminosity */
+        {
+            float lum = hsl_lum(color);
+            memcpy(color, in_color, sizeof(color));
+            hsl_set_lum(color, lum);
+        }
+
+        float dst_alpha = inout[i + 3];
+        float a = alpha + dst_alpha * (1.0f - alpha);
+        float src_term = alpha / a;
+        float aux_term = 1.0f - src_term;
+        for (int c = 0; c < 3; ++c)
+            inout[i + c] = color[c] * src_term + in_color[c] * aux_term;
+        inout[i + 3] = a;
+    }
+}
+
+/* Separable modes that branch per channel, in pre-multiplied space */
+template <BlendMode::Mode mode>
+void blendSeparable(float *inout, const float *aux, float opacity)
+{
+    for (int i = 0; i < TILE_PIXEL_COUNT * 4; i += 4)
+    {
+        float4 in_pixel = premultiply(float4::load(inout + i));
+        float4 aux_pixel = float4::load(aux + i);
+        aux_pixel = premultiply(aux_pixel.withAlpha(aux_pixel.alpha() * opacity));
+
+        float aA = in_pixel.alpha();
+        float aB = aux_pixel.alpha();
+        float aD = aA + aB - aA * aB;
+
+        float cA[4], cB[4], out[4];
+        in_pixel.store(cA);
+        aux_pixel.store(cB);
+
+        for (int c = 0; c < 3; ++c)
+        {
+            float common_path = cB[c] * (1.0f - aA) + cA[c] * (1.0f - aB);
+
+            if (mode == BlendMode::ColorDodge)
+            {
+                if (cB[c] * aA + cA[c] * aB >= aB * aA)
+                    out[c] = aB * aA + common_path;
+                else
+                    out[c] = cA[c] * aB / (1.0f - cB[c] / aB) + common_path;
+            }
+            else /* ColorBurn */
+            {
+                float other_common_path = cB[c] * aA + cA[c] * aB;
+                if (other_common_path <= aB * aA)
+                    out[c] = common_path;
+                else
+                    out[c] = aB * (other_common_path - aB * aA) / cB[c] + common_path;
+            }
+        }
+        out[3] = aD;
+
+        unpremultiply(float4::load(out)).store(inout + i);
+    }
+}
+
+inline float calculate_alpha(float rr, float hardness, float slope1, float slope2)
+{
+    if (rr <= 1.0f)
+    {
+        if (rr <= hardness)
+            return 1.0f + rr * slope1;
+        else
+            return -slope2 + rr * slope2;
+    }
+
+    return 0.0f;
+}
+
+inline float alpha_from_dab(float x, float y, NativeKernels::DabParams const &p)
+{
+    float xr = x * p.matrix[0] + y * p.matrix[1];
+    float yr = x * p.matrix[2] + y * p.matrix[3];
+    float rr = (yr * yr + xr * xr);
+    return calculate_alpha(rr, p.hardness, p.slope1, p.slope2);
+}
+
+inline float alpha_from_subpixel_dab(float x, float y, NativeKernels::DabParams const &p)
+{
+    // The corners of the pixel, in the dab's coordiate space
+    float xr0 = (x - 0.5f) * p.matrix[0] + (y - 0.5f) * p.matrix[1];
+    float yr0 = (x - 0.5f) * p.matrix[2] + (y - 0.5f) * p.matrix[3];
+    float xr1 = (x + 0.5f) * p.matrix[0] + (y + 0.5f) * p.matrix[1];
+    float yr1 = (x + 0.5f) * p.matrix[2] + (y + 0.5f) * p.matrix[3];
+
+    float x_near, y_near;
+
+    // If the signs differ this pixel contains the center of the dab
+    if (std::signbit(xr0) != std::signbit(xr1))
+        x_near = 0;
+    else
+        x_near = std::min(std::fabs(xr0), std::fabs(xr1));
+
+    if (std::signbit(yr0) != std::signbit(yr1))
+        y_near = 0;
+    else
+        y_near = std::min(std::fabs(yr0), std::fabs(yr1));
+
+    float rr_near = x_near * x_near + y_near * y_near;
+
+    if (rr_near > 1.0f)
+        return 0.0f;
+
+    float x_far = std::max(std::fabs(xr0), std::fabs(xr1));
+    float y_far = std::max(std::fabs(yr0), std::fabs(yr1));
+    float rr_far = x_far * x_far + y_far * y_far;
+
+    // MyPaint's AA blend
+    float visibilityNear = 1.0f - rr_near;
+    float delta = rr_far - rr_near;
+    float delta2 = 1.0f + delta;
+    visibilityNear /= delta2;
+    float rr = 1.0f - visibilityNear;
+
+    return calculate_alpha(rr, p.hardness, p.slope1, p.slope2);
+}
+
+/* read_imagef() with CLK_NORMALIZED_COORDS_TRUE | CLK_ADDRESS_CLAMP | CLK_FILTER_LINEAR */
+inline float sampleLinearClamp(MaskBuffer const &image, float s, float t)
+{
+    const int w = image.width();
+    const int h = image.height();
+    const uint8_t *data = image.constData();
+
+    float u = s * w - 0.5f;
+    float v = t * h - 0.5f;
+    int i0 = std::floor(u);
+    int j0 = std::floor(v);
+    float a = u - i0;
+    float b = v - j0;
+
+    auto texel = [=](int i, int j) {
+        if (i < 0 || j < 0 || i >= w || j >= h)
+            return 0.0f;
+        return data[i + j * w] * (1.0f / 255.0f);
+    };
+
+    return (1.0f - a) * (1.0f - b) * texel(i0, j0) +
+           a * (1.0f - b) * texel(i0 + 1, j0) +
+           (1.0f - a) * b * texel(i0, j0 + 1) +
+           a * b * texel(i0 + 1, j0 + 1);
+}
+
+/* The texel index for CLK_NORMALIZED_COORDS_TRUE | CLK_ADDRESS_REPEAT | CLK_FILTER_NEAREST */
+inline int repeatNearest(float s, int size)
+{
+    float u = (s - std::floor(s)) * size;
+    return std::min<int>(std::floor(u), size - 1);
+}
+
+inline float alpha_from_mask(float x, float y, NativeKernels::DabParams const &p)
+{
+    // Apply rotation and shift to (0.0, 1.0)
+    float s = x * p.matrix[0] + y * p.matrix[1] + 0.5f;
+    float t = x * p.matrix[2] + y * p.matrix[3] + 0.5f;
+
+    return sampleLinearClamp(*p.stamp, s, t);
+}
+
+inline float apply_texture(float alpha, float x, float y, NativeKernels::DabParams const &p)
+{
+    MaskBuffer const &texture = *p.texture;
+    int i = repeatNearest(x / texture.width(), texture.width());
+    int j = repeatNearest(y / texture.height(), texture.height());
+    float texture_value = texture.constData()[i + j * texture.width()] * (1.0f / 255.0f) * p.texStrength;
+    return std::min(std::max(alpha - texture_value, 0.0f), 1.0f);
+}
+
+inline float4 apply_normal_mode(float4 pixel, float4 color, float alpha, float color_alpha)
+{
+    alpha = alpha * color.alpha();
+    float dst_alpha = pixel.alpha();
+
+    float a = alpha * color_alpha + dst_alpha * (1.0f - alpha);
+    float a_term = dst_alpha * (1.0f - alpha);
+
+    if (a > 0.0f) /* Needed because color_alpha can make a = zero */
+        pixel = (color * (alpha * color_alpha) + pixel * a_term) / a;
+
+    return pixel.withAlpha(a);
+}
+
+inline float4 apply_locked_normal_mode(float4 pixel, float4 color, float alpha)
+{
+    float dst_alpha = pixel.alpha();
+
+    if (dst_alpha)
+    {
+        alpha = alpha * color.alpha();
+        float a_term = 1.0f - alpha;
+
+        pixel = (color * alpha + pixel * a_term).withAlpha(dst_alpha);
+    }
+
+    return pixel;
+}
+
+inline float4 apply_isolate_mode(float4 pixel, float4 color, float alpha)
+{
+    float color_a = color.alpha();
+    alpha = alpha * color_a;
+    float dst_alpha = pixel.alpha();
+
+    float a_term = dst_alpha - dst_alpha * alpha;
+    float a = alpha + a_term;
+
+    pixel = (color * alpha + pixel * a_term) / a;
+
+    return pixel.withAlpha(std::max(std::min(a, color_a), dst_alpha));
+}
+
+/* One instance per MyPaintKernels-template.cl variant */
+template <NativeKernels::DabParams::Shape shape, NativeKernels::DabParams::Mode mode, bool textured>
+void mypaintDabVariant(float *buf, int offset, int width, int height, float x, float y,
+                       NativeKernels::DabParams const &p)
+{
+    typedef NativeKernels::DabParams DabParams;
+    const float4 color = float4::load(p.color);
+
+    for (int gidy = 0; gidy < height; ++gidy)
+    {
+        float *row = buf + (gidy * TILE_PIXEL_WIDTH + offset) * 4;
+
+        for (int gidx = 0; gidx < width; ++gidx)
+        {
+            float alpha;
+            if (shape == DabParams::Dab)
+                alpha = alpha_from_dab(gidx - x, gidy - y, p);
+            else if (shape == DabParams::Micro)
+                alpha = alpha_from_subpixel_dab(gidx - x, gidy - y, p);
+            else
+                alpha = alpha_from_mask(gidx - x, gidy - y, p);
+
+            if (textured && alpha > 0.0f)
+                alpha = apply_texture(alpha, gidx + p.texOffsetX - x, gidy + p.texOffsetY - y, p);
+
+            if (alpha > 0.0f)
+            {
+                float *pixel = row + gidx * 4;
+                if (mode == DabParams::Normal)
+                    apply_normal_mode(float4::load(pixel), color, alpha, p.colorAlpha).store(pixel);
+                else if (mode == DabParams::Locked)
+                    apply_locked_normal_mode(float4::load(pixel), color, alpha).store(pixel);
+                else
+                    apply_isolate_mode(float4::load(pixel), color, alpha).store(pixel);
+            }
+        }
+    }
+}
+
+template <NativeKernels::DabParams::Shape shape, NativeKernels::DabParams::Mode mode>
+void mypaintDabMode(float *buf, int offset, int width, int height, float x, float y,
+                    NativeKernels::DabParams const &p)
+{
+    if (p.texture)
+        mypaintDabVariant<shape, mode, true>(buf, offset, width, height, x, y, p);
+    else
+        mypaintDabVariant<shape, mode, false>(buf, offset, width, height, x, y, p);
+}
+
+template <NativeKernels::DabParams::Shape shape>
+void mypaintDabShape(float *buf, int offset, int width, int height, float x, float y,
+                     NativeKernels::DabParams const &p)
+{
+    typedef NativeKernels::DabParams DabParams;
+
+    switch (p.mode) {
+    case DabParams::Locked:
+        mypaintDabMode<shape, DabParams::Locked>(buf, offset, width, height, x, y, p);
+        break;
+    case DabParams::Isolate:
+        mypaintDabMode<shape, DabParams::Isolate>(buf, offset, width, height, x, y, p);
+        break;
+    default:
+        mypaintDabMode<shape, DabParams::Normal>(buf, offset, width, height, x, y, p);
+        break;
+    }
+}
+
+inline float color_query_weight(float xx, float yy, float radius)
+{
+    float rr = (yy * yy + xx * xx) / (radius * radius);
+
+    if (rr <= 1.0f)
+        return 1.0f - rr;
+
+    return 0.0f;
+}
+
+}
+
+void NativeKernels::parallelFor(int count, std::function<void(int)> const &fn)
+{
+    if (count <= 0)
+        return;
+
+    if (count == 1)
+    {
+        fn(0);
+        return;
+    }
+
+    QThreadPool *pool = QThreadPool::globalInstance();
+    std::atomic<int> next(0);
+    QSemaphore done;
+
+    int started = 0;
+    int helpers = std::min(count, pool->maxThreadCount()) - 1;
+    for (int i = 0; i < helpers; ++i)
+    {
+        ParallelForTask *task = new ParallelForTask(fn, &next, count, &done);
+        if (!pool->tryStart(task))
+        {
+            delete task;
+            break;
+        }
+        started++;
+    }
+
+    // The calling thread takes part instead of sleeping
+    ParallelForTask(fn, &next, count, &done).run();
+    done.acquire(started + 1);
+}
+
+void NativeKernels::fill(float *buf, const float color[4])
+{
+    const float4 pixel = float4::load(color);
+
+    for (int i = 0; i < TILE_PIXEL_COUNT; ++i)
+        pixel.store(buf + i * 4);
+}
+
+void NativeKernels::blend(float *inout, const float *aux, BlendMode::Mode mode, float opacity)
+{
+    switch (mode) {
+    case BlendMode::Multiply:
+        for (int i = 0; i < TILE_PIXEL_COUNT * 4; i += 4)
+        {
+            float4 in_pixel = premultiply(float4::load(inout + i));
+            float4 aux_pixel = float4::load(aux + i);
+            aux_pixel = premultiply(aux_pixel.withAlpha(aux_pixel.alpha() * opacity));
+
+            float aA = in_pixel.alpha();
+            float aB = aux_pixel.alpha();
+            float aD = aA + aB - aA * aB;
+
+            float4 out_pixel = in_pixel * aux_pixel + in_pixel * (1.0f - aB) + aux_pixel * (1.0f - aA);
+            unpremultiply(out_pixel.withAlpha(aD)).store(inout + i);
+        }
+        break;
+    case BlendMode::ColorDodge:
+        blendSeparable<BlendMode::ColorDodge>(inout, aux, opacity);
+        break;
+    case BlendMode::ColorBurn:
+        blendSeparable<BlendMode::ColorBurn>(inout, aux, opacity);
+        break;
+    case BlendMode::Screen:
+        for (int i = 0; i < TILE_PIXEL_COUNT * 4; i += 4)
+        {
+            float4 in_pixel = premultiply(float4::load(inout + i));
+            float4 aux_pixel = float4::load(aux + i);
+            aux_pixel = premultiply(aux_pixel.withAlpha(aux_pixel.alpha() * opacity));
+
+            unpremultiply(aux_pixel + in_pixel - aux_pixel * in_pixel).store(inout + i);
+        }
+        break;
+    case BlendMode::Hue:
+        blendNonSeparable<BlendMode::Hue>(inout, aux, opacity);
+        break;
+    case BlendMode::Saturation:
+        blendNonSeparable<BlendMode::Saturation>(inout, aux, opacity);
+        break;
+    case BlendMode::Color:
+        blendNonSeparable<BlendMode::Color>(inout, aux, opacity);
+        break;
+    case BlendMode::Luminosity:
+        blendNonSeparable<BlendMode::Luminosity>(inout, aux, opacity);
+        break;
+    case BlendMode::DestinationIn:
+        for (int i = 0; i < TILE_PIXEL_COUNT * 4; i += 4)
+            inout[i + 3] *= aux[i + 3] * opacity;
+        break;
+    case BlendMode::DestinationOut:
+        for (int i = 0; i < TILE_PIXEL_COUNT * 4; i += 4)
+            inout[i + 3] *= 1.0f - (aux[i + 3] * opacity);
+        break;
+    case BlendMode::SourceAtop:
+        for (int i = 0; i < TILE_PIXEL_COUNT * 4; i += 4)
+        {
+            float4 in_pixel = float4::load(inout + i);
+            float4 aux_pixel = float4::load(aux + i);
+            float alpha = aux_pixel.alpha() * opacity;
+
+            (aux_pixel * alpha + in_pixel * (1.0f - alpha)).withAlpha(in_pixel.alpha()).store(inout + i);
+        }
+        break;
+    case BlendMode::DestinationAtop:
+        for (int i = 0; i < TILE_PIXEL_COUNT * 4; i += 4)
+        {
+            float4 in_pixel = float4::load(inout + i);
+            float4 aux_pixel = float4::load(aux + i);
+            float in_alpha = in_pixel.alpha();
+
+            (aux_pixel * (1.0f - in_alpha) + in_pixel * in_alpha).withAlpha(aux_pixel.alpha() * opacity).store(inout + i);
+        }
+        break;
+    default:
+        for (int i = 0; i < TILE_PIXEL_COUNT * 4; i += 4)
+        {
+            float4 aux_pixel = float4::load(aux + i);
+            overPixel(float4::load(inout + i), aux_pixel, aux_pixel.alpha() * opacity).store(inout + i);
+        }
+        break;
+    }
+}
+
+void NativeKernels::colorMask(float *inout, const float *aux, const float color[4])
+{
+    const float4 colorPixel = float4::load(color);
+
+    for (int i = 0; i < TILE_PIXEL_COUNT * 4; i += 4)
+        overPixel(float4::load(inout + i), colorPixel, aux[i + 3] * color[3]).store(inout + i);
+}
+
+void NativeKernels::circle(float *buf, int x, int y, float r, const float color[4])
+{
+    const float4 colorPixel = float4::load(color);
+    float rr = r * r;
+
+    for (int gidy = 0; gidy < TILE_PIXEL_HEIGHT; ++gidy)
+        for (int gidx = 0; gidx < TILE_PIXEL_WIDTH; ++gidx)
+        {
+            float xx = (x - gidx) * (x - gidx);
+            float yy = (y - gidy) * (y - gidy);
+
+            if (!(xx + yy < rr))
+                continue;
+
+            float dist = std::sqrt(xx + yy);
+            float *p = buf + (gidx + gidy * TILE_PIXEL_WIDTH) * 4;
+            float4 pixel = float4::load(p);
+
+            if (dist < r - 1)
+            {
+                pixel = colorPixel.withAlpha(std::max(pixel.alpha(), color[3]));
+            }
+            else
+            {
+                float alpha = (r - dist) * color[3];
+                float dst_alpha = pixel.alpha();
+
+                float a = alpha + dst_alpha * (1.0f - alpha);
+                float a_term = dst_alpha * (1.0f - alpha);
+
+                pixel = ((colorPixel * alpha + pixel * a_term) / a).withAlpha(std::max(dst_alpha, alpha));
+            }
+
+            pixel.store(p);
+        }
+}
+
+void NativeKernels::gradientApply(const float *src, float *dst, int offsetX, int offsetY,
+                                  float vecX, float vecY, const float color[4])
+{
+    static const float dither[] = {
+      -0.000894779815076f, 0.002526183202987f, -0.002977620989162f, -0.000961841665921f, -0.002219203533179f, 0.001836599187491f,
+      0.000179014870731f, 0.003835451823258f, -0.002844696376256f, -0.002614203357553f, -0.000898684569121f, -0.003781822497427f,
+      -0.002539903013743f, -0.000730459373852f, -0.000492445411811f, -0.000019733080357f, 0.000133445502853f, -0.002035096966073f,
+      -0.001587624212566f, 0.001823724900110f, 0.003437126611359f, -0.002672838034602f, 0.000914430428299f, 0.001704298686780f,
+      0.003892962149703f, -0.001302441040775f, -0.000471331115497f, 0.001042514261109f, -0.003063514405616f, 0.000820492568349f,
+      0.001999632846291f, -0.001792838602531f, 0.002961764819442f, 0.001970719332613f, -0.001919485561856f, -0.000647735315795f,
+      0.002299355285000f, -0.000581302872970f, -0.002460143133076f, 0.003562597378860f, -0.000396333070068f, -0.003393733448024f,
+      0.002455015627391f, -0.002245091262948f, 0.001779916879067f, 0.002850201434824f, 0.003134923628933f
+    };
+    static const int dither_size = sizeof(dither) / sizeof(dither[0]);
+    const float4 colorPixel = float4::load(color);
+
+    for (int gidy = 0; gidy < TILE_PIXEL_HEIGHT; ++gidy)
+        for (int gidx = 0; gidx < TILE_PIXEL_WIDTH; ++gidx)
+        {
+            int idx = gidx + gidy * TILE_PIXEL_WIDTH;
+            float value = vecX * (gidx + offsetX) + vecY * (gidy + offsetY) + dither[idx % dither_size];
+            value = std::min(std::max(value, 0.0f), 1.0f);
+
+            float4 outColor = float4::load(src + idx * 4);
+            if (outColor.alpha() > 0.0f)
+                outColor = (colorPixel * value + outColor * (1.0f - value)).withAlpha(outColor.alpha());
+            outColor.store(dst + idx * 4);
+        }
+}
+
+void NativeKernels::matrixApply(const float *src, float *dst, const float matrix[4], float offsetX, float offsetY)
+{
+    auto sampleAxis = [](int base, float coord, int upper_bound, float &w0, float &w1) {
+        if (base < -1)
+        {
+            w0 = w1 = 0.0f;
+        }
+        else if (base < 0)
+        {
+            w1 = coord - base;
+            w0 = 0.0f;
+        }
+        else if (base >= upper_bound)
+        {
+            w0 = w1 = 0.0f;
+        }
+        else if (base >= upper_bound - 1)
+        {
+            w1 = 0.0f;
+            w0 = 1.0f - (coord - base);
+        }
+        else
+        {
+            w1 = coord - base;
+            w0 = 1.0f - w1;
+        }
+    };
+
+    auto sample = [src](int x, int y) {
+        return premultiply(float4::load(src + (x + y * TILE_PIXEL_WIDTH) * 4));
+    };
+
+    for (int gidy = 0; gidy < TILE_PIXEL_HEIGHT; ++gidy)
+        for (int gidx = 0; gidx < TILE_PIXEL_WIDTH; ++gidx)
+        {
+            int idx = gidx + gidy * TILE_PIXEL_WIDTH;
+            float coordX = gidx * matrix[0] + gidy * matrix[1] + offsetX;
+            float coordY = gidx * matrix[2] + gidy * matrix[3] + offsetY;
+
+            int lowerX = std::floor(coordX);
+            int lowerY = std::floor(coordY);
+            int upperX = lowerX + 1;
+            int upperY = lowerY + 1;
+
+            float xw0, xw1, yw0, yw1;
+            sampleAxis(lowerX, coordX, TILE_PIXEL_WIDTH, xw0, xw1);
+            sampleAxis(lowerY, coordY, TILE_PIXEL_HEIGHT, yw0, yw1);
+
+            float4 result = premultiply(float4::load(dst + idx * 4));
+
+            if (xw0 != 0.0f)
+            {
+                if (yw0 != 0.0f)
+                    result += sample(lowerX, lowerY) * (xw0 * yw0);
+                if (yw1 != 0.0f)
+                    result += sample(lowerX, upperY) * (xw0 * yw1);
+            }
+
+            if (xw1 != 0.0f)
+            {
+                if (yw0 != 0.0f)
+                    result += sample(upperX, lowerY) * (xw1 * yw0);
+                if (yw1 != 0.0f)
+                    result += sample(upperX, upperY) * (xw1 * yw1);
+            }
+
+            unpremultiply(result).store(dst + idx * 4);
+        }
+}
+
+void NativeKernels::subrectCopy(const float *src, int srcX, int srcY, float *dst, int dstX, int dstY, int width, int height)
+{
+    for (int row = 0; row < height; ++row)
+        memcpy(dst + ((dstY + row) * TILE_PIXEL_WIDTH + dstX) * 4,
+               src + ((srcY + row) * TILE_PIXEL_WIDTH + srcX) * 4,
+               width * sizeof(float) * 4);
+}
+
+void NativeKernels::isolateComposite(float *out, const float *in, const float *aux,
+                                     int offset, int width, int height, IsolateOperation operation)
+{
+    for (int row = 0; row < height; ++row)
+    {
+        const int rowStart = (offset + row * TILE_PIXEL_WIDTH) * 4;
+
+        if (operation == IsolateCopy)
+        {
+            memcpy(out + rowStart, aux + rowStart, width * sizeof(float) * 4);
+            continue;
+        }
+
+        for (int i = rowStart; i < rowStart + width * 4; i += 4)
+        {
+            float4 in_pixel = float4::load(in + i);
+            float4 aux_pixel = float4::load(aux + i);
+
+            if (operation == IsolateOver)
+                overPixel(in_pixel, aux_pixel, aux_pixel.alpha()).store(out + i);
+            else if (operation == IsolateSourceAtop)
+                (aux_pixel * aux_pixel.alpha() + in_pixel * (1.0f - aux_pixel.alpha())).withAlpha(in_pixel.alpha()).store(out + i);
+            else
+                in_pixel.withAlpha(in_pixel.alpha() * (1.0f - aux_pixel.alpha())).store(out + i);
+        }
+    }
+}
+
+void NativeKernels::tileDiffBounds(const float *a, const float *b, int bounds[4])
+{
+    const size_t rowBytes = TILE_PIXEL_WIDTH * 4 * sizeof(float);
+
+    for (int y = 0; y < TILE_PIXEL_HEIGHT; ++y)
+    {
+        const float *rowA = a + y * TILE_PIXEL_WIDTH * 4;
+        const float *rowB = b + y * TILE_PIXEL_WIDTH * 4;
+
+        if (memcmp(rowA, rowB, rowBytes) == 0)
+            continue;
+
+        int x = 0;
+        while (memcmp(rowA + x * 4, rowB + x * 4, 4 * sizeof(float)) == 0)
+            ++x;
+        bounds[0] = std::min(bounds[0], x);
+
+        x = TILE_PIXEL_WIDTH - 1;
+        while (memcmp(rowA + x * 4, rowB + x * 4, 4 * sizeof(float)) == 0)
+            --x;
+        bounds[2] = std::max(bounds[2], x);
+
+        bounds[1] = std::min(bounds[1], y);
+        bounds[3] = std::max(bounds[3], y);
+    }
+}
+
+void NativeKernels::fillFloats(float *mask, float value)
+{
+    std::fill(mask, mask + TILE_PIXEL_COUNT, value);
+}
+
+void NativeKernels::maskCircle(float *mask, float x, float y, float r, float circle_alpha)
+{
+    float rr = r * r;
+
+    for (int gidy = 0; gidy < TILE_PIXEL_HEIGHT; ++gidy)
+        for (int gidx = 0; gidx < TILE_PIXEL_WIDTH; ++gidx)
+        {
+            float xx = (x - gidx) * (x - gidx);
+            float yy = (y - gidy) * (y - gidy);
+
+            if (!(xx + yy < rr))
+                continue;
+
+            float dist = std::sqrt(xx + yy);
+            float alpha = (dist < r - 1) ? circle_alpha : (r - dist) * circle_alpha;
+            float &value = mask[gidx + gidy * TILE_PIXEL_WIDTH];
+
+            if (value < alpha)
+                value = alpha;
+        }
+}
+
+void NativeKernels::applyMaskTile(float *out, const float *in, const float *mask, const float color[4])
+{
+    const float4 colorPixel = float4::load(color);
+
+    for (int i = 0; i < TILE_PIXEL_COUNT; ++i)
+        overPixel(float4::load(in + i * 4), colorPixel, color[3] * mask[i]).store(out + i * 4);
+}
+
+void NativeKernels::patternFillCircle(float *buf, int x, int y, int patternX, int patternY, float r, QImage const &pattern)
+{
+    const int w = pattern.width();
+    const int h = pattern.height();
+
+    for (int gidy = 0; gidy < TILE_PIXEL_HEIGHT; ++gidy)
+    {
+        int j = repeatNearest(float(patternY + gidy) / h, h);
+        const uchar *patternRow = pattern.constScanLine(j);
+
+        for (int gidx = 0; gidx < TILE_PIXEL_WIDTH; ++gidx)
+        {
+            float dx = x - gidx;
+            float dy = y - gidy;
+
+            if (std::sqrt(dx * dx + dy * dy) <= r)
+            {
+                const uchar *texel = patternRow + repeatNearest(float(patternX + gidx) / w, w) * 4;
+                float4 pixel = float4(texel[0], texel[1], texel[2], texel[3]) * (1.0f / 255.0f);
+                pixel.store(buf + (gidx + gidy * TILE_PIXEL_WIDTH) * 4);
+            }
+        }
+    }
+}
+
+void NativeKernels::mypaintDab(float *buf, int offset, int width, int height, float x, float y, DabParams const &params)
+{
+    switch (params.shape) {
+    case DabParams::Micro:
+        mypaintDabShape<DabParams::Micro>(buf, offset, width, height, x, y, params);
+        break;
+    case DabParams::Mask:
+        mypaintDabShape<DabParams::Mask>(buf, offset, width, height, x, y, params);
+        break;
+    default:
+        mypaintDabShape<DabParams::Dab>(buf, offset, width, height, x, y, params);
+        break;
+    }
+}
+
+void NativeKernels::mypaintColorQuery(const float *buf, float x, float y, int offset, int width, int height,
+                                      float radius, float accum[5])
+{
+    float4 total_accum;
+    float total_weight = 0.0f;
+
+    for (int gidy = 0; gidy < height; ++gidy)
+    {
+        float4 row_accum;
+        float row_weight = 0.0f;
+
+        for (int ix = 0; ix < width; ++ix)
+        {
+            float pixel_weight = color_query_weight(ix - x, gidy - y, radius);
+
+            if (buf)
+            {
+                float4 pixel = float4::load(buf + (ix + gidy * TILE_PIXEL_WIDTH + offset) * 4);
+                row_accum += premultiply(pixel) * pixel_weight;
+            }
+            row_weight += pixel_weight;
+        }
+
+        total_accum += row_accum;
+        total_weight += row_weight;
+    }
+
+    float values[4];
+    total_accum.store(values);
+    for (int i = 0; i < 4; ++i)
+        accum[i] += values[i];
+    accum[4] += total_weight;
+}
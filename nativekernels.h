@@ -0,0 +1,78 @@
+#ifndef NATIVEKERNELS_H
+#define NATIVEKERNELS_H
+
+#include <functional>
+#include <QImage>
+#include "blendmodes.h"
+#include "maskbuffer.h"
+
+/* Host implementations of the OpenCL kernels, used when SharedOpenCL runs the
+ * native backend. Each function matches the kernel of the same name in the .cl
+ * sources, tile buffers are TILE_PIXEL_WIDTH * TILE_PIXEL_HEIGHT RGBA floats and
+ * mask buffers are TILE_PIXEL_WIDTH * TILE_PIXEL_HEIGHT floats.
+ */
+namespace NativeKernels
+{
+    /* Call fn(0) ... fn(count - 1) from the global thread pool and the calling
+     * thread, returning when all of them have finished. Must not be nested.
+     */
+    void parallelFor(int count, std::function<void(int)> const &fn);
+
+    void fill(float *buf, const float color[4]);
+    void blend(float *inout, const float *aux, BlendMode::Mode mode, float opacity);
+    void colorMask(float *inout, const float *aux, const float color[4]);
+    void circle(float *buf, int x, int y, float r, const float color[4]);
+    void gradientApply(const float *src, float *dst, int offsetX, int offsetY,
+                       float vecX, float vecY, const float color[4]);
+    void matrixApply(const float *src, float *dst, const float matrix[4], float offsetX, float offsetY);
+    /* Copy a width x height block, in pixels, between two tiles */
+    void subrectCopy(const float *src, int srcX, int srcY, float *dst, int dstX, int dstY, int width, int height);
+
+    void fillFloats(float *mask, float value);
+    void maskCircle(float *mask, float x, float y, float r, float alpha);
+    void applyMaskTile(float *out, const float *in, const float *mask, const float color[4]);
+
+    enum IsolateOperation { IsolateCopy, IsolateOver, IsolateSourceAtop, IsolateDestinationOut };
+    /* out = aux composited onto in for a width x height block starting at offset, in
+     * is unused by IsolateCopy. out may be a different tile from in.
+     */
+    void isolateComposite(float *out, const float *in, const float *aux,
+                          int offset, int width, int height, IsolateOperation operation);
+
+    /* Grow bounds (min x, min y, max x, max y) to cover every pixel that differs between a and b */
+    void tileDiffBounds(const float *a, const float *b, int bounds[4]);
+
+    /* pattern must be QImage::Format_RGBA8888 */
+    void patternFillCircle(float *buf, int x, int y, int patternX, int patternY, float r, QImage const &pattern);
+
+    struct DabParams
+    {
+        enum Shape { Dab, Micro, Mask } shape = Dab;
+        enum Mode { Normal, Locked, Isolate } mode = Normal;
+
+        float hardness = 0.0f;
+        float slope1 = 0.0f;
+        float slope2 = 0.0f;
+        float matrix[4] = {1.0f, 0.0f, 0.0f, 1.0f};
+        MaskBuffer const *stamp = nullptr; /* Mask shape only */
+
+        MaskBuffer const *texture = nullptr; /* Null if untextured */
+        float texOffsetX = 0.0f;
+        float texOffsetY = 0.0f;
+        float texStrength = 0.0f;
+
+        float colorAlpha = 1.0f;
+        float color[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+    };
+
+    /* One of the mypaint_* template kernels over a width x height block starting at offset */
+    void mypaintDab(float *buf, int offset, int width, int height, float x, float y, DabParams const &params);
+
+    /* mypaint_color_query_tile for one tile, buf may be null for an empty
+     * tile. Adds {r * a, g * a, b * a, a} * weight and weight to accum.
+     */
+    void mypaintColorQuery(const float *buf, float x, float y, int offset, int width, int height,
+                           float radius, float accum[5]);
+}
+
+#endif // NATIVEKERNELS_H
@@ -0,0 +1,183 @@
+#include "openclprofiler.h"
+#include <algorithm>
+#include <QMutexLocker>
+#include <QJsonObject>
+
+OpenCLProfiler::OpenCLProfiler()
+    : pending(0)
+{
+}
+
+OpenCLProfiler::~OpenCLProfiler()
+{
+    waitForPending();
+}
+
+OpenCLProfiler::Entry *OpenCLProfiler::entryFor(QByteArray const &name)
+{
+    auto found = entries.find(name);
+    if (found == entries.end())
+    {
+        Entry entry;
+        entry.profiler = this;
+        entry.stats.name = name;
+        found = entries.emplace(name, entry).first;
+    }
+
+    return &found->second;
+}
+
+void OpenCLProfiler::record(cl_event event, Entry *entry)
+{
+    /* The callback may run immediately if the event has already completed,
+     * so it must be registered without holding the lock.
+     */
+    {
+        QMutexLocker lock(&mutex);
+        pending++;
+    }
+
+    clRetainEvent(event);
+    if (CL_SUCCESS != clSetEventCallback(event, CL_COMPLETE, eventComplete, entry))
+    {
+        clReleaseEvent(event);
+
+        QMutexLocker lock(&mutex);
+        if (--pending == 0)
+            pendingDone.wakeAll();
+    }
+}
+
+void OpenCLProfiler::record(cl_event event, cl_kernel kernel)
+{
+    Entry *entry;
+
+    {
+        QMutexLocker lock(&mutex);
+
+        Entry *&kernelEntry = kernelEntries[kernel];
+        if (!kernelEntry)
+        {
+            size_t nameSize = 0;
+            clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, nullptr, &nameSize);
+            QByteArray name(nameSize, '\0');
+            clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, nameSize, name.data(), nullptr);
+            // Drop the trailing null
+            name.truncate(qstrlen(name.constData()));
+            kernelEntry = entryFor(name);
+        }
+        entry = kernelEntry;
+    }
+
+    record(event, entry);
+}
+
+void OpenCLProfiler::record(cl_event event, const char *command)
+{
+    Entry *entry;
+
+    {
+        QMutexLocker lock(&mutex);
+        entry = entryFor(QByteArray(command));
+    }
+
+    record(event, entry);
+}
+
+void CL_CALLBACK OpenCLProfiler::eventComplete(cl_event event, cl_int status, void *userData)
+{
+    Entry *entry = reinterpret_cast<Entry *>(userData);
+    OpenCLProfiler *self = entry->profiler;
+
+    cl_ulong queued = 0, submit = 0, start = 0, end = 0;
+    bool valid = status == CL_COMPLETE;
+    valid = valid && CL_SUCCESS == clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, nullptr);
+    valid = valid && CL_SUCCESS == clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(submit), &submit, nullptr);
+    valid = valid && CL_SUCCESS == clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, nullptr);
+    valid = valid && CL_SUCCESS == clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr);
+    clReleaseEvent(event);
+
+    QMutexLocker lock(&self->mutex);
+
+    if (valid)
+    {
+        Stats &stats = entry->stats;
+        quint64 run = end - start;
+
+        if (stats.count == 0 || run < stats.minRunNs)
+            stats.minRunNs = run;
+        if (run > stats.maxRunNs)
+            stats.maxRunNs = run;
+
+        stats.count++;
+        stats.queuedNs += submit - queued;
+        stats.submitNs += start - submit;
+        stats.runNs += run;
+    }
+
+    if (--self->pending == 0)
+        self->pendingDone.wakeAll();
+}
+
+bool OpenCLProfiler::waitForPending(unsigned long msecs)
+{
+    QMutexLocker lock(&mutex);
+
+    while (pending > 0)
+        if (!pendingDone.wait(&mutex, msecs))
+            return false;
+
+    return true;
+}
+
+void OpenCLProfiler::reset()
+{
+    QMutexLocker lock(&mutex);
+
+    // Entries stay allocated because in-flight callbacks still point at them
+    for (auto &iter: entries)
+    {
+        QByteArray name = iter.second.stats.name;
+        iter.second.stats = Stats();
+        iter.second.stats.name = name;
+    }
+}
+
+std::vector<OpenCLProfiler::Stats> OpenCLProfiler::results()
+{
+    std::vector<Stats> result;
+
+    {
+        QMutexLocker lock(&mutex);
+        for (auto const &iter: entries)
+            if (iter.second.stats.count)
+                result.push_back(iter.second.stats);
+    }
+
+    std::sort(result.begin(), result.end(), [](Stats const &a, Stats const &b) {
+        return a.runNs > b.runNs;
+    });
+
+    return result;
+}
+
+QJsonArray OpenCLProfiler::toJson()
+{
+    QJsonArray result;
+
+    for (Stats const &stats: results())
+    {
+        QJsonObject entry;
+        entry["name"] = QString::fromUtf8(stats.name);
+        entry["count"] = double(stats.count);
+        entry["queued_ms"] = stats.queuedNs / 1.0e6;
+        entry["submit_ms"] = stats.submitNs / 1.0e6;
+        entry["run_ms"] = stats.runNs / 1.0e6;
+        entry["mean_run_us"] = stats.runNs / 1.0e3 / stats.count;
+        entry["min_run_us"] = stats.minRunNs / 1.0e3;
+        entry["max_run_us"] = stats.maxRunNs / 1.0e3;
+        result.append(entry);
+    }
+
+    return result;
+}
@@ -0,0 +1,69 @@
+#ifndef OPENCLPROFILER_H
+#define OPENCLPROFILER_H
+
+#include <map>
+#include <vector>
+#include <QByteArray>
+#include <QJsonArray>
+#include <QMutex>
+#include <QWaitCondition>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+/* Aggregates the CL_QUEUE_PROFILING_ENABLE timestamps of completed commands
+ * by kernel (or command) name. Events are handed over with record() and are
+ * collected from the driver's completion callback.
+ */
+class OpenCLProfiler
+{
+public:
+    struct Stats
+    {
+        QByteArray name;
+        quint64 count = 0;
+        quint64 queuedNs = 0; /* CL_PROFILING_COMMAND_QUEUED -> SUBMIT */
+        quint64 submitNs = 0; /* CL_PROFILING_COMMAND_SUBMIT -> START */
+        quint64 runNs = 0;    /* CL_PROFILING_COMMAND_START -> END */
+        quint64 minRunNs = 0;
+        quint64 maxRunNs = 0;
+    };
+
+    OpenCLProfiler();
+    ~OpenCLProfiler();
+    OpenCLProfiler(const OpenCLProfiler&) = delete;
+    OpenCLProfiler &operator=(const OpenCLProfiler&) = delete;
+
+    void record(cl_event event, cl_kernel kernel);
+    void record(cl_event event, const char *command);
+
+    /* Block until all recorded events have reported back, or msecs pass */
+    bool waitForPending(unsigned long msecs = 5000);
+    void reset();
+
+    /* Sorted by total run time, longest first */
+    std::vector<Stats> results();
+    QJsonArray toJson();
+
+private:
+    struct Entry
+    {
+        OpenCLProfiler *profiler;
+        Stats stats;
+    };
+
+    Entry *entryFor(QByteArray const &name);
+    void record(cl_event event, Entry *entry);
+    static void CL_CALLBACK eventComplete(cl_event event, cl_int status, void *userData);
+
+    QMutex mutex;
+    QWaitCondition pendingDone;
+    int pending;
+    std::map<QByteArray, Entry> entries;
+    std::map<cl_kernel, Entry *> kernelEntries;
+};
+
+#endif // OPENCLPROFILER_H
@@ -7,17 +7,27 @@
 #include <QDebug>
 #include <QtEndian>
 #include <QSaveFile>
+#include <QFileInfo>
+#include <QSet>
 #include <QBuffer>
 #include <QXmlStreamWriter>
 #include <QXmlStreamReader>
 #include <qzipwriter.h>
 #include <qzipreader.h>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <algorithm>
 #include <cstdint>
+#include <vector>
 
 #include "lodepng.h"
 #include "imagefiles.h"
+#include "pngstream.h"
 
-namespace {
 QString blendModeToOraOp(BlendMode::Mode mode)
 {
     if (mode == BlendMode::Over)
@@ -80,6 +90,7 @@ BlendMode::Mode oraOpToMode(QString opName)
     return BlendMode::Over;
 }
 
+namespace {
 void writePixelRGBA(const float *in, uint16_t *out)
 {
     float r = in[0];
@@ -110,23 +121,202 @@ void writePixelRGBA(const float *in, uint16_t *out)
     }
 }
 
-void writeBackground(QZipWriter &writer, QString const &path, CanvasTile *tile, QSize const &tileBounds)
+/* Runs a list of jobs on the global thread pool, the calling thread collects them
+ * in order with waitFor() and works on jobs nobody has started while it waits.
+ * Jobs are started at most one per thread ahead of the one being collected, so
+ * finished results don't pile up faster than they're consumed.
+ */
+class JobRunner
+{
+public:
+    explicit JobRunner(std::vector<std::function<void()>> jobList)
+        : jobs(std::move(jobList)),
+          done(jobs.size(), false),
+          next(0),
+          collected(0),
+          helpers(0)
+    {
+        QThreadPool *pool = QThreadPool::globalInstance();
+        int wanted = std::min<int>(jobs.size(), pool->maxThreadCount()) - 1;
+        window = std::max(wanted, 0) + 1;
+
+        for (int i = 0; i < wanted; ++i)
+        {
+            QRunnable *task = new Helper(this);
+            if (!pool->tryStart(task))
+            {
+                delete task;
+                break;
+            }
+            helpers++;
+        }
+    }
+
+    ~JobRunner()
+    {
+        // Jobs that haven't started yet won't be collected
+        {
+            QMutexLocker lock(&mutex);
+            next = jobs.size();
+            jobCollected.wakeAll();
+        }
+
+        helpersDone.acquire(helpers);
+    }
+
+    void waitFor(size_t index)
+    {
+        QMutexLocker lock(&mutex);
+
+        if (index > collected)
+        {
+            collected = index;
+            jobCollected.wakeAll();
+        }
+
+        while (!done[index])
+        {
+            lock.unlock();
+            bool ran = runNext(false);
+            lock.relock();
+
+            if (!ran)
+                while (!done[index])
+                    jobFinished.wait(&mutex);
+        }
+    }
+
+private:
+    class Helper : public QRunnable
+    {
+    public:
+        Helper(JobRunner *runner) : runner(runner) {}
+
+        void run()
+        {
+            while (runner->runNext(true))
+                ;
+            runner->helpersDone.release();
+        }
+
+        JobRunner *runner;
+    };
+
+    /* Run the next job, if wait is false this gives up rather than waiting for
+     * the collected jobs to catch up.
+     */
+    bool runNext(bool wait)
+    {
+        size_t index = 0;
+
+        {
+            QMutexLocker lock(&mutex);
+
+            while (next < jobs.size() && next >= collected + window)
+            {
+                if (!wait)
+                    return false;
+                jobCollected.wait(&mutex);
+            }
+
+            if (next >= jobs.size())
+                return false;
+
+            index = next++;
+        }
+
+        jobs[index]();
+
+        QMutexLocker lock(&mutex);
+        done[index] = true;
+        jobFinished.wakeAll();
+        return true;
+    }
+
+    std::vector<std::function<void()>> jobs;
+    std::vector<bool> done;
+    size_t next;
+    size_t collected;
+    size_t window;
+    int helpers;
+    QSemaphore helpersDone;
+    QMutex mutex;
+    QWaitCondition jobFinished;
+    QWaitCondition jobCollected;
+};
+
+/* A file to add to the archive, encoded by a JobRunner */
+struct OraEntry
+{
+    QString path;
+    /* Reported through the progress callback when the entry is written, if not empty */
+    QString progressMessage;
+    std::function<QByteArray()> encode;
+    /* If set the data is copied from this file in the previous ORA instead of being encoded */
+    QString copyFrom;
+    QByteArray data;
+};
+
+const char backgroundTileFile[] = "data/background_tile.png";
+const char backgroundLayerFile[] = "data/background_layer.png";
+
+/* The parts of record that can still be copied from its file, reader is opened on
+ * the file if anything can. The file must not have been touched since the record
+ * was made.
+ */
+OraFileRecord usableRecord(OraFileRecord const &record, std::unique_ptr<QZipReader> &reader)
+{
+    OraFileRecord result;
+
+    if (record.filePath.isEmpty())
+        return result;
+
+    QFileInfo fileInfo(record.filePath);
+    if (!fileInfo.exists() || fileInfo.lastModified() != record.lastModified || fileInfo.size() != record.size)
+        return result;
+
+    reader.reset(new QZipReader(record.filePath, QIODevice::ReadOnly));
+    if (reader->status() != QZipReader::NoError)
+    {
+        reader.reset();
+        return result;
+    }
+
+    QSet<QString> files;
+    for (QZipReader::FileInfo const &info: reader->fileInfoList())
+        files.insert(info.filePath);
+
+    for (auto const &iter: record.layers)
+        if (files.contains(iter.second.path))
+            result.layers.insert(iter);
+
+    if (files.contains(backgroundTileFile) && files.contains(backgroundLayerFile))
+    {
+        result.backgroundPixels = record.backgroundPixels;
+        result.backgroundSize = record.backgroundSize;
+    }
+
+    return result;
+}
+
+/* tileData must already be mapped, this runs off the calling thread */
+QByteArray encodeBackground(const float *tileData, QSize const &tileBounds)
 {
     QSize resultBounds(TILE_PIXEL_WIDTH * tileBounds.width(),
                        TILE_PIXEL_HEIGHT * tileBounds.height());
-    std::unique_ptr<uint16_t> layerData(new uint16_t[resultBounds.width() * resultBounds.height() * 3]);
+
+    // Every tile row of the background is the same, so only one is built
+    std::vector<uint16_t> rowData(resultBounds.width() * TILE_PIXEL_HEIGHT * 3);
 
     // Save the background as an RGB png, MyPaint can't load RGBA backgrounds
     {
         size_t rowComps = resultBounds.width() * 3;
 
-        uint16_t *rowPtr = layerData.get();
-        const float *tileData = tile->mapHost();
+        uint16_t *rowPtr = rowData.data();
 
-        for (int row = 0; row < resultBounds.height(); row++)
+        for (int row = 0; row < TILE_PIXEL_HEIGHT; row++)
         {
-            int tileY = row % TILE_PIXEL_HEIGHT;
-            const float *srcPtr = tileData + (TILE_PIXEL_WIDTH * 4) * tileY;
+            const float *srcPtr = tileData + (TILE_PIXEL_WIDTH * 4) * row;
 
             for (int col = 0; col < resultBounds.width(); col++)
             {
@@ -141,33 +331,95 @@ void writeBackground(QZipWriter &writer, QString const &path, CanvasTile *tile,
         }
     }
 
-    unsigned char *pngData = nullptr;
-    size_t pngDataSize;
-    unsigned int png_error;
+    QBuffer buffer;
+    buffer.open(QIODevice::WriteOnly);
+    PNGStreamWriter writer(&buffer, resultBounds.width(), resultBounds.height(), PNGStreamWriter::RGB);
+
+    for (int iy = 0; iy < tileBounds.height(); ++iy)
+        writer.writeRows(rowData.data(), TILE_PIXEL_HEIGHT);
+    writer.finish();
+
+    return buffer.buffer();
+}
+
+/* The layer's tiles must already be mapped, this runs off the calling thread.
+ * Only one row of tiles is held uncompressed at a time.
+ */
+QByteArray encodeLayer(CanvasLayer const *layer, QRect const &tileBounds)
+{
+    QBuffer buffer;
+    buffer.open(QIODevice::WriteOnly);
+
+    if (tileBounds.isEmpty())
+    {
+        const uint16_t empty[4] = {0, 0, 0, 0};
+        PNGStreamWriter writer(&buffer, 1, 1, PNGStreamWriter::RGBA);
+        writer.writeRows(empty, 1);
+        writer.finish();
+        return buffer.buffer();
+    }
+
+    QSize size(tileBounds.width() * TILE_PIXEL_WIDTH,
+               tileBounds.height() * TILE_PIXEL_HEIGHT);
+    PNGStreamWriter writer(&buffer, size.width(), size.height(), PNGStreamWriter::RGBA);
+
+    std::vector<uint16_t> rowData(size.width() * TILE_PIXEL_HEIGHT * 4);
+    size_t rowComps = size.width() * 4;
+
+    for (int iy = 0; iy < tileBounds.height(); ++iy)
+    {
+        for (int ix = 0; ix < tileBounds.width(); ++ix)
+        {
+            CanvasTile *tile = layer->getTileMaybe(ix + tileBounds.x(), iy + tileBounds.y());
+            uint16_t *rowPtr = rowData.data() + (4 * ix * TILE_PIXEL_WIDTH);
+            if (tile)
+            {
+                const float *tileData = tile->mapHost();
 
-    png_error = lodepng_encode_memory(&pngData, &pngDataSize,
-                                      (unsigned char*)layerData.get(),
-                                      resultBounds.width(), resultBounds.height(),
-                                      LCT_RGB, 16);
+                for (int row = 0; row < TILE_PIXEL_HEIGHT; row++)
+                {
+                    for (int col = 0; col < TILE_PIXEL_WIDTH; col++)
+                    {
+                        writePixelRGBA(tileData + (col * 4), rowPtr + (col * 4));
+                    }
 
-    if (png_error)
-        qWarning() << "lodepng error:" << lodepng_error_text(png_error);
+                    rowPtr += rowComps;
+                    tileData += TILE_PIXEL_WIDTH * 4;
+                }
+            }
+            else
+            {
+                for (int row = 0; row < TILE_PIXEL_HEIGHT; row++)
+                {
+                    memset(rowPtr, 0, TILE_PIXEL_WIDTH * sizeof(uint16_t) * 4);
+                    rowPtr += rowComps;
+                }
+            }
+        }
+
+        writer.writeRows(rowData.data(), TILE_PIXEL_HEIGHT);
+    }
+
+    writer.finish();
 
-    writer.addFile(path, QByteArray::fromRawData((const char *)pngData, pngDataSize));
+    return buffer.buffer();
+}
 
-    if (pngData)
-        free(pngData);
+QByteArray encodeImage(QImage const &image)
+{
+    QBuffer buffer;
+    image.save(&buffer, "PNG");
+    return buffer.buffer();
 }
 
 void writeStack(QXmlStreamWriter &stackXML,
-                QZipWriter &oraZipWriter,
+                std::vector<OraEntry> &entries,
                 int imageX,
                 int imageY,
                 QList<CanvasLayer *> const &layers,
                 int &layerNum,
-                int &progressStep,
-                float progressStepTotal,
-                std::function<void(QString const &, float)> progressCallback)
+                OraFileRecord const &previous,
+                OraFileRecord &saved)
 {
     for (int layerIdx = layers.size() - 1; layerIdx >= 0; layerIdx--)
     {
@@ -175,79 +427,40 @@ void writeStack(QXmlStreamWriter &stackXML,
 
         if (currentLayer->type == LayerType::Layer)
         {
-            QRect tileBounds = tileSetBounds(currentLayer->getTileSet());
+            QString layerFileName = QString::asprintf("data/layer%03d.png", layerNum++);
 
-            progressCallback(QStringLiteral("Saving layer \"%1\"").arg(currentLayer->name), progressStep++ / progressStepTotal);
+            OraEntry entry;
+            entry.path = layerFileName;
+            entry.progressMessage = QStringLiteral("Saving layer \"%1\"").arg(currentLayer->name);
 
-            QRect bounds;
-            uint16_t *layerData = NULL;
+            QPoint origin;
+            auto reused = previous.layers.find(currentLayer->contentVersion);
 
-            if (tileBounds.isEmpty())
+            if (reused != previous.layers.end())
             {
-                bounds = QRect(0, 0, 1, 1);
-                layerData = new uint16_t[bounds.width() * bounds.height() * 4];
-                memset(layerData, 0, bounds.width() * bounds.height() * 4 * sizeof(uint16_t));
+                // Unchanged since the previous file, its PNG is copied as is
+                entry.copyFrom = reused->second.path;
+                origin = reused->second.origin;
             }
             else
             {
-                bounds = QRect(tileBounds.x() * TILE_PIXEL_WIDTH,
-                               tileBounds.y() * TILE_PIXEL_HEIGHT,
-                               tileBounds.width() * TILE_PIXEL_WIDTH,
-                               tileBounds.height() * TILE_PIXEL_HEIGHT);
-
-                // Linearize image
-                layerData = new uint16_t[bounds.width() * bounds.height() * 4];
-                size_t rowComps = bounds.width() * 4;
-
-                for (int iy = 0; iy < tileBounds.height(); ++iy)
-                    for (int ix = 0; ix < tileBounds.width(); ++ix)
-                    {
-                        CanvasTile *tile = currentLayer->getTileMaybe(ix + tileBounds.x(), iy + tileBounds.y());
-                        uint16_t *rowPtr = layerData + (rowComps * iy * TILE_PIXEL_HEIGHT)
-                                                     + (4 * ix * TILE_PIXEL_WIDTH);
-                        if (tile)
-                        {
-                            const float *tileData = tile->mapHost();
-
-                            for (int row = 0; row < TILE_PIXEL_HEIGHT; row++)
-                            {
-                                for (int col = 0; col < TILE_PIXEL_WIDTH; col++)
-                                {
-                                    writePixelRGBA(tileData + (col * 4), rowPtr + (col * 4));
-                                }
-
-                                rowPtr += rowComps;
-                                tileData += TILE_PIXEL_WIDTH * 4;
-                            }
-                        }
-                        else
-                        {
-                            for (int row = 0; row < TILE_PIXEL_HEIGHT; row++)
-                            {
-                                memset(rowPtr, 0, TILE_PIXEL_WIDTH * sizeof(uint16_t) * 4);
-                                rowPtr += rowComps;
-                            }
-                        }
-                    }
-            }
+                QRect tileBounds = tileSetBounds(currentLayer->getTileSet());
 
-            unsigned char *pngData;
-            size_t pngDataSize;
+                if (!tileBounds.isEmpty())
+                    origin = QPoint(tileBounds.x() * TILE_PIXEL_WIDTH,
+                                    tileBounds.y() * TILE_PIXEL_HEIGHT);
 
-            unsigned int png_error = lodepng_encode_memory(&pngData, &pngDataSize,
-                                                           (unsigned char*)layerData,
-                                                           bounds.width(), bounds.height(),
-                                                           LCT_RGBA, 16);
+                // Mapping uses the OpenCL queue, so it's done here rather than by the encoder
+                for (auto const &iter: *currentLayer->tiles)
+                    iter.second->mapHost();
 
-            if (png_error)
-                qDebug() << "lodepng error:" << lodepng_error_text(png_error);
-
-            QString layerFileName = QString::asprintf("data/layer%03d.png", layerNum++);
-
-            oraZipWriter.addFile(layerFileName, QByteArray::fromRawData((const char *)pngData, pngDataSize));
+                entry.encode = [currentLayer, tileBounds]() {
+                    return encodeLayer(currentLayer, tileBounds);
+                };
+            }
 
-            free(pngData);
-            delete[] layerData;
+            entries.push_back(entry);
+            saved.layers[currentLayer->contentVersion] = {layerFileName, origin};
 
             stackXML.writeStartElement("layer");
             stackXML.writeAttribute("src", layerFileName);
@@ -260,8 +473,8 @@ void writeStack(QXmlStreamWriter &stackXML,
                 stackXML.writeAttribute("edit-locked", "true");
             stackXML.writeAttribute("composite-op", blendModeToOraOp(currentLayer->mode));
             stackXML.writeAttribute("opacity", QString::number(currentLayer->opacity, 'f'));
-            stackXML.writeAttribute("x", QString::number(bounds.x() - imageX));
-            stackXML.writeAttribute("y", QString::number(bounds.y() - imageY));
+            stackXML.writeAttribute("x", QString::number(origin.x() - imageX));
+            stackXML.writeAttribute("y", QString::number(origin.y() - imageY));
             stackXML.writeEndElement(); // layer
         }
         else
@@ -277,10 +490,10 @@ void writeStack(QXmlStreamWriter &stackXML,
                 stackXML.writeAttribute("edit-locked", "true");
             stackXML.writeAttribute("composite-op", blendModeToOraOp(currentLayer->mode));
             stackXML.writeAttribute("opacity", QString::number(currentLayer->opacity, 'f'));
-            writeStack(stackXML, oraZipWriter,
+            writeStack(stackXML, entries,
                        imageX, imageY,
                        currentLayer->children, layerNum,
-                       progressStep, progressStepTotal, progressCallback);
+                       previous, saved);
             stackXML.writeEndElement(); // stack
         }
     }
@@ -289,11 +502,19 @@ void writeStack(QXmlStreamWriter &stackXML,
 
 void saveStackAs(CanvasStack *stack, QRect frame, QString path, std::function<void(QString const &, float)> progressCallback)
 {
-    int progressStep = 1;
-    float progressStepTotal = (stack->layers.size() + 2) / 100.0f;
+    /* Layers that haven't changed since the stack was last loaded or saved are
+     * copied from that file, the new one replaces path only once it's complete.
+     */
+    std::unique_ptr<QZipReader> previousReader;
+    OraFileRecord previous = usableRecord(stack->oraRecord, previousReader);
+    OraFileRecord saved;
 
     QSaveFile saveFile(path);
-    saveFile.open(QIODevice::WriteOnly);
+    if (!saveFile.open(QIODevice::WriteOnly))
+    {
+        qWarning() << "Failed to open" << path << "for writing:" << saveFile.errorString();
+        return;
+    }
     QZipWriter oraZipWriter(&saveFile);
     oraZipWriter.setCompressionPolicy(QZipWriter::NeverCompress);
 
@@ -330,18 +551,48 @@ void saveStackAs(CanvasStack *stack, QRect frame, QString path, std::function<vo
 
     stackXML.writeStartElement("stack");
 
-    writeStack(stackXML, oraZipWriter,
+    /* Rendering uses the OpenCL queue and leaves the layer tiles unmapped, so it's
+     * done before writeStack() maps the tiles the encoders will read.
+     */
+    QImage mergedImage = stackToImage(stack);
+
+    /* Every file is encoded in parallel, but added to the archive in this order */
+    std::vector<OraEntry> entries;
+
+    writeStack(stackXML, entries,
                frame.x(), frame.y(),
                stack->layers, layerNum,
-               progressStep, progressStepTotal, progressCallback);
+               previous, saved);
 
     {
         // Save the background tile
-        CanvasTile *background = stack->backgroundTile.get();
-        QString backgroundTilePath = QStringLiteral("data/background_tile.png");
-        writeBackground(oraZipWriter, backgroundTilePath, background, QSize(1, 1));
-        QString backgroundLayerPath = QStringLiteral("data/background_layer.png");
-        writeBackground(oraZipWriter, backgroundLayerPath, background, imageTileBounds.size());
+        const float *background = stack->backgroundTile->mapHost();
+        QString backgroundTilePath = QString::fromLatin1(backgroundTileFile);
+        QString backgroundLayerPath = QString::fromLatin1(backgroundLayerFile);
+        QSize backgroundSize = imageTileBounds.size();
+
+        saved.backgroundPixels.assign(background, background + TILE_COMP_TOTAL);
+        saved.backgroundSize = backgroundSize;
+
+        OraEntry tileEntry;
+        tileEntry.path = backgroundTilePath;
+
+        OraEntry layerEntry;
+        layerEntry.path = backgroundLayerPath;
+
+        if (previous.backgroundSize == backgroundSize && previous.backgroundPixels == saved.backgroundPixels)
+        {
+            tileEntry.copyFrom = backgroundTilePath;
+            layerEntry.copyFrom = backgroundLayerPath;
+        }
+        else
+        {
+            tileEntry.encode = [background]() { return encodeBackground(background, QSize(1, 1)); };
+            layerEntry.encode = [background, backgroundSize]() { return encodeBackground(background, backgroundSize); };
+        }
+
+        entries.push_back(tileEntry);
+        entries.push_back(layerEntry);
 
         stackXML.writeStartElement("layer");
         stackXML.writeAttribute("src", backgroundLayerPath);
@@ -360,36 +611,112 @@ void saveStackAs(CanvasStack *stack, QRect frame, QString path, std::function<vo
 
     stackBuffer.close();
 
-    progressCallback(QStringLiteral("Saving thumbnail"), progressStep++ / progressStepTotal);
+    {
+        QByteArray stackData = stackBuffer.buffer();
+        OraEntry stackEntry;
+        stackEntry.path = QStringLiteral("stack.xml");
+        stackEntry.encode = [stackData]() { return stackData; };
+        entries.push_back(stackEntry);
+
+        OraEntry mimetypeEntry;
+        mimetypeEntry.path = QStringLiteral("mimetype");
+        mimetypeEntry.encode = []() { return QByteArray("image/openraster"); };
+        entries.push_back(mimetypeEntry);
+    }
 
-    oraZipWriter.addFile("stack.xml", stackBuffer.buffer());
-    QByteArray mimetypeData("image/openraster");
-    oraZipWriter.addFile("mimetype", mimetypeData);
+    {
+        OraEntry mergedEntry;
+        mergedEntry.path = QStringLiteral("mergedimage.png");
+        mergedEntry.progressMessage = QStringLiteral("Saving thumbnail");
+        mergedEntry.encode = [mergedImage]() { return encodeImage(mergedImage); };
+        entries.push_back(mergedEntry);
+
+        OraEntry thumbEntry;
+        thumbEntry.path = QStringLiteral("Thumbnails/thumbnail.png");
+        thumbEntry.encode = [mergedImage]() {
+            return encodeImage(mergedImage.scaled(128, 128, Qt::KeepAspectRatio));
+        };
+        entries.push_back(thumbEntry);
+    }
 
-    QBuffer mergedImageBuffer;
-    QImage mergedImage = stackToImage(stack);
-    mergedImage.save(&mergedImageBuffer, "PNG");
-    oraZipWriter.addFile("mergedimage.png", mergedImageBuffer.buffer());
+    int progressStep = 1;
+    float progressStepTotal = 1.0f;
+    for (OraEntry const &entry: entries)
+        if (!entry.progressMessage.isEmpty())
+            progressStepTotal += 1.0f;
+    progressStepTotal /= 100.0f;
+
+    std::vector<std::function<void()>> jobs;
+    for (OraEntry &entry: entries)
+        jobs.push_back([&entry]() {
+            if (entry.encode)
+                entry.data = entry.encode();
+        });
+
+    bool failed = false;
+
+    {
+        JobRunner runner(std::move(jobs));
+
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            OraEntry &entry = entries[i];
+
+            if (!entry.progressMessage.isEmpty())
+                progressCallback(entry.progressMessage, progressStep++ / progressStepTotal);
+
+            runner.waitFor(i);
+
+            // QZipReader isn't thread safe, so copies are read here rather than by the runner
+            if (!entry.copyFrom.isEmpty())
+                entry.data = previousReader->fileData(entry.copyFrom);
+
+            if (entry.data.isEmpty())
+            {
+                qWarning() << "Failed to write" << entry.path << "to" << path;
+                failed = true;
+                break;
+            }
+
+            oraZipWriter.addFile(entry.path, entry.data);
+            entry.data = QByteArray();
+        }
+    }
+
+    // The previous file may be the one being replaced
+    previousReader.reset();
 
-    QBuffer thumbImageBuffer;
-    QImage thumbImage = mergedImage.scaled(128, 128, Qt::KeepAspectRatio);
-    thumbImage.save(&thumbImageBuffer, "PNG");
-    oraZipWriter.addFile("Thumbnails/thumbnail.png", thumbImageBuffer.buffer());
+    if (failed)
+    {
+        saveFile.cancelWriting();
+        return;
+    }
 
     progressCallback(QStringLiteral("Writing ORA data"), progressStep++ / progressStepTotal);
 
     oraZipWriter.close();
-    saveFile.commit();
+
+    if (saveFile.commit())
+    {
+        QFileInfo fileInfo(path);
+        saved.filePath = fileInfo.absoluteFilePath();
+        saved.lastModified = fileInfo.lastModified();
+        saved.size = fileInfo.size();
+        stack->oraRecord = std::move(saved);
+    }
 }
 
 namespace {
-CanvasLayer *layerFromLinear(uint16_t *layerData, QRect bounds)
+/* Tile data decoded off the calling thread, waiting to be copied into CanvasTiles */
+typedef std::vector<std::pair<QPoint, std::unique_ptr<float[]>>> DecodedTiles;
+
+DecodedTiles tilesFromLinear(uint16_t *layerData, QRect bounds)
 {
     QRect tileBounds = boundingTiles(bounds);
     const size_t dataCompStride = bounds.width() * 4;
 
-    float *newTileData = new float[TILE_PIXEL_WIDTH * TILE_PIXEL_HEIGHT * 4];
-    CanvasLayer *result = new CanvasLayer("");
+    std::unique_ptr<float[]> newTileData(new float[TILE_PIXEL_WIDTH * TILE_PIXEL_HEIGHT * 4]);
+    DecodedTiles result;
 
     for (int iy = 0; iy < tileBounds.height(); ++iy)
         for (int ix = 0; ix < tileBounds.width(); ++ix)
@@ -401,7 +728,7 @@ CanvasLayer *layerFromLinear(uint16_t *layerData, QRect bounds)
             for (int row = 0; row < TILE_PIXEL_HEIGHT; ++row)
                 for (int col = 0; col < TILE_PIXEL_WIDTH; ++col)
                 {
-                    float *outPtr = newTileData + (row * TILE_PIXEL_WIDTH * 4) + (col * 4);
+                    float *outPtr = newTileData.get() + (row * TILE_PIXEL_WIDTH * 4) + (col * 4);
                     int srcX = col + srcXOffset;
                     int srcY = row + srcYOffset;
                     uint16_t *inPtr = layerData + srcY * dataCompStride + srcX * 4;
@@ -443,13 +770,11 @@ CanvasLayer *layerFromLinear(uint16_t *layerData, QRect bounds)
 
             if (realPixels)
             {
-                memcpy(result->openTileAt(ix + tileBounds.x(), iy + tileBounds.y()),
-                       newTileData, TILE_PIXEL_WIDTH * TILE_PIXEL_HEIGHT * sizeof(float) * 4);
+                result.emplace_back(QPoint(ix + tileBounds.x(), iy + tileBounds.y()), std::move(newTileData));
+                newTileData.reset(new float[TILE_PIXEL_WIDTH * TILE_PIXEL_HEIGHT * 4]);
             }
         }
 
-    delete[] newTileData;
-
     return result;
 }
 
@@ -477,20 +802,26 @@ CanvasTile *backgroundFromLinear(uint16_t *imageData, QSize imageSize)
     return result;
 }
 
-uint16_t *readZipPNG(QZipReader &reader, QString const &path, QSize *resultSize)
+QByteArray readZipFile(QZipReader &reader, QString const &path)
 {
-    *resultSize = QSize(0, 0);
-
     if (path.isEmpty())
-        return nullptr;
+        return QByteArray();
 
-    QByteArray layerPNGData = reader.fileData(path);
+    QByteArray data = reader.fileData(path);
 
-    if (!layerPNGData.size())
-    {
+    if (!data.size())
         qDebug() << "Failed to read" << path;
+
+    return data;
+}
+
+/* The result is allocated by lodepng and must be released with free() */
+uint16_t *decodePNG(QByteArray const &layerPNGData, QString const &path, QSize *resultSize)
+{
+    *resultSize = QSize(0, 0);
+
+    if (!layerPNGData.size())
         return nullptr;
-    }
 
     uint16_t *layerData;
     unsigned int layerDataWidth;
@@ -509,6 +840,37 @@ uint16_t *readZipPNG(QZipReader &reader, QString const &path, QSize *resultSize)
     return layerData;
 }
 
+uint16_t *readZipPNG(QZipReader &reader, QString const &path, QSize *resultSize)
+{
+    return decodePNG(readZipFile(reader, path), path, resultSize);
+}
+
+/* A layer from stack.xml whose PNG hasn't been decoded yet */
+struct PendingLayer
+{
+    CanvasLayer *layer;
+    QString path;
+    QPoint offset;
+    QByteArray pngData;
+    DecodedTiles tiles;
+    bool decoded = false;
+};
+
+/* Fill pending.tiles, returns false if the PNG couldn't be decoded */
+bool decodeLayer(PendingLayer &pending)
+{
+    QSize layerSize;
+    uint16_t *layerData = decodePNG(pending.pngData, pending.path, &layerSize);
+
+    if (!layerData)
+        return false;
+
+    pending.tiles = tilesFromLinear(layerData, QRect(pending.offset, layerSize));
+    free(layerData);
+
+    return true;
+}
+
 void setLayerAttributes(CanvasLayer *layer,
                         QXmlStreamAttributes const &attributes)
 {
@@ -541,9 +903,11 @@ void setLayerAttributes(CanvasLayer *layer,
     layer->opacity = opacity;
 }
 
+/* Builds the layer tree, the layers' PNG data is added to pendingLayers to be decoded later */
 QList<CanvasLayer *> readStack(QXmlStreamReader &stackXML,
                                std::unique_ptr<CanvasTile> &resultBackgroundTile,
-                               QZipReader &oraZipReader)
+                               QZipReader &oraZipReader,
+                               std::vector<PendingLayer> &pendingLayers)
 {
     QList<CanvasLayer *> resultLayers;
 
@@ -557,7 +921,7 @@ QList<CanvasLayer *> readStack(QXmlStreamReader &stackXML,
             CanvasLayer *layerGroup = new CanvasLayer("");
             layerGroup->type = LayerType::Group;
             setLayerAttributes(layerGroup, stackXML.attributes());
-            layerGroup->children = readStack(stackXML, resultBackgroundTile, oraZipReader);
+            layerGroup->children = readStack(stackXML, resultBackgroundTile, oraZipReader, pendingLayers);
             resultLayers.prepend(layerGroup);
         }
         else if (token == QXmlStreamReader::EndElement &&
@@ -605,22 +969,21 @@ QList<CanvasLayer *> readStack(QXmlStreamReader &stackXML,
             if (src.isEmpty())
                 continue;
 
-            QSize layerSize;
-
-            uint16_t *layerData = readZipPNG(oraZipReader, src, &layerSize);
+            QByteArray pngData = readZipFile(oraZipReader, src);
 
-            if (!layerData)
+            if (pngData.isEmpty())
                 continue;
 
-            CanvasLayer *maybeLayer = layerFromLinear(layerData, QRect(x, y, layerSize.width(), layerSize.height()));
-
-            if (maybeLayer)
-            {
-                setLayerAttributes(maybeLayer, attributes);
-                resultLayers.prepend(maybeLayer);
-            }
+            CanvasLayer *layer = new CanvasLayer("");
+            setLayerAttributes(layer, attributes);
+            resultLayers.prepend(layer);
 
-            free(layerData);
+            PendingLayer pending;
+            pending.layer = layer;
+            pending.path = src;
+            pending.offset = QPoint(x, y);
+            pending.pngData = pngData;
+            pendingLayers.push_back(std::move(pending));
         }
     }
 
@@ -693,19 +1056,66 @@ void loadStackFromORA(CanvasStack *stack, QRect *frame,  QString path)
     }
 
     std::unique_ptr<CanvasTile> resultBackgroundTile;
-    QList<CanvasLayer *> resultLayers = readStack(stackXML, resultBackgroundTile, oraZipReader);
+    std::vector<PendingLayer> pendingLayers;
+    QList<CanvasLayer *> resultLayers = readStack(stackXML, resultBackgroundTile, oraZipReader, pendingLayers);
 
     if (!resultLayers.empty() && (resultLayers.first()->name == "background") && resultBackgroundTile)
     {
         // qDebug() << "Discarded background layer";
-        delete resultLayers.first();
+        CanvasLayer *background = resultLayers.first();
+        pendingLayers.erase(std::remove_if(pendingLayers.begin(), pendingLayers.end(),
+                                           [background](PendingLayer const &pending) {
+                                               return pending.layer == background;
+                                           }),
+                            pendingLayers.end());
+        delete background;
         resultLayers.pop_front();
     }
 
+    /* Decode every layer in parallel, the tiles are created here because that
+     * uses the OpenCL queue. Each layer is uploaded as soon as it's ready.
+     */
+    {
+        std::vector<std::function<void()>> jobs;
+        for (PendingLayer &pending: pendingLayers)
+            jobs.push_back([&pending]() {
+                pending.decoded = decodeLayer(pending);
+                pending.pngData = QByteArray();
+            });
+
+        JobRunner runner(std::move(jobs));
+
+        for (size_t i = 0; i < pendingLayers.size(); ++i)
+        {
+            runner.waitFor(i);
+
+            PendingLayer &pending = pendingLayers[i];
+            for (auto &iter: pending.tiles)
+            {
+                memcpy(pending.layer->openTileAt(iter.first.x(), iter.first.y()),
+                       iter.second.get(), TILE_PIXEL_WIDTH * TILE_PIXEL_HEIGHT * sizeof(float) * 4);
+                iter.second.reset();
+            }
+            pending.tiles.clear();
+        }
+    }
+
     if (!resultLayers.empty())
     {
+        // Until a layer is modified its PNG can be copied straight into the next save
+        QFileInfo fileInfo(path);
+        OraFileRecord record;
+        record.filePath = fileInfo.absoluteFilePath();
+        record.lastModified = fileInfo.lastModified();
+        record.size = fileInfo.size();
+
+        for (PendingLayer const &pending: pendingLayers)
+            if (pending.decoded)
+                record.layers[pending.layer->contentVersion] = {pending.path, pending.offset};
+
         stack->clearLayers();
         stack->layers = resultLayers;
+        stack->oraRecord = std::move(record);
 
         if (resultBackgroundTile)
             stack->setBackground(std::move(resultBackgroundTile));
@@ -2,8 +2,14 @@
 #define ORA_H
 
 #include "canvasstack.h"
+#include "blendmodes.h"
+#include <QString>
 #include <functional>
 
+/* The composite-op names used by ORA, also used by the native document format */
+QString blendModeToOraOp(BlendMode::Mode mode);
+BlendMode::Mode oraOpToMode(QString opName);
+
 void saveStackAs(CanvasStack *stack, QRect frame, QString path,
                  std::function<void(QString const &msg, float percent)> progressCallback = [](QString const &, float) {});
 void loadStackFromORA(CanvasStack *stack, QRect *frame, QString path);
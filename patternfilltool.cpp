@@ -2,6 +2,7 @@
 #include "strokecontext.h"
 #include "canvastile.h"
 #include "paintutils.h"
+#include "nativekernels.h"
 #include <qmath.h>
 #include <QImage>
 #include <QVariant>
@@ -20,6 +21,7 @@ public:
 
     float radius;
     cl_mem pattern;
+    QImage nativePattern;
 
     QPoint lastDab;
 };
@@ -27,6 +29,11 @@ public:
 PatternFillStrokeContext::PatternFillStrokeContext(CanvasLayer *layer, float radius, QImage const &image)
     : StrokeContext(layer), radius(radius), pattern(0)
 {
+    if (SharedOpenCL::getSharedOpenCL()->native)
+    {
+        nativePattern = image.convertToFormat(QImage::Format_RGBA8888);
+    }
+    else
     {
         cl_int err = CL_SUCCESS;
         cl_image_format fmt = {CL_RGBA, CL_UNORM_INT8};
@@ -50,6 +57,33 @@ PatternFillStrokeContext::~PatternFillStrokeContext()
 
 void PatternFillStrokeContext::drawDab(QPointF point, TileSet &modTiles)
 {
+    if (!nativePattern.isNull())
+    {
+        int intRadius = ceil(radius);
+        int ix_start = tile_indice(point.x() - intRadius, TILE_PIXEL_WIDTH);
+        int iy_start = tile_indice(point.y() - intRadius, TILE_PIXEL_HEIGHT);
+
+        int ix_end   = tile_indice(point.x() + intRadius, TILE_PIXEL_WIDTH);
+        int iy_end   = tile_indice(point.y() + intRadius, TILE_PIXEL_HEIGHT);
+
+        for (int iy = iy_start; iy <= iy_end; ++iy)
+        {
+            for (int ix = ix_start; ix <= ix_end; ++ix)
+            {
+                CanvasTile *tile = layer->getTile(ix, iy);
+                modTiles.insert(QPoint(ix, iy));
+
+                NativeKernels::patternFillCircle(tile->mapHost(),
+                                                 point.x() - (ix * TILE_PIXEL_WIDTH),
+                                                 point.y() - (iy * TILE_PIXEL_HEIGHT),
+                                                 ix * TILE_PIXEL_WIDTH, iy * TILE_PIXEL_HEIGHT,
+                                                 radius, nativePattern);
+            }
+        }
+
+        return;
+    }
+
     if (!pattern)
         return;
 
@@ -75,10 +109,14 @@ void PatternFillStrokeContext::drawDab(QPointF point, TileSet &modTiles)
         {
             cl_int offsetX = point.x() - (ix * TILE_PIXEL_WIDTH);
             cl_int offsetY = point.y() - (iy * TILE_PIXEL_HEIGHT);
-            cl_mem data = layer->clOpenTileAt(ix, iy);
+            CanvasTile *tile = layer->getTile(ix, iy);
+            cl_mem data = tile->unmapHost();
 
             modTiles.insert(QPoint(ix, iy));
 
+            CLDependencies deps;
+            deps.add(tile->eventSlot());
+
             err = clSetKernelArg<cl_mem>(kernel, 0, data);
             err = clSetKernelArg<cl_int>(kernel, 1, offsetX);
             err = clSetKernelArg<cl_int>(kernel, 2, offsetY);
@@ -86,8 +124,9 @@ void PatternFillStrokeContext::drawDab(QPointF point, TileSet &modTiles)
             err = clSetKernelArg<cl_int>(kernel, 4, iy * TILE_PIXEL_HEIGHT);
             err = clEnqueueNDRangeKernel(SharedOpenCL::getSharedOpenCL()->cmdQueue,
                                          kernel, 2,
-                                         nullptr, global_work_size, nullptr,
-                                         0, nullptr, nullptr);
+                                         nullptr, global_work_size,
+                                         SharedOpenCL::getSharedOpenCL()->localWorkSize(kernel, 2, global_work_size).get(),
+                                         deps.count(), deps.waitList(), deps.event(kernel));
         }
     }
 
@@ -0,0 +1,599 @@
+#include "pngstream.h"
+#include <QDebug>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+const size_t outputChunkSize = 64 * 1024;
+
+/* Bigger images are left to QImage and its allocation limits, the stream reader
+ * would need a tile row of floats for the full width before reading anything.
+ */
+const quint32 maxReadDimension = 1 << 17;
+const quint64 maxReadPixels = quint64(1) << 29;
+
+quint32 readBigEndian32(const uint8_t *in)
+{
+    return (quint32(in[0]) << 24) | (quint32(in[1]) << 16) | (quint32(in[2]) << 8) | in[3];
+}
+
+void writeBigEndian32(uint8_t *out, uint32_t value)
+{
+    out[0] = (value >> 24) & 0xFF;
+    out[1] = (value >> 16) & 0xFF;
+    out[2] = (value >> 8) & 0xFF;
+    out[3] = value & 0xFF;
+}
+
+uint8_t paethPredictor(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = std::abs(p - a);
+    int pb = std::abs(p - b);
+    int pc = std::abs(p - c);
+
+    if (pa <= pb && pa <= pc)
+        return a;
+    else if (pb <= pc)
+        return b;
+    return c;
+}
+}
+
+PNGStreamWriter::PNGStreamWriter(QIODevice *device, int width, int height, ColorType colorType)
+    : device(device),
+      width(width),
+      height(height),
+      bytesPerPixel(colorType == RGBA ? 8 : 6),
+      rowBytes(size_t(width) * bytesPerPixel),
+      rowsWritten(0),
+      failed(false),
+      previousRow(rowBytes, 0),
+      output(outputChunkSize)
+{
+    for (auto &candidate: candidates)
+        candidate.resize(rowBytes + 1);
+
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+    {
+        qWarning() << "PNGStreamWriter: deflateInit failed";
+        failed = true;
+        return;
+    }
+    stream.next_out = output.data();
+    stream.avail_out = output.size();
+
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    if (device->write((const char *)signature, sizeof(signature)) != sizeof(signature))
+        failed = true;
+
+    uint8_t header[13];
+    writeBigEndian32(header, width);
+    writeBigEndian32(header + 4, height);
+    header[8] = 16; // Bit depth
+    header[9] = colorType;
+    header[10] = 0; // Deflate
+    header[11] = 0; // Adaptive filtering
+    header[12] = 0; // No interlacing
+
+    writeChunk("IHDR", header, sizeof(header));
+}
+
+PNGStreamWriter::~PNGStreamWriter()
+{
+    deflateEnd(&stream);
+}
+
+bool PNGStreamWriter::writeChunk(const char *type, const uint8_t *data, size_t size)
+{
+    if (failed)
+        return false;
+
+    uint8_t prefix[8];
+    writeBigEndian32(prefix, size);
+    memcpy(prefix + 4, type, 4);
+
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, prefix + 4, 4);
+    if (size)
+        crc = crc32(crc, data, size);
+
+    uint8_t suffix[4];
+    writeBigEndian32(suffix, crc);
+
+    if (device->write((const char *)prefix, sizeof(prefix)) != sizeof(prefix) ||
+        (size && device->write((const char *)data, size) != qint64(size)) ||
+        device->write((const char *)suffix, sizeof(suffix)) != sizeof(suffix))
+    {
+        qWarning() << "PNGStreamWriter: write failed";
+        failed = true;
+    }
+
+    return !failed;
+}
+
+/* Fill candidates with every filter type applied to row, see the PNG specification section 9 */
+void PNGStreamWriter::filterRow(const uint8_t *row)
+{
+    const uint8_t *prior = previousRow.data();
+
+    for (int type = 0; type < 5; ++type)
+        candidates[type][0] = type;
+
+    uint8_t *none = candidates[0].data() + 1;
+    uint8_t *sub = candidates[1].data() + 1;
+    uint8_t *up = candidates[2].data() + 1;
+    uint8_t *average = candidates[3].data() + 1;
+    uint8_t *paeth = candidates[4].data() + 1;
+
+    for (size_t i = 0; i < rowBytes; ++i)
+    {
+        int left = i >= size_t(bytesPerPixel) ? row[i - bytesPerPixel] : 0;
+        int above = prior[i];
+        int aboveLeft = i >= size_t(bytesPerPixel) ? prior[i - bytesPerPixel] : 0;
+
+        none[i] = row[i];
+        sub[i] = row[i] - left;
+        up[i] = row[i] - above;
+        average[i] = row[i] - ((left + above) >> 1);
+        paeth[i] = row[i] - paethPredictor(left, above, aboveLeft);
+    }
+}
+
+bool PNGStreamWriter::deflateRow(const uint8_t *row, int flush)
+{
+    stream.next_in = const_cast<uint8_t *>(row);
+    stream.avail_in = row ? rowBytes + 1 : 0;
+
+    while (!failed)
+    {
+        int err = deflate(&stream, flush);
+        if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR)
+        {
+            qWarning() << "PNGStreamWriter: deflate failed" << err;
+            failed = true;
+            break;
+        }
+
+        bool full = stream.avail_out == 0;
+        if (full || (err == Z_STREAM_END && stream.avail_out != output.size()))
+        {
+            writeChunk("IDAT", output.data(), output.size() - stream.avail_out);
+            stream.next_out = output.data();
+            stream.avail_out = output.size();
+        }
+
+        if (err == Z_STREAM_END)
+            break;
+        // With room left in the output all of the input has been taken
+        if (!full && stream.avail_in == 0 && flush == Z_NO_FLUSH)
+            break;
+    }
+
+    return !failed;
+}
+
+bool PNGStreamWriter::writeRows(const uint16_t *rows, int count)
+{
+    if (rowsWritten + count > height)
+    {
+        qWarning() << "PNGStreamWriter: too many rows";
+        failed = true;
+    }
+
+    const uint8_t *row = (const uint8_t *)rows;
+
+    for (int i = 0; i < count && !failed; ++i)
+    {
+        filterRow(row);
+
+        /* Pick the filter with the smallest sum of absolute differences, as
+         * recommended by the specification, it's a cheap guess at which one
+         * compresses best.
+         */
+        int best = 0;
+        quint64 bestSum = ~quint64(0);
+        for (int type = 0; type < 5; ++type)
+        {
+            quint64 sum = 0;
+            const int8_t *data = (const int8_t *)candidates[type].data() + 1;
+            for (size_t j = 0; j < rowBytes; ++j)
+                sum += std::abs(int(data[j]));
+
+            if (sum < bestSum)
+            {
+                bestSum = sum;
+                best = type;
+            }
+        }
+
+        deflateRow(candidates[best].data(), Z_NO_FLUSH);
+
+        memcpy(previousRow.data(), row, rowBytes);
+        row += rowBytes;
+        rowsWritten++;
+    }
+
+    return !failed;
+}
+
+bool PNGStreamWriter::finish()
+{
+    if (rowsWritten != height)
+    {
+        qWarning() << "PNGStreamWriter: finished with" << rowsWritten << "of" << height << "rows";
+        failed = true;
+    }
+
+    deflateRow(nullptr, Z_FINISH);
+    writeChunk("IEND", nullptr, 0);
+
+    return !failed;
+}
+
+PNGStreamReader::PNGStreamReader(QIODevice *device)
+    : device(device),
+      valid(false),
+      inflateStarted(false),
+      imageWidth(0),
+      imageHeight(0),
+      bitDepth(0),
+      colorType(0),
+      channels(0),
+      bytesPerPixel(0),
+      rowBytes(0),
+      rowsRead(0),
+      idatRemaining(0),
+      chunkCRC(0),
+      hasTransparentColor(false),
+      input(outputChunkSize)
+{
+    memset(&stream, 0, sizeof(stream));
+    memset(transparentColor, 0, sizeof(transparentColor));
+
+    valid = readHeader();
+}
+
+PNGStreamReader::~PNGStreamReader()
+{
+    if (inflateStarted)
+        inflateEnd(&stream);
+}
+
+bool PNGStreamReader::readChunkHeader(quint32 *length, char type[4])
+{
+    uint8_t header[8];
+    if (device->read((char *)header, sizeof(header)) != sizeof(header))
+        return false;
+
+    *length = readBigEndian32(header);
+    memcpy(type, header + 4, 4);
+    chunkCRC = crc32(crc32(0L, Z_NULL, 0), header + 4, 4);
+
+    return true;
+}
+
+/* Read the CRC that ends the current chunk, false if it doesn't match */
+bool PNGStreamReader::checkCRC()
+{
+    uint8_t crc[4];
+    if (device->read((char *)crc, sizeof(crc)) != sizeof(crc))
+        return false;
+
+    return readBigEndian32(crc) == chunkCRC;
+}
+
+/* Read the chunks up to the first IDAT */
+bool PNGStreamReader::readHeader()
+{
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    uint8_t fileSignature[8];
+    if (device->read((char *)fileSignature, sizeof(fileSignature)) != sizeof(fileSignature) ||
+        memcmp(signature, fileSignature, sizeof(signature)))
+        return false;
+
+    bool haveHeader = false;
+    bool haveData = false;
+    quint32 length;
+    char type[4];
+
+    while (readChunkHeader(&length, type))
+    {
+        if (!memcmp(type, "IDAT", 4))
+        {
+            if (!haveHeader || (colorType == 3 && palette.empty()))
+                return false;
+
+            idatRemaining = length;
+            haveData = true;
+            break;
+        }
+
+        QByteArray data = device->read(length);
+        if (quint32(data.size()) != length)
+            return false;
+        const uint8_t *bytes = (const uint8_t *)data.constData();
+
+        chunkCRC = crc32(chunkCRC, bytes, length);
+        if (!checkCRC())
+            return false;
+
+        if (!memcmp(type, "IHDR", 4))
+        {
+            if (length != 13)
+                return false;
+
+            quint32 width = readBigEndian32(bytes);
+            quint32 height = readBigEndian32(bytes + 4);
+            if (width == 0 || height == 0 || width > maxReadDimension || height > maxReadDimension ||
+                quint64(width) * height > maxReadPixels)
+                return false;
+
+            imageWidth = width;
+            imageHeight = height;
+            bitDepth = bytes[8];
+            colorType = bytes[9];
+
+            // Interlaced images are stored in passes rather than rows
+            if (bytes[10] != 0 || bytes[11] != 0 || bytes[12] != 0)
+                return false;
+
+            if (colorType == 0 || colorType == 3)
+                channels = 1;
+            else if (colorType == 2)
+                channels = 3;
+            else if (colorType == 4)
+                channels = 2;
+            else if (colorType == 6)
+                channels = 4;
+            else
+                return false;
+
+            bool validDepth = bitDepth == 8 || bitDepth == 16 ||
+                              ((colorType == 0 || colorType == 3) && (bitDepth == 1 || bitDepth == 2 || bitDepth == 4));
+            if (!validDepth || (colorType == 3 && bitDepth == 16))
+                return false;
+
+            bytesPerPixel = std::max(1, channels * bitDepth / 8);
+            rowBytes = (size_t(imageWidth) * channels * bitDepth + 7) / 8;
+            haveHeader = true;
+        }
+        else if (!memcmp(type, "PLTE", 4))
+        {
+            palette.clear();
+            for (quint32 i = 0; i + 2 < length; i += 3)
+                palette.insert(palette.end(), {bytes[i], bytes[i + 1], bytes[i + 2], 0xFF});
+        }
+        else if (!memcmp(type, "tRNS", 4))
+        {
+            if (colorType == 3)
+            {
+                for (quint32 i = 0; i < length && i * 4 < palette.size(); ++i)
+                    palette[i * 4 + 3] = bytes[i];
+            }
+            else if ((colorType == 0 && length >= 2) || (colorType == 2 && length >= 6))
+            {
+                hasTransparentColor = true;
+                for (quint32 i = 0; i < length / 2 && i < 3; ++i)
+                    transparentColor[i] = (bytes[i * 2] << 8) | bytes[i * 2 + 1];
+            }
+        }
+    }
+
+    if (!haveData)
+        return false;
+
+    if (inflateInit(&stream) != Z_OK)
+        return false;
+    inflateStarted = true;
+
+    currentRow.resize(rowBytes + 1);
+    previousRow.assign(rowBytes, 0);
+
+    return true;
+}
+
+/* Read more of the IDAT data, moving on to the next IDAT chunk when this one runs out */
+bool PNGStreamReader::fillInput()
+{
+    while (idatRemaining == 0)
+    {
+        if (!checkCRC())
+            return false;
+
+        quint32 length;
+        char type[4];
+        if (!readChunkHeader(&length, type) || memcmp(type, "IDAT", 4))
+            return false;
+
+        idatRemaining = length;
+    }
+
+    qint64 size = std::min<qint64>(idatRemaining, input.size());
+    if (device->read((char *)input.data(), size) != size)
+        return false;
+
+    idatRemaining -= size;
+    chunkCRC = crc32(chunkCRC, input.data(), size);
+    stream.next_in = input.data();
+    stream.avail_in = size;
+
+    return true;
+}
+
+/* After the last row, read the rest of the current IDAT chunk so its CRC can be checked */
+bool PNGStreamReader::finishData()
+{
+    while (idatRemaining)
+    {
+        qint64 size = std::min<qint64>(idatRemaining, input.size());
+        if (device->read((char *)input.data(), size) != size)
+            return false;
+
+        idatRemaining -= size;
+        chunkCRC = crc32(chunkCRC, input.data(), size);
+    }
+
+    return checkCRC();
+}
+
+bool PNGStreamReader::inflateRow()
+{
+    stream.next_out = currentRow.data();
+    stream.avail_out = currentRow.size();
+
+    while (stream.avail_out)
+    {
+        if (stream.avail_in == 0 && !fillInput())
+            return false;
+
+        int err = inflate(&stream, Z_NO_FLUSH);
+        if (err == Z_STREAM_END)
+            return stream.avail_out == 0;
+        if (err != Z_OK)
+            return false;
+    }
+
+    return true;
+}
+
+/* Undo the row's filter in place, see the PNG specification section 9. Returns
+ * false for an unknown filter type.
+ */
+bool PNGStreamReader::unfilterRow()
+{
+    uint8_t *row = currentRow.data() + 1;
+    const uint8_t *prior = previousRow.data();
+    const size_t bpp = bytesPerPixel;
+
+    switch (currentRow[0])
+    {
+    case 1: // Sub
+        for (size_t i = bpp; i < rowBytes; ++i)
+            row[i] += row[i - bpp];
+        break;
+    case 2: // Up
+        for (size_t i = 0; i < rowBytes; ++i)
+            row[i] += prior[i];
+        break;
+    case 3: // Average
+        for (size_t i = 0; i < rowBytes; ++i)
+        {
+            int left = i >= bpp ? row[i - bpp] : 0;
+            row[i] += (left + prior[i]) >> 1;
+        }
+        break;
+    case 4: // Paeth
+        for (size_t i = 0; i < rowBytes; ++i)
+        {
+            int left = i >= bpp ? row[i - bpp] : 0;
+            int aboveLeft = i >= bpp ? prior[i - bpp] : 0;
+            row[i] += paethPredictor(left, prior[i], aboveLeft);
+        }
+        break;
+    case 0: // None
+        break;
+    default:
+        return false;
+    }
+
+    memcpy(previousRow.data(), row, rowBytes);
+    return true;
+}
+
+void PNGStreamReader::convertRow(float *out)
+{
+    const uint8_t *row = previousRow.data();
+    const float maxValue = float((1 << bitDepth) - 1);
+
+    auto sample = [&](int x, int channel) -> int {
+        if (bitDepth == 16)
+        {
+            const uint8_t *p = row + (size_t(x) * channels + channel) * 2;
+            return (p[0] << 8) | p[1];
+        }
+        if (bitDepth == 8)
+            return row[size_t(x) * channels + channel];
+
+        // Packed samples, only possible with one channel
+        size_t bit = size_t(x) * bitDepth;
+        int shift = 8 - bitDepth - (bit % 8);
+        return (row[bit / 8] >> shift) & ((1 << bitDepth) - 1);
+    };
+
+    for (int x = 0; x < imageWidth; ++x, out += 4)
+    {
+        if (colorType == 3)
+        {
+            size_t index = sample(x, 0) * 4;
+            if (index + 3 < palette.size())
+            {
+                out[0] = palette[index + 0] / 255.0f;
+                out[1] = palette[index + 1] / 255.0f;
+                out[2] = palette[index + 2] / 255.0f;
+                out[3] = palette[index + 3] / 255.0f;
+            }
+            else
+            {
+                out[0] = out[1] = out[2] = out[3] = 0.0f;
+            }
+        }
+        else if (colorType == 0 || colorType == 4)
+        {
+            int gray = sample(x, 0);
+            out[0] = out[1] = out[2] = gray / maxValue;
+
+            if (colorType == 4)
+                out[3] = sample(x, 1) / maxValue;
+            else
+                out[3] = (hasTransparentColor && gray == transparentColor[0]) ? 0.0f : 1.0f;
+        }
+        else
+        {
+            int r = sample(x, 0);
+            int g = sample(x, 1);
+            int b = sample(x, 2);
+            out[0] = r / maxValue;
+            out[1] = g / maxValue;
+            out[2] = b / maxValue;
+
+            if (colorType == 6)
+                out[3] = sample(x, 3) / maxValue;
+            else if (hasTransparentColor && r == transparentColor[0] && g == transparentColor[1] && b == transparentColor[2])
+                out[3] = 0.0f;
+            else
+                out[3] = 1.0f;
+        }
+    }
+}
+
+bool PNGStreamReader::readRows(float *out, int count)
+{
+    if (!valid || rowsRead + count > imageHeight)
+        return false;
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (!inflateRow() || !unfilterRow())
+        {
+            qWarning() << "PNGStreamReader: image data is truncated or corrupt";
+            valid = false;
+            return false;
+        }
+
+        convertRow(out);
+        out += size_t(imageWidth) * 4;
+        rowsRead++;
+    }
+
+    if (rowsRead == imageHeight && !finishData())
+    {
+        qWarning() << "PNGStreamReader: image data failed its checksum";
+        valid = false;
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,107 @@
+#ifndef PNGSTREAM_H
+#define PNGSTREAM_H
+
+#include <QIODevice>
+#include <QtGlobal>
+#include <cstdint>
+#include <vector>
+#include "zlib.h"
+
+/* Writes a 16 bit PNG a block of rows at a time, each block is filtered and
+ * compressed as it arrives so the uncompressed image never has to be in memory.
+ */
+class PNGStreamWriter
+{
+public:
+    enum ColorType { RGB = 2, RGBA = 6 };
+
+    /* Writes the PNG header to device, the rows of the image are then added with writeRows() */
+    PNGStreamWriter(QIODevice *device, int width, int height, ColorType colorType);
+    PNGStreamWriter(const PNGStreamWriter&) = delete;
+    PNGStreamWriter &operator=(const PNGStreamWriter&) = delete;
+    ~PNGStreamWriter();
+
+    /* Add the next count rows, the samples are in PNG (big endian) byte order */
+    bool writeRows(const uint16_t *rows, int count);
+    /* Write the remaining compressed data and the end of the image, every row must have been added */
+    bool finish();
+
+private:
+    bool writeChunk(const char *type, const uint8_t *data, size_t size);
+    bool deflateRow(const uint8_t *row, int flush);
+    void filterRow(const uint8_t *row);
+
+    QIODevice *device;
+    int width;
+    int height;
+    int bytesPerPixel;
+    size_t rowBytes;
+    int rowsWritten;
+    bool failed;
+
+    z_stream stream;
+    std::vector<uint8_t> previousRow;
+    /* The filter type byte followed by the filtered row, for each filter type */
+    std::vector<uint8_t> candidates[5];
+    std::vector<uint8_t> output;
+};
+
+/* Reads a PNG a block of rows at a time, inflating only as much of the image
+ * as the rows need. Interlaced images can't be read in row order and aren't
+ * supported, use QImage for those.
+ */
+class PNGStreamReader
+{
+public:
+    /* Reads the header from device, check isValid() before reading rows */
+    PNGStreamReader(QIODevice *device);
+    PNGStreamReader(const PNGStreamReader&) = delete;
+    PNGStreamReader &operator=(const PNGStreamReader&) = delete;
+    ~PNGStreamReader();
+
+    bool isValid() const { return valid; }
+    int width() const { return imageWidth; }
+    int height() const { return imageHeight; }
+
+    /* Read the next count rows as RGBA floats in the range [0, 1], with width() pixels per row */
+    bool readRows(float *out, int count);
+
+private:
+    bool readHeader();
+    bool readChunkHeader(quint32 *length, char type[4]);
+    bool checkCRC();
+    bool fillInput();
+    bool finishData();
+    bool inflateRow();
+    bool unfilterRow();
+    void convertRow(float *out);
+
+    QIODevice *device;
+    bool valid;
+    bool inflateStarted;
+    int imageWidth;
+    int imageHeight;
+    int bitDepth;
+    int colorType;
+    int channels;
+    int bytesPerPixel;
+    size_t rowBytes;
+    int rowsRead;
+
+    /* Bytes of the current IDAT chunk that haven't been read yet */
+    quint32 idatRemaining;
+    /* CRC of the current chunk's type and the data read so far */
+    uLong chunkCRC;
+
+    std::vector<uint8_t> palette;       /* RGBA entries */
+    bool hasTransparentColor;
+    uint16_t transparentColor[3];
+
+    z_stream stream;
+    std::vector<uint8_t> input;
+    /* The filter type byte followed by the row, and the unfiltered row before it */
+    std::vector<uint8_t> currentRow;
+    std::vector<uint8_t> previousRow;
+};
+
+#endif // PNGSTREAM_H
@@ -1,6 +1,7 @@
 #include "roundbrushtool.h"
 #include "canvastile.h"
 #include "paintutils.h"
+#include "nativekernels.h"
 #include <qmath.h>
 #include <memory>
 #include <QColor>
@@ -21,6 +22,8 @@ public:
     std::unique_ptr<CanvasTile> nullTile;
     CanvasLayer const *srcLayer;
     std::map<QPoint, cl_mem, _tilePointCompare> drawTiles;
+    std::map<QPoint, cl_event, _tilePointCompare> drawEvents;
+    std::map<QPoint, std::unique_ptr<float[]>, _tilePointCompare> nativeDrawTiles;
 
     float radius;
 
@@ -53,6 +56,9 @@ RoundBrushStrokeContext::~RoundBrushStrokeContext()
         if(iter.second)
             clReleaseMemObject(iter.second);
     }
+
+    for (auto &iter: drawEvents)
+        clearEventSlot(&iter.second);
 }
 
 void RoundBrushStrokeContext::drawDab(QPointF point, float pressure, TileSet &modTiles)
@@ -76,6 +82,32 @@ void RoundBrushStrokeContext::drawDab(QPointF point, float pressure, TileSet &mo
     int ix_end   = tile_indice(point.x() + intRadius, TILE_PIXEL_WIDTH);
     int iy_end   = tile_indice(point.y() + intRadius, TILE_PIXEL_HEIGHT);
 
+    if (SharedOpenCL::getSharedOpenCL()->native)
+    {
+        for (int iy = iy_start; iy <= iy_end; ++iy)
+        {
+            for (int ix = ix_start; ix <= ix_end; ++ix)
+            {
+                std::unique_ptr<float[]> &drawData = nativeDrawTiles[QPoint(ix, iy)];
+
+                if (!drawData)
+                {
+                    drawData.reset(new float[TILE_PIXEL_WIDTH * TILE_PIXEL_HEIGHT]);
+                    NativeKernels::fillFloats(drawData.get(), 0.0f);
+                }
+
+                modTiles.insert(QPoint(ix, iy));
+
+                NativeKernels::maskCircle(drawData.get(),
+                                          point.x() - (ix * TILE_PIXEL_WIDTH),
+                                          point.y() - (iy * TILE_PIXEL_HEIGHT),
+                                          mapped_radius, mapped_alpha);
+            }
+        }
+
+        return;
+    }
+
     const size_t circleWorkSize[2] = {TILE_PIXEL_HEIGHT, TILE_PIXEL_WIDTH};
     cl_kernel circleKernel = SharedOpenCL::getSharedOpenCL()->paintKernel_maskCircle;
     cl_kernel fillKernel = SharedOpenCL::getSharedOpenCL()->paintKernel_fillFloats;
@@ -90,6 +122,7 @@ void RoundBrushStrokeContext::drawDab(QPointF point, float pressure, TileSet &mo
             cl_float offsetY = point.y() - (iy * TILE_PIXEL_HEIGHT);
 
             cl_mem &drawMem = drawTiles[QPoint(ix, iy)];
+            cl_event &drawEvent = drawEvents[QPoint(ix, iy)];
 
             if (!drawMem)
             {
@@ -99,33 +132,42 @@ void RoundBrushStrokeContext::drawDab(QPointF point, float pressure, TileSet &mo
                                          maskComps * sizeof(float), nullptr, nullptr);
                 float value = 0;
 
+                CLDependencies deps;
+                deps.add(&drawEvent);
+
                 clSetKernelArg<cl_mem>(fillKernel, 0, drawMem);
                 clSetKernelArg<float>(fillKernel, 1, value);
                 clEnqueueNDRangeKernel(SharedOpenCL::getSharedOpenCL()->cmdQueue,
                                        fillKernel, 1,
-                                       nullptr, &maskComps, nullptr,
-                                       0, nullptr, nullptr);
+                                       nullptr, &maskComps,
+                                       SharedOpenCL::getSharedOpenCL()->localWorkSize(fillKernel, 1, &maskComps).get(),
+                                       deps.count(), deps.waitList(), deps.event(fillKernel));
             }
 
             modTiles.insert(QPoint(ix, iy));
 
+            CLDependencies deps;
+            deps.add(&drawEvent);
+
             clSetKernelArg<cl_mem>(circleKernel, 0, drawMem);
             clSetKernelArg<cl_float>(circleKernel, 1, offsetX);
             clSetKernelArg<cl_float>(circleKernel, 2, offsetY);
             clSetKernelArg<cl_float>(circleKernel, 4, mapped_alpha);
             clEnqueueNDRangeKernel(SharedOpenCL::getSharedOpenCL()->cmdQueue,
                                    circleKernel, 2,
-                                   nullptr, circleWorkSize, nullptr,
-                                   0, nullptr, nullptr);
+                                   nullptr, circleWorkSize,
+                                   SharedOpenCL::getSharedOpenCL()->localWorkSize(circleKernel, 2, circleWorkSize).get(),
+                                   deps.count(), deps.waitList(), deps.event(circleKernel));
         }
     }
 }
 
 void RoundBrushStrokeContext::applyLayer(const TileSet &modTiles)
 {
+    const bool native = SharedOpenCL::getSharedOpenCL()->native;
     cl_float4 pixel = {r, g, b, 1.0f};
     const size_t blendWorkSize[1]  = {TILE_PIXEL_WIDTH * TILE_PIXEL_HEIGHT};
-    cl_kernel blendKernel = SharedOpenCL::getSharedOpenCL()->paintKernel_applyMaskTile;
+    cl_kernel blendKernel = native ? nullptr : SharedOpenCL::getSharedOpenCL()->paintKernel_applyMaskTile;
 
     for (QPoint const &tilePos: modTiles)
     {
@@ -143,17 +185,28 @@ void RoundBrushStrokeContext::applyLayer(const TileSet &modTiles)
             srcTile = nullTile.get();
         }
 
+        if (native)
+        {
+            NativeKernels::applyMaskTile(dstTile->mapHost(), srcTile->mapHost(),
+                                         nativeDrawTiles[tilePos].get(), pixel.s);
+            continue;
+        }
+
         cl_mem srcMem = srcTile->unmapHost();
         cl_mem dstMem = dstTile->unmapHost();
 
+        CLDependencies deps;
+        deps.add(dstTile->eventSlot()).add(srcTile->eventSlot()).add(&drawEvents[tilePos]);
+
         clSetKernelArg<cl_mem>(blendKernel, 0, dstMem);
         clSetKernelArg<cl_mem>(blendKernel, 1, srcMem);
         clSetKernelArg<cl_mem>(blendKernel, 2, drawMem);
         clSetKernelArg<cl_float4>(blendKernel, 3, pixel);
         clEnqueueNDRangeKernel(SharedOpenCL::getSharedOpenCL()->cmdQueue,
                                blendKernel, 1,
-                               nullptr, blendWorkSize, nullptr,
-                               0, nullptr, nullptr);
+                               nullptr, blendWorkSize,
+                               SharedOpenCL::getSharedOpenCL()->localWorkSize(blendKernel, 1, blendWorkSize).get(),
+                               deps.count(), deps.waitList(), deps.event(blendKernel));
     }
 }
 
@@ -0,0 +1,311 @@
+#include "strokereplay.h"
+#include "canvaswidget.h"
+#include "canvasstrokepoint.h"
+#include <algorithm>
+#include <cstdlib>
+#include <QApplication>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThread>
+#include <QDebug>
+#include <iostream>
+
+namespace {
+    std::vector<std::vector<CanvasStrokePoint>> strokesFromFile(QString const &path)
+    {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly))
+            throw QString("Failed to open file: ") + file.errorString();
+
+        QJsonDocument const jsonDoc = QJsonDocument::fromJson(file.readAll());
+        if (!jsonDoc.isArray())
+            throw QString("JSON parse failed");
+
+        QJsonArray const strokesArray = jsonDoc.array();
+        std::vector<std::vector<CanvasStrokePoint>> result;
+
+        // A single stroke is an array of points, each point is itself an array of numbers
+        if (!strokesArray.isEmpty() && strokesArray.at(0).toArray().at(0).isArray())
+        {
+            for (auto const &stroke: strokesArray)
+                result.push_back(CanvasStrokePoint::pointsFromJSON(stroke.toArray()));
+        }
+        else
+        {
+            result.push_back(CanvasStrokePoint::pointsFromJSON(strokesArray));
+        }
+
+        result.erase(std::remove_if(result.begin(), result.end(),
+                                    [](std::vector<CanvasStrokePoint> const &s) { return s.empty(); }),
+                     result.end());
+
+        if (result.empty())
+            throw QString("No stroke points");
+
+        return result;
+    }
+
+    /* Hash of the pixel data, independent of the QImage format and line padding */
+    QByteArray imageChecksum(QImage image)
+    {
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+
+        if (image.isNull())
+            return hash.result().toHex();
+
+        image = image.convertToFormat(QImage::Format_ARGB32);
+
+        qint32 size[4] = {image.width(), image.height(), image.offset().x(), image.offset().y()};
+        hash.addData(reinterpret_cast<const char *>(size), sizeof(size));
+        for (int y = 0; y < image.height(); ++y)
+            hash.addData(reinterpret_cast<const char *>(image.constScanLine(y)), image.width() * 4);
+
+        return hash.result().toHex();
+    }
+
+    struct ImageDifference
+    {
+        int maxDifference = 0;
+        int differingPixels = 0;
+    };
+
+    /* Compared premultiplied, so noise in nearly transparent pixels doesn't count */
+    ImageDifference compareImages(QImage a, QImage b, int tolerance)
+    {
+        ImageDifference result;
+
+        a = a.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+        b = b.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+        for (int y = 0; y < a.height(); ++y)
+        {
+            const uchar *aLine = a.constScanLine(y);
+            const uchar *bLine = b.constScanLine(y);
+
+            for (int x = 0; x < a.width(); ++x)
+            {
+                int pixelDifference = 0;
+                for (int c = 0; c < 4; ++c)
+                    pixelDifference = std::max(pixelDifference, std::abs(aLine[x * 4 + c] - bLine[x * 4 + c]));
+
+                result.maxDifference = std::max(result.maxDifference, pixelDifference);
+                if (pixelDifference > tolerance)
+                    result.differingPixels++;
+            }
+        }
+
+        return result;
+    }
+
+    double percentile(std::vector<double> const &sorted, double p)
+    {
+        if (sorted.empty())
+            return 0.0;
+        size_t index = std::min<size_t>(sorted.size() - 1, p * sorted.size());
+        return sorted[index];
+    }
+}
+
+StrokeReplay::StrokeReplay(CanvasWidget *canvas, QObject *parent) :
+    QObject(parent),
+    canvas(canvas)
+{
+}
+
+bool StrokeReplay::modeFromString(QString const &str, Mode *mode)
+{
+    if (str == QStringLiteral("realtime"))
+        *mode = RealTime;
+    else if (str == QStringLiteral("fast"))
+        *mode = Fast;
+    else if (str == QStringLiteral("sync"))
+        *mode = Sync;
+    else
+        return false;
+    return true;
+}
+
+void StrokeReplay::execute(QString path)
+{
+    std::vector<std::vector<CanvasStrokePoint>> strokes;
+
+    try
+    {
+        strokes = strokesFromFile(path);
+    }
+    catch (QString err)
+    {
+        qWarning() << path << err;
+        QApplication::quit();
+        return;
+    }
+
+    // The event thread starts with the canvas's GL context
+    while (canvas && !canvas->isReady())
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+
+    if (!canvas)
+    {
+        QApplication::quit();
+        return;
+    }
+
+    if (!toolPath.isEmpty())
+        canvas->setActiveTool(toolPath);
+
+    bool savedSync = canvas->getSynchronous();
+    canvas->setSynchronous(mode == Sync);
+    canvas->resetStrokeEventStats();
+
+    size_t totalPoints = 0;
+    for (auto const &stroke: strokes)
+        totalPoints += stroke.size();
+
+    /* Filled in from the event thread, the vector isn't resized until after the final sync */
+    std::vector<qint64> sentNs(totalPoints, 0);
+    std::vector<qint64> doneNs(totalPoints, 0);
+    size_t pointIndex = 0;
+
+    QElapsedTimer timer;
+    timer.start();
+    double strokeTime = 0.0; // The recorded time of the current point, in ms
+
+    auto waitUntil = [&](double targetMs) {
+        while (true)
+        {
+            double remaining = targetMs - timer.nsecsElapsed() / 1.0e6;
+            if (remaining <= 0.0)
+                break;
+            QCoreApplication::processEvents(QEventLoop::AllEvents, 1);
+            if (remaining > 1.0)
+                QThread::usleep(std::min(remaining - 1.0, 1.0) * 1000.0);
+        }
+    };
+
+    for (auto const &stroke: strokes)
+    {
+        for (auto iter = stroke.begin(); iter != stroke.end(); ++iter)
+        {
+            if (mode == RealTime)
+            {
+                if (iter != stroke.begin())
+                    strokeTime += iter->dt;
+                waitUntil(strokeTime);
+            }
+
+            size_t i = pointIndex++;
+            qint64 *done = &doneNs[i];
+            sentNs[i] = timer.nsecsElapsed();
+
+            if (iter == stroke.begin())
+                canvas->startStroke({iter->x, iter->y}, iter->p);
+            else
+                canvas->strokeTo({iter->x, iter->y}, iter->p, iter->dt);
+
+            canvas->notifyWhenProcessed([&timer, done]() {
+                *done = timer.nsecsElapsed();
+            });
+        }
+
+        canvas->endStroke();
+    }
+
+    CanvasWidget::StrokeEventStats eventStats = canvas->getStrokeEventStats();
+    double wallMs = timer.nsecsElapsed() / 1.0e6;
+    QImage result = canvas->asImage();
+    canvas->setSynchronous(savedSync);
+
+    std::vector<double> latencies;
+    latencies.reserve(totalPoints);
+    for (size_t i = 0; i < totalPoints; ++i)
+        latencies.push_back((doneNs[i] - sentNs[i]) / 1.0e6);
+    std::sort(latencies.begin(), latencies.end());
+
+    double latencySum = 0.0;
+    for (double latency: latencies)
+        latencySum += latency;
+
+    QJsonObject latencyObject;
+    latencyObject["mean_ms"] = latencies.empty() ? 0.0 : latencySum / latencies.size();
+    latencyObject["p50_ms"] = percentile(latencies, 0.50);
+    latencyObject["p95_ms"] = percentile(latencies, 0.95);
+    latencyObject["p99_ms"] = percentile(latencies, 0.99);
+    latencyObject["max_ms"] = latencies.empty() ? 0.0 : latencies.back();
+
+    static const char *modeNames[] = {"realtime", "fast", "sync"};
+
+    QJsonObject reportObject;
+    reportObject["input"] = path;
+    reportObject["mode"] = modeNames[mode];
+    reportObject["tool"] = canvas->getActiveTool();
+    reportObject["strokes"] = double(strokes.size());
+    reportObject["points"] = double(totalPoints);
+    reportObject["processed"] = double(eventStats.processed);
+    reportObject["coalesced"] = double(eventStats.coalesced);
+    reportObject["dropped"] = double(eventStats.dropped);
+    reportObject["wall_ms"] = wallMs;
+    reportObject["latency"] = latencyObject;
+    QJsonArray sizeArray;
+    sizeArray.append(result.width());
+    sizeArray.append(result.height());
+    reportObject["image_size"] = sizeArray;
+    reportObject["checksum"] = QString::fromLatin1(imageChecksum(result));
+
+    if (!imageOutputPath.isEmpty() && !result.save(imageOutputPath, "PNG"))
+        qWarning() << "Failed to write replay image" << imageOutputPath;
+
+    bool referenceMatch = true;
+    if (!referencePath.isEmpty())
+    {
+        QImage reference(referencePath);
+        QJsonObject referenceObject;
+        referenceObject["path"] = referencePath;
+        referenceObject["tolerance"] = referenceTolerance;
+
+        if (reference.isNull())
+        {
+            qWarning() << "Failed to read replay reference" << referencePath;
+            referenceMatch = false;
+        }
+        else if (reference.size() != result.size())
+        {
+            qWarning() << "Replay reference is" << reference.size() << "but the result is" << result.size();
+            referenceMatch = false;
+        }
+        else
+        {
+            ImageDifference difference = compareImages(result, reference, referenceTolerance);
+            referenceObject["max_difference"] = difference.maxDifference;
+            referenceObject["differing_pixels"] = difference.differingPixels;
+            referenceMatch = difference.differingPixels == 0;
+        }
+
+        referenceObject["match"] = referenceMatch;
+        reportObject["reference"] = referenceObject;
+    }
+
+    QByteArray reportJson = QJsonDocument(reportObject).toJson();
+
+    if (reportOutputPath.isEmpty() || reportOutputPath == QStringLiteral("-"))
+    {
+        std::cout << reportJson.constData() << std::flush;
+    }
+    else
+    {
+        QFile reportFile(reportOutputPath);
+        if (!reportFile.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+            reportFile.write(reportJson) != reportJson.size())
+        {
+            qWarning() << "Failed to write replay report" << reportOutputPath << reportFile.errorString();
+        }
+    }
+
+    if (referenceMatch)
+        QApplication::quit();
+    else
+        QApplication::exit(1);
+}
@@ -0,0 +1,48 @@
+#ifndef STROKEREPLAY_H
+#define STROKEREPLAY_H
+
+#include <QObject>
+#include <QPointer>
+
+class CanvasWidget;
+
+/* Feeds recorded strokes through a CanvasWidget and writes a JSON report of
+ * per-point latency, coalesced and dropped events, and a checksum of the
+ * final image. The input is either one stroke in the CanvasStrokePoint
+ * format (like preview_strokes/default.json) or an array of them.
+ */
+class StrokeReplay : public QObject
+{
+    Q_OBJECT
+public:
+    explicit StrokeReplay(CanvasWidget *canvas, QObject *parent = 0);
+
+    enum Mode {
+        RealTime, /* Send each point after its recorded dt, like a tablet would */
+        Fast,     /* Send points as fast as they can be queued */
+        Sync      /* Process each point before sending the next, never coalesces */
+    };
+
+    static bool modeFromString(QString const &str, Mode *mode);
+
+    Mode mode = Fast;
+    /* The tool to replay with, the canvas's active tool if empty */
+    QString toolPath;
+    /* Write the report as JSON, "-" or empty for stdout */
+    QString reportOutputPath;
+    /* Save the final image as a PNG, e.g. from the native backend to compare other devices with */
+    QString imageOutputPath;
+    /* Compare the final image with this PNG, the replay fails if any channel of any pixel
+     * differs by more than referenceTolerance 8 bit levels.
+     */
+    QString referencePath;
+    int referenceTolerance = 2;
+
+public slots:
+    void execute(QString path);
+
+private:
+    QPointer<CanvasWidget> canvas;
+};
+
+#endif // STROKEREPLAY_H
@@ -20,11 +20,21 @@
 
 #include "canvaswidget-opencl.h"
 
+#include <QTableWidgetItem>
+#include <QThreadPool>
+
 SystemInfoDialog::SystemInfoDialog(QWidget *parent) :
     QDialog(parent),
     ui(new Ui::SystemInfoDialog)
 {
     ui->setupUi(this);
+
+    connect(ui->resetProfileButton, &QPushButton::clicked, [this]() {
+        if (SharedOpenCL *context = SharedOpenCL::getSharedOpenCLMaybe())
+            if (context->profiler)
+                context->profiler->reset();
+        updateProfileTable();
+    });
 }
 
 namespace {
@@ -92,6 +102,12 @@ void SystemInfoDialog::showEvent(QShowEvent *event)
         activePlatform = context->platform;
         activeDevice = context->device;
         activeDeviceShared = context->gl_sharing;
+
+        if (context->native)
+        {
+            addPlatformHeader(queryResultString, "Native CPU backend (active)");
+            addPlatformValue(queryResultString, "Threads", QString::number(QThreadPool::globalInstance()->maxThreadCount()));
+        }
     }
 
     for (OpenCLDeviceInfo &deviceInfo: enumerateOpenCLDevices())
@@ -156,6 +172,58 @@ void SystemInfoDialog::showEvent(QShowEvent *event)
     queryResultString.append("</body>\n");
 
     ui->queryOutput->setText(queryResultString);
+
+    updateProfileTable();
+}
+
+void SystemInfoDialog::updateProfileTable()
+{
+    SharedOpenCL *context = SharedOpenCL::getSharedOpenCLMaybe();
+    OpenCLProfiler *profiler = context ? context->profiler.get() : nullptr;
+
+    ui->profileTable->setVisible(profiler != nullptr);
+    ui->resetProfileButton->setVisible(profiler != nullptr);
+
+    if (!profiler)
+        return;
+
+    static const QStringList headers = {
+        "Kernel", "Count", "Run (ms)", "Mean (us)", "Min (us)", "Max (us)", "Queued (ms)", "Submit (ms)"
+    };
+
+    auto numberItem = [](double value) {
+        QTableWidgetItem *item = new QTableWidgetItem();
+        item->setData(Qt::DisplayRole, value);
+        item->setTextAlignment(Qt::AlignRight | Qt::AlignVCenter);
+        return item;
+    };
+
+    std::vector<OpenCLProfiler::Stats> results = profiler->results();
+
+    /* Sorting must be off while filling or rows will move under us */
+    ui->profileTable->setSortingEnabled(false);
+    ui->profileTable->clear();
+    ui->profileTable->setColumnCount(headers.size());
+    ui->profileTable->setHorizontalHeaderLabels(headers);
+    ui->profileTable->setRowCount(results.size());
+
+    int row = 0;
+    for (OpenCLProfiler::Stats const &stats: results)
+    {
+        ui->profileTable->setItem(row, 0, new QTableWidgetItem(QString::fromUtf8(stats.name)));
+        ui->profileTable->setItem(row, 1, numberItem(stats.count));
+        ui->profileTable->setItem(row, 2, numberItem(stats.runNs / 1.0e6));
+        ui->profileTable->setItem(row, 3, numberItem(stats.runNs / 1.0e3 / stats.count));
+        ui->profileTable->setItem(row, 4, numberItem(stats.minRunNs / 1.0e3));
+        ui->profileTable->setItem(row, 5, numberItem(stats.maxRunNs / 1.0e3));
+        ui->profileTable->setItem(row, 6, numberItem(stats.queuedNs / 1.0e6));
+        ui->profileTable->setItem(row, 7, numberItem(stats.submitNs / 1.0e6));
+        row++;
+    }
+
+    ui->profileTable->setSortingEnabled(true);
+    ui->profileTable->sortByColumn(2, Qt::DescendingOrder);
+    ui->profileTable->resizeColumnsToContents();
 }
 
 SystemInfoDialog::~SystemInfoDialog()
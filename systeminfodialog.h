@@ -20,6 +20,8 @@ protected:
     void showEvent(QShowEvent *event);
 
 private:
+    void updateProfileTable();
+
     std::unique_ptr<Ui::SystemInfoDialog> ui;
 };
 
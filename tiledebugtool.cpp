@@ -2,6 +2,7 @@
 #include "strokecontext.h"
 #include "canvastile.h"
 #include "paintutils.h"
+#include "nativekernels.h"
 #include <qmath.h>
 #include <QVariant>
 
@@ -36,14 +37,18 @@ void TileDebugStrokeContext::drawDab(QPointF point, TileSet &modTiles)
     int ix_end   = tile_indice(point.x() + intRadius, TILE_PIXEL_WIDTH);
     int iy_end   = tile_indice(point.y() + intRadius, TILE_PIXEL_HEIGHT);
 
+    const bool native = SharedOpenCL::getSharedOpenCL()->native;
     const size_t global_work_size[2] = {TILE_PIXEL_HEIGHT, TILE_PIXEL_WIDTH};
-    cl_kernel kernel = SharedOpenCL::getSharedOpenCL()->circleKernel;
+    cl_kernel kernel = native ? nullptr : SharedOpenCL::getSharedOpenCL()->circleKernel;
 
     cl_int err = CL_SUCCESS;
     cl_int stride = TILE_PIXEL_WIDTH;
 
-    err = clSetKernelArg<cl_int>(kernel, 1, stride);
-    err = clSetKernelArg<cl_float>(kernel, 4, floatRadius);
+    if (kernel)
+    {
+        err = clSetKernelArg<cl_int>(kernel, 1, stride);
+        err = clSetKernelArg<cl_float>(kernel, 4, floatRadius);
+    }
 
     for (int iy = iy_start; iy <= iy_end; ++iy)
     {
@@ -58,18 +63,30 @@ void TileDebugStrokeContext::drawDab(QPointF point, TileSet &modTiles)
 
             cl_int offsetX = point.x() - (ix * TILE_PIXEL_WIDTH);
             cl_int offsetY = point.y() - (iy * TILE_PIXEL_HEIGHT);
-            cl_mem data = layer->clOpenTileAt(ix, iy);
+            CanvasTile *tile = layer->getTile(ix, iy);
 
             modTiles.insert(QPoint(ix, iy));
 
+            if (native)
+            {
+                NativeKernels::circle(tile->mapHost(), offsetX, offsetY, floatRadius, pixel.s);
+                continue;
+            }
+
+            cl_mem data = tile->unmapHost();
+
+            CLDependencies deps;
+            deps.add(tile->eventSlot());
+
             err = clSetKernelArg<cl_mem>(kernel, 0, data);
             err = clSetKernelArg<cl_int>(kernel, 2, offsetX);
             err = clSetKernelArg<cl_int>(kernel, 3, offsetY);
             err = clSetKernelArg<cl_float4>(kernel, 5, pixel);
             err = clEnqueueNDRangeKernel(SharedOpenCL::getSharedOpenCL()->cmdQueue,
                                          kernel, 2,
-                                         nullptr, global_work_size, nullptr,
-                                         0, nullptr, nullptr);
+                                         nullptr, global_work_size,
+                                         SharedOpenCL::getSharedOpenCL()->localWorkSize(kernel, 2, global_work_size).get(),
+                                         deps.count(), deps.waitList(), deps.event(kernel));
         }
     }
 
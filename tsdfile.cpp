@@ -0,0 +1,746 @@
+#include "tsdfile.h"
+#include "canvaslayer.h"
+#include "canvastile.h"
+#include "nativekernels.h"
+#include "ora.h"
+
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonValue>
+#include <QtEndian>
+#include <atomic>
+#include <cstring>
+#include <vector>
+#include "zlib.h"
+
+#if defined(Q_OS_WIN32)
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* A TileShadow document (.tsd) is laid out as:
+ *
+ *   header   8 byte magic, u64 offset of the current index
+ *   chunks   one per distinct tile, the tile's floats compressed by compressTile()
+ *   index    "TSDI", u32 JSON size, u32 chunk count, u32 tile count,
+ *            the JSON document (layer tree, attributes, frame),
+ *            the chunk table {SHA-256 digest, u64 offset, u32 size},
+ *            the tile table {i32 x, i32 y, u32 chunk}
+ *
+ * Integers are little endian. Each layer in the JSON refers to a range of the
+ * tile table, and tiles with the same digest share a chunk.
+ *
+ * A save appends the chunks the file doesn't have and a new index, and only then
+ * points the header at the new index, so an interrupted save leaves the previous
+ * one readable. Once most of the file is unreferenced it's rewritten instead.
+ */
+
+namespace {
+const char fileMagic[8] = {'T', 'S', 'D', 'O', 'C', '\r', '\n', '\x1A'};
+const char indexMagic[4] = {'T', 'S', 'D', 'I'};
+enum {
+    formatVersion = 1,
+    headerSize = 16,
+    indexHeaderSize = 16,
+    digestSize = 32,
+    chunkEntrySize = digestSize + 12,
+    tileEntrySize = 12,
+    tileBytes = TILE_COMP_TOTAL * sizeof(float),
+    /* Don't bother compacting until at least this much of the file is unreferenced */
+    compactMinimumWaste = 16 * 1024 * 1024
+};
+
+struct ChunkEntry
+{
+    QByteArray digest;
+    quint64 offset;
+    quint32 size;
+};
+
+struct TileEntry
+{
+    qint32 x;
+    qint32 y;
+    quint32 chunk;
+};
+
+/* Chunks are shared by digest alone, so it has to be one that won't collide */
+QByteArray digestTile(const float *data)
+{
+    return QCryptographicHash::hash(QByteArray::fromRawData((const char *)data, tileBytes),
+                                    QCryptographicHash::Sha256);
+}
+
+/* QFile::flush() only hands the data to the OS, this waits until it's on disk */
+bool syncFile(QFile &file)
+{
+    if (!file.flush())
+        return false;
+#if defined(Q_OS_WIN32)
+    return FlushFileBuffers((HANDLE)_get_osfhandle(file.handle()));
+#elif defined(Q_OS_MAC)
+    return fcntl(file.handle(), F_FULLFSYNC) != -1 || fsync(file.handle()) == 0;
+#else
+    return fsync(file.handle()) == 0;
+#endif
+}
+
+/* The floats are split into byte planes before compressing, neighbouring pixels
+ * usually share their exponent bytes and those compress far better together.
+ */
+QByteArray compressTile(const float *data)
+{
+    std::vector<uint8_t> planes(tileBytes);
+
+    for (int i = 0; i < TILE_COMP_TOTAL; ++i)
+    {
+        uint32_t bits;
+        memcpy(&bits, data + i, sizeof(bits));
+        planes[i] = bits;
+        planes[i + TILE_COMP_TOTAL] = bits >> 8;
+        planes[i + TILE_COMP_TOTAL * 2] = bits >> 16;
+        planes[i + TILE_COMP_TOTAL * 3] = bits >> 24;
+    }
+
+    uLongf size = compressBound(tileBytes);
+    QByteArray result(int(size), Qt::Uninitialized);
+
+    if (compress2((Bytef *)result.data(), &size, planes.data(), tileBytes, Z_BEST_SPEED) != Z_OK)
+        return QByteArray();
+
+    result.resize(size);
+    return result;
+}
+
+bool decompressTile(const uchar *chunk, quint32 size, float *out)
+{
+    std::vector<uint8_t> planes(tileBytes);
+    uLongf planesSize = tileBytes;
+
+    if (uncompress(planes.data(), &planesSize, chunk, size) != Z_OK || planesSize != tileBytes)
+        return false;
+
+    for (int i = 0; i < TILE_COMP_TOTAL; ++i)
+    {
+        uint32_t bits = uint32_t(planes[i]) |
+                        (uint32_t(planes[i + TILE_COMP_TOTAL]) << 8) |
+                        (uint32_t(planes[i + TILE_COMP_TOTAL * 2]) << 16) |
+                        (uint32_t(planes[i + TILE_COMP_TOTAL * 3]) << 24);
+        memcpy(out + i, &bits, sizeof(bits));
+    }
+
+    return true;
+}
+
+/* A layer's entries in the tile table. The refs come from the previous save if the
+ * layer hasn't changed, otherwise they're digested from the mapped tiles in data.
+ */
+struct SaveLayer
+{
+    CanvasLayer const *layer;
+    std::vector<TsdFileRecord::TileRef> refs;
+    std::vector<const float *> data;
+};
+
+struct SaveChunk
+{
+    QByteArray digest;
+    quint32 size;
+    quint64 offset;
+    /* Where the chunk is in the previous file, if it's there */
+    bool inSource;
+    quint64 sourceOffset;
+    const float *data;
+    QByteArray compressed;
+};
+
+QJsonArray writeLayers(QList<CanvasLayer *> const &layers,
+                       TsdFileRecord const &previous,
+                       std::vector<SaveLayer> &saveLayers,
+                       int &tileCount)
+{
+    QJsonArray result;
+
+    for (CanvasLayer const *layer: layers)
+    {
+        QJsonObject layerObject;
+        layerObject["name"] = layer->name;
+        layerObject["visible"] = layer->visible;
+        layerObject["editable"] = layer->editable;
+        layerObject["mode"] = blendModeToOraOp(layer->mode);
+        layerObject["opacity"] = layer->opacity;
+
+        if (layer->type == LayerType::Group)
+        {
+            layerObject["type"] = QStringLiteral("group");
+            layerObject["children"] = writeLayers(layer->children, previous, saveLayers, tileCount);
+        }
+        else
+        {
+            SaveLayer saveLayer;
+            saveLayer.layer = layer;
+
+            auto found = previous.layers.find(layer->contentVersion);
+            if (found != previous.layers.end())
+            {
+                saveLayer.refs = found->second;
+            }
+            else
+            {
+                // Mapping uses the OpenCL queue, so it's done here rather than by the digesting
+                for (auto const &iter: *layer->tiles)
+                {
+                    saveLayer.refs.push_back({iter.first, QByteArray()});
+                    saveLayer.data.push_back(iter.second->mapHost());
+                }
+            }
+
+            QJsonArray tileRange;
+            tileRange.append(tileCount);
+            tileRange.append(int(saveLayer.refs.size()));
+            tileCount += saveLayer.refs.size();
+
+            layerObject["type"] = QStringLiteral("layer");
+            layerObject["tiles"] = tileRange;
+            saveLayers.push_back(std::move(saveLayer));
+        }
+
+        result.append(layerObject);
+    }
+
+    return result;
+}
+
+QByteArray buildIndex(QByteArray const &json,
+                      std::vector<SaveChunk> const &chunkTable,
+                      std::vector<TileEntry> const &tileTable)
+{
+    QByteArray result(indexHeaderSize + json.size() +
+                      chunkTable.size() * chunkEntrySize +
+                      tileTable.size() * tileEntrySize, Qt::Uninitialized);
+    uchar *out = (uchar *)result.data();
+
+    memcpy(out, indexMagic, sizeof(indexMagic));
+    qToLittleEndian<quint32>(json.size(), out + 4);
+    qToLittleEndian<quint32>(chunkTable.size(), out + 8);
+    qToLittleEndian<quint32>(tileTable.size(), out + 12);
+    out += indexHeaderSize;
+
+    memcpy(out, json.constData(), json.size());
+    out += json.size();
+
+    for (SaveChunk const &chunk: chunkTable)
+    {
+        memcpy(out, chunk.digest.constData(), digestSize);
+        qToLittleEndian<quint64>(chunk.offset, out + digestSize);
+        qToLittleEndian<quint32>(chunk.size, out + digestSize + 8);
+        out += chunkEntrySize;
+    }
+
+    for (TileEntry const &tile: tileTable)
+    {
+        qToLittleEndian<qint32>(tile.x, out);
+        qToLittleEndian<qint32>(tile.y, out + 4);
+        qToLittleEndian<quint32>(tile.chunk, out + 8);
+        out += tileEntrySize;
+    }
+
+    return result;
+}
+
+/* A tile to decode, its CanvasTile is created before the decoding starts */
+struct LoadTile
+{
+    CanvasLayer *layer;
+    QPoint point;
+    quint32 chunk;
+    float *data;
+};
+
+typedef std::vector<std::pair<CanvasLayer *, std::vector<TsdFileRecord::TileRef>>> LoadedLayers;
+
+QList<CanvasLayer *> readLayers(QJsonArray const &array,
+                                std::vector<TileEntry> const &tileTable,
+                                std::vector<ChunkEntry> const &chunkTable,
+                                std::vector<LoadTile> &loadTiles,
+                                LoadedLayers &loadedLayers)
+{
+    QList<CanvasLayer *> result;
+
+    for (QJsonValue const &value: array)
+    {
+        QJsonObject layerObject = value.toObject();
+
+        CanvasLayer *layer = new CanvasLayer(layerObject["name"].toString());
+        layer->visible = layerObject["visible"].toBool(true);
+        layer->editable = layerObject["editable"].toBool(true);
+        layer->mode = oraOpToMode(layerObject["mode"].toString());
+        layer->opacity = layerObject["opacity"].toDouble(1.0);
+        result.append(layer);
+
+        if (layerObject["type"].toString() == QStringLiteral("group"))
+        {
+            layer->type = LayerType::Group;
+            layer->children = readLayers(layerObject["children"].toArray(), tileTable, chunkTable, loadTiles, loadedLayers);
+            continue;
+        }
+
+        QJsonArray tileRange = layerObject["tiles"].toArray();
+        int first = tileRange.at(0).toInt();
+        int count = tileRange.at(1).toInt();
+
+        if (first < 0 || count < 0 || size_t(first) + size_t(count) > tileTable.size())
+        {
+            qWarning() << "Layer" << layer->name << "has an invalid tile range";
+            count = 0;
+        }
+
+        // Tiles are decoded in parallel, so two entries for one point would write the same tile
+        TileSet seen;
+        bool duplicates = false;
+
+        std::vector<TsdFileRecord::TileRef> refs;
+        for (int i = first; i < first + count; ++i)
+        {
+            TileEntry const &tile = tileTable[i];
+            QPoint point(tile.x, tile.y);
+            if (!seen.insert(point).second)
+            {
+                duplicates = true;
+                continue;
+            }
+            loadTiles.push_back({layer, point, tile.chunk, nullptr});
+            refs.push_back({point, chunkTable[tile.chunk].digest});
+        }
+        loadedLayers.push_back({layer, std::move(refs)});
+
+        if (duplicates)
+            qWarning() << "Layer" << layer->name << "has duplicate tiles, only the first of each was read";
+    }
+
+    return result;
+}
+}
+
+bool isTSDPath(QString const &path)
+{
+    return path.endsWith(QStringLiteral(".tsd"), Qt::CaseInsensitive);
+}
+
+void saveStackAsTSD(CanvasStack *stack, QRect frame, QString path, std::function<void(QString const &, float)> progressCallback)
+{
+    QString filePath = QFileInfo(path).absoluteFilePath();
+
+    /* Chunks from the previous save can be reused as long as its file hasn't been
+     * touched since, it's mapped so they can be copied if the file is rewritten.
+     */
+    TsdFileRecord previous;
+    QFile sourceFile(stack->tsdRecord.filePath);
+    const uchar *sourceData = nullptr;
+    {
+        TsdFileRecord const &record = stack->tsdRecord;
+        QFileInfo fileInfo(record.filePath);
+
+        if (!record.filePath.isEmpty() && fileInfo.exists() &&
+            fileInfo.lastModified() == record.lastModified && fileInfo.size() == record.size &&
+            sourceFile.open(QIODevice::ReadOnly))
+        {
+            sourceData = sourceFile.map(0, record.size);
+            if (sourceData)
+                previous = record;
+        }
+    }
+
+    progressCallback(QStringLiteral("Saving tiles"), 1.0f);
+
+    std::vector<SaveLayer> saveLayers;
+    int tileCount = 0;
+
+    QJsonObject root;
+    root["format"] = int(formatVersion);
+    if (!frame.isEmpty())
+    {
+        QJsonArray frameArray;
+        frameArray.append(frame.x());
+        frameArray.append(frame.y());
+        frameArray.append(frame.width());
+        frameArray.append(frame.height());
+        root["frame"] = frameArray;
+    }
+    root["layers"] = writeLayers(stack->layers, previous, saveLayers, tileCount);
+
+    {
+        // The background is the last entry of the tile table
+        SaveLayer background;
+        background.layer = nullptr;
+        background.refs.push_back({QPoint(0, 0), QByteArray()});
+        background.data.push_back(stack->backgroundTile->mapHost());
+        saveLayers.push_back(std::move(background));
+
+        root["background"] = tileCount++;
+    }
+
+    QByteArray json = QJsonDocument(root).toJson(QJsonDocument::Compact);
+
+    // Digest the tiles of every layer that changed
+    std::vector<std::pair<size_t, size_t>> undigested;
+    for (size_t i = 0; i < saveLayers.size(); ++i)
+        for (size_t j = 0; j < saveLayers[i].data.size(); ++j)
+            undigested.push_back({i, j});
+
+    NativeKernels::parallelFor(undigested.size(), [&](int n) {
+        SaveLayer &saveLayer = saveLayers[undigested[n].first];
+        saveLayer.refs[undigested[n].second].digest = digestTile(saveLayer.data[undigested[n].second]);
+    });
+
+    // Build the tables, only tiles the previous file doesn't have need compressing
+    std::vector<SaveChunk> chunkTable;
+    std::map<QByteArray, quint32> chunkIndex;
+    std::vector<TileEntry> tileTable;
+
+    for (SaveLayer const &saveLayer: saveLayers)
+        for (size_t j = 0; j < saveLayer.refs.size(); ++j)
+        {
+            TsdFileRecord::TileRef const &ref = saveLayer.refs[j];
+            auto found = chunkIndex.find(ref.digest);
+            quint32 index;
+
+            if (found != chunkIndex.end())
+            {
+                index = found->second;
+            }
+            else
+            {
+                SaveChunk chunk;
+                chunk.digest = ref.digest;
+                chunk.size = 0;
+                chunk.offset = 0;
+                chunk.inSource = false;
+                chunk.sourceOffset = 0;
+                chunk.data = nullptr;
+
+                auto sourceChunk = previous.chunks.find(ref.digest);
+                if (sourceChunk != previous.chunks.end())
+                {
+                    chunk.inSource = true;
+                    chunk.sourceOffset = sourceChunk->second.offset;
+                    chunk.size = sourceChunk->second.size;
+                }
+                else if (j < saveLayer.data.size())
+                {
+                    chunk.data = saveLayer.data[j];
+                }
+                else
+                {
+                    // Unchanged layers only refer to chunks of the previous file
+                    qWarning() << "Failed to save" << path << ": a tile is missing from" << previous.filePath;
+                    return;
+                }
+
+                index = chunkTable.size();
+                chunkTable.push_back(std::move(chunk));
+                chunkIndex[ref.digest] = index;
+            }
+
+            tileTable.push_back({ref.point.x(), ref.point.y(), index});
+        }
+
+    std::vector<size_t> newChunks;
+    for (size_t i = 0; i < chunkTable.size(); ++i)
+        if (!chunkTable[i].inSource)
+            newChunks.push_back(i);
+
+    std::atomic<int> compressFailures(0);
+    NativeKernels::parallelFor(newChunks.size(), [&](int n) {
+        SaveChunk &chunk = chunkTable[newChunks[n]];
+        chunk.compressed = compressTile(chunk.data);
+        chunk.size = chunk.compressed.size();
+        if (chunk.compressed.isEmpty())
+            compressFailures++;
+    });
+
+    if (compressFailures)
+    {
+        qWarning() << "Failed to save" << path << ": tile compression failed";
+        return;
+    }
+
+    progressCallback(QStringLiteral("Writing tiles"), 60.0f);
+
+    qint64 newBytes = 0;
+    qint64 liveBytes = headerSize;
+    for (SaveChunk const &chunk: chunkTable)
+    {
+        liveBytes += chunk.size;
+        if (!chunk.inSource)
+            newBytes += chunk.size;
+    }
+
+    qint64 indexBytes = indexHeaderSize + json.size() +
+                        qint64(chunkTable.size()) * chunkEntrySize +
+                        qint64(tileTable.size()) * tileEntrySize;
+
+    bool append = !previous.filePath.isEmpty() && previous.filePath == filePath;
+    if (append)
+    {
+        // Compact the file instead once most of it would be unreferenced
+        qint64 appendedSize = previous.size + newBytes + indexBytes;
+        qint64 waste = appendedSize - liveBytes - indexBytes;
+        if (waste > compactMinimumWaste && waste * 2 > appendedSize)
+            append = false;
+    }
+
+    qint64 offset = append ? previous.size : qint64(headerSize);
+    for (SaveChunk &chunk: chunkTable)
+    {
+        if (append && chunk.inSource)
+        {
+            chunk.offset = chunk.sourceOffset;
+        }
+        else
+        {
+            chunk.offset = offset;
+            offset += chunk.size;
+        }
+    }
+    const quint64 indexOffset = offset;
+
+    QByteArray indexData = buildIndex(json, chunkTable, tileTable);
+
+    uchar header[headerSize];
+    memcpy(header, fileMagic, sizeof(fileMagic));
+    qToLittleEndian<quint64>(indexOffset, header + 8);
+
+    bool ok = true;
+
+    if (append)
+    {
+        // The previous file is the one being appended to, so it doesn't need to stay mapped
+        sourceFile.close();
+
+        QFile file(filePath);
+        ok = file.open(QIODevice::ReadWrite) && file.size() == previous.size && file.seek(previous.size);
+
+        for (size_t i: newChunks)
+        {
+            QByteArray const &data = chunkTable[i].compressed;
+            ok = ok && file.write(data) == data.size();
+        }
+
+        ok = ok && file.write(indexData) == indexData.size() && syncFile(file);
+
+        // Point the header at the new index only once everything it refers to is on disk
+        ok = ok && file.seek(8) && file.write((const char *)header + 8, 8) == 8 && syncFile(file);
+        file.close();
+    }
+    else
+    {
+        QSaveFile saveFile(filePath);
+        ok = saveFile.open(QIODevice::WriteOnly);
+        ok = ok && saveFile.write((const char *)header, headerSize) == headerSize;
+
+        for (SaveChunk const &chunk: chunkTable)
+        {
+            if (chunk.inSource)
+                ok = ok && saveFile.write((const char *)sourceData + chunk.sourceOffset, chunk.size) == chunk.size;
+            else
+                ok = ok && saveFile.write(chunk.compressed) == chunk.compressed.size();
+        }
+
+        ok = ok && saveFile.write(indexData) == indexData.size();
+
+        // The previous file may be the one being replaced
+        sourceFile.close();
+
+        if (ok)
+            ok = saveFile.commit();
+        else
+            saveFile.cancelWriting();
+    }
+
+    progressCallback(QStringLiteral("Writing index"), 95.0f);
+
+    if (!ok)
+    {
+        qWarning() << "Failed to write" << path;
+        // An append may have left unreferenced data behind, the next save rewrites the file
+        stack->tsdRecord = TsdFileRecord();
+        return;
+    }
+
+    TsdFileRecord saved;
+    QFileInfo fileInfo(filePath);
+    saved.filePath = filePath;
+    saved.lastModified = fileInfo.lastModified();
+    saved.size = fileInfo.size();
+
+    for (SaveChunk const &chunk: chunkTable)
+        saved.chunks[chunk.digest] = {chunk.offset, chunk.size};
+
+    for (SaveLayer &saveLayer: saveLayers)
+        if (saveLayer.layer)
+            saved.layers[saveLayer.layer->contentVersion] = std::move(saveLayer.refs);
+
+    stack->tsdRecord = std::move(saved);
+}
+
+void loadStackFromTSD(CanvasStack *stack, QRect *frame, QString path)
+{
+    QFile file(path);
+
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        qDebug() << "Could not open" << path;
+        return;
+    }
+
+    /* The tiles are decoded straight out of the mapped file, nothing but the
+     * index is read up front.
+     */
+    const quint64 fileSize = file.size();
+    const uchar *data = fileSize >= quint64(headerSize) ? file.map(0, fileSize) : nullptr;
+
+    if (!data || memcmp(data, fileMagic, sizeof(fileMagic)))
+    {
+        qDebug() << "Could not read" << path << "not a TileShadow document";
+        return;
+    }
+
+    const quint64 indexOffset = qFromLittleEndian<quint64>(data + 8);
+
+    if (indexOffset < quint64(headerSize) || indexOffset + indexHeaderSize > fileSize ||
+        memcmp(data + indexOffset, indexMagic, sizeof(indexMagic)))
+    {
+        qDebug() << "Could not read" << path << "invalid index";
+        return;
+    }
+
+    const uchar *index = data + indexOffset;
+    const quint32 jsonSize = qFromLittleEndian<quint32>(index + 4);
+    const quint32 chunkCount = qFromLittleEndian<quint32>(index + 8);
+    const quint32 tileCount = qFromLittleEndian<quint32>(index + 12);
+
+    if (indexOffset + indexHeaderSize + jsonSize +
+        quint64(chunkCount) * chunkEntrySize + quint64(tileCount) * tileEntrySize > fileSize)
+    {
+        qDebug() << "Could not read" << path << "truncated index";
+        return;
+    }
+
+    QJsonDocument document = QJsonDocument::fromJson(QByteArray::fromRawData((const char *)index + indexHeaderSize, jsonSize));
+    QJsonObject root = document.object();
+
+    if (root["format"].toInt() < 1 || root["format"].toInt() > formatVersion)
+    {
+        qDebug() << "Could not read" << path << "unsupported format" << root["format"].toInt();
+        return;
+    }
+
+    std::vector<ChunkEntry> chunkTable(chunkCount);
+    const uchar *entry = index + indexHeaderSize + jsonSize;
+    for (ChunkEntry &chunk: chunkTable)
+    {
+        chunk.digest = QByteArray((const char *)entry, digestSize);
+        chunk.offset = qFromLittleEndian<quint64>(entry + digestSize);
+        chunk.size = qFromLittleEndian<quint32>(entry + digestSize + 8);
+        entry += chunkEntrySize;
+
+        if (chunk.offset < quint64(headerSize) || chunk.offset + chunk.size > indexOffset)
+        {
+            qDebug() << "Could not read" << path << "invalid chunk table";
+            return;
+        }
+    }
+
+    std::vector<TileEntry> tileTable(tileCount);
+    for (TileEntry &tile: tileTable)
+    {
+        tile.x = qFromLittleEndian<qint32>(entry);
+        tile.y = qFromLittleEndian<qint32>(entry + 4);
+        tile.chunk = qFromLittleEndian<quint32>(entry + 8);
+        entry += tileEntrySize;
+
+        if (tile.chunk >= chunkCount)
+        {
+            qDebug() << "Could not read" << path << "invalid tile table";
+            return;
+        }
+    }
+
+    std::vector<LoadTile> loadTiles;
+    LoadedLayers loadedLayers;
+    QList<CanvasLayer *> resultLayers = readLayers(root["layers"].toArray(), tileTable, chunkTable, loadTiles, loadedLayers);
+
+    std::unique_ptr<CanvasTile> resultBackgroundTile;
+    int backgroundIndex = root["background"].toInt(-1);
+    if (backgroundIndex >= 0 && quint32(backgroundIndex) < tileCount)
+    {
+        resultBackgroundTile.reset(new CanvasTile());
+        loadTiles.push_back({nullptr, QPoint(0, 0), tileTable[backgroundIndex].chunk, resultBackgroundTile->mapHost()});
+    }
+
+    // Creating the tiles uses the OpenCL queue, only the decoding is done in parallel
+    for (LoadTile &tile: loadTiles)
+        if (tile.layer)
+            tile.data = tile.layer->openTileAt(tile.point.x(), tile.point.y());
+
+    std::atomic<int> decodeFailures(0);
+    NativeKernels::parallelFor(loadTiles.size(), [&](int n) {
+        LoadTile &tile = loadTiles[n];
+        ChunkEntry const &chunk = chunkTable[tile.chunk];
+
+        if (!decompressTile(data + chunk.offset, chunk.size, tile.data))
+        {
+            memset(tile.data, 0, tileBytes);
+            decodeFailures++;
+        }
+    });
+
+    if (decodeFailures)
+        qWarning() << "Failed to read" << decodeFailures << "tiles from" << path;
+
+    if (resultLayers.empty())
+        return;
+
+    // Until a layer is modified its tiles don't need to be written again
+    TsdFileRecord record;
+    if (!decodeFailures)
+    {
+        QFileInfo fileInfo(path);
+        record.filePath = fileInfo.absoluteFilePath();
+        record.lastModified = fileInfo.lastModified();
+        record.size = fileInfo.size();
+
+        for (ChunkEntry const &chunk: chunkTable)
+            record.chunks[chunk.digest] = {chunk.offset, chunk.size};
+
+        for (auto &iter: loadedLayers)
+            record.layers[iter.first->contentVersion] = std::move(iter.second);
+    }
+
+    stack->clearLayers();
+    stack->layers = resultLayers;
+    stack->tsdRecord = std::move(record);
+
+    if (resultBackgroundTile)
+        stack->setBackground(std::move(resultBackgroundTile));
+
+    if (frame)
+    {
+        QJsonArray frameArray = root["frame"].toArray();
+        if (frameArray.size() == 4)
+            *frame = QRect(frameArray.at(0).toInt(), frameArray.at(1).toInt(),
+                           frameArray.at(2).toInt(), frameArray.at(3).toInt());
+        else
+            *frame = QRect();
+    }
+}
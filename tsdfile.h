@@ -0,0 +1,16 @@
+#ifndef TSDFILE_H
+#define TSDFILE_H
+
+#include "canvasstack.h"
+#include <functional>
+
+/* TileShadow's own document format, each tile is compressed on its own so saves
+ * only have to write the tiles that changed. ORA remains the format for
+ * exchanging images with other programs.
+ */
+bool isTSDPath(QString const &path);
+void saveStackAsTSD(CanvasStack *stack, QRect frame, QString path,
+                    std::function<void(QString const &msg, float percent)> progressCallback = [](QString const &, float) {});
+void loadStackFromTSD(CanvasStack *stack, QRect *frame, QString path);
+
+#endif // TSDFILE_H
@@ -0,0 +1,410 @@
+#include "workgrouptuner.h"
+#include "canvaswidget-opencl.h"
+#include "canvastile.h"
+#include "opencldeviceinfo.h"
+#include <array>
+#include <vector>
+#include <QSettings>
+#include <QStringList>
+#include <QElapsedTimer>
+#include <QDebug>
+
+QString WorkGroupTuner::LocalSize::toString() const
+{
+    if (isDefault())
+        return QStringLiteral("default");
+    return QStringLiteral("%1x%2").arg(size[0]).arg(size[1]);
+}
+
+WorkGroupTuner::LocalSize WorkGroupTuner::LocalSize::fromString(QString const &str)
+{
+    LocalSize result;
+    QStringList parts = str.split('x');
+
+    if (parts.size() == 2)
+    {
+        bool xOk = false;
+        bool yOk = false;
+        size_t x = parts[0].toUInt(&xOk);
+        size_t y = parts[1].toUInt(&yOk);
+
+        if (xOk && yOk && x > 0 && y > 0)
+        {
+            result.size[0] = x;
+            result.size[1] = y;
+        }
+    }
+
+    return result;
+}
+
+static QString settingsGroup(cl_device_id device)
+{
+    OpenCLDeviceInfo deviceInfo(device);
+
+    QString key = QStringLiteral("%1 - %2 - %3").arg(deviceInfo.getPlatformName(),
+                                                    deviceInfo.getDeviceName(),
+                                                    deviceInfo.getDeviceInfoString(CL_DRIVER_VERSION)).simplified();
+    key.replace('/', '_');
+    key.replace('\\', '_');
+
+    return QStringLiteral("OpenCL/WorkGroupSizes/") + key;
+}
+
+WorkGroupTuner::Results WorkGroupTuner::load(cl_device_id device)
+{
+    Results results;
+
+    QSettings appSettings;
+    appSettings.beginGroup(settingsGroup(device));
+    for (QString const &kernelName: appSettings.childKeys())
+        results[kernelName.toUtf8()] = LocalSize::fromString(appSettings.value(kernelName).toString());
+    appSettings.endGroup();
+
+    return results;
+}
+
+void WorkGroupTuner::save(cl_device_id device, Results const &results)
+{
+    QString group = settingsGroup(device);
+
+    QSettings appSettings;
+    appSettings.remove(group);
+    appSettings.beginGroup(group);
+    for (auto const &iter: results)
+        appSettings.setValue(QString::fromUtf8(iter.first), iter.second.toString());
+    appSettings.endGroup();
+}
+
+namespace {
+
+struct Tunable
+{
+    LazyProgram *program;
+    QByteArray name;
+    cl_uint dims;
+    std::function<void(cl_kernel)> setArgs;
+    bool dabSized;
+};
+
+/* Average milliseconds per launch, or a negative value if the size was rejected */
+double timeKernel(cl_command_queue queue, cl_kernel kernel, cl_uint dims,
+                  const size_t *globalWorkSize, const size_t *localWorkSize)
+{
+    static const int warmupRuns = 2;
+    static const int timedRuns = 16;
+
+    for (int i = 0; i < warmupRuns; ++i)
+        if (CL_SUCCESS != clEnqueueNDRangeKernel(queue, kernel, dims,
+                                                 nullptr, globalWorkSize, localWorkSize,
+                                                 0, nullptr, nullptr))
+            return -1.0;
+    clFinish(queue);
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < timedRuns; ++i)
+        clEnqueueNDRangeKernel(queue, kernel, dims,
+                               nullptr, globalWorkSize, localWorkSize,
+                               0, nullptr, nullptr);
+    clFinish(queue);
+
+    return timer.nsecsElapsed() / 1.0e6 / timedRuns;
+}
+
+std::vector<WorkGroupTuner::LocalSize> candidateSizes(cl_uint dims, size_t kernelMax, const size_t maxItems[3])
+{
+    std::vector<WorkGroupTuner::LocalSize> result;
+
+    for (size_t x = 8; x <= TILE_PIXEL_WIDTH * 4; x *= 2)
+    {
+        for (size_t y = 1; y <= (dims == 1 ? 1 : 16); y *= 2)
+        {
+            if (x * y < 16 || x * y > kernelMax || x > maxItems[0] || y > maxItems[1])
+                continue;
+            if (dims == 2 && x > TILE_PIXEL_WIDTH)
+                continue;
+
+            WorkGroupTuner::LocalSize candidate;
+            candidate.size[0] = x;
+            candidate.size[1] = y;
+            result.push_back(candidate);
+        }
+    }
+
+    return result;
+}
+
+}
+
+WorkGroupTuner::Results WorkGroupTuner::run(SharedOpenCL *opencl, std::function<void(QString const &)> progress)
+{
+    Results results;
+
+    if (!opencl || opencl->native)
+        return results;
+
+    cl_int err = CL_SUCCESS;
+    cl_context ctx = opencl->ctx;
+    cl_command_queue queue = opencl->cmdQueue;
+
+    /* Scratch resources, the tiles are filled with mid gray so no kernel hits a degenerate path */
+    std::vector<float> tileData(TILE_COMP_TOTAL, 0.5f);
+    std::vector<cl_uchar> maskData(64 * 64, 0x80);
+    std::vector<cl_uchar> patternData(64 * 64 * 4, 0x80);
+
+    cl_mem tileA = clCreateBuffer(ctx, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                  TILE_COMP_TOTAL * sizeof(float), tileData.data(), &err);
+    cl_mem tileB = clCreateBuffer(ctx, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                  TILE_COMP_TOTAL * sizeof(float), tileData.data(), &err);
+    cl_mem floatMask = clCreateBuffer(ctx, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                      TILE_PIXEL_WIDTH * TILE_PIXEL_HEIGHT * sizeof(float), tileData.data(), &err);
+    cl_mem u8Tile = clCreateBuffer(ctx, CL_MEM_READ_WRITE,
+                                   TILE_COMP_TOTAL * sizeof(cl_uchar), nullptr, &err);
+
+    cl_image_format maskFmt = {CL_INTENSITY, CL_UNORM_INT8};
+    cl_mem maskImage = cl::createImage2D(opencl, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &maskFmt,
+                                         64, 64, 0, maskData.data(), &err);
+    cl_image_format patternFmt = {CL_RGBA, CL_UNORM_INT8};
+    cl_mem patternImage = cl::createImage2D(opencl, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &patternFmt,
+                                            64, 64, 0, patternData.data(), &err);
+
+    const cl_float4 color = {0.25f, 0.5f, 0.75f, 0.5f};
+
+    std::vector<Tunable> tunables;
+
+    tunables.push_back({&opencl->baseKernelsProgram, "fill", 1, [&](cl_kernel kernel) {
+        clSetKernelArg<cl_mem>(kernel, 0, tileA);
+        clSetKernelArg<cl_float4>(kernel, 1, color);
+    }});
+
+    tunables.push_back({&opencl->baseKernelsProgram, "floatToU8", 1, [&](cl_kernel kernel) {
+        clSetKernelArg<cl_mem>(kernel, 0, tileA);
+        clSetKernelArg<cl_mem>(kernel, 1, u8Tile);
+    }});
+
+    for (const char *name: {"tileSVGOver", "tileSVGMultipy", "tileSVGMColorDodge", "tileSVGColorBurn",
+                            "tileSVGScreen", "tileSVGHue", "tileSVGSaturation", "tileSVGColor",
+                            "tileSVGLuminosity", "tileSVGDstOut", "tileSVGDstIn", "tileSVGSrcAtop",
+                            "tileSVGDstAtop"})
+    {
+        tunables.push_back({&opencl->baseKernelsProgram, name, 1, [&](cl_kernel kernel) {
+            clSetKernelArg<cl_mem>(kernel, 0, tileA);
+            clSetKernelArg<cl_mem>(kernel, 1, tileA);
+            clSetKernelArg<cl_mem>(kernel, 2, tileB);
+            clSetKernelArg<cl_float>(kernel, 3, 1.0f);
+        }});
+    }
+
+    tunables.push_back({&opencl->baseKernelsProgram, "tileColorMask", 1, [&](cl_kernel kernel) {
+        clSetKernelArg<cl_mem>(kernel, 0, tileA);
+        clSetKernelArg<cl_mem>(kernel, 1, tileA);
+        clSetKernelArg<cl_mem>(kernel, 2, tileB);
+        clSetKernelArg<cl_float4>(kernel, 3, color);
+    }});
+
+    tunables.push_back({&opencl->baseKernelsProgram, "gradientApply", 2, [&](cl_kernel kernel) {
+        clSetKernelArg<cl_mem>(kernel, 0, tileB);
+        clSetKernelArg<cl_mem>(kernel, 1, tileA);
+        clSetKernelArg<cl_int2>(kernel, 2, {-64, -64});
+        clSetKernelArg<cl_float2>(kernel, 3, {1.0f / 256.0f, 1.0f / 256.0f});
+        clSetKernelArg<cl_float4>(kernel, 4, color);
+    }});
+
+    tunables.push_back({&opencl->baseKernelsProgram, "matrixApply", 2, [&](cl_kernel kernel) {
+        clSetKernelArg<cl_mem>(kernel, 0, tileB);
+        clSetKernelArg<cl_mem>(kernel, 1, tileA);
+        clSetKernelArg<cl_float4>(kernel, 2, {0.866f, -0.5f, 0.5f, 0.866f});
+        clSetKernelArg<cl_float2>(kernel, 3, {3.5f, 2.5f});
+    }});
+
+    tunables.push_back({&opencl->baseKernelsProgram, "circle", 2, [&](cl_kernel kernel) {
+        clSetKernelArg<cl_mem>(kernel, 0, tileA);
+        clSetKernelArg<cl_int>(kernel, 1, TILE_PIXEL_WIDTH);
+        clSetKernelArg<cl_int>(kernel, 2, 64);
+        clSetKernelArg<cl_int>(kernel, 3, 64);
+        clSetKernelArg<cl_float>(kernel, 4, 48.0f);
+        clSetKernelArg<cl_float4>(kernel, 5, color);
+    }});
+
+    tunables.push_back({&opencl->paintKernelsProgram, "fillFloats", 1, [&](cl_kernel kernel) {
+        clSetKernelArg<cl_mem>(kernel, 0, floatMask);
+        clSetKernelArg<cl_float>(kernel, 1, 0.0f);
+    }});
+
+    tunables.push_back({&opencl->paintKernelsProgram, "maskCircle", 2, [&](cl_kernel kernel) {
+        clSetKernelArg<cl_mem>(kernel, 0, floatMask);
+        clSetKernelArg<cl_float>(kernel, 1, 64.0f);
+        clSetKernelArg<cl_float>(kernel, 2, 64.0f);
+        clSetKernelArg<cl_float>(kernel, 3, 48.0f);
+        clSetKernelArg<cl_float>(kernel, 4, 0.5f);
+    }});
+
+    tunables.push_back({&opencl->paintKernelsProgram, "applyMaskTile", 1, [&](cl_kernel kernel) {
+        clSetKernelArg<cl_mem>(kernel, 0, tileA);
+        clSetKernelArg<cl_mem>(kernel, 1, tileB);
+        clSetKernelArg<cl_mem>(kernel, 2, floatMask);
+        clSetKernelArg<cl_float4>(kernel, 3, color);
+    }});
+
+    if (patternImage)
+    {
+        tunables.push_back({&opencl->patternKernelsProgram, "patternFillCircle", 2, [&](cl_kernel kernel) {
+            clSetKernelArg<cl_mem>(kernel, 0, tileA);
+            clSetKernelArg<cl_int>(kernel, 1, 64);
+            clSetKernelArg<cl_int>(kernel, 2, 64);
+            clSetKernelArg<cl_int>(kernel, 3, 0);
+            clSetKernelArg<cl_int>(kernel, 4, 0);
+            clSetKernelArg<cl_float>(kernel, 5, 48.0f);
+            clSetKernelArg<cl_mem>(kernel, 6, patternImage);
+        }});
+    }
+
+    /* Every MyPaint template instance, timed at dab sizes rather than a full tile */
+    for (QByteArray shape: {"dab", "micro", "mask"})
+    {
+        for (QByteArray mode: {"", "_locked", "_isolate"})
+        {
+            for (bool textured: {false, true})
+            {
+                if ((shape == "mask" || textured) && !maskImage)
+                    continue;
+
+                QByteArray name = "mypaint_" + shape + mode + (textured ? "_textured" : "");
+                bool isMask = shape == "mask";
+
+                tunables.push_back({&opencl->myPaintTemplateProgram, name, 2, [&, isMask, textured](cl_kernel kernel) {
+                    int argIndex = 0;
+                    clSetKernelArg<cl_mem>(kernel, argIndex++, tileA);
+                    clSetKernelArg<cl_int>(kernel, argIndex++, 0);
+                    clSetKernelArg<cl_float>(kernel, argIndex++, 64.0f);
+                    clSetKernelArg<cl_float>(kernel, argIndex++, 64.0f);
+                    if (isMask)
+                    {
+                        clSetKernelArg<cl_mem>(kernel, argIndex++, maskImage);
+                        clSetKernelArg<cl_float4>(kernel, argIndex++, {1.0f / 128.0f, 0.0f, 0.0f, 1.0f / 128.0f});
+                    }
+                    else
+                    {
+                        clSetKernelArg<cl_float>(kernel, argIndex++, 0.5f);
+                        clSetKernelArg<cl_float4>(kernel, argIndex++, {1.0f / 48.0f, 0.0f, 0.0f, 1.0f / 48.0f});
+                        clSetKernelArg<cl_float>(kernel, argIndex++, -1.0f);
+                        clSetKernelArg<cl_float>(kernel, argIndex++, -1.0f);
+                    }
+                    if (textured)
+                    {
+                        clSetKernelArg<cl_float>(kernel, argIndex++, 0.0f);
+                        clSetKernelArg<cl_float>(kernel, argIndex++, 0.0f);
+                        clSetKernelArg<cl_float>(kernel, argIndex++, 0.5f);
+                        clSetKernelArg<cl_mem>(kernel, argIndex++, maskImage);
+                    }
+                    clSetKernelArg<cl_float>(kernel, argIndex++, 1.0f);
+                    clSetKernelArg<cl_float4>(kernel, argIndex++, color);
+                }, true});
+            }
+        }
+    }
+
+    size_t maxItems[3] = {1, 1, 1};
+    clGetDeviceInfo(opencl->device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(maxItems), maxItems, nullptr);
+
+    typedef std::array<size_t, 2> GlobalSize;
+    const std::vector<GlobalSize> tileSize1D = {{{TILE_PIXEL_WIDTH * TILE_PIXEL_HEIGHT, 1}}};
+    const std::vector<GlobalSize> tileSize2D = {{{TILE_PIXEL_WIDTH, TILE_PIXEL_HEIGHT}}};
+    /* Dab kernels only cover the bounds of the dabs within a tile, so a full tile
+     * launch says little about how they usually run.
+     */
+    const std::vector<GlobalSize> dabSizes = {{{16, 16}}, {{32, 32}}, {{TILE_PIXEL_WIDTH, TILE_PIXEL_HEIGHT}}};
+
+    for (Tunable const &tunable: tunables)
+    {
+        cl_program prog = tunable.program->get(tunable.name);
+        if (!prog)
+            continue;
+
+        /* A private kernel object so the arguments don't race with the canvas' enqueues */
+        cl_kernel kernel = clCreateKernel(prog, tunable.name.constData(), &err);
+        if (err != CL_SUCCESS)
+            continue;
+
+        tunable.setArgs(kernel);
+
+        size_t kernelMax = 0;
+        clGetKernelWorkGroupInfo(kernel, opencl->device, CL_KERNEL_WORK_GROUP_SIZE,
+                                 sizeof(kernelMax), &kernelMax, nullptr);
+
+        std::vector<GlobalSize> const &globalSizes = tunable.dabSized ? dabSizes :
+                                                     tunable.dims == 1 ? tileSize1D : tileSize2D;
+
+        std::vector<double> defaultTimes;
+        double defaultTime = 0.0;
+        for (GlobalSize const &globalSize: globalSizes)
+        {
+            double time = timeKernel(queue, kernel, tunable.dims, globalSize.data(), nullptr);
+            defaultTimes.push_back(time);
+            defaultTime = (time < 0.0 || defaultTime < 0.0) ? -1.0 : defaultTime + time;
+        }
+
+        LocalSize best;
+        double bestTime = defaultTime;
+
+        for (LocalSize const &candidate: candidateSizes(tunable.dims, kernelMax, maxItems))
+        {
+            double time = 0.0;
+            for (size_t i = 0; i < globalSizes.size() && time >= 0.0; ++i)
+            {
+                bool divides = true;
+                for (cl_uint d = 0; d < tunable.dims; ++d)
+                    divides = divides && globalSizes[i][d] % candidate.size[d] == 0;
+
+                // localWorkSize() falls back to the default for sizes the candidate doesn't divide
+                double sizeTime = divides ? timeKernel(queue, kernel, tunable.dims, globalSizes[i].data(), candidate.size)
+                                          : defaultTimes[i];
+                time = sizeTime < 0.0 ? -1.0 : time + sizeTime;
+            }
+
+            // Require a clear win so timer noise doesn't flip the result between runs
+            if (time >= 0.0 && (bestTime < 0.0 || time < bestTime * 0.97))
+            {
+                best = candidate;
+                bestTime = time;
+            }
+        }
+
+        clReleaseKernel(kernel);
+
+        if (bestTime < 0.0)
+            continue;
+
+        results[tunable.name] = best;
+
+        QString line = QStringLiteral("%1: %2 (%3ms, default %4ms)")
+                           .arg(QString::fromUtf8(tunable.name), best.toString())
+                           .arg(bestTime, 0, 'f', 4)
+                           .arg(defaultTime, 0, 'f', 4);
+        qDebug() << qPrintable(line);
+        if (progress)
+            progress(line);
+    }
+
+    clReleaseMemObject(tileA);
+    clReleaseMemObject(tileB);
+    clReleaseMemObject(floatMask);
+    clReleaseMemObject(u8Tile);
+    if (maskImage)
+        clReleaseMemObject(maskImage);
+    if (patternImage)
+        clReleaseMemObject(patternImage);
+
+    return results;
+}
+
+void WorkGroupTuner::tune(SharedOpenCL *opencl, std::function<void(QString const &)> progress)
+{
+    if (!opencl || opencl->native)
+        return;
+
+    Results results = run(opencl, progress);
+    save(opencl->device, results);
+    opencl->setTunedSizes(results);
+}
@@ -0,0 +1,46 @@
+#ifndef WORKGROUPTUNER_H
+#define WORKGROUPTUNER_H
+
+#include <functional>
+#include <map>
+#include <QByteArray>
+#include <QString>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+class SharedOpenCL;
+
+/* Finds the fastest local work size for each kernel by timing a set of
+ * candidates on the active device. Results are kept in QSettings under
+ * "OpenCL/WorkGroupSizes/<device>/<kernel>" so they only need to be found
+ * once per device and driver.
+ */
+namespace WorkGroupTuner
+{
+    /* A size of zero in every dimension means the driver's choice (a null local size) */
+    struct LocalSize
+    {
+        size_t size[2] = {0, 0};
+
+        bool isDefault() const { return size[0] == 0; }
+        QString toString() const;
+        static LocalSize fromString(QString const &str);
+    };
+
+    typedef std::map<QByteArray, LocalSize> Results;
+
+    Results load(cl_device_id device);
+    void save(cl_device_id device, Results const &results);
+
+    /* Time every tunable kernel, progress is called once per kernel with a line of text */
+    Results run(SharedOpenCL *opencl, std::function<void(QString const &)> progress = nullptr);
+
+    /* Run, save the results, and make them active in opencl */
+    void tune(SharedOpenCL *opencl, std::function<void(QString const &)> progress = nullptr);
+}
+
+#endif // WORKGROUPTUNER_H
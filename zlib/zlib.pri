@@ -1,7 +1,7 @@
 INCLUDEPATH += $$PWD
 SOURCES += \
     $$PWD/adler32.c \
-#    $$PWD/compress.c \
+    $$PWD/compress.c \
     $$PWD/crc32.c \
     $$PWD/deflate.c \
 #    $$PWD/gzclose.c \
@@ -13,7 +13,7 @@ SOURCES += \
     $$PWD/inflate.c \
     $$PWD/inftrees.c \
     $$PWD/trees.c \
-#    $$PWD/uncompr.c \
+    $$PWD/uncompr.c \
     $$PWD/zutil.c
 
 HEADERS += \